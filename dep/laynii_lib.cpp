@@ -1,5 +1,11 @@
 
 #include "./laynii_lib.h"
+#include <chrono>
+#include <ctime>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 
 // ============================================================================
 // Command-line log messages
@@ -7,9 +13,10 @@
 
 void log_welcome(const char* programname) {
     cout << "======================="<< endl;
-    cout << "LayNii v2.7.1          "<< endl;
+    cout << "LayNii v" << LN_VERSION << "          "<< endl;
     cout << "======================="<< endl;
     cout << programname << "\n" << endl;
+    ln_profile_begin(programname);
 }
 
 void log_output(const char* filename) {
@@ -25,6 +32,15 @@ void log_nifti_descriptives(nifti_image* nii) {
     cout << "    Datatype = " << nii->datatype << "\n" << endl;
 }
 
+void log_crop_descriptives(const ln_crop& crop) {
+    // Print the bounding box that the inputs are cropped to
+    const float fraction = static_cast<float>(crop.size[0] * crop.size[1] * crop.size[2])
+        / (static_cast<float>(crop.nii_full->nx) * crop.nii_full->ny * crop.nii_full->nz);
+    cout << "    Bounding box: " << crop.size[0] << " X | " << crop.size[1] << " Y | " << crop.size[2] << " Z " << endl;
+    cout << "    Box start = " << crop.start[0] << " x " << crop.start[1] << " x " << crop.start[2] << endl;
+    cout << "    Box volume = " << fraction * 100 << " % of the field of view\n" << endl;
+}
+
 // ============================================================================
 // Statistics functions
 // ============================================================================
@@ -185,30 +201,22 @@ float gaus(float distance, float sigma) {
 // Utility functions
 // ============================================================================
 
-void save_output_nifti(const string path, const string tag,  nifti_image* nii,
-                       const bool log, const bool use_outpath) {
-    ///////////////////////////////////////////////////////////////////////////
-    // Note:
-    // - 1st argument is the string of the output file name
-    //       if there is no explicit output path given, this will be the file
-    //       name of the main input data
-    //       if there is an explicit output file name given, this will be the
-    //       user-defined name following the -output
-    //       (including the path and including the file extension)
-    // - 2nd argument is the output file name tag, that will be added to the
-    //       above argument, this field is ignored, when the flag "use_outpath"
-    //       (last argument) is selected.
-    // - 3rd argument is the pointer to the data set that is supposed to be
-    //       written
-    // - 4th argument states if, during the execution of the program an the
-    //   writing process should be logged
-    //       this argument is optional with the default: TRUE
-    // - 5th argument states if the output tag (second argument) should be
-    //   ignored or not. This argument is optional the default: FALSE
-    //
-    // example: save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true, use_outpath);
-    ///////////////////////////////////////////////////////////////////////////
+// Set by ln_set_output_crop, see "Bounding box cropping" below
+static const ln_crop* ln_output_crop = NULL;
+static bool ln_crop_is_full(const ln_crop& crop);
+// See "In-memory image store" below
+static bool ln_memory_store_put(const string& path, nifti_image* nii);
+
+static nifti_image* ln_copy_nifti_data(const nifti_image* nii) {
+    nifti_image* nii_new = nifti_copy_nim_info(nii);
+    nii_new->data = malloc(nii->nvox * nii->nbyper);
+    memcpy(nii_new->data, nii->data, nii->nvox * nii->nbyper);
+    return nii_new;
+}
 
+string ln_output_path(const string path, const string tag,
+                      const bool use_outpath) {
+    // Output file name as used by save_output_nifti
     string path_out;
 
     if (use_outpath) {
@@ -247,98 +255,427 @@ void save_output_nifti(const string path, const string tag,  nifti_image* nii,
         // Prepare output path
         path_out = dir + sep + basename + "_" + tag + ext;
     }
+    return path_out;
+}
 
-    // Save nifti
+void save_output_nifti(const string path, const string tag,  nifti_image* nii,
+                       const bool log, const bool use_outpath) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - 1st argument is the string of the output file name
+    //       if there is no explicit output path given, this will be the file
+    //       name of the main input data
+    //       if there is an explicit output file name given, this will be the
+    //       user-defined name following the -output
+    //       (including the path and including the file extension)
+    // - 2nd argument is the output file name tag, that will be added to the
+    //       above argument, this field is ignored, when the flag "use_outpath"
+    //       (last argument) is selected.
+    // - 3rd argument is the pointer to the data set that is supposed to be
+    //       written
+    // - 4th argument states if, during the execution of the program an the
+    //   writing process should be logged
+    //       this argument is optional with the default: TRUE
+    // - 5th argument states if the output tag (second argument) should be
+    //   ignored or not. This argument is optional the default: FALSE
+    //
+    // example: save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true, use_outpath);
+    ///////////////////////////////////////////////////////////////////////////
+
+    ln_profile_scope profile("save outputs");
+    string path_out = ln_output_path(path, tag, use_outpath);
     nifti_set_filenames(nii, path_out.c_str(), 1, 1);
-    nifti_image_write(nii);
+    ln_get_output_bgzf();  // Applies LAYNII_OUTPUT_BGZF to znzlib
+
+    // Images in the cropped frame are put back into the full field of view
+    nifti_image* nii_out = nii;
+    const ln_crop* crop = ln_output_crop;
+    if (crop != NULL && !ln_crop_is_full(*crop) && nii->nx == crop->size[0]
+        && nii->ny == crop->size[1] && nii->nz == crop->size[2]) {
+        nii_out = ln_uncrop_nifti(nii, *crop);
+    }
+    // Smaller datatypes for label (and optionally float) outputs
+    nifti_image* nii_compact = ln_compact_nifti(nii_out, ln_get_output_type());
+    if (nii_compact != nii_out) {
+        if (nii_out != nii) {
+            nifti_image_free(nii_out);
+        }
+        nii_out = nii_compact;
+    }
+
+    // Keep the output in memory for the next programs of a pipeline
+    if (ln_memory_store_active()) {
+        if (nii_out == nii) {
+            nii_out = ln_copy_nifti_data(nii);
+        }
+        if (!ln_memory_store_put(path_out, nii_out)) {
+            if (log) {
+                cout << "    Keeping output in memory:" << endl;
+                cout << "      " << path_out << endl;
+            }
+            return;
+        }
+        nii = nii_out;  // Owned by the store, the writer needs its own copy
+    }
+
+    // Save nifti
+    if (ln_get_async_output() > 0) {
+        // The writer gets its own copy, tools often keep changing 'nii'
+        if (nii_out == nii) {
+            nii_out = ln_copy_nifti_data(nii);
+        }
+        ln_write_async(nii_out);
+        if (log) {
+            cout << "    Writing output in the background as:" << endl;
+            cout << "      " << path_out << endl;
+        }
+        return;
+    }
+    nifti_image_write(nii_out);
+    if (nii_out != nii) {
+        nifti_image_free(nii_out);
+    }
     if (log) {
         log_output(path_out.c_str());
     }
 }
 
 
-nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii) {
-    nifti_image* nii_new = nifti_copy_nim_info(nii);
-    nii_new->datatype = NIFTI_TYPE_FLOAT32;
-    nii_new->nbyper = sizeof(float);
-    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    float* nii_new_data = static_cast<float*>(nii_new->data);
-    int nr_voxels = nii_new->nvox;
+// ----------------------------------------------------------------------------
+// Blocked gzip outputs
+// ----------------------------------------------------------------------------
+// BGZF files are ordinary (multi member) gzip files, cut into
+// independently compressed blocks of 64 KB. Files in this format are read
+// with random access by znzlib, so cropped and slab-wise reads of large
+// .nii.gz inputs only inflate the blocks they need. Compression is slightly
+// worse than a single stream.
+static int ln_output_bgzf = -1;  // -1: not set, read LAYNII_OUTPUT_BGZF
 
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+void ln_set_output_bgzf(bool use_bgzf) {
+    ln_output_bgzf = use_bgzf ? 1 : 0;
+    znz_set_bgzf(ln_output_bgzf);
+}
+
+bool ln_get_output_bgzf(void) {
+    if (ln_output_bgzf < 0) {
+        const char* value = getenv("LAYNII_OUTPUT_BGZF");
+        ln_set_output_bgzf(value != NULL && atoi(value) > 0);
+    }
+    return ln_output_bgzf > 0;
+}
+
+// ----------------------------------------------------------------------------
+// Datatype conversion
+// ----------------------------------------------------------------------------
+// Conversions cast values, replace NaNs with zeros and apply scaling in one
+// pass. Source and destination can be the same memory (in-place conversion).
+// In that case each chunk of values is copied into a small buffer first, so
+// that no value is overwritten before it is read.
+static const int64_t LN_CONVERT_CHUNK = 1024;
+
+template <typename T>
+static inline bool ln_is_nan(const T) { return false; }
+template <>
+inline bool ln_is_nan<float>(const float v) { return v != v; }
+template <>
+inline bool ln_is_nan<double>(const double v) { return v != v; }
+
+template <typename T_in, typename T_out>
+static void ln_convert_chunk(const void* src, void* dst, const int64_t begin,
+                             const int64_t n, const bool scale,
+                             const double slope, const double inter) {
+    T_in in[LN_CONVERT_CHUNK];
+    T_out out[LN_CONVERT_CHUNK];
+    memcpy(in, static_cast<const T_in*>(src) + begin, n * sizeof(T_in));
+    for (int64_t i = 0; i < n; ++i) {
+        // NaNs become zeros
+        out[i] = ln_is_nan(in[i]) ? 0 : static_cast<T_out>(in[i]);
+    }
+    if (scale) {
+        for (int64_t i = 0; i < n; ++i) {
+            out[i] *= slope;
+            out[i] += inter;
         }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+    }
+    memcpy(static_cast<T_out*>(dst) + begin, out, n * sizeof(T_out));
+}
+
+template <typename T_in, typename T_out>
+static void ln_convert_values(const void* src, void* dst, const int64_t nr_values,
+                              const bool scale, const double slope, const double inter) {
+    if (src != dst) {
+        const T_in* in = static_cast<const T_in*>(src);
+        T_out* out = static_cast<T_out*>(dst);
+        for (int64_t i = 0; i < nr_values; ++i) {
+            // NaNs become zeros
+            *(out + i) = ln_is_nan(*(in + i)) ? 0 : static_cast<T_out>(*(in + i));
+        }
+        if (scale) {
+            for (int64_t i = 0; i < nr_values; ++i) {
+                *(out + i) *= slope;
+                *(out + i) += inter;
+            }
         }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+        return;
+    }
+    const int64_t nr_chunks = (nr_values + LN_CONVERT_CHUNK - 1) / LN_CONVERT_CHUNK;
+    // When converting in place to a wider type, chunks are written from the
+    // end so that no chunk overwrites values that are not read yet.
+    const bool backwards = sizeof(T_out) > sizeof(T_in);
+    for (int64_t c = 0; c < nr_chunks; ++c) {
+        const int64_t chunk = backwards ? nr_chunks - 1 - c : c;
+        const int64_t begin = chunk * LN_CONVERT_CHUNK;
+        const int64_t n = std::min(LN_CONVERT_CHUNK, nr_values - begin);
+        ln_convert_chunk<T_in, T_out>(src, dst, begin, n, scale, slope, inter);
+    }
+}
+
+template <typename T_out>
+static bool ln_convert_data(const void* src, const int datatype, void* dst,
+                            const int64_t nr_values, const bool scale = false,
+                            const double slope = 1, const double inter = 0) {
+    // See nifti1.h for notes on data types
+    switch (datatype) {
+        case NIFTI_TYPE_UINT8:
+            ln_convert_values<uint8_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_UINT16:
+            ln_convert_values<uint16_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_UINT32:
+            ln_convert_values<uint32_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_UINT64:
+            ln_convert_values<uint64_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_INT8:
+            ln_convert_values<int8_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_INT16:
+            ln_convert_values<int16_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_INT32:
+            ln_convert_values<int32_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_INT64:
+            ln_convert_values<int64_t, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_FLOAT32:
+            ln_convert_values<float, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        case NIFTI_TYPE_FLOAT64:
+            ln_convert_values<double, T_out>(src, dst, nr_values, scale, slope, inter);
+            break;
+        default:
+            cout << "Warning! Unrecognized nifti data type!" << endl;
+            return false;
+    }
+    return true;
+}
+
+template <typename T_out>
+static void ln_convert_nifti_inplace(nifti_image* nii, const int datatype) {
+    const int64_t nr_voxels = nii->nvox;
+    if (nii->datatype == datatype) {
+        // Only scrub NaNs
+        ln_convert_data<T_out>(nii->data, datatype, nii->data, nr_voxels);
+        return;
+    }
+    if (nifti_image_data_is_mapped(nii)) {
+        // Mapped input data can not be resized, convert into new memory
+        void* data = malloc(nr_voxels * sizeof(T_out));
+        if (data == NULL) {
+            fprintf(stderr, "** failed to allocate memory for conversion\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ln_convert_data<T_out>(nii->data, nii->datatype, data, nr_voxels)) {
+            nifti_image_unload(nii);
+            nii->data = data;
+            nii->datatype = datatype;
+            nii->nbyper = sizeof(T_out);
+        } else {
+            free(data);
         }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
+        return;
+    }
+    if (static_cast<size_t>(nii->nbyper) < sizeof(T_out)) {
+        // Grow the buffer first, the old values stay at its beginning
+        void* data = realloc(nii->data, nr_voxels * sizeof(T_out));
+        if (data == NULL) {
+            fprintf(stderr, "** failed to allocate memory for conversion\n");
+            exit(EXIT_FAILURE);
+        }
+        nii->data = data;
+    }
+    if (ln_convert_data<T_out>(nii->data, nii->datatype, nii->data, nr_voxels)) {
+        nii->datatype = datatype;
+        nii->nbyper = sizeof(T_out);
+    }
+}
+
+void convert_nifti_to_float32(nifti_image* nii) {
+    ln_convert_nifti_inplace<float>(nii, NIFTI_TYPE_FLOAT32);
+}
+
+void convert_nifti_to_int32(nifti_image* nii) {
+    ln_convert_nifti_inplace<int32_t>(nii, NIFTI_TYPE_INT32);
+}
+
+// ----------------------------------------------------------------------------
+// Compact output datatypes
+// ----------------------------------------------------------------------------
+// Many outputs are label images stored as float32 or int32. With
+// LN_OUTPUT_COMPACT, save_output_nifti stores integer valued images with the
+// smallest integer type that holds all values, which is lossless. With
+// LN_OUTPUT_SCALED16, other float images are also stored as int16 with one
+// scaling slope for the whole image, max|v| / 32767. This is a fixed absolute
+// step, not a floating point format: values much smaller than the largest one
+// lose their significant digits.
+static int ln_output_type = -1;  // -1: not set, read LAYNII_OUTPUT_TYPE
+
+void ln_set_output_type(int type) {
+    ln_output_type = type;
+}
+
+int ln_get_output_type(void) {
+    if (ln_output_type < 0) {
+        const char* value = getenv("LAYNII_OUTPUT_TYPE");
+        ln_output_type = LN_OUTPUT_NATIVE;
+        if (value != NULL && !strcmp(value, "compact")) {
+            ln_output_type = LN_OUTPUT_COMPACT;
+        } else if (value != NULL && !strcmp(value, "scaled16")) {
+            ln_output_type = LN_OUTPUT_SCALED16;
         }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
     }
+    return ln_output_type;
+}
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
+template <typename T>
+static void ln_scan_values(const void* data, const int64_t nr_values,
+                           double& v_min, double& v_max, bool& integral,
+                           bool& finite) {
+    const T* values = static_cast<const T*>(data);
+    for (int64_t i = 0; i < nr_values; ++i) {
+        const double v = static_cast<double>(*(values + i));
+        if (v != v || std::isinf(v)) {
+            finite = false;
+            return;
+        }
+        v_min = std::min(v_min, v);
+        v_max = std::max(v_max, v);
+        integral = integral && v == std::floor(v);
+    }
+}
+
+nifti_image* ln_compact_nifti(nifti_image* nii, const int type) {
+    if (type == LN_OUTPUT_NATIVE || nii->data == NULL || nii->nvox == 0) {
+        return nii;
+    }
+    // Images that are already scaled are kept as they are
+    if (nii->scl_slope != 0 && (nii->scl_slope != 1 || nii->scl_inter != 0)) {
+        return nii;
+    }
+
+    double v_min = std::numeric_limits<double>::max();
+    double v_max = std::numeric_limits<double>::lowest();
+    bool integral = true, finite = true;
+    switch (nii->datatype) {
+        case NIFTI_TYPE_UINT16:
+            ln_scan_values<uint16_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_UINT32:
+            ln_scan_values<uint32_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_UINT64:
+            ln_scan_values<uint64_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_INT16:
+            ln_scan_values<int16_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_INT32:
+            ln_scan_values<int32_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_INT64:
+            ln_scan_values<int64_t>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_FLOAT32:
+            ln_scan_values<float>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        case NIFTI_TYPE_FLOAT64:
+            ln_scan_values<double>(nii->data, nii->nvox, v_min, v_max, integral, finite);
+            break;
+        default:  // Already one byte, or not a scalar type
+            return nii;
+    }
+    // NaNs and infinities can only be kept by float types
+    if (!finite) {
+        return nii;
+    }
+
+    nifti_image* nii_new = NULL;
+    if (integral) {
+        if (v_min >= 0 && v_max <= 255 && nii->nbyper > 1) {
+            nii_new = nifti_copy_nim_info(nii);
+            nii_new->datatype = NIFTI_TYPE_UINT8;
+            nii_new->nbyper = sizeof(uint8_t);
+            nii_new->data = malloc(nii_new->nvox * nii_new->nbyper);
+            ln_convert_data<uint8_t>(nii->data, nii->datatype, nii_new->data, nii->nvox);
+        } else if (v_min >= -32768 && v_max <= 32767 && nii->nbyper > 2) {
+            nii_new = nifti_copy_nim_info(nii);
+            nii_new->datatype = NIFTI_TYPE_INT16;
+            nii_new->nbyper = sizeof(int16_t);
+            nii_new->data = malloc(nii_new->nvox * nii_new->nbyper);
+            ln_convert_data<int16_t>(nii->data, nii->datatype, nii_new->data, nii->nvox);
+        } else if (v_min >= std::numeric_limits<int32_t>::min()
+                   && v_max <= std::numeric_limits<int32_t>::max() && nii->nbyper > 4) {
+            nii_new = nifti_copy_nim_info(nii);
+            nii_new->datatype = NIFTI_TYPE_INT32;
+            nii_new->nbyper = sizeof(int32_t);
+            nii_new->data = malloc(nii_new->nvox * nii_new->nbyper);
+            ln_convert_data<int32_t>(nii->data, nii->datatype, nii_new->data, nii->nvox);
+        }
+    } else if (type == LN_OUTPUT_SCALED16) {
+        const double slope = std::max(std::fabs(v_min), std::fabs(v_max)) / 32767.;
+        nii_new = nifti_copy_nim_info(nii);
+        nii_new->datatype = NIFTI_TYPE_INT16;
+        nii_new->nbyper = sizeof(int16_t);
+        nii_new->data = malloc(nii_new->nvox * nii_new->nbyper);
+        nii_new->scl_slope = slope;
+        nii_new->scl_inter = 0;
+
+        int16_t* nii_new_data = static_cast<int16_t*>(nii_new->data);
+        const char* src = static_cast<const char*>(nii->data);
+        double buffer[LN_CONVERT_CHUNK];
+        for (int64_t begin = 0; begin < nii->nvox; begin += LN_CONVERT_CHUNK) {
+            const int64_t n = std::min(LN_CONVERT_CHUNK, nii->nvox - begin);
+            ln_convert_data<double>(src + begin * nii->nbyper, nii->datatype,
+                                    buffer, n);
+            for (int64_t i = 0; i < n; ++i) {
+                *(nii_new_data + begin + i) =
+                    static_cast<int16_t>(std::lround(buffer[i] / slope));
+            }
         }
     }
+    return nii_new != NULL ? nii_new : nii;
+}
+
+nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii) {
+    nifti_image* nii_new = nifti_copy_nim_info(nii);
+    nii_new->datatype = NIFTI_TYPE_FLOAT32;
+    nii_new->nbyper = sizeof(float);
+    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
+    const int64_t nr_voxels = nii_new->nvox;
 
     //  Incorporate scaling (scl_slope) and translation (scl_inter) headers
     cout << "  Nifti header 'scl slope': " << nii->scl_slope <<endl;
     cout << "  Nifti header 'scl inter': " << nii->scl_inter <<endl;
     if (nii->scl_slope != 0) {
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) *= nii->scl_slope;
-            *(nii_new_data + i) += nii->scl_inter;
-        }
+        ln_convert_data<float>(nii->data, nii->datatype, nii_new->data, nr_voxels,
+                               true, nii->scl_slope, nii->scl_inter);
         nii_new->scl_slope = 1.;
         nii_new->scl_inter = 0.;
     } else {
+        ln_convert_data<float>(nii->data, nii->datatype, nii_new->data, nr_voxels);
         cout << endl;
         cout << "  !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << endl;
         cout << "  CAUTION: Nifti scaling parameter 'scl slope' is 0." << endl;
@@ -370,72 +707,8 @@ nifti_image* copy_nifti_as_float32(nifti_image* nii) {
     nii_new->datatype = NIFTI_TYPE_FLOAT32;
     nii_new->nbyper = sizeof(float);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    float* nii_new_data = static_cast<float*>(nii_new->data);
-    int nr_voxels = nii_new->nvox;
-
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<float>(*(nii_data + i));
-        }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
-    }
-
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!= *(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
-        }
-    }
 
+    ln_convert_data<float>(nii->data, nii->datatype, nii_new->data, nii_new->nvox);
     return nii_new;
 }
 
@@ -463,52 +736,52 @@ nifti_image* copy_nifti_as_double(nifti_image* nii) {
     // ------------------------------------------------------------------------
     if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
         uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
         uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
         uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
         uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
         int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
         int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
         int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
         int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
         float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
         double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nii_new->nvox; ++i) {
+        for (int64_t i = 0; i < nii_new->nvox; ++i) {
             *(nii_new_data + i) = static_cast<double>(*(nii_data + i));
         }
     } else {
@@ -516,7 +789,7 @@ nifti_image* copy_nifti_as_double(nifti_image* nii) {
     }
 
     // Replace nans with zeros
-    for (int i = 0; i < nii->nvox; ++i) {
+    for (int64_t i = 0; i < nii->nvox; ++i) {
         if (*(nii_new_data + i)!= *(nii_new_data + i)) {
             *(nii_new_data + i) = 0;
         }
@@ -530,73 +803,8 @@ nifti_image* copy_nifti_as_int32(nifti_image* nii) {
     nii_new->datatype = NIFTI_TYPE_INT32;
     nii_new->nbyper = sizeof(int32_t);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
-
-    int32_t* nii_new_data = static_cast<int32_t*>(nii_new->data);
-
-    // NOTE(Faruk): See nifti1.h for notes on data types
-    // ------------------------------------------------------------------------
-    if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
-        uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
-        uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
-        uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
-        uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
-        int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
-        int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
-        int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
-        int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
-        float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
-        double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
-            *(nii_new_data + i) = static_cast<int32_t>(*(nii_data + i));
-        }
-    } else {
-        cout << "Warning! Unrecognized nifti data type!" << endl;
-    }
-
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_new_data + i)!=*(nii_new_data + i)) {
-            *(nii_new_data + i) = 0;
-        }
-    }
 
+    ln_convert_data<int32_t>(nii->data, nii->datatype, nii_new->data, nii_new->nvox);
     return nii_new;
 }
 
@@ -607,7 +815,7 @@ nifti_image* copy_nifti_as_float16(nifti_image* nii) {
     nii_new->datatype = NIFTI_TYPE_INT16;
     nii_new->nbyper = sizeof(short);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
+    const int64_t nr_voxels = nii_new->nvox;
 
     short *nii_new_data = static_cast<short*>(nii_new->data);
 
@@ -615,52 +823,52 @@ nifti_image* copy_nifti_as_float16(nifti_image* nii) {
     // ------------------------------------------------------------------------
     if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
         uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
         uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
         uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
         uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
         int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
         int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
         int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
         int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
         float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
         double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = (short)((double) (*(nii_data + i) * 1000));
         }
     } else {
@@ -668,7 +876,7 @@ nifti_image* copy_nifti_as_float16(nifti_image* nii) {
     }
     nii_new->scl_slope = nii->scl_slope / 1000.;
     // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         if (*(nii_new_data + i)!=*(nii_new_data + i)) {
             *(nii_new_data + i) = 0;
         }
@@ -682,7 +890,7 @@ nifti_image* copy_nifti_as_int16(nifti_image* nii) {
     nii_new->datatype = NIFTI_TYPE_INT16;
     nii_new->nbyper = sizeof(int16_t);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
+    const int64_t nr_voxels = nii_new->nvox;
 
     int16_t* nii_new_data = static_cast<int16_t*>(nii_new->data);
 
@@ -690,52 +898,52 @@ nifti_image* copy_nifti_as_int16(nifti_image* nii) {
     // ------------------------------------------------------------------------
     if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
         uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
         uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
         uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
         uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
         int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
         int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
         int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
         int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
         float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
         double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int16_t>(*(nii_data + i));
         }
     } else {
@@ -743,7 +951,7 @@ nifti_image* copy_nifti_as_int16(nifti_image* nii) {
     }
 
     // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         if (*(nii_new_data + i)!= *(nii_new_data + i)) {
             *(nii_new_data + i) = 0;
         }
@@ -758,7 +966,7 @@ nifti_image* copy_nifti_as_int8(nifti_image* nii) {
     nii_new->datatype = NIFTI_TYPE_INT8;
     nii_new->nbyper = sizeof(int8_t);
     nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
-    int nr_voxels = nii_new->nvox;
+    const int64_t nr_voxels = nii_new->nvox;
 
     int8_t* nii_new_data = static_cast<int8_t*>(nii_new->data);
 
@@ -766,52 +974,52 @@ nifti_image* copy_nifti_as_int8(nifti_image* nii) {
     // ------------------------------------------------------------------------
     if (nii->datatype == 2) {  // NIFTI_TYPE_UINT8
         uint8_t* nii_data = static_cast<uint8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 512) {  // NIFTI_TYPE_UINT16
         uint16_t* nii_data = static_cast<uint16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 768) {  // NIFTI_TYPE_UINT32
         uint32_t* nii_data = static_cast<uint32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 1280) {  // NIFTI_TYPE_UINT64
         uint64_t* nii_data = static_cast<uint64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 256) {  // NIFTI_TYPE_INT8
         int8_t* nii_data = static_cast<int8_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 4) {  // NIFTI_TYPE_INT16
         int16_t* nii_data = static_cast<int16_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 8) {  // NIFTI_TYPE_INT32
         int32_t* nii_data = static_cast<int32_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 1024) {  // NIFTI_TYPE_INT64
         int64_t* nii_data = static_cast<int64_t*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 16) {  // NIFTI_TYPE_FLOAT32
         float* nii_data = static_cast<float*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else if (nii->datatype == 64) {  // NIFTI_TYPE_FLOAT64
         double* nii_data = static_cast<double*>(nii->data);
-        for (int i = 0; i < nr_voxels; ++i) {
+        for (int64_t i = 0; i < nr_voxels; ++i) {
             *(nii_new_data + i) = static_cast<int8_t>(*(nii_data + i));
         }
     } else {
@@ -819,7 +1027,7 @@ nifti_image* copy_nifti_as_int8(nifti_image* nii) {
     }
 
     // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         if (*(nii_new_data + i)!= *(nii_new_data + i)) {
             *(nii_new_data + i) = 0;
         }
@@ -831,13 +1039,28 @@ nifti_image* copy_nifti_as_int8(nifti_image* nii) {
 // ============================================================================
 // Faruk's favorite functions
 // ============================================================================
+// Linear indices are 64-bit so that large 4D series do not
+// overflow. Divisions fall back to 32-bit whenever the index fits, since
+// they are considerably faster and cover nearly all 3D images.
 std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
-    const uint32_t linear_index,
+    const uint64_t linear_index,
     const uint32_t size_x,
     const uint32_t size_y) {
 
-    uint32_t z = linear_index / (size_x * size_y);
-    uint32_t temp = linear_index % (size_x * size_y);
+    const uint64_t size_xy = static_cast<uint64_t>(size_x) * size_y;
+    if (linear_index <= std::numeric_limits<uint32_t>::max()
+        && size_xy <= std::numeric_limits<uint32_t>::max()) {
+        const uint32_t i = static_cast<uint32_t>(linear_index);
+        const uint32_t nxy = static_cast<uint32_t>(size_xy);
+        uint32_t z = i / nxy;
+        uint32_t temp = i % nxy;
+        uint32_t y = temp / size_x;
+        uint32_t x = temp % size_x;
+        return std::make_tuple(x, y, z);
+    }
+
+    uint32_t z = linear_index / size_xy;
+    uint64_t temp = linear_index % size_xy;
     uint32_t y = temp / size_x;
     uint32_t x = temp % size_x;
 
@@ -845,30 +1068,40 @@ std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
 }
 
 std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> ind2sub_4D(
-    const uint32_t linear_index,
+    const uint64_t linear_index,
     const uint32_t size_x,
     const uint32_t size_y,
     const uint32_t size_z) {
 
-    uint32_t t = linear_index / (size_x * size_y * size_z);
-    uint32_t temp = linear_index % (size_x * size_y * size_z);
-    uint32_t z = temp / (size_x * size_y);
-    temp = linear_index % (size_x * size_y);
-    uint32_t y = temp / size_x;
-    uint32_t x = temp % size_x;
+    const uint64_t size_xyz = static_cast<uint64_t>(size_x) * size_y * size_z;
+    uint32_t x, y, z;
+    if (linear_index <= std::numeric_limits<uint32_t>::max()
+        && size_xyz <= std::numeric_limits<uint32_t>::max()) {
+        const uint32_t i = static_cast<uint32_t>(linear_index);
+        const uint32_t nxyz = static_cast<uint32_t>(size_xyz);
+        uint32_t t = i / nxyz;
+        tie(x, y, z) = ind2sub_3D(i % nxyz, size_x, size_y);
+        return std::make_tuple(x, y, z, t);
+    }
+
+    uint32_t t = linear_index / size_xyz;
+    tie(x, y, z) = ind2sub_3D(linear_index % size_xyz, size_x, size_y);
 
     return std::make_tuple(x, y, z, t);
 }
 
 
-uint32_t sub2ind_3D(const uint32_t x, const uint32_t y, const uint32_t z,
+uint64_t sub2ind_3D(const uint32_t x, const uint32_t y, const uint32_t z,
                     const uint32_t size_x, const uint32_t size_y) {
-    return size_x * size_y * z + size_x * y + x;
+    return static_cast<uint64_t>(size_x) * size_y * z
+           + static_cast<uint64_t>(size_x) * y + x;
 }
 
-uint32_t sub2ind_4D(const uint32_t x, const uint32_t y, const uint32_t z, const uint32_t t,
+uint64_t sub2ind_4D(const uint32_t x, const uint32_t y, const uint32_t z, const uint32_t t,
                     const uint32_t size_x, const uint32_t size_y, const uint32_t size_z) {
-    return size_x * size_y * size_z * t + size_x * size_y * z + size_x * y + x;
+    return static_cast<uint64_t>(size_x) * size_y * size_z * t
+           + static_cast<uint64_t>(size_x) * size_y * z
+           + static_cast<uint64_t>(size_x) * y + x;
 }
 
 
@@ -894,14 +1127,1156 @@ std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b)
 // }
 
 // ============================================================================
-// Smoothing
+// Multithreading
 // ============================================================================
-nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
-                                 nifti_image* nii_mask, int32_t mask_value) {
+static int ln_nr_threads = 1;
+// Set in the threads of ln_parallel_jobs
+static thread_local bool ln_job_thread = false;
 
-    // Copy input niftis TODO[Faruk]: Understand why I have to do this
-    nifti_image* temp1 = copy_nifti_as_float32(nii_in);
-    nifti_image* temp2 = copy_nifti_as_int32(nii_mask);
+void ln_set_nr_threads(int nr_threads) {
+    if (nr_threads < 1) {  // Use all available cores
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    ln_nr_threads = nr_threads < 1 ? 1 : nr_threads;
+    // Also compress .nii.gz outputs with the same number of threads and
+    // inflate .nii.gz inputs on a read-ahead thread
+    znz_set_nr_threads(ln_nr_threads);
+}
+
+int ln_get_nr_threads(void) {
+    return ln_nr_threads;
+}
+
+// Threads that work on the same data in steps wait here until all of them
+// have finished the current step
+struct ln_barrier {
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint32_t nr_threads = 1, nr_waiting = 0, generation = 0;
+};
+
+static void ln_barrier_wait(ln_barrier& barrier) {
+    std::unique_lock<std::mutex> lock(barrier.mutex);
+    const uint32_t generation = barrier.generation;
+    if (++barrier.nr_waiting == barrier.nr_threads) {
+        barrier.nr_waiting = 0;
+        barrier.generation += 1;
+        barrier.cv.notify_all();
+    } else {
+        barrier.cv.wait(lock, [&] { return barrier.generation != generation; });
+    }
+}
+
+void ln_parallel_jobs(const uint32_t nr_jobs, const std::function<void(uint32_t)>& job) {
+    const uint32_t nr_threads = std::min(static_cast<uint32_t>(ln_nr_threads), nr_jobs);
+    if (nr_threads <= 1 || ln_job_thread) {
+        for (uint32_t n = 0; n != nr_jobs; ++n) {
+            job(n);
+        }
+        return;
+    }
+    std::atomic<uint32_t> next_job(0);
+    std::vector<std::thread> threads;
+    for (uint32_t n_th = 0; n_th != nr_threads; ++n_th) {
+        threads.push_back(std::thread([&]() {
+            ln_job_thread = true;
+            for (uint32_t n = next_job++; n < nr_jobs; n = next_job++) {
+                job(n);
+            }
+        }));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// ============================================================================
+// Asynchronous output writing
+// ============================================================================
+// When enabled, save_output_nifti hands a snapshot of each output
+// to a background writer thread and returns, so that compressing earlier
+// outputs overlaps later stages. At most 'max_pending' snapshots wait in the
+// queue, which bounds the extra memory. Programs call ln_flush_outputs at the
+// end to wait for the writer and to report failures in their exit status.
+// Outputs that are still queued when a program returns early are written
+// at exit.
+static int ln_async_max_pending = -1;  // -1: not set, read LAYNII_ASYNC_OUTPUT
+static std::mutex ln_writer_mutex;
+static std::condition_variable ln_writer_cv;
+static std::deque<nifti_image*> ln_writer_queue;
+static std::thread ln_writer_thread;
+static bool ln_writer_busy = false, ln_writer_stop = false;
+static std::vector<string> ln_writer_failed;
+
+static void ln_writer_loop(void) {
+    std::unique_lock<std::mutex> lock(ln_writer_mutex);
+    while (true) {
+        ln_writer_cv.wait(lock, [] { return ln_writer_stop || !ln_writer_queue.empty(); });
+        if (ln_writer_queue.empty()) {  // Stopped and nothing left to write
+            break;
+        }
+        nifti_image* nii = ln_writer_queue.front();
+        ln_writer_queue.pop_front();
+        ln_writer_busy = true;
+        ln_writer_cv.notify_all();  // Room in the queue
+        lock.unlock();
+
+        const bool failed = nifti_image_write_status(nii) != 0;
+        const string fname = nii->fname;
+        nifti_image_free(nii);
+
+        lock.lock();
+        ln_writer_busy = false;
+        if (failed) {
+            ln_writer_failed.push_back(fname);
+        }
+        ln_writer_cv.notify_all();
+    }
+}
+
+static void ln_writer_atexit(void) {
+    {
+        std::lock_guard<std::mutex> lock(ln_writer_mutex);
+        ln_writer_stop = true;
+    }
+    ln_writer_cv.notify_all();
+    ln_writer_thread.join();
+    ln_flush_outputs();  // Only reports failures, the exit status is already set
+}
+
+void ln_set_async_output(int max_pending) {
+    ln_flush_outputs();
+    ln_async_max_pending = max_pending < 0 ? 0 : max_pending;
+}
+
+int ln_get_async_output(void) {
+    if (ln_async_max_pending < 0) {
+        const char* value = getenv("LAYNII_ASYNC_OUTPUT");
+        ln_async_max_pending = value != NULL ? std::max(0, atoi(value)) : 0;
+    }
+    return ln_async_max_pending;
+}
+
+void ln_write_async(nifti_image* nii) {
+    std::unique_lock<std::mutex> lock(ln_writer_mutex);
+    if (!ln_writer_thread.joinable()) {
+        ln_writer_thread = std::thread(ln_writer_loop);
+        std::atexit(ln_writer_atexit);
+    }
+    const size_t max_pending = std::max(1, ln_get_async_output());
+    ln_writer_cv.wait(lock, [max_pending] { return ln_writer_queue.size() < max_pending; });
+    ln_writer_queue.push_back(nii);
+    ln_writer_cv.notify_all();
+}
+
+bool ln_flush_outputs(void) {
+    std::unique_lock<std::mutex> lock(ln_writer_mutex);
+    ln_writer_cv.wait(lock, [] { return ln_writer_queue.empty() && !ln_writer_busy; });
+    for (const string& fname : ln_writer_failed) {
+        fprintf(stderr, "** failed to write '%s'\n", fname.c_str());
+    }
+    const bool success = ln_writer_failed.empty();
+    ln_writer_failed.clear();
+    return success;
+}
+
+// ============================================================================
+// In-memory image store
+// ============================================================================
+// LN_PIPELINE runs several programs in one process. Outputs are
+// kept here under their file names, so that the next program gets them from
+// memory instead of a compressed file. Readers get their own copy, because
+// many programs change their inputs in place.
+struct ln_memory_image {
+    nifti_image* nii;
+    bool saved;  // Also written to disk
+};
+static bool ln_memory_active = false;
+static std::vector<string> ln_memory_save_patterns;
+static std::map<string, ln_memory_image> ln_memory_images;
+
+static string ln_memory_key(const string& path) {
+    string key = path;
+    while (key.compare(0, 2, "./") == 0) {
+        key = key.substr(2);
+    }
+    return key;
+}
+
+static nifti_image* ln_memory_read_hook(const char* hname, int read_data) {
+    const nifti_image* stored = ln_memory_store_find(hname);
+    if (stored == NULL) {
+        return NULL;
+    }
+    return read_data ? ln_copy_nifti_data(stored) : nifti_copy_nim_info(stored);
+}
+
+// Takes ownership of 'nii', returns true when it should also be written
+static bool ln_memory_store_put(const string& path, nifti_image* nii) {
+    const string key = ln_memory_key(path);
+    bool saved = false;
+    for (size_t i = 0; i < ln_memory_save_patterns.size(); ++i) {
+        if (ln_match_wildcard(ln_memory_key(ln_memory_save_patterns[i]), key)) {
+            saved = true;
+        }
+    }
+    ln_memory_store_drop(key);
+    ln_memory_images[key] = {nii, saved};
+    return saved;
+}
+
+void ln_memory_store_begin(const std::vector<string>& save_patterns) {
+    ln_memory_store_end();
+    ln_memory_save_patterns = save_patterns;
+    ln_memory_active = true;
+    nifti_set_read_hook(ln_memory_read_hook);
+}
+
+void ln_memory_store_end(void) {
+    for (auto& entry : ln_memory_images) {
+        nifti_image_free(entry.second.nii);
+    }
+    ln_memory_images.clear();
+    ln_memory_save_patterns.clear();
+    ln_memory_active = false;
+    nifti_set_read_hook(NULL);
+}
+
+bool ln_memory_store_active(void) {
+    return ln_memory_active;
+}
+
+const nifti_image* ln_memory_store_find(const string& path) {
+    if (!ln_memory_active) {
+        return NULL;
+    }
+    auto entry = ln_memory_images.find(ln_memory_key(path));
+    return entry != ln_memory_images.end() ? entry->second.nii : NULL;
+}
+
+std::vector<string> ln_memory_store_paths(void) {
+    std::vector<string> paths;
+    for (auto& entry : ln_memory_images) {
+        paths.push_back(entry.first);
+    }
+    return paths;
+}
+
+bool ln_memory_store_saved(const string& path) {
+    auto entry = ln_memory_images.find(ln_memory_key(path));
+    return entry != ln_memory_images.end() && entry->second.saved;
+}
+
+void ln_memory_store_drop(const string& path) {
+    auto entry = ln_memory_images.find(ln_memory_key(path));
+    if (entry != ln_memory_images.end()) {
+        nifti_image_free(entry->second.nii);
+        ln_memory_images.erase(entry);
+    }
+}
+
+bool ln_match_wildcard(const string& pattern, const string& text) {
+    // Greedy matching with backtracking to the last '*'
+    size_t p = 0, t = 0, star = string::npos, star_t = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            star_t = t;
+        } else if (p < pattern.size() && pattern[p] == text[t]) {
+            ++p;
+            ++t;
+        } else if (star != string::npos) {
+            p = star + 1;
+            t = ++star_t;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+// ============================================================================
+// Profiling
+// ============================================================================
+// Stage times are inclusive: a stage that runs inside another one
+// (e.g. "save outputs") counts for both, and its name is joined to the outer
+// name with '/'. Memory is sampled when a stage ends: the resident set size
+// at that moment and the peak of the process up to then. The summary is meant
+// for sizing cluster jobs and for comparing LayNii versions.
+struct ln_profile_frame {
+    size_t stat;  // Index in ln_profile_stats
+    bool sequential;  // Started by ln_profile_stage
+    double wall, cpu;  // At the start of the stage
+};
+struct ln_profile_stat {
+    string name;
+    int calls;
+    double wall, cpu, rss, peak_rss;  // Seconds and megabytes
+};
+static int ln_profile_state = -1;  // -1: not set, read LAYNII_PROFILE
+static string ln_profile_path;
+static string ln_profile_program;
+static double ln_profile_wall0 = 0, ln_profile_cpu0 = 0;
+static std::mutex ln_profile_mutex;
+static std::vector<ln_profile_frame> ln_profile_frames;
+static std::vector<ln_profile_stat> ln_profile_stats;
+
+static double ln_profile_wall(void) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double ln_profile_cpu(void) {
+#ifdef _WIN32
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+static void ln_profile_memory(double& rss, double& peak_rss) {
+    rss = 0, peak_rss = 0;
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    peak_rss = usage.ru_maxrss / 1048576.0;  // Bytes
+#else
+    peak_rss = usage.ru_maxrss / 1024.0;  // Kilobytes
+#endif
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        long pages_total = 0, pages_resident = 0;
+        if (fscanf(statm, "%ld %ld", &pages_total, &pages_resident) == 2) {
+            rss = pages_resident * (sysconf(_SC_PAGESIZE) / 1048576.0);
+        }
+        fclose(statm);
+    }
+    peak_rss = std::max(peak_rss, rss);  // The peak is updated lazily
+#endif
+}
+
+// Callers hold ln_profile_mutex
+static void ln_profile_push(const char* name, const bool sequential) {
+    if (ln_profile_wall0 == 0) {
+        ln_profile_wall0 = ln_profile_wall();
+        ln_profile_cpu0 = ln_profile_cpu();
+    }
+    string path = name;
+    if (!ln_profile_frames.empty()) {
+        path = ln_profile_stats[ln_profile_frames.back().stat].name + "/" + path;
+    }
+    size_t s = 0;
+    while (s < ln_profile_stats.size() && ln_profile_stats[s].name != path) {
+        ++s;
+    }
+    if (s == ln_profile_stats.size()) {
+        ln_profile_stats.push_back({path, 0, 0, 0, 0, 0});
+    }
+    ln_profile_frames.push_back({s, sequential, ln_profile_wall(), ln_profile_cpu()});
+}
+
+static void ln_profile_pop(void) {
+    const ln_profile_frame frame = ln_profile_frames.back();
+    ln_profile_frames.pop_back();
+    ln_profile_stat& stat = ln_profile_stats[frame.stat];
+    double rss, peak_rss;
+    ln_profile_memory(rss, peak_rss);
+    stat.calls += 1;
+    stat.wall += ln_profile_wall() - frame.wall;
+    stat.cpu += ln_profile_cpu() - frame.cpu;
+    stat.rss = std::max(stat.rss, rss);
+    stat.peak_rss = std::max(stat.peak_rss, peak_rss);
+}
+
+static void ln_profile_atexit(void) {
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    while (!ln_profile_frames.empty()) {
+        ln_profile_pop();
+    }
+    const double wall = ln_profile_wall() - ln_profile_wall0;
+    const double cpu = ln_profile_cpu() - ln_profile_cpu0;
+    double rss, peak_rss;
+    ln_profile_memory(rss, peak_rss);
+
+    string path = ln_profile_path;
+    const char* value = getenv("LAYNII_PROFILE");
+    if (path.empty() && value != NULL && strcmp(value, "1") != 0) {
+        path = value;
+    }
+    if (path.empty()) {
+        path = ln_profile_program + "_profile.json";
+    }
+    const bool csv = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+
+    FILE* fp;
+    if (csv) {
+        FILE* existing = fopen(path.c_str(), "r");
+        fp = fopen(path.c_str(), "a");
+        if (existing != NULL) {
+            fclose(existing);
+        } else if (fp != NULL) {
+            fprintf(fp, "version,program,threads,stage,calls,wall_seconds,"
+                        "cpu_seconds,rss_mb,peak_rss_mb\n");
+        }
+    } else {
+        fp = fopen(path.c_str(), "w");
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "** failed to write profile '%s'\n", path.c_str());
+        return;
+    }
+
+    const char* program = ln_profile_program.c_str();
+    const int nr_threads = ln_get_nr_threads();
+    if (csv) {
+        for (const ln_profile_stat& stat : ln_profile_stats) {
+            fprintf(fp, "%s,%s,%d,\"%s\",%d,%.3f,%.3f,%.1f,%.1f\n", LN_VERSION,
+                    program, nr_threads, stat.name.c_str(), stat.calls,
+                    stat.wall, stat.cpu, stat.rss, stat.peak_rss);
+        }
+        fprintf(fp, "%s,%s,%d,\"total\",1,%.3f,%.3f,%.1f,%.1f\n", LN_VERSION,
+                program, nr_threads, wall, cpu, rss, peak_rss);
+    } else {
+        fprintf(fp, "{\n  \"version\": \"%s\",\n  \"program\": \"%s\",\n"
+                    "  \"threads\": %d,\n  \"wall_seconds\": %.3f,\n"
+                    "  \"cpu_seconds\": %.3f,\n  \"peak_rss_mb\": %.1f,\n"
+                    "  \"stages\": [", LN_VERSION, program, nr_threads, wall,
+                cpu, peak_rss);
+        for (size_t s = 0; s < ln_profile_stats.size(); ++s) {
+            const ln_profile_stat& stat = ln_profile_stats[s];
+            fprintf(fp, "%s\n    {\"name\": \"%s\", \"calls\": %d, "
+                        "\"wall_seconds\": %.3f, \"cpu_seconds\": %.3f, "
+                        "\"rss_mb\": %.1f, \"peak_rss_mb\": %.1f}",
+                    s == 0 ? "" : ",", stat.name.c_str(), stat.calls, stat.wall,
+                    stat.cpu, stat.rss, stat.peak_rss);
+        }
+        fprintf(fp, "\n  ]\n}\n");
+    }
+    fclose(fp);
+    cout << "\n  Profile written to: " << path << endl;
+}
+
+void ln_set_profile(const string& path) {
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    ln_profile_state = 1;
+    ln_profile_path = path;
+}
+
+bool ln_get_profile(void) {
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    if (ln_profile_state < 0) {
+        const char* value = getenv("LAYNII_PROFILE");
+        ln_profile_state = value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+    }
+    return ln_profile_state == 1;
+}
+
+void ln_profile_begin(const char* programname) {
+    if (!ln_get_profile()) {
+        return;
+    }
+    // Only the first program of a process (e.g. LN_PIPELINE) names the profile
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    if (ln_profile_program.empty()) {
+        ln_profile_program = programname;
+        if (ln_profile_wall0 == 0) {
+            ln_profile_wall0 = ln_profile_wall();
+            ln_profile_cpu0 = ln_profile_cpu();
+        }
+        std::atexit(ln_profile_atexit);
+    }
+}
+
+void ln_profile_stage(const char* name) {
+    if (!ln_get_profile() || ln_job_thread) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    if (!ln_profile_frames.empty() && ln_profile_frames.back().sequential) {
+        ln_profile_pop();
+    }
+    ln_profile_push(name, true);
+}
+
+ln_profile_scope::ln_profile_scope(const char* name) : depth(0) {
+    if (!ln_get_profile() || ln_job_thread) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    ln_profile_push(name, false);
+    depth = ln_profile_frames.size();
+}
+
+ln_profile_scope::~ln_profile_scope() {
+    if (depth == 0) {
+        return;
+    }
+    // Also ends the sequential stages that were started within this one
+    std::lock_guard<std::mutex> lock(ln_profile_mutex);
+    while (ln_profile_frames.size() >= depth) {
+        ln_profile_pop();
+    }
+}
+
+// ============================================================================
+// Streaming 4D data
+// ============================================================================
+// Voxelwise 4D tools do not need to hold whole time series in
+// memory. They read their inputs in slabs of z-slices across all time points
+// and write their 4D outputs slab by slab. The slab size follows from a memory
+// budget. Each input is read through one open stream. Compressed inputs that
+// need more than one slab and can not seek cheaply (not BGZF) are inflated
+// once into a temporary file, which the slabs are then read from.
+static int64_t ln_max_memory = int64_t(2048) * 1024 * 1024;
+
+void ln_set_max_memory(int64_t megabytes) {
+    ln_max_memory = std::max(int64_t(1), megabytes) * 1024 * 1024;
+}
+
+int64_t ln_get_max_memory(void) {
+    return ln_max_memory;
+}
+
+void ln_reset_settings(void) {
+    ln_set_output_crop(NULL);
+    nifti_set_mmap_read(0);
+    ln_set_nr_threads(1);
+    ln_set_max_memory(2048);
+    // Back to "not set", so that the environment variables apply again
+    ln_flush_outputs();
+    ln_async_max_pending = -1;
+    ln_output_type = -1;
+    ln_output_bgzf = -1;
+    znz_set_bgzf(0);
+}
+
+int ln_slab_nr_slices(const nifti_image* nii, const int nr_buffers) {
+    // Number of z-slices for which 'nr_buffers' float slabs fit the budget
+    const int64_t nxyz = static_cast<int64_t>(nii->nx) * nii->ny * nii->nz;
+    const int64_t nr_vols = nii->nvox / nxyz;
+    const int64_t slice_bytes = static_cast<int64_t>(nii->nx) * nii->ny
+                                * nr_vols * sizeof(float) * nr_buffers;
+    const int64_t nr_slices = ln_max_memory / std::max(int64_t(1), slice_bytes);
+    return static_cast<int>(std::max(int64_t(1), std::min(nr_slices, int64_t(nii->nz))));
+}
+
+bool ln_slab_reader_open(ln_slab_reader& reader, const nifti_image* nii,
+                         const int nr_slices) {
+    reader.nii = nii;
+    reader.fp = NULL;
+    reader.fp_raw = NULL;
+    reader.offset = nii->iname_offset;
+
+    // Images of an earlier pipeline stage are kept in memory
+    if (ln_memory_store_find(nii->iname) != NULL) {
+        return true;
+    }
+    if (nii->iname_offset < 0) {
+        fprintf(stderr, "** can not stream data without a fixed offset\n");
+        return false;
+    }
+    char* fname = nifti_findimgname(nii->iname, nii->nifti_type);
+    if (fname == NULL) {
+        fprintf(stderr, "** no image file found for '%s'\n", nii->iname);
+        return false;
+    }
+    reader.fp = znzopen(fname, "rb", nifti_is_gzfile(fname));
+    free(fname);
+    if (znz_isnull(reader.fp)) {
+        fprintf(stderr, "** failed to open '%s'\n", nii->iname);
+        return false;
+    }
+    if (nr_slices >= nii->nz || znz_random_access(reader.fp)) {
+        return true;
+    }
+
+    // Every slab has data in every volume, so each slab of a gzip stream
+    // would be inflated from the start of the file again. Inflate the data
+    // once into a temporary file instead.
+    reader.fp_raw = std::tmpfile();
+    bool success = reader.fp_raw != NULL
+                   && znzseek(reader.fp, nii->iname_offset, SEEK_SET) >= 0;
+    std::vector<char> buffer(16 * 1024 * 1024);
+    int64_t remain = static_cast<int64_t>(nii->nvox) * nii->nbyper;
+    while (success && remain > 0) {
+        const size_t n = static_cast<size_t>(
+            std::min(remain, static_cast<int64_t>(buffer.size())));
+        success = znzread(buffer.data(), 1, n, reader.fp) == n
+                  && fwrite(buffer.data(), 1, n, reader.fp_raw) == n;
+        remain -= n;
+    }
+    znzclose(reader.fp);
+    if (!success) {
+        fprintf(stderr, "** failed to inflate '%s' into a temporary file\n",
+                nii->iname);
+        ln_slab_reader_close(reader);
+        return false;
+    }
+    reader.offset = 0;
+    return true;
+}
+
+void ln_slab_reader_close(ln_slab_reader& reader) {
+    if (!znz_isnull(reader.fp)) {
+        znzclose(reader.fp);
+    }
+    if (reader.fp_raw != NULL) {
+        fclose(reader.fp_raw);  // Temporary files are removed when closed
+        reader.fp_raw = NULL;
+    }
+}
+
+bool ln_read_slab(ln_slab_reader& reader, const int z_begin,
+                  const int nr_slices, float* data, const bool scale) {
+    // Values are converted like copy_nifti_as_float32 (or
+    // copy_nifti_as_float32_with_scl_slope_and_scl_inter when 'scale' is set).
+    const nifti_image* nii = reader.nii;
+    const int64_t nxy = static_cast<int64_t>(nii->nx) * nii->ny;
+    const int64_t nxyz = nxy * nii->nz;
+    const int64_t nr_vols = nii->nvox / nxyz;
+    const int64_t slab_voxels = nxy * nr_slices;
+    const bool swap = nii->swapsize > 1 && nii->byteorder != nifti_short_order();
+    const bool do_scale = scale && nii->scl_slope != 0;
+
+    // Images of an earlier pipeline stage are kept in memory
+    const nifti_image* stored = ln_memory_store_find(nii->iname);
+    if (stored != NULL) {
+        for (int64_t t = 0; t < nr_vols; ++t) {
+            const char* src = static_cast<const char*>(stored->data)
+                              + (nxyz * t + nxy * z_begin) * nii->nbyper;
+            if (!ln_convert_data<float>(src, nii->datatype, data + slab_voxels * t,
+                                        slab_voxels, do_scale, nii->scl_slope,
+                                        nii->scl_inter)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<char> buffer(slab_voxels * nii->nbyper);
+    for (int64_t t = 0; t < nr_vols; ++t) {
+        const int64_t offset = reader.offset
+                               + (nxyz * t + nxy * z_begin) * nii->nbyper;
+        bool success;
+        if (reader.fp_raw != NULL) {
+            success = fseek(reader.fp_raw, offset, SEEK_SET) == 0
+                      && fread(buffer.data(), 1, buffer.size(), reader.fp_raw)
+                         == buffer.size();
+        } else {
+            success = znzseek(reader.fp, offset, SEEK_SET) >= 0
+                      && znzread(buffer.data(), 1, buffer.size(), reader.fp)
+                         == buffer.size();
+        }
+        if (!success) {
+            fprintf(stderr, "** failed to read slab from '%s'\n", nii->iname);
+            return false;
+        }
+        if (swap) {
+            nifti_swap_Nbytes(buffer.size() / nii->swapsize, nii->swapsize,
+                              buffer.data());
+        }
+        if (!ln_convert_data<float>(buffer.data(), nii->datatype,
+                                    data + slab_voxels * t, slab_voxels,
+                                    do_scale, nii->scl_slope, nii->scl_inter)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+nifti_image* ln_read_as_float32(const char* path, const bool scale) {
+    // The data is converted while it is read, one volume at a time, so that
+    // the input is never held in memory in its own datatype as well.
+    nifti_image* nii = nifti_image_read(path, 0);
+    if (nii == NULL) {
+        return NULL;
+    }
+    nii->data = malloc(static_cast<size_t>(nii->nvox) * sizeof(float));
+    if (nii->data == NULL) {
+        fprintf(stderr, "** failed to allocate memory for '%s'\n", path);
+        nifti_image_free(nii);
+        return NULL;
+    }
+    ln_slab_reader reader;
+    bool success = ln_slab_reader_open(reader, nii, nii->nz);
+    if (success) {
+        success = ln_read_slab(reader, 0, nii->nz,
+                               static_cast<float*>(nii->data), scale);
+        ln_slab_reader_close(reader);
+    }
+    if (!success) {
+        nifti_image_free(nii);
+        return NULL;
+    }
+    if (scale && nii->scl_slope != 0) {
+        nii->scl_slope = 1.;
+        nii->scl_inter = 0.;
+    }
+    nii->datatype = NIFTI_TYPE_FLOAT32;
+    nii->nbyper = sizeof(float);
+    nii->swapsize = sizeof(float);
+    nii->byteorder = nifti_short_order();
+    return nii;
+}
+
+bool ln_slab_writer_open(ln_slab_writer& writer, nifti_image* nii,
+                         const string path, const string tag,
+                         const bool use_outpath) {
+    // Slabs are written into an uncompressed file. For .nii.gz
+    // outputs this is a temporary file that is compressed when closing.
+    writer.nii = nii;
+    writer.path = ln_output_path(path, tag, use_outpath);
+    writer.path_raw = writer.path;
+    if (nifti_is_gzfile(writer.path.c_str())) {
+        writer.path_raw += ".tmp.nii";
+    }
+
+    nii->datatype = NIFTI_TYPE_FLOAT32;
+    nii->nbyper = sizeof(float);
+    nii->data = NULL;
+    nifti_set_filenames(nii, writer.path_raw.c_str(), 0, 1);
+    if (writer.path_raw == writer.path) {  // Paths without extension
+        writer.path = nii->iname;
+    }
+    writer.path_raw = nii->iname;
+    if (nii->nifti_type != NIFTI_FTYPE_NIFTI1_1
+        && nii->nifti_type != NIFTI_FTYPE_NIFTI2_1) {
+        fprintf(stderr, "** streamed outputs need a single file (.nii)\n");
+        return false;
+    }
+    // Header (and extensions) only
+    nifti_image_write_hdr_img(nii, 0, "wb");
+    writer.offset = nii->iname_offset;
+
+    writer.file.open(writer.path_raw.c_str(),
+                     std::ios::in | std::ios::out | std::ios::binary);
+    if (!writer.file.is_open()) {
+        fprintf(stderr, "** failed to open '%s'\n", writer.path_raw.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ln_slab_write(ln_slab_writer& writer, const int z_begin,
+                   const int nr_slices, const float* data) {
+    const nifti_image* nii = writer.nii;
+    const int64_t nxy = static_cast<int64_t>(nii->nx) * nii->ny;
+    const int64_t nxyz = nxy * nii->nz;
+    const int64_t nr_vols = nii->nvox / nxyz;
+    const int64_t slab_voxels = nxy * nr_slices;
+
+    for (int64_t t = 0; t < nr_vols; ++t) {
+        writer.file.seekp(writer.offset + (nxyz * t + nxy * z_begin) * sizeof(float));
+        writer.file.write(reinterpret_cast<const char*>(data + slab_voxels * t),
+                          slab_voxels * sizeof(float));
+    }
+    if (!writer.file) {
+        fprintf(stderr, "** failed to write slab to '%s'\n", writer.path_raw.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ln_slab_writer_close(ln_slab_writer& writer, const bool log) {
+    ln_profile_scope profile("save outputs");
+    bool success = static_cast<bool>(writer.file);
+    writer.file.close();
+
+    if (writer.path_raw != writer.path) {
+        // Compress the uncompressed file into the output
+        ln_get_output_bgzf();
+        FILE* fp_in = fopen(writer.path_raw.c_str(), "rb");
+        znzFile fp_out = znzopen(writer.path.c_str(), "wb", 1);
+        if (fp_in == NULL || znz_isnull(fp_out)) {
+            success = false;
+        } else {
+            std::vector<char> buffer(16 * 1024 * 1024);
+            size_t n;
+            while ((n = fread(buffer.data(), 1, buffer.size(), fp_in)) > 0) {
+                if (znzwrite(buffer.data(), 1, n, fp_out) != n) {
+                    success = false;
+                    break;
+                }
+            }
+        }
+        if (fp_in != NULL) fclose(fp_in);
+        if (!znz_isnull(fp_out)) znzclose(fp_out);
+        remove(writer.path_raw.c_str());
+    }
+    nifti_set_filenames(writer.nii, writer.path.c_str(), 0, 1);
+
+    if (!success) {
+        fprintf(stderr, "** failed to write '%s'\n", writer.path.c_str());
+    } else if (log) {
+        log_output(writer.path.c_str());
+    }
+    return success;
+}
+
+// ============================================================================
+// Bounding box cropping
+// ============================================================================
+// Rim files are often a small patch inside a large (upsampled)
+// field of view. Rim-based tools read only the bounding box of the nonzero
+// voxels (plus a margin) and allocate their scratch images in this cropped
+// frame. Cropping keeps the raster order of the voxels, so loops over linear
+// indices visit the voxels in the same order as in the full frame. Outputs are
+// put back into the full field of view by save_output_nifti.
+//
+// Cropped headers get their dimensions updated from the dim array, which sets
+// unused dimensions (e.g. dim[4] = 0 in some 3D headers) to 1. Reads of the
+// full frame are updated the same way, so results never depend on whether
+// the box is smaller than the field of view.
+
+static bool ln_crop_is_full(const ln_crop& crop) {
+    return crop.size[0] == crop.nii_full->nx && crop.size[1] == crop.nii_full->ny
+           && crop.size[2] == crop.nii_full->nz;
+}
+
+static void ln_crop_header(nifti_image* nii, const ln_crop& crop) {
+    // Shift the origin to the first voxel of the box
+    const double shift[3] = {static_cast<double>(crop.start[0]),
+                             static_cast<double>(crop.start[1]),
+                             static_cast<double>(crop.start[2])};
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            nii->qto_xyz.m[r][3] += nii->qto_xyz.m[r][c] * shift[c];
+            nii->sto_xyz.m[r][3] += nii->sto_xyz.m[r][c] * shift[c];
+        }
+    }
+    nii->qoffset_x = nii->qto_xyz.m[0][3];
+    nii->qoffset_y = nii->qto_xyz.m[1][3];
+    nii->qoffset_z = nii->qto_xyz.m[2][3];
+    nii->qto_ijk = nifti_dmat44_inverse(nii->qto_xyz);
+    nii->sto_ijk = nifti_dmat44_inverse(nii->sto_xyz);
+
+    nii->dim[1] = crop.size[0];
+    nii->dim[2] = crop.size[1];
+    nii->dim[3] = crop.size[2];
+    nifti_update_dims_from_array(nii);
+}
+
+bool ln_crop_find(ln_crop& crop, const std::vector<string>& paths,
+                  const int margin) {
+    crop.nii_full = NULL;
+    int64_t box_min[3] = {std::numeric_limits<int64_t>::max(),
+                          std::numeric_limits<int64_t>::max(),
+                          std::numeric_limits<int64_t>::max()};
+    int64_t box_max[3] = {-1, -1, -1};
+
+    for (size_t p = 0; p < paths.size(); ++p) {
+        nifti_image* nii = nifti_image_read(paths[p].c_str(), 0);
+        if (!nii) {
+            fprintf(stderr, "** failed to read NIfTI from '%s'\n", paths[p].c_str());
+            ln_crop_free(crop);
+            return false;
+        }
+        if (crop.nii_full == NULL) {
+            crop.nii_full = nii;
+        } else if (nii->nx != crop.nii_full->nx || nii->ny != crop.nii_full->ny
+                   || nii->nz != crop.nii_full->nz) {
+            fprintf(stderr, "** '%s' does not match the dimensions of '%s'\n",
+                    paths[p].c_str(), crop.nii_full->fname);
+            nifti_image_free(nii);
+            ln_crop_free(crop);
+            return false;
+        }
+
+        // Scan the input in slabs, only the box is kept
+        const int64_t nx = nii->nx, ny = nii->ny;
+        const int64_t nxy = nx * ny;
+        const int64_t nr_vols = nii->nvox / (nxy * nii->nz);
+        const int nr_slices = ln_slab_nr_slices(nii, 1);
+        std::vector<float> slab(nxy * nr_slices * nr_vols);
+        ln_slab_reader reader;
+        bool success = ln_slab_reader_open(reader, nii, nr_slices);
+        for (int z0 = 0; success && z0 < nii->nz; z0 += nr_slices) {
+            const int n = std::min(nr_slices, static_cast<int>(nii->nz) - z0);
+            if (!ln_read_slab(reader, z0, n, slab.data())) {
+                success = false;
+                break;
+            }
+            const int64_t slab_voxels = nxy * n;
+            for (int64_t i = 0; i < slab_voxels * nr_vols; ++i) {
+                if (slab[i] != 0) {
+                    const int64_t j = i % slab_voxels;
+                    const int64_t x = j % nx, y = (j / nx) % ny, z = z0 + j / nxy;
+                    box_min[0] = std::min(box_min[0], x);
+                    box_min[1] = std::min(box_min[1], y);
+                    box_min[2] = std::min(box_min[2], z);
+                    box_max[0] = std::max(box_max[0], x);
+                    box_max[1] = std::max(box_max[1], y);
+                    box_max[2] = std::max(box_max[2], z);
+                }
+            }
+        }
+        ln_slab_reader_close(reader);
+        if (nii != crop.nii_full) nifti_image_free(nii);
+        if (!success) {
+            ln_crop_free(crop);
+            return false;
+        }
+    }
+
+    const int64_t dims[3] = {crop.nii_full->nx, crop.nii_full->ny, crop.nii_full->nz};
+    for (int d = 0; d < 3; ++d) {
+        if (box_max[d] < 0) {  // No nonzero voxels, keep the full frame
+            crop.start[d] = 0;
+            crop.size[d] = dims[d];
+        } else {
+            crop.start[d] = std::max(int64_t(0), box_min[d] - margin);
+            crop.size[d] = std::min(dims[d], box_max[d] + margin + 1) - crop.start[d];
+        }
+    }
+    return true;
+}
+
+void ln_crop_free(ln_crop& crop) {
+    if (ln_output_crop == &crop) {
+        ln_output_crop = NULL;
+    }
+    if (crop.nii_full != NULL) {
+        nifti_image_free(crop.nii_full);
+        crop.nii_full = NULL;
+    }
+}
+
+nifti_image* ln_read_cropped(const char* path, const ln_crop& crop) {
+    const nifti_image* stored = ln_memory_store_find(path);
+    if (stored != NULL) {
+        if (stored->nx != crop.nii_full->nx || stored->ny != crop.nii_full->ny
+            || stored->nz != crop.nii_full->nz) {
+            fprintf(stderr, "** '%s' does not match the dimensions of '%s'\n",
+                    path, crop.nii_full->fname);
+            return NULL;
+        }
+        return ln_crop_nifti(stored, crop);
+    }
+
+    nifti_image* nii = nifti_image_read(path, 0);
+    if (!nii) {
+        return NULL;
+    }
+    if (nii->nx != crop.nii_full->nx || nii->ny != crop.nii_full->ny
+        || nii->nz != crop.nii_full->nz) {
+        fprintf(stderr, "** '%s' does not match the dimensions of '%s'\n",
+                path, crop.nii_full->fname);
+        nifti_image_free(nii);
+        return NULL;
+    }
+    if (ln_crop_is_full(crop)) {
+        if (nifti_image_load(nii) < 0) {
+            nifti_image_free(nii);
+            return NULL;
+        }
+        nifti_update_dims_from_array(nii);
+        return nii;
+    }
+
+    // Box over the spatial dimensions, all volumes
+    int64_t start[7] = {crop.start[0], crop.start[1], crop.start[2], 0, 0, 0, 0};
+    int64_t size[7] = {crop.size[0], crop.size[1], crop.size[2], 1, 1, 1, 1};
+    for (int d = 3; d < nii->ndim; ++d) {
+        size[d] = nii->dim[d + 1];
+    }
+    void* data = NULL;
+    const int64_t nr_bytes = nifti_read_subregion_image(nii, start, size, &data);
+
+    ln_crop_header(nii, crop);
+    if (nr_bytes != static_cast<int64_t>(nii->nvox * nii->nbyper)) {
+        fprintf(stderr, "** failed to read bounding box from '%s'\n", path);
+        free(data);
+        nifti_image_free(nii);
+        return NULL;
+    }
+    nii->data = data;
+    return nii;
+}
+
+uint64_t ln_crop_full_index(const ln_crop& crop, const uint64_t i) {
+    const uint64_t x = i % crop.size[0];
+    const uint64_t y = (i / crop.size[0]) % crop.size[1];
+    const uint64_t z = i / (crop.size[0] * crop.size[1]);
+    return sub2ind_3D(x + crop.start[0], y + crop.start[1], z + crop.start[2],
+                      crop.nii_full->nx, crop.nii_full->ny);
+}
+
+nifti_image* ln_crop_ids_to_full(const ln_crop& crop, nifti_image* nii) {
+    // Zero means "no id". The first voxel of the box is only an
+    // id when the rim touches the corner of the field of view.
+    nifti_image* nii_new = copy_nifti_as_int32(nii);
+    int32_t* nii_new_data = static_cast<int32_t*>(nii_new->data);
+    for (int64_t i = 0; i < nii_new->nvox; ++i) {
+        if (*(nii_new_data + i) > 0) {
+            *(nii_new_data + i) = ln_crop_full_index(crop, *(nii_new_data + i));
+        }
+    }
+    return nii_new;
+}
+
+void ln_set_output_crop(const ln_crop* crop) {
+    ln_output_crop = crop;
+}
+
+nifti_image* ln_uncrop_nifti(nifti_image* nii, const ln_crop& crop) {
+    // Zero padded copy of a cropped image in the full field of view
+    const nifti_image* full = crop.nii_full;
+    nifti_image* nii_new = nifti_copy_nim_info(nii);
+    nii_new->qoffset_x = full->qoffset_x;
+    nii_new->qoffset_y = full->qoffset_y;
+    nii_new->qoffset_z = full->qoffset_z;
+    nii_new->qto_xyz = full->qto_xyz;
+    nii_new->qto_ijk = full->qto_ijk;
+    nii_new->sto_xyz = full->sto_xyz;
+    nii_new->sto_ijk = full->sto_ijk;
+    nii_new->dim[1] = full->nx;
+    nii_new->dim[2] = full->ny;
+    nii_new->dim[3] = full->nz;
+    nifti_update_dims_from_array(nii_new);
+    nii_new->data = calloc(nii_new->nvox, nii_new->nbyper);
+
+    const int64_t row_bytes = crop.size[0] * nii->nbyper;
+    const int64_t nr_rows = nii->nvox / crop.size[0];
+    const char* src = static_cast<const char*>(nii->data);
+    char* dst = static_cast<char*>(nii_new->data);
+    for (int64_t r = 0; r < nr_rows; ++r) {
+        const int64_t y = r % crop.size[1];
+        const int64_t z = (r / crop.size[1]) % crop.size[2];
+        const int64_t t = r / (crop.size[1] * crop.size[2]);
+        const int64_t j = ((t * full->nz + z + crop.start[2]) * full->ny
+                           + y + crop.start[1]) * full->nx + crop.start[0];
+        memcpy(dst + j * nii->nbyper, src + r * row_bytes, row_bytes);
+    }
+    return nii_new;
+}
+
+nifti_image* ln_crop_nifti(const nifti_image* nii, const ln_crop& crop) {
+    // Copy of the box of an image in the full field of view
+    if (ln_crop_is_full(crop)) {
+        nifti_image* nii_new = ln_copy_nifti_data(nii);
+        nifti_update_dims_from_array(nii_new);
+        return nii_new;
+    }
+    nifti_image* nii_new = nifti_copy_nim_info(nii);
+    ln_crop_header(nii_new, crop);
+    nii_new->data = malloc(nii_new->nvox * nii_new->nbyper);
+
+    const int64_t row_bytes = crop.size[0] * nii->nbyper;
+    const int64_t nr_rows = nii_new->nvox / crop.size[0];
+    const char* src = static_cast<const char*>(nii->data);
+    char* dst = static_cast<char*>(nii_new->data);
+    for (int64_t r = 0; r < nr_rows; ++r) {
+        const int64_t y = r % crop.size[1];
+        const int64_t z = (r / crop.size[1]) % crop.size[2];
+        const int64_t t = r / (crop.size[1] * crop.size[2]);
+        const int64_t j = ((t * nii->nz + z + crop.start[2]) * nii->ny
+                           + y + crop.start[1]) * nii->nx + crop.start[0];
+        memcpy(dst + r * row_bytes, src + j * nii->nbyper, row_bytes);
+    }
+    return nii_new;
+}
+
+// ============================================================================
+// Smoothing
+// ============================================================================
+static void iterative_smoothing_sweep(const float* data_in, float* data_out,
+                                      const int32_t* mask_data, const int32_t mask_value,
+                                      const int32_t* voi_id, const uint32_t voi_begin,
+                                      const uint32_t voi_end,
+                                      const uint32_t size_x, const uint32_t size_y,
+                                      const uint32_t size_z,
+                                      const float w_0, const float w_dX,
+                                      const float w_dY, const float w_dZ) {
+    const uint32_t end_x = size_x - 1;
+    const uint32_t end_y = size_y - 1;
+    const uint32_t end_z = size_z - 1;
+
+    uint32_t ix, iy, iz;
+    uint64_t j;
+    for (uint32_t ii = voi_begin; ii != voi_end; ++ii) {
+        uint32_t i = *(voi_id + ii);
+
+        if (*(mask_data + i) == mask_value) {
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+            float new_val = 0, total_weight = 0;
+
+            // Start with the voxel itself
+            new_val += *(data_in + i) * w_0;
+            total_weight += w_0;
+
+            // ----------------------------------------------------------------
+            // 1-jump neighbours
+            // ----------------------------------------------------------------
+            if (ix > 0) {
+                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dX;
+                    total_weight += w_dX;
+                }
+            }
+            if (ix < end_x) {
+                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dX;
+                    total_weight += w_dX;
+                }
+            }
+            if (iy > 0) {
+                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dY;
+                    total_weight += w_dY;
+                }
+            }
+            if (iy < end_y) {
+                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dY;
+                    total_weight += w_dY;
+                }
+            }
+            if (iz > 0) {
+                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dZ;
+                    total_weight += w_dZ;
+                }
+            }
+            if (iz < end_z) {
+                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
+                if (*(mask_data + j) == mask_value) {
+                    new_val += *(data_in + j) * w_dZ;
+                    total_weight += w_dZ;
+                }
+            }
+            // ----------------------------------------------------------------
+            // 2-jump neighbours
+            // ----------------------------------------------------------------
+            // TODO
+
+            // ----------------------------------------------------------------
+            // 3-jump neighbours
+            // ----------------------------------------------------------------
+            // TODO
+
+            *(data_out + i) = new_val / total_weight;
+        }
+    }
+}
+
+nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
+                                 nifti_image* nii_mask, int32_t mask_value) {
+
+    // Copy input niftis TODO[Faruk]: Understand why I have to do this
+    nifti_image* temp1 = copy_nifti_as_float32(nii_in);
+    nifti_image* temp2 = copy_nifti_as_int32(nii_mask);
 
     float* nii_in_data = static_cast<float*>(temp1->data);
     int32_t* nii_mask_data = static_cast<int32_t*>(temp2->data);
@@ -911,22 +2286,12 @@ nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
     const uint32_t size_y = temp1->ny;
     const uint32_t size_z = temp1->nz;
     const uint32_t size_t = temp1->nt;
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
     const float dX = temp1->pixdim[1];
     const float dY = temp1->pixdim[2];
     const float dZ = temp1->pixdim[3];
 
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is written to constrain voxel visits
     // Find the subset voxels that will be used many times
@@ -955,6 +2320,10 @@ nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
     float* nii_smooth_data = static_cast<float*>(nii_smooth->data);
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         *(nii_smooth_data + i) = 0;
+        // Voxels outside of the mask end up as zeros in the first volume
+        if (*(nii_mask_data + i) != mask_value) {
+            *(nii_in_data + i) = 0;
+        }
     }
 
     // Pre-compute weights
@@ -964,87 +2333,642 @@ nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
     float w_dY = gaus(dY, FWHM_val);
     float w_dZ = gaus(dZ, FWHM_val);
 
-    uint32_t ix, iy, iz, j;
-    for (uint16_t t = 0; t != size_t; ++t) {  // Over 4th dim (e.g. timepoints)
-        for (uint16_t n = 0; n != iter_smooth; ++n) {
-            cout << "\r    Iteration: " << n+1 << "/" << iter_smooth << flush;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                uint32_t i = *(voi_id + ii);
-
-                if (*(nii_mask_data + i) == mask_value) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    float new_val = 0, total_weight = 0;
-
-                    // Start with the voxel itself
-                    new_val += *(nii_in_data + nr_voxels * t + i) * w_0;
-                    total_weight += w_0;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dX;
-                            total_weight += w_dX;
-                        }
+    // Split voxels of interest into one chunk per thread. The threads are
+    // started once and wait for each other after every iteration.
+    const uint32_t nr_threads = ln_job_thread ? 1 : std::max(1u, std::min(
+        static_cast<uint32_t>(ln_get_nr_threads()), nr_voi));
+    const uint32_t chunk = (nr_voi + nr_threads - 1) / nr_threads;
+    ln_barrier barrier;
+    barrier.nr_threads = nr_threads;
+
+    auto smooth_chunk = [&](const uint32_t n_th) {
+        const uint32_t voi_begin = std::min(n_th * chunk, nr_voi);
+        const uint32_t voi_end = std::min(voi_begin + chunk, nr_voi);
+        for (uint32_t t = 0; t != size_t; ++t) {  // Over 4th dim (e.g. timepoints)
+            // NOTE: Two buffers are swapped between iterations instead of
+            // copying the smoothed volume back after every iteration. Voxels
+            // outside of the mask are never written and hold the same values
+            // in both.
+            float* data_in = nii_in_data + static_cast<uint64_t>(nr_voxels) * t;
+            float* data_out = nii_smooth_data + static_cast<uint64_t>(nr_voxels) * t;
+            for (int n = 0; n < iter_smooth; ++n) {
+                if (n_th == 0) {
+                    cout << "\r    Iteration: " << n+1 << "/" << iter_smooth << flush;
+                }
+                iterative_smoothing_sweep(data_in, data_out, nii_mask_data, mask_value,
+                                          voi_id, voi_begin, voi_end, size_x, size_y,
+                                          size_z, w_0, w_dX, w_dY, w_dZ);
+                ln_barrier_wait(barrier);
+                std::swap(data_in, data_out);
+            }
+            // Last smoothed volume is in the input buffer after the final swap
+            if (n_th == 0) {
+                float* data_smooth = nii_smooth_data + static_cast<uint64_t>(nr_voxels) * t;
+                if (data_in != data_smooth) {
+                    for (uint32_t i = 0; i != nr_voxels; ++i) {
+                        *(data_smooth + i) = *(data_in + i);
                     }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dX;
-                            total_weight += w_dX;
-                        }
+                }
+                cout << endl;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t n_th = 1; n_th < nr_threads; ++n_th) {
+        threads.push_back(std::thread(smooth_chunk, n_th));
+    }
+    smooth_chunk(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    free(voi_id);
+    nifti_image_free(temp1);
+    nifti_image_free(temp2);
+    return nii_smooth;
+}
+
+// ============================================================================
+// 26-connected neighbourhood
+// ============================================================================
+// Neighbour visiting order is the same as the hand unrolled
+// 1-jump, 2-jump, 3-jump blocks that used to live in LN2_LAYERS. Keeping the
+// order makes the legacy wavefront mode reproduce the old outputs exactly.
+static const int8_t LN_NEIGHBORS_26[26][3] = {
+    // 1-jump neighbours
+    {-1,  0,  0}, { 1,  0,  0}, { 0, -1,  0}, { 0,  1,  0}, { 0,  0, -1}, { 0,  0,  1},
+    // 2-jump neighbours
+    {-1, -1,  0}, {-1,  1,  0}, { 1, -1,  0}, { 1,  1,  0},
+    { 0, -1, -1}, { 0, -1,  1}, { 0,  1, -1}, { 0,  1,  1},
+    {-1,  0, -1}, { 1,  0, -1}, {-1,  0,  1}, { 1,  0,  1},
+    // 3-jump neighbours
+    {-1, -1, -1}, {-1, -1,  1}, {-1,  1, -1}, { 1, -1, -1},
+    {-1,  1,  1}, { 1, -1,  1}, { 1,  1, -1}, { 1,  1,  1}
+};
+
+static void ln_neighbor_weights_26(float* w, const float dX, const float dY, const float dZ) {
+    // Short diagonals
+    const float dia_xy = sqrt(dX * dX + dY * dY);
+    const float dia_xz = sqrt(dX * dX + dZ * dZ);
+    const float dia_yz = sqrt(dY * dY + dZ * dZ);
+    // Long diagonals
+    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
+
+    for (int n = 0; n != 26; ++n) {
+        const bool ox = LN_NEIGHBORS_26[n][0] != 0;
+        const bool oy = LN_NEIGHBORS_26[n][1] != 0;
+        const bool oz = LN_NEIGHBORS_26[n][2] != 0;
+        if (ox && oy && oz) {
+            w[n] = dia_xyz;
+        } else if (ox && oy) {
+            w[n] = dia_xy;
+        } else if (oy && oz) {
+            w[n] = dia_yz;
+        } else if (ox && oz) {
+            w[n] = dia_xz;
+        } else if (ox) {
+            w[n] = dX;
+        } else if (oy) {
+            w[n] = dY;
+        } else {
+            w[n] = dZ;
+        }
+    }
+}
+
+// ============================================================================
+// Sparse voxels of interest grid
+// ============================================================================
+void ln_voi_grid_build(ln_voi_grid& grid, const int32_t* voi_id, const uint32_t nr_voi,
+                       const uint32_t size_x, const uint32_t size_y, const uint32_t size_z,
+                       const float dX, const float dY, const float dZ) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - voi_id has to be in ascending order (as it is when filled by a single
+    //   pass over the full grid). Then the full grid index of each neighbour
+    //   direction also ascends, and neighbours can be matched by walking one
+    //   pointer per direction over voi_id. No full grid sized lookup table is
+    //   needed.
+    ///////////////////////////////////////////////////////////////////////////
+    grid.size_x = size_x;
+    grid.size_y = size_y;
+    grid.size_z = size_z;
+    grid.nr_voi = nr_voi;
+    ln_neighbor_weights_26(grid.w, dX, dY, dZ);
+
+    grid.voi_id.assign(voi_id, voi_id + nr_voi);
+    grid.nbr_start.assign(nr_voi + 1, 0);
+    grid.nbr_id.clear();
+    grid.nbr_dir.clear();
+    if (nr_voi == 0) return;
+
+    // Full grid index offset of each neighbour direction
+    const int64_t nxy = static_cast<int64_t>(size_x) * size_y;
+    int64_t offset[26];
+    for (int n = 0; n != 26; ++n) {
+        offset[n] = LN_NEIGHBORS_26[n][0] + LN_NEIGHBORS_26[n][1] * static_cast<int64_t>(size_x)
+                    + LN_NEIGHBORS_26[n][2] * nxy;
+    }
+
+    // Raw pointers keep the inner loops cheap in unoptimized builds
+    const uint32_t* vid = grid.voi_id.data();
+    uint32_t* start = grid.nbr_start.data();
+    uint32_t* nbr_id = NULL;
+    uint8_t* nbr_dir = NULL;
+
+    // First pass counts the neighbours, second pass fills them in
+    for (int pass = 0; pass != 2; ++pass) {
+        if (pass == 1) {
+            grid.nbr_id.resize(start[nr_voi]);
+            grid.nbr_dir.resize(start[nr_voi]);
+            nbr_id = grid.nbr_id.data();
+            nbr_dir = grid.nbr_dir.data();
+        }
+        uint32_t walk[26] = {0};
+        uint32_t ix, iy, iz, w, k = 0;
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            const int64_t i = vid[ii];
+            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+            // Only voxels at the edges of the full grid need bound checks
+            const bool at_edge = ix == 0 || iy == 0 || iz == 0 || ix == size_x - 1
+                                 || iy == size_y - 1 || iz == size_z - 1;
+
+            for (int n = 0; n != 26; ++n) {
+                if (at_edge) {
+                    const int jx = LN_NEIGHBORS_26[n][0];
+                    const int jy = LN_NEIGHBORS_26[n][1];
+                    const int jz = LN_NEIGHBORS_26[n][2];
+                    if ((jx < 0 && ix == 0) || (jx > 0 && ix == size_x - 1)
+                        || (jy < 0 && iy == 0) || (jy > 0 && iy == size_y - 1)
+                        || (jz < 0 && iz == 0) || (jz > 0 && iz == size_z - 1)) {
+                        continue;
                     }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dY;
-                            total_weight += w_dY;
-                        }
+                }
+                const int64_t j = i + offset[n];
+                w = walk[n];
+                while (w != nr_voi && vid[w] < j) {
+                    w += 1;
+                }
+                walk[n] = w;
+                if (w != nr_voi && vid[w] == j) {
+                    if (pass == 1) {
+                        nbr_id[k] = w;
+                        nbr_dir[k] = n;
                     }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dY;
-                            total_weight += w_dY;
-                        }
+                    k += 1;
+                }
+            }
+            if (pass == 0) start[ii + 1] = k;
+        }
+    }
+}
+
+void ln_voi_grid_face_lock(const ln_voi_grid& grid, const uint8_t* lock_mask,
+                           std::vector<uint8_t>& jump_lock) {
+    const uint32_t size_x = grid.size_x;
+    const uint32_t size_y = grid.size_y;
+    const uint32_t size_z = grid.size_z;
+    const int64_t nxy = static_cast<int64_t>(size_x) * size_y;
+
+    jump_lock.assign(grid.nr_voi, 0);
+    const uint32_t* vid = grid.voi_id.data();
+    uint8_t* lock = jump_lock.data();
+    uint32_t ix, iy, iz;
+    for (uint32_t ii = 0; ii != grid.nr_voi; ++ii) {
+        const int64_t i = vid[ii];
+        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
+        if ((ix > 0 && *(lock_mask + i - 1) != 0)
+            || (ix < size_x - 1 && *(lock_mask + i + 1) != 0)
+            || (iy > 0 && *(lock_mask + i - size_x) != 0)
+            || (iy < size_y - 1 && *(lock_mask + i + size_x) != 0)
+            || (iz > 0 && *(lock_mask + i - nxy) != 0)
+            || (iz < size_z - 1 && *(lock_mask + i + nxy) != 0)) {
+            lock[ii] = 1;
+        }
+    }
+}
+
+uint32_t ln_voi_grid_find(const ln_voi_grid& grid, const uint32_t i) {
+    const std::vector<uint32_t>::const_iterator it =
+        std::lower_bound(grid.voi_id.begin(), grid.voi_id.end(), i);
+    if (it == grid.voi_id.end() || *it != i) return grid.nr_voi;
+    return it - grid.voi_id.begin();
+}
+
+// ============================================================================
+// Connected clusters
+// ============================================================================
+static uint32_t ln_cluster_root(std::vector<uint32_t>& parent, uint32_t a) {
+    while (parent[a] != a) {
+        parent[a] = parent[parent[a]];  // Path halving
+        a = parent[a];
+    }
+    return a;
+}
+
+uint32_t ln_label_clusters(const int32_t* data, int32_t* labels,
+                           const uint32_t size_x, const uint32_t size_y,
+                           const uint32_t size_z, const int connectivity,
+                           std::vector<uint32_t>& sizes) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Two passes over the grid. The first pass gives each voxel the label of
+    //   its neighbours that were already visited (in raster order), and
+    //   records with union-find which labels meet. The second pass replaces
+    //   each label with the compact id of its set and counts the voxels.
+    // - 'labels' can be the same array as 'data'.
+    ///////////////////////////////////////////////////////////////////////////
+    const int nr_neighbors = connectivity == 6 ? 6 : connectivity == 18 ? 18 : 26;
+    int8_t backward[13][3];  // Neighbours that come earlier in raster order
+    int nr_backward = 0;
+    for (int n = 0; n != nr_neighbors; ++n) {
+        const int8_t* o = LN_NEIGHBORS_26[n];
+        if (o[2] < 0 || (o[2] == 0 && (o[1] < 0 || (o[1] == 0 && o[0] < 0)))) {
+            backward[nr_backward][0] = o[0];
+            backward[nr_backward][1] = o[1];
+            backward[nr_backward][2] = o[2];
+            nr_backward += 1;
+        }
+    }
+
+    std::vector<uint32_t> parent(1, 0);  // Label 0 is the background
+    uint64_t i = 0;
+    for (uint32_t iz = 0; iz != size_z; ++iz) {
+        for (uint32_t iy = 0; iy != size_y; ++iy) {
+            for (uint32_t ix = 0; ix != size_x; ++ix, ++i) {
+                if (data[i] == 0) {
+                    labels[i] = 0;
+                    continue;
+                }
+                uint32_t label = 0;
+                for (int n = 0; n != nr_backward; ++n) {
+                    const int64_t jx = static_cast<int64_t>(ix) + backward[n][0];
+                    const int64_t jy = static_cast<int64_t>(iy) + backward[n][1];
+                    const int64_t jz = static_cast<int64_t>(iz) + backward[n][2];
+                    if (jx < 0 || jy < 0 || jz < 0 || jx >= size_x || jy >= size_y) {
+                        continue;
                     }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dZ;
-                            total_weight += w_dZ;
-                        }
+                    const uint32_t other = labels[sub2ind_3D(jx, jy, jz, size_x, size_y)];
+                    if (other == 0) {
+                        continue;
                     }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_mask_data + j) == mask_value) {
-                            new_val += *(nii_in_data + nr_voxels * t + j) * w_dZ;
-                            total_weight += w_dZ;
-                        }
+                    const uint32_t root = ln_cluster_root(parent, other);
+                    if (label == 0) {
+                        label = root;
+                    } else if (root != label) {  // Two clusters meet
+                        parent[std::max(root, label)] = std::min(root, label);
+                        label = std::min(root, label);
                     }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    // TODO
+                }
+                if (label == 0) {
+                    label = parent.size();
+                    parent.push_back(label);
+                }
+                labels[i] = label;
+            }
+        }
+    }
+
+    // Roots are the smallest label of their set, so ids follow the raster
+    // order of the first voxel of each cluster
+    std::vector<uint32_t> id(parent.size(), 0);
+    uint32_t nr_clusters = 0;
+    for (uint32_t l = 1; l != parent.size(); ++l) {
+        const uint32_t root = ln_cluster_root(parent, l);
+        if (id[root] == 0) {
+            id[root] = ++nr_clusters;
+        }
+        id[l] = id[root];
+    }
+    sizes.assign(nr_clusters + 1, 0);
+    const uint64_t nr_voxels = static_cast<uint64_t>(size_x) * size_y * size_z;
+    for (i = 0; i != nr_voxels; ++i) {
+        if (labels[i] != 0) {
+            labels[i] = id[labels[i]];
+            sizes[labels[i]] += 1;
+        }
+    }
+    return nr_clusters;
+}
+
+// ============================================================================
+// Spatial index for UV coordinates
+// ============================================================================
+void ln_uv_grid_build(ln_uv_grid& grid, const float* u, const float* v,
+                      const uint32_t nr_points, const float radius) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Points are binned into square cells of (at least) radius size, so a
+    //   radius query only needs to look at the 3x3 cells around its center.
+    // - Points with non-finite coordinates are left out. They can not be
+    //   within any radius anyway.
+    // - Cell size is increased when needed to keep the number of cells along
+    //   each axis at most 1024.
+    ///////////////////////////////////////////////////////////////////////////
+    float min_u = std::numeric_limits<float>::max();
+    float min_v = std::numeric_limits<float>::max();
+    float max_u = std::numeric_limits<float>::lowest();
+    float max_v = std::numeric_limits<float>::lowest();
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (!std::isfinite(u[i]) || !std::isfinite(v[i])) continue;
+        if (u[i] < min_u) min_u = u[i];
+        if (u[i] > max_u) max_u = u[i];
+        if (v[i] < min_v) min_v = v[i];
+        if (v[i] > max_v) max_v = v[i];
+    }
+    if (min_u > max_u) {  // No finite points
+        min_u = max_u = min_v = max_v = 0;
+    }
 
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    // TODO
+    const uint32_t max_cells = 1024;
+    float cell_size = radius;
+    cell_size = std::max(cell_size, (max_u - min_u) / max_cells);
+    cell_size = std::max(cell_size, (max_v - min_v) / max_cells);
+    if (!(cell_size > 0)) cell_size = 1;
+
+    grid.min_u = min_u;
+    grid.min_v = min_v;
+    grid.cell_size = cell_size;
+    grid.nr_cells_u = std::min(static_cast<uint32_t>((max_u - min_u) / cell_size) + 1, max_cells);
+    grid.nr_cells_v = std::min(static_cast<uint32_t>((max_v - min_v) / cell_size) + 1, max_cells);
+
+    // Counting sort of the points into cells. Points stay in ascending order
+    // within each cell.
+    const uint32_t nr_cells = grid.nr_cells_u * grid.nr_cells_v;
+    std::vector<uint32_t> point_cell(nr_points, nr_cells);
+    grid.cell_start.assign(nr_cells + 1, 0);
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (!std::isfinite(u[i]) || !std::isfinite(v[i])) continue;
+        const uint32_t cu = ln_uv_grid_cell(grid.min_u, grid.cell_size, grid.nr_cells_u, u[i]);
+        const uint32_t cv = ln_uv_grid_cell(grid.min_v, grid.cell_size, grid.nr_cells_v, v[i]);
+        point_cell[i] = cv * grid.nr_cells_u + cu;
+        grid.cell_start[point_cell[i] + 1] += 1;
+    }
+    for (uint32_t c = 0; c != nr_cells; ++c) {
+        grid.cell_start[c + 1] += grid.cell_start[c];
+    }
+    grid.cell_id.resize(grid.cell_start[nr_cells]);
+    std::vector<uint32_t> fill(grid.cell_start.begin(), grid.cell_start.end() - 1);
+    for (uint32_t i = 0; i != nr_points; ++i) {
+        if (point_cell[i] == nr_cells) continue;
+        grid.cell_id[fill[point_cell[i]]] = i;
+        fill[point_cell[i]] += 1;
+    }
+}
 
-                    *(nii_smooth_data + nr_voxels * t + i) = new_val / total_weight;
+void ln_uv_grid_query(const ln_uv_grid& grid, const float* u, const float* v,
+                      const float u0, const float v0, const float radius,
+                      std::vector<uint32_t>& ids) {
+    ids.clear();
+    if (!std::isfinite(u0) || !std::isfinite(v0) || grid.cell_id.empty()) return;
+
+    const float radius_sqr = radius * radius;
+    // Small margin so that rounding can not drop points at the cell borders
+    const float r = radius + grid.cell_size * 0.001f;
+    const uint32_t cu_begin = ln_uv_grid_cell(grid.min_u, grid.cell_size, grid.nr_cells_u, u0 - r);
+    const uint32_t cu_end = ln_uv_grid_cell(grid.min_u, grid.cell_size, grid.nr_cells_u, u0 + r);
+    const uint32_t cv_begin = ln_uv_grid_cell(grid.min_v, grid.cell_size, grid.nr_cells_v, v0 - r);
+    const uint32_t cv_end = ln_uv_grid_cell(grid.min_v, grid.cell_size, grid.nr_cells_v, v0 + r);
+
+    for (uint32_t cv = cv_begin; cv <= cv_end; ++cv) {
+        for (uint32_t cu = cu_begin; cu <= cu_end; ++cu) {
+            const uint32_t c = cv * grid.nr_cells_u + cu;
+            for (uint32_t k = grid.cell_start[c]; k != grid.cell_start[c + 1]; ++k) {
+                const uint32_t j = grid.cell_id[k];
+                float dist_uv = (u0 - u[j]) * (u0 - u[j]) + (v0 - v[j]) * (v0 - v[j]);
+                if (dist_uv < radius_sqr) {  // Check Euclidean distance
+                    ids.push_back(j);
                 }
             }
-            // Swap image data for the next iteration
-            for (uint32_t i = 0; i != nr_voxels * size_t; ++i) {
-                *(nii_in_data + i) = *(nii_smooth_data + i);
+        }
+    }
+    // Callers rely on the same (ascending) order as a full scan
+    std::sort(ids.begin(), ids.end());
+}
+
+// ============================================================================
+// Geodesic distances
+// ============================================================================
+static void ln_sort_front(std::vector<uint32_t>& front, std::vector<uint32_t>& buffer,
+                          const uint32_t nr_voi) {
+    // LSD radix sort with 11 bit digits. Fronts are re-sorted after every
+    // growth step, where std::sort is slow in unoptimized builds.
+    const uint32_t n = front.size();
+    if (n < 2) return;
+    buffer.resize(n);
+    uint32_t* src = front.data();
+    uint32_t* dst = buffer.data();
+    uint32_t count[2048];
+    int nr_pass = 0;
+    for (uint64_t range = 1; range < nr_voi; range <<= 11) {
+        const int shift = 11 * nr_pass;
+        std::fill(count, count + 2048, 0);
+        for (uint32_t k = 0; k != n; ++k) {
+            count[(src[k] >> shift) & 2047] += 1;
+        }
+        uint32_t sum = 0;
+        for (int b = 0; b != 2048; ++b) {
+            const uint32_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (uint32_t k = 0; k != n; ++k) {
+            dst[count[(src[k] >> shift) & 2047]++] = src[k];
+        }
+        std::swap(src, dst);
+        nr_pass += 1;
+    }
+    if (nr_pass % 2 == 1) front.swap(buffer);
+}
+
+static void ln_grow_voi(const ln_voi_grid& grid, const uint8_t* grow_mask,
+                        const uint8_t* jump_lock, float* dist, int32_t* step,
+                        int32_t* id, int32_t* prevstep, const bool mode_legacy,
+                        const float max_dist, const float max_dist_grow) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - All arrays are indexed by voxel of interest (size grid.nr_voi).
+    // - Grows geodesic distances over the 26-connected voxel grid, starting
+    //   from the seed voxels that are marked with step == 1. Seed distances
+    //   are taken from the dist array as they are (usually 0).
+    // - Only voxels with a non-zero grow_mask value can be reached. NULL
+    //   grow_mask means all voxels of interest can be reached.
+    // - id (origin seed of each voxel) and prevstep (voxel of interest index
+    //   of the previous voxel on the shortest path) are optional and can be
+    //   NULL.
+    // - Voxels with a non-zero jump_lock value (optional) only grow into their
+    //   face neighbours.
+    // - Growth stops after the step in which max_dist is reached. Voxels at
+    //   max_dist_grow or farther are not grown from.
+    // - Default mode keeps a queue of the voxels updated in the previous
+    //   step (the active front), so each step only visits the front instead
+    //   of all voxels of interest. A voxel joins the front once for every
+    //   step that lowers its distance, and each front is radix sorted. The
+    //   cost is therefore O(U), with U the total number of updates. U is a
+    //   small multiple of N in practice, but O(steps x N) in the worst case.
+    //   mode_legacy runs the older wavefront rescan of all voxels of
+    //   interest per step: always O(steps x N). Both modes visit voxels in
+    //   the same order and produce identical outputs. Legacy mode is kept
+    //   for regression comparisons.
+    ///////////////////////////////////////////////////////////////////////////
+    const uint32_t nr_voi = grid.nr_voi;
+    const uint32_t* nbr_start = grid.nbr_start.data();
+    const uint32_t* nbr_id = grid.nbr_id.data();
+    const uint8_t* nbr_dir = grid.nbr_dir.data();
+    uint32_t i, j;
+    float d;
+
+    // Active front of the current and the next step. in_next keeps
+    // front_next free of duplicates.
+    std::vector<uint32_t> front, front_next, sort_buffer;
+    std::vector<uint8_t> in_next;
+    if (!mode_legacy) {
+        for (i = 0; i != nr_voi; ++i) {
+            if (*(step + i) == 1) front.push_back(i);
+        }
+        in_next.assign(nr_voi, 0);
+    }
+
+    int32_t grow_step = 1;
+    uint32_t voxel_counter = 1;
+    float temp_max_dist = 0;
+    while (voxel_counter != 0 && temp_max_dist < max_dist) {
+        voxel_counter = 0;
+        const uint32_t nr_front = mode_legacy ? nr_voi : front.size();
+        for (uint32_t ii = 0; ii != nr_front; ++ii) {
+            i = mode_legacy ? ii : front[ii];
+            // Voxels that got updated again within this step are skipped
+            if (*(step + i) != grow_step) continue;
+            if (!(*(dist + i) < max_dist_grow)) continue;
+            voxel_counter += 1;
+
+            const bool locked = jump_lock != NULL && *(jump_lock + i) != 0;
+            for (uint32_t k = nbr_start[i]; k != nbr_start[i + 1]; ++k) {
+                // Face neighbours come first
+                if (locked && nbr_dir[k] >= 6) break;
+                j = nbr_id[k];
+                if (grow_mask == NULL || *(grow_mask + j) != 0) {
+                    d = *(dist + i) + grid.w[nbr_dir[k]];
+                    if (d < *(dist + j) || *(dist + j) == 0) {
+                        *(dist + j) = d;
+                        *(step + j) = grow_step + 1;
+                        if (id != NULL) *(id + j) = *(id + i);
+                        if (prevstep != NULL) *(prevstep + j) = i;
+                        if (!mode_legacy && in_next[j] == 0) {
+                            in_next[j] = 1;
+                            front_next.push_back(j);
+                        }
+                    }
+                }
+            }
+
+            // Update maximum distance reached
+            if (*(dist + i) > temp_max_dist) {
+                temp_max_dist = *(dist + i);
+            }
+        }
+
+        if (!mode_legacy) {
+            // Visit the next front in the same (ascending) order as the
+            // legacy rescan does
+            ln_sort_front(front_next, sort_buffer, nr_voi);
+            for (uint32_t ii = 0; ii != front_next.size(); ++ii) {
+                in_next[front_next[ii]] = 0;
+            }
+            front.swap(front_next);
+            front_next.clear();
+        }
+        grow_step += 1;
+    }
+}
+
+void ln_grow_geodesic_voi(const ln_voi_grid& grid, const uint8_t* grow_mask,
+                          float* dist, int32_t* step, int32_t* id, int32_t* prevstep,
+                          const bool mode_legacy, const float max_dist) {
+    ln_grow_voi(grid, grow_mask, NULL, dist, step, id, prevstep, mode_legacy,
+                max_dist, std::numeric_limits<float>::max());
+}
+
+void ln_grow_voronoi_voi(const ln_voi_grid& grid, const uint8_t* jump_lock,
+                         float* dist, int32_t* step, int32_t* id,
+                         const float max_dist) {
+    ln_grow_voi(grid, NULL, jump_lock, dist, step, id, NULL, false,
+                std::numeric_limits<float>::max(), max_dist);
+}
+
+uint32_t ln_update_geodesic_min_voi(const ln_voi_grid& grid, float* min_dist,
+                                    const uint32_t seed,
+                                    std::vector<uint32_t>* lowered) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - min_dist is indexed by voxel of interest and holds the distance to
+    //   the closest of the previous seeds. Initialize it with
+    //   std::numeric_limits<float>::max() before the first seed.
+    // - Bounded Dijkstra: a voxel is only expanded when the new seed lowers
+    //   its distance, so the cost of each call scales with the size of the
+    //   new seed's cell instead of the whole domain.
+    ///////////////////////////////////////////////////////////////////////////
+    typedef std::pair<float, uint32_t> dist_id;
+    std::priority_queue<dist_id, std::vector<dist_id>, std::greater<dist_id> > queue;
+
+    uint32_t nr_updated = 0;
+    *(min_dist + seed) = 0;
+    queue.push(dist_id(0, seed));
+    while (!queue.empty()) {
+        const float d_i = queue.top().first;
+        const uint32_t i = queue.top().second;
+        queue.pop();
+        // Stale entry, voxel got a shorter distance after it was queued
+        if (d_i > *(min_dist + i)) continue;
+        nr_updated += 1;
+        if (lowered) lowered->push_back(i);
+
+        for (uint32_t k = grid.nbr_start[i]; k != grid.nbr_start[i + 1]; ++k) {
+            const uint32_t j = grid.nbr_id[k];
+            const float d = d_i + grid.w[grid.nbr_dir[k]];
+            if (d < *(min_dist + j)) {
+                *(min_dist + j) = d;
+                queue.push(dist_id(d, j));
+            }
+        }
+    }
+    return nr_updated;
+}
+
+void ln_flood_geodesic_voi(const ln_voi_grid& grid, const uint8_t* grow_mask,
+                           float* dist, const std::vector<uint32_t>& seeds) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Note:
+    // - Relaxes with the same rule as the wavefront, where a distance of 0
+    //   counts as not reached. A seed that starts at 0 therefore ends up with
+    //   the distance of the round trip to its closest neighbour, exactly as
+    //   in the wavefront floods.
+    // - Each voxel is expanded once per distance it gets, in increasing
+    //   order of distance, instead of once per wavefront step that lowers it.
+    ///////////////////////////////////////////////////////////////////////////
+    typedef std::pair<float, uint32_t> dist_id;
+    std::priority_queue<dist_id, std::vector<dist_id>, std::greater<dist_id> > queue;
+    for (const uint32_t seed : seeds) {
+        queue.push(dist_id(*(dist + seed), seed));
+    }
+
+    while (!queue.empty()) {
+        const float d_i = queue.top().first;
+        const uint32_t i = queue.top().second;
+        queue.pop();
+        // Stale entry, voxel got a shorter distance after it was queued
+        if (d_i != *(dist + i)) continue;
+
+        for (uint32_t k = grid.nbr_start[i]; k != grid.nbr_start[i + 1]; ++k) {
+            const uint32_t j = grid.nbr_id[k];
+            if (grow_mask == NULL || *(grow_mask + j) != 0) {
+                const float d = d_i + grid.w[grid.nbr_dir[k]];
+                if (d < *(dist + j) || *(dist + j) == 0) {
+                    *(dist + j) = d;
+                    queue.push(dist_id(d, j));
+                }
             }
         }
-        cout << endl;
     }
-    return nii_smooth;
 }
 
 // ============================================================================
@@ -1056,12 +2980,12 @@ float ln_gaussian(float distance, float sigma) {
            * std::exp(-0.5 * distance * distance / (sigma * sigma));
 }
 
-void ln_normalize_to_zero_one(float* data, int data_size) {
+void ln_normalize_to_zero_one(float* data, int64_t data_size) {
 
     // Find minimum and maximum
     float temp_max = std::numeric_limits<float>::min();
     float temp_min = std::numeric_limits<float>::max();
-    for (int i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         if (*(data + i) > temp_max) {
             temp_max = *(data + i);
         }
@@ -1071,13 +2995,13 @@ void ln_normalize_to_zero_one(float* data, int data_size) {
     }
 
     // Translate minimum to zero
-    for (int i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data + i) -= temp_min;
     }
 
     // Scale maximum to one
     temp_max -= temp_min;
-    for (int i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data + i) /= temp_max;
     }    
 }
@@ -1089,7 +3013,7 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
                                      const float fwhm, const int nr_iterations, const bool log) {
     // NOTE: Overwrites the input with the smoothed image at the end
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
     float* data_temp = (float*)malloc(data_size * sizeof(float));
 
@@ -1100,12 +3024,13 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
     float w_dZ = ln_gaussian(dz, fwhm);
 
     // Loop over every data point
-    int ix, iy, iz, it, j;
+    int ix, iy, iz, it;
+    int64_t j;
     for (int n = 0; n != nr_iterations; ++n) {
 
         if (log) std::printf("    Iteration: %i/%i\n", n+1, nr_iterations);
 
-        for (int i = 0; i != data_size; ++i) {
+        for (int64_t i = 0; i != data_size; ++i) {
 
             std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
             float new_val = 0, total_weight = 0;
@@ -1153,7 +3078,7 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
         }
 
         // Swap image data for the next iteration
-        for (int i = 0; i != data_size; ++i) {
+        for (int64_t i = 0; i != data_size; ++i) {
             *(data_in + i) = *(data_temp + i);
         }
     }
@@ -1164,11 +3089,12 @@ void ln_smooth_gaussian_iterative_3D(float* data_in,
 void ln_compute_gradients_3D(const float* data_in, float* data_grad_x, float* data_grad_y, float* data_grad_z, 
                              const int nx, const int ny, const int nz, const int nt) {
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
     // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
+    int ix, iy, iz, it;
+    int64_t j, k;
+    for (int64_t i = 0; i != data_size; ++i) {
         std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
 
         // --------------------------------------------------------------------
@@ -1196,11 +3122,12 @@ void ln_compute_gradients_3D(const float* data_in, float* data_grad_x, float* da
 void ln_compute_gradients_3D_over_x(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
     // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
+    int ix, iy, iz, it;
+    int64_t j, k;
+    for (int64_t i = 0; i != data_size; ++i) {
         std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
         if (ix > 0 && ix < nx-1) {
             j = sub2ind_4D(ix-1, iy, iz, it, nx, ny, nz);
@@ -1214,11 +3141,12 @@ void ln_compute_gradients_3D_over_x(const float* data_in, float* data_out,
 void ln_compute_gradients_3D_over_y(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
     // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
+    int ix, iy, iz, it;
+    int64_t j, k;
+    for (int64_t i = 0; i != data_size; ++i) {
         std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
         if (iy > 0 && iy < ny-1) {
             j = sub2ind_4D(ix, iy-1, iz, it, nx, ny, nz);
@@ -1232,11 +3160,12 @@ void ln_compute_gradients_3D_over_y(const float* data_in, float* data_out,
 void ln_compute_gradients_3D_over_z(const float* data_in, float* data_out, 
                                     const int nx, const int ny, const int nz, const int nt) {
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
     // Loop over every data point
-    int ix, iy, iz, it, j, k;
-    for (int i = 0; i != data_size; ++i) {
+    int ix, iy, iz, it;
+    int64_t j, k;
+    for (int64_t i = 0; i != data_size; ++i) {
         std::tie(ix, iy, iz, it) = ind2sub_4D(i, nx, ny, nz);
         if (iz > 0 && iz < nz-1) {
             j = sub2ind_4D(ix, iy, iz-1, it, nx, ny, nz);
@@ -1259,7 +3188,7 @@ void ln_compute_hessian_3D(const float* data_in, float* data_shorthessian,
     //     *(data_shorthessian + i*6 + 4) = 2nd derivative yz zy
     //     *(data_shorthessian + i*6 + 5) = 2nd derivative zz
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
     float FWHM = 1.0;
 
     // Allocate memory (NOTE: I have prioritized RAM optimization)
@@ -1275,19 +3204,19 @@ void ln_compute_hessian_3D(const float* data_in, float* data_shorthessian,
 
     // xx
     ln_compute_gradients_3D_over_x(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 0) =  *(data_grad_2nd + i);
     }
 
     // xy
     ln_compute_gradients_3D_over_y(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 1) =  *(data_grad_2nd + i);
     }
 
     // xz
     ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 2) =  *(data_grad_2nd + i);
     }
 
@@ -1300,13 +3229,13 @@ void ln_compute_hessian_3D(const float* data_in, float* data_shorthessian,
 
     // yy
     ln_compute_gradients_3D_over_y(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 3) =  *(data_grad_2nd + i);
     }
 
     // yz
     ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 4) =  *(data_grad_2nd + i);
     }
 
@@ -1319,7 +3248,7 @@ void ln_compute_hessian_3D(const float* data_in, float* data_shorthessian,
 
     // zz
     ln_compute_gradients_3D_over_z(data_grad_1st, data_grad_2nd, nx, ny, nz, nt);
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         *(data_shorthessian + i*6 + 5) =  *(data_grad_2nd + i);
     } 
 
@@ -1332,9 +3261,9 @@ void ln_compute_eigen_values_3D(const float* data_shorthessian, float* data_eigv
     // NOTE: Implementing Delledalle et al. 2017, Hal.
     // NOTE: I simplified complex conjugates as I do not have complex values.
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         float a = *(data_shorthessian + i*6 + 0);  // xx
         float b = *(data_shorthessian + i*6 + 3);  // yy
         float c = *(data_shorthessian + i*6 + 5);  // zz
@@ -1429,9 +3358,9 @@ void ln_compute_eigen_vectors_3D(const float* data_shorthessian,
 
     // NOTE: Implementing Delledalle et al. 2017, Hal.
 
-    int data_size = nx * ny * nz * nt;
+    const int64_t data_size = static_cast<int64_t>(nx) * ny * nz * nt;
 
-    for (uint32_t i = 0; i != data_size; ++i) {
+    for (int64_t i = 0; i != data_size; ++i) {
         float a = *(data_shorthessian + i*6 + 0);  // xx
         float b = *(data_shorthessian + i*6 + 3);  // yy
         float c = *(data_shorthessian + i*6 + 5);  // zz
@@ -1,4 +1,7 @@
 
+#ifndef LAYNII_LIB_H
+#define LAYNII_LIB_H
+
 #include <stdio.h>
 //#include <math.h>
 #include <cmath>
@@ -6,6 +9,18 @@
 #include <iostream>
 #include <string>
 #include <tuple>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <queue>
+#include <functional>
+#include <fstream>
 #include "./nifti2_io.h"
 
 using namespace std;
@@ -34,6 +49,8 @@ void log_nifti_descriptives(nifti_image* nii);
 
 void save_output_nifti(string filename, string prefix, nifti_image* nii,
                        bool log = true, bool use_outpath = false);
+string ln_output_path(const string path, const string tag,
+                      const bool use_outpath = false);
 
 nifti_image* copy_nifti_as_double(nifti_image* nii);
 nifti_image* copy_nifti_as_float32(nifti_image* nii);
@@ -43,24 +60,47 @@ nifti_image* copy_nifti_as_int16(nifti_image* nii);
 nifti_image* copy_nifti_as_int8(nifti_image* nii);
 nifti_image* copy_nifti_as_float32_with_scl_slope_and_scl_inter(nifti_image* nii);
 
+// Convert the data of a nifti image in place, so that there is no second copy
+// of the input in memory. NaNs are replaced with zeros.
+void convert_nifti_to_float32(nifti_image* nii);
+void convert_nifti_to_int32(nifti_image* nii);
+
+// Output datatypes used by save_output_nifti. LN_OUTPUT_COMPACT stores integer
+// valued images with the smallest integer type that holds them (lossless).
+// LN_OUTPUT_SCALED16 also stores other images as int16 with a slope of
+// max|v| / 32767, which is the absolute precision of every value (lossy). The
+// LAYNII_OUTPUT_TYPE environment variable ("compact" or "scaled16") sets the
+// default, which is LN_OUTPUT_NATIVE.
+enum { LN_OUTPUT_NATIVE = 0, LN_OUTPUT_COMPACT = 1, LN_OUTPUT_SCALED16 = 2 };
+void ln_set_output_type(int type);
+int ln_get_output_type(void);
+// Returns 'nii' itself when the datatype can not be made smaller
+nifti_image* ln_compact_nifti(nifti_image* nii, const int type);
+
+// Write compressed outputs as BGZF (blocked gzip), which stays readable by all
+// gzip readers and can be read with random access. The LAYNII_OUTPUT_BGZF
+// environment variable (1) sets the default, which is off.
+void ln_set_output_bgzf(bool use_bgzf);
+bool ln_get_output_bgzf(void);
+
 std::tuple<uint32_t, uint32_t, uint32_t> ind2sub_3D(
-    const uint32_t linear_index,
+    const uint64_t linear_index,
     const uint32_t size_x,
     const uint32_t size_y);
 
 std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> ind2sub_4D(
-    const uint32_t linear_index,
+    const uint64_t linear_index,
     const uint32_t size_x,
     const uint32_t size_y,
     const uint32_t size_z);
 
-uint32_t sub2ind_3D(const uint32_t x,
+uint64_t sub2ind_3D(const uint32_t x,
                     const uint32_t y,
                     const uint32_t z,
                     const uint32_t size_x,
                     const uint32_t size_y);
 
-uint32_t sub2ind_4D(const uint32_t x,
+uint64_t sub2ind_4D(const uint32_t x,
                     const uint32_t y,
                     const uint32_t z,
                     const uint32_t t,
@@ -71,13 +111,250 @@ uint32_t sub2ind_4D(const uint32_t x,
 std::tuple<float, float> simplex_closure_2D(float x, float y);
 std::tuple<float, float> simplex_perturb_2D(float x, float y, float a, float b);
 
+// Number of threads used by the library functions that support it. Values
+// below 1 select all available cores.
+void ln_set_nr_threads(int nr_threads);
+int ln_get_nr_threads(void);
+
+// Runs job(0) ... job(nr_jobs - 1) on up to ln_get_nr_threads() threads. Each
+// thread takes the next job that is not started yet. Calls from within a job
+// run on the calling thread, and profiling stages of jobs are not recorded.
+void ln_parallel_jobs(const uint32_t nr_jobs, const std::function<void(uint32_t)>& job);
+
+// Asynchronous output writing. With 'max_pending' above 0, save_output_nifti
+// queues outputs for a background writer thread. The LAYNII_ASYNC_OUTPUT
+// environment variable sets the default (0, synchronous). ln_flush_outputs
+// waits for all queued outputs, prints the ones that failed and returns
+// false when there are any. Programs call it before they finish, so that
+// write failures set their exit status. ln_write_async queues an image and
+// takes ownership of it.
+void ln_set_async_output(int max_pending);
+int ln_get_async_output(void);
+void ln_write_async(nifti_image* nii);
+bool ln_flush_outputs(void);
+
+// In-memory image store, for running several programs in one process. While
+// it is active, save_output_nifti keeps each output in memory under its file
+// name, and nifti_image_read, ln_read_cropped and ln_read_slab find it there.
+// Outputs are only written to disk when their file name matches one of the
+// 'save_patterns' ('*' matches any characters).
+void ln_memory_store_begin(const std::vector<string>& save_patterns);
+void ln_memory_store_end(void);
+bool ln_memory_store_active(void);
+const nifti_image* ln_memory_store_find(const string& path);
+std::vector<string> ln_memory_store_paths(void);
+bool ln_memory_store_saved(const string& path);
+void ln_memory_store_drop(const string& path);
+bool ln_match_wildcard(const string& pattern, const string& text);
+
+// Restores the defaults of the ln_set_* settings (output crop, threads,
+// memory budget, asynchronous output, output type, BGZF) and of
+// nifti_set_mmap_read, so that settings of one program run by LN_PIPELINE do
+// not carry over to the next. Profiling is left as it is.
+void ln_reset_settings(void);
+
+// Per stage timing and memory use. While profiling is on, wall time, CPU time
+// and resident memory are recorded for each stage, and a summary is written
+// at exit: JSON, or one CSV row per stage (appended) when the file name ends
+// in ".csv". 'path' empty selects the LAYNII_PROFILE environment variable, or
+// "<program>_profile.json". LAYNII_PROFILE (1 or a file name) also turns
+// profiling on for programs without the -profile option. ln_profile_stage
+// ends the previous stage started with it and starts the next one. An
+// ln_profile_scope stage lasts until the end of the enclosing block.
+void ln_set_profile(const string& path);
+bool ln_get_profile(void);
+void ln_profile_begin(const char* programname);
+void ln_profile_stage(const char* name);
+struct ln_profile_scope {
+    explicit ln_profile_scope(const char* name);
+    ~ln_profile_scope();
+    size_t depth;  // 0: profiling is off
+};
+
+// Streaming 4D data. A slab holds 'nr_slices' z-slices, starting at
+// 'z_begin', across all time points as float32: all slab voxels of the
+// first time point, then of the second time point, and so on. Only the
+// header of the input needs to be read (nifti_image_read(path, 0)). Open a
+// reader with the slab size that will be used, so that it can tell whether
+// the input is read in one slab.
+void ln_set_max_memory(int64_t megabytes);
+int64_t ln_get_max_memory(void);
+int ln_slab_nr_slices(const nifti_image* nii, const int nr_buffers);
+
+struct ln_slab_reader {
+    const nifti_image* nii;  // Input header, data is never allocated
+    znzFile fp;              // Input file
+    FILE* fp_raw;            // Temporary inflated copy of a compressed input
+    int64_t offset;          // Byte offset of the image data
+};
+
+bool ln_slab_reader_open(ln_slab_reader& reader, const nifti_image* nii,
+                         const int nr_slices);
+bool ln_read_slab(ln_slab_reader& reader, const int z_begin,
+                  const int nr_slices, float* data, const bool scale = false);
+void ln_slab_reader_close(ln_slab_reader& reader);
+
+// Read a whole image as float32 through a slab reader. Peak memory is the
+// float32 data plus one volume of the input, instead of the input and a
+// converted copy (nifti_image_read followed by copy_nifti_as_float32).
+nifti_image* ln_read_as_float32(const char* path, const bool scale = false);
+
+struct ln_slab_writer {
+    nifti_image* nii;  // Output header, data is never allocated
+    string path;       // Output file
+    string path_raw;   // Uncompressed file the slabs are written into
+    std::fstream file;
+    int64_t offset;    // Byte offset of the image data
+};
+
+bool ln_slab_writer_open(ln_slab_writer& writer, nifti_image* nii,
+                         const string path, const string tag,
+                         const bool use_outpath = false);
+bool ln_slab_write(ln_slab_writer& writer, const int z_begin,
+                   const int nr_slices, const float* data);
+bool ln_slab_writer_close(ln_slab_writer& writer, const bool log = true);
+
+// Bounding box cropping. The box covers the nonzero voxels of the inputs given
+// to ln_crop_find, plus 'margin' voxels. Inputs on the same grid are read in
+// the box with ln_read_cropped. After ln_set_output_crop, save_output_nifti
+// writes images of box size back into the full field of view. Images read in
+// the box have unused header dimensions of 0 set to 1, also when the box is
+// the full field of view.
+struct ln_crop {
+    nifti_image* nii_full;  // Header of the full image, data is never allocated
+    int64_t start[3];       // First voxel of the box
+    int64_t size[3];        // Box dimensions
+};
+
+bool ln_crop_find(ln_crop& crop, const std::vector<string>& paths,
+                  const int margin = 1);
+void ln_crop_free(ln_crop& crop);
+void log_crop_descriptives(const ln_crop& crop);
+nifti_image* ln_read_cropped(const char* path, const ln_crop& crop);
+void ln_set_output_crop(const ln_crop* crop);
+nifti_image* ln_uncrop_nifti(nifti_image* nii, const ln_crop& crop);
+nifti_image* ln_crop_nifti(const nifti_image* nii, const ln_crop& crop);
+
+// Linear index in the full field of view of box index i
+uint64_t ln_crop_full_index(const ln_crop& crop, const uint64_t i);
+// Int32 copy of an image of voxel ids, with the ids mapped to the full frame
+nifti_image* ln_crop_ids_to_full(const ln_crop& crop, nifti_image* nii);
+
 nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
                                  nifti_image* nii_mask, int32_t mask_value);
 
+// ============================================================================
+// Sparse voxels of interest grid
+// ============================================================================
+
+// Compact (CSR) 26-neighbour adjacency over the voxels of interest. Per voxel
+// scratch data can be kept in arrays of nr_voi elements instead of full grid
+// images. Voxel of interest ii maps to full grid index voi_id[ii]. Its
+// neighbours are nbr_id[nbr_start[ii]] ... nbr_id[nbr_start[ii+1] - 1], with
+// edge length w[nbr_dir[k]].
+struct ln_voi_grid {
+    uint32_t size_x, size_y, size_z;
+    uint32_t nr_voi;
+    float w[26];
+    std::vector<uint32_t> voi_id;
+    std::vector<uint32_t> nbr_start;
+    std::vector<uint32_t> nbr_id;
+    std::vector<uint8_t> nbr_dir;
+};
+
+void ln_voi_grid_build(ln_voi_grid& grid, const int32_t* voi_id, const uint32_t nr_voi,
+                       const uint32_t size_x, const uint32_t size_y, const uint32_t size_z,
+                       const float dX, const float dY, const float dZ);
+
+// Returns nr_voi when full grid index i is not a voxel of interest
+uint32_t ln_voi_grid_find(const ln_voi_grid& grid, const uint32_t i);
+
+// Flags the voxels of interest that have a face neighbour with a non-zero
+// lock_mask value. lock_mask is a full grid array.
+void ln_voi_grid_face_lock(const ln_voi_grid& grid, const uint8_t* lock_mask,
+                           std::vector<uint8_t>& jump_lock);
+
+// ============================================================================
+// Connected clusters
+// ============================================================================
+
+// Labels the connected clusters of nonzero voxels (6, 18 or 26 connectivity)
+// in two passes over the grid. Cluster ids 1 ... n follow the raster order of
+// the first voxel of each cluster. sizes[id] gets the number of voxels of
+// each cluster. Returns the number of clusters. 'labels' can be 'data'.
+uint32_t ln_label_clusters(const int32_t* data, int32_t* labels,
+                           const uint32_t size_x, const uint32_t size_y,
+                           const uint32_t size_z, const int connectivity,
+                           std::vector<uint32_t>& sizes);
+
+// ============================================================================
+// Spatial index for UV coordinates
+// ============================================================================
+
+// Uniform grid of square cells over flat (UV) coordinates for fixed radius
+// neighbour queries. Cell c holds points cell_id[cell_start[c]] ...
+// cell_id[cell_start[c+1] - 1].
+struct ln_uv_grid {
+    float min_u, min_v, cell_size;
+    uint32_t nr_cells_u, nr_cells_v;
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> cell_id;
+};
+
+inline uint32_t ln_uv_grid_cell(const float min, const float cell_size,
+                                const uint32_t nr_cells, const float x) {
+    const float c = std::floor((x - min) / cell_size);
+    if (!(c > 0)) return 0;
+    if (c >= nr_cells - 1) return nr_cells - 1;
+    return static_cast<uint32_t>(c);
+}
+
+void ln_uv_grid_build(ln_uv_grid& grid, const float* u, const float* v,
+                      const uint32_t nr_points, const float radius);
+
+// Fills ids with all points closer than radius to (u0, v0), in ascending order
+void ln_uv_grid_query(const ln_uv_grid& grid, const float* u, const float* v,
+                      const float u0, const float v0, const float radius,
+                      std::vector<uint32_t>& ids);
+
+// ============================================================================
+// Geodesic distances
+// ============================================================================
+
+void ln_grow_geodesic_voi(const ln_voi_grid& grid, const uint8_t* grow_mask,
+                          float* dist, int32_t* step, int32_t* id, int32_t* prevstep,
+                          const bool mode_legacy = false,
+                          const float max_dist = std::numeric_limits<float>::max());
+
+// Grows Voronoi cells (id of the closest seed) with the same distances as
+// ln_grow_geodesic_voi. Voxels flagged in jump_lock (see
+// ln_voi_grid_face_lock) only grow into their face neighbours, so cells do
+// not leak diagonally across thin borders. Voxels at max_dist or farther are
+// not grown from.
+void ln_grow_voronoi_voi(const ln_voi_grid& grid, const uint8_t* jump_lock,
+                         float* dist, int32_t* step, int32_t* id,
+                         const float max_dist = std::numeric_limits<float>::max());
+
+// Lowers a running minimum distance field with the geodesic distances from a
+// new seed. Only the region that gets closer to the new seed is visited.
+// Returns the number of voxels whose distance was lowered, their ids are
+// appended to 'lowered' when given.
+uint32_t ln_update_geodesic_min_voi(const ln_voi_grid& grid, float* min_dist,
+                                    const uint32_t seed,
+                                    std::vector<uint32_t>* lowered = NULL);
+
+// Same distances as ln_grow_geodesic_voi, grown with a priority queue instead
+// of a wavefront. Seeds are voxels of interest with their starting distance in
+// dist, all other voxels have to be 0 (not reached). The grid and grow_mask
+// are only read, so several floods can share them across threads.
+void ln_flood_geodesic_voi(const ln_voi_grid& grid, const uint8_t* grow_mask,
+                           float* dist, const std::vector<uint32_t>& seeds);
+
 // ============================================================================
 // Preprocessor macros.
 // ============================================================================
 #define PI 3.14159265;
+#define LN_VERSION "2.7.1"
 
 // ============================================================================
 // WIP NOLAD...
@@ -85,7 +362,7 @@ nifti_image* iterative_smoothing(nifti_image* nii_in, int iter_smooth,
 
 float ln_gaussian(float distance, float sigma);
 
-void ln_normalize_to_zero_one(float* data, int data_size);
+void ln_normalize_to_zero_one(float* data, int64_t data_size);
 
 void ln_smooth_gaussian_iterative_3D(float* data_in,
                                      const int   nx, const int   ny, const int   nz, const int nt,
@@ -114,3 +391,5 @@ void ln_compute_eigen_vectors_3D(const float* data_shorthessian,
                                  const float* data_eigval1, const float* data_eigval2, const float* data_eigval3,
                                  float* data_eigvec1, float* data_eigvec2, float* data_eigvec3,
                                  const int nx, const int ny, const int nz, const int nt);
+
+#endif  // LAYNII_LIB_H
@@ -0,0 +1,17 @@
+
+#ifndef LAYNII_PROGRAMS_H
+#define LAYNII_PROGRAMS_H
+
+// ============================================================================
+// Programs that LN_PIPELINE runs in one process. Each of them is defined in
+// its own src/<PROGRAM>.cpp, whose main function only calls it. Build these
+// sources with -DLAYNII_NO_MAIN to link them into another program.
+// ============================================================================
+int ln2_rimify_run(int argc, char* argv[]);
+int ln2_layers_run(int argc, char* argv[]);
+int ln2_multilaterate_run(int argc, char* argv[]);
+int ln2_patch_flatten_run(int argc, char* argv[]);
+int ln2_layer_smooth_run(int argc, char* argv[]);
+int ln2_profile_run(int argc, char* argv[]);
+
+#endif  // LAYNII_PROGRAMS_H
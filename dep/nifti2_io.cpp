@@ -412,6 +412,7 @@ static nifti_global_options g_opts = {
         0, /* skip_blank_ext    - skip extender if no extensions  */
         1, /* allow_upper_fext  - allow uppercase file extensions */
         0, /* alter_cifti       - alter CIFTI dims to use nx,t,u,v*/
+        0, /* mmap_read         - map uncompressed data from file */
 };
 
 char nifti1_magic[4] = { 'n', '+', '1', '\0' };
@@ -3640,6 +3641,36 @@ void nifti_set_alter_cifti( int alter_cifti )
     g_opts.alter_cifti = alter_cifti ? 1 : 0;
 }
 
+/*----------------------------------------------------------------------*/
+/*! set nifti's global mmap_read flag
+
+    When set, nifti_image_load() maps the data of uncompressed files that
+    need no byte swapping straight from the file (private, copy-on-write)
+    instead of reading it into allocated memory.  Pages that are only
+    read are shared with the page cache and with other processes reading
+    the same file.
+
+    explicitly set to 0 or 1
+*//*--------------------------------------------------------------------*/
+void nifti_set_mmap_read( int mmap_read )
+{
+    g_opts.mmap_read = mmap_read ? 1 : 0;
+}
+
+/*----------------------------------------------------------------------*/
+/*! set a function that nifti_image_read() asks first for each image
+
+    The hook returns a new image for names it knows (with data if
+    read_data is set), or NULL to read the file as usual.  This lets a
+    program pass images between stages in memory.  Pass NULL to remove.
+*//*--------------------------------------------------------------------*/
+static nifti_read_hook_t g_read_hook = NULL;
+
+void nifti_set_read_hook( nifti_read_hook_t hook )
+{
+    g_read_hook = hook;
+}
+
 /*----------------------------------------------------------------------*/
 /*! check current directory for existing header file
 
@@ -5833,6 +5864,10 @@ nifti_image *nifti_image_read( const char *hname , int read_data )
       fprintf(stderr,", HAVE_ZLIB = %d\n", nifti_compiled_with_zlib());
    }
 
+   /**- images provided by the read hook come first */
+   if( g_read_hook != NULL && (nim = g_read_hook(hname, read_data)) != NULL )
+      return nim;
+
    /**- determine filename to use for header */
    hfile = nifti_findhdrname(hname);
    if( hfile == NULL ){
@@ -6676,6 +6711,143 @@ static znzFile nifti_image_load_prep( nifti_image *nim )
 }
 
 
+/*----------------------------------------------------------------------
+ * memory mapped image data
+ *
+ * Mapped data blocks are kept in a small list, so that nifti_image_unload()
+ * and nifti_image_free() know to munmap() rather than free() them. Images
+ * can be freed on another thread (e.g. the background output writer) while
+ * the main thread maps new data, so the list is guarded by a mutex.
+ *----------------------------------------------------------------------*/
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <mutex>
+
+typedef struct {
+   void   * data;     /* nim->data, inside the mapping */
+   void   * base;     /* start of the mapping          */
+   size_t   length;   /* length of the mapping         */
+} nifti_mmap_ele;
+
+static nifti_mmap_ele * g_mmap_list = NULL;
+static int              g_mmap_count = 0;
+static std::mutex       g_mmap_mutex;
+
+/* the caller has to hold g_mmap_mutex */
+static int nifti_mmap_find( const void * data )
+{
+   int c;
+   if( data == NULL ) return -1;
+   for( c = 0; c < g_mmap_count; c++ )
+      if( g_mmap_list[c].data == data ) return c;
+   return -1;
+}
+
+/*! return 1 if the image data is mapped from its file, else 0 */
+int nifti_image_data_is_mapped( const nifti_image * nim )
+{
+   if( nim == NULL ) return 0;
+   std::lock_guard<std::mutex> lock(g_mmap_mutex);
+   return ( nifti_mmap_find(nim->data) >= 0 ) ? 1 : 0;
+}
+
+/* free() or munmap() a data block */
+static void nifti_free_data( void * data )
+{
+   void   * base;
+   size_t   length;
+   {
+      std::lock_guard<std::mutex> lock(g_mmap_mutex);
+      int c = nifti_mmap_find(data);
+      if( c >= 0 ){
+         base   = g_mmap_list[c].base;
+         length = g_mmap_list[c].length;
+         g_mmap_list[c] = g_mmap_list[--g_mmap_count];
+      }
+      else base = NULL;
+   }
+   if( base == NULL ){ free(data); return; }
+#if !defined(_WIN32)
+   munmap(base, length);
+#else
+   (void)length;
+#endif
+}
+
+/*----------------------------------------------------------------------
+ * nifti_image_load_mmap  - map the image data from an uncompressed file
+ *
+ * Only used if g_opts.mmap_read is set, for native byte order data that
+ * is suitably aligned in the file.
+ *
+ * return 0 on success, -1 if the data has to be read in the usual way
+ *----------------------------------------------------------------------*/
+static int nifti_image_load_mmap( nifti_image *nim )
+{
+#if defined(_WIN32)
+   (void)nim;
+   return -1;
+#else
+   int64_t          ntot, ioff;
+   char           * tmpimgname;
+   int              fd;
+   struct stat      st;
+   void           * base;
+   size_t           length;
+   nifti_mmap_ele * list;
+
+   if( nim == NULL || nim->iname == NULL || nim->nbyper <= 0 ||
+       nim->nvox <= 0 || nim->data != NULL ) return -1;
+   if( nifti_is_gzfile(nim->iname) ) return -1;
+   if( nim->swapsize > 1 && nim->byteorder != nifti_short_order() ) return -1;
+
+   /* values must be aligned in memory, as they are in a read buffer */
+   ioff = nim->iname_offset;
+   if( ioff < 0 ) return -1;
+   if( nim->swapsize > 1 && ioff % nim->swapsize != 0 ) return -1;
+
+   ntot = nifti_get_volsize(nim);
+   tmpimgname = nifti_findimgname(nim->iname , nim->nifti_type);
+   if( tmpimgname == NULL ) return -1;
+   if( nifti_is_gzfile(tmpimgname) ){ free(tmpimgname); return -1; }
+
+   fd = open(tmpimgname, O_RDONLY);
+   free(tmpimgname);
+   if( fd < 0 ) return -1;
+   if( fstat(fd, &st) != 0 || (int64_t)st.st_size < ioff + ntot ){
+      close(fd);
+      return -1;
+   }
+
+   length = (size_t)(ioff + ntot);
+   base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);  /* the mapping stays valid */
+   if( base == MAP_FAILED ) return -1;
+
+   {
+      std::lock_guard<std::mutex> lock(g_mmap_mutex);
+      list = (nifti_mmap_ele *)realloc(g_mmap_list,
+                                       (g_mmap_count+1)*sizeof(nifti_mmap_ele));
+      if( list == NULL ){ munmap(base, length); return -1; }
+      g_mmap_list = list;
+      g_mmap_list[g_mmap_count].data   = (char *)base + ioff;
+      g_mmap_list[g_mmap_count].base   = base;
+      g_mmap_list[g_mmap_count].length = length;
+      g_mmap_count++;
+   }
+
+   nim->data = (char *)base + ioff;
+   if( g_opts.debug > 2 )
+      fprintf(stderr,"+d mapped %" PRId64 " bytes of image data from '%s'\n",
+              ntot, nim->iname);
+   return 0;
+#endif
+}
+
+
 /*----------------------------------------------------------------------
  * nifti_image_load
  *----------------------------------------------------------------------*/
@@ -6683,6 +6855,8 @@ static znzFile nifti_image_load_prep( nifti_image *nim )
     \brief Load the image blob into a previously initialized nifti_image.
 
         - If not yet set, the data buffer is allocated with calloc().
+        - With nifti_set_mmap_read(1), uncompressed data may be mapped
+          from the file instead.
         - The data buffer will be byteswapped if necessary.
         - The data buffer will not be scaled.
 
@@ -6700,6 +6874,9 @@ int nifti_image_load( nifti_image *nim )
    int64_t ntot , ii ;
    znzFile fp ;
 
+   /**- if requested, map uncompressed data instead of reading it */
+   if( g_opts.mmap_read && nifti_image_load_mmap( nim ) == 0 ) return 0;
+
    /**- open the file and position the FILE pointer */
    fp = nifti_image_load_prep( nim );
 
@@ -6837,7 +7014,7 @@ int64_t nifti_read_buffer(znzFile fp, void* dataptr, int64_t ntot,
 void nifti_image_unload( nifti_image *nim )
 {
    if( nim != NULL && nim->data != NULL ){
-     free(nim->data) ; nim->data = NULL ;
+     nifti_free_data(nim->data) ; nim->data = NULL ;
    }
    return ;
 }
@@ -6857,7 +7034,7 @@ void nifti_image_free( nifti_image *nim )
    if( nim == NULL ) return ;
    if( nim->fname != NULL ) free(nim->fname) ;
    if( nim->iname != NULL ) free(nim->iname) ;
-   if( nim->data  != NULL ) free(nim->data ) ;
+   if( nim->data  != NULL ) nifti_free_data(nim->data ) ;
    (void)nifti_free_extensions( nim ) ;
    free(nim) ; return ;
 }
@@ -8034,6 +8211,39 @@ void nifti_image_write( nifti_image *nim )
 }
 
 
+/*----------------------------------------------------------------------*/
+/*! similar to nifti_image_write, but return whether writing succeeded
+
+   Header, data and the closing of the file (which flushes compressed
+   output) are all checked.
+
+   \return 0 on success, -1 on failure
+
+   \sa nifti_image_write
+*//*--------------------------------------------------------------------*/
+int nifti_image_write_status( nifti_image *nim )
+{
+   znzFile fp;
+   int     status = 0;
+
+   if( nim && nim->nifti_type == NIFTI_FTYPE_ASCII ){
+      nifti_image_write(nim);
+      return 0;
+   }
+
+   /* header and extensions, leave the file open at the data offset */
+   fp = nifti_image_write_hdr_img(nim,2,"wb");
+   if( znz_isnull(fp) ) return -1;
+
+   if( nifti_write_all_data(fp,nim,NULL) ) status = -1;
+   if( znzclose(fp) ) status = -1;
+
+   if( status && g_opts.debug > 0 )
+      fprintf(stderr,"** failed to write '%s'\n", nim->fname);
+   return status;
+}
+
+
 /*----------------------------------------------------------------------*/
 /*! similar to nifti_image_write, but data is in NBL struct, not nim->data
 
@@ -9084,6 +9294,7 @@ int64_t nifti_read_subregion_image( nifti_image * nim,
 
   /* get the file open */
   fp = nifti_image_load_prep( nim );
+  if(fp == NULL) return -1;
   /* the current offset is just past the nifti header, save
    * location so that SEEK_SET can be used below
    */
@@ -9102,6 +9313,7 @@ int64_t nifti_read_subregion_image( nifti_image * nim,
   if(! *data) {
     if(g_opts.debug > 1)
       fprintf(stderr,"allocation of   bytes failed\n");
+    znzclose(fp);
     return -1;
   }
 
@@ -9143,6 +9355,7 @@ int64_t nifti_read_subregion_image( nifti_image * nim,
               if(nread != read_amount) {
                 if(g_opts.debug > 1) {
                   fprintf(stderr,"read of   bytes failed\n");
+                  znzclose(fp);
                   return -1;
                 }
               }
@@ -9155,6 +9368,7 @@ int64_t nifti_read_subregion_image( nifti_image * nim,
     }
   }
   }
+  znzclose(fp);   /* in any case, close the file */
   return bytes;
 }
 
@@ -444,6 +444,7 @@ int64_t      nifti_read_subregion_image(nifti_image *nim, int64_t *start_index,
                                         int64_t *region_size, void ** data);
 
 void         nifti_image_write   ( nifti_image * nim ) ;
+int          nifti_image_write_status( nifti_image * nim ) ;
 void         nifti_image_write_bricks(nifti_image * nim,
                                       const nifti_brick_list * NBL);
 void         nifti_image_infodump( const nifti_image * nim ) ;
@@ -479,6 +480,10 @@ void   nifti_set_skip_blank_ext( int skip ) ;
 void   nifti_set_allow_upper_fext( int allow ) ;
 int    nifti_get_alter_cifti( void );
 void   nifti_set_alter_cifti( int alter_cifti );
+void   nifti_set_mmap_read( int mmap_read );
+typedef nifti_image * (*nifti_read_hook_t)( const char * hname, int read_data );
+void   nifti_set_read_hook( nifti_read_hook_t hook );
+int    nifti_image_data_is_mapped( const nifti_image * nim );
 
 int    nifti_alter_cifti_dims(nifti_image * nim);
 
@@ -684,6 +689,7 @@ typedef struct {
     int skip_blank_ext;      /*!< skip extender if no extensions  */
     int allow_upper_fext;    /*!< allow uppercase file extensions */
     int alter_cifti;         /*!< convert CIFTI dimensions        */
+    int mmap_read;           /*!< map uncompressed data from file */
 } nifti_global_options;
 
 typedef struct {
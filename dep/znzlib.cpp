@@ -23,6 +23,12 @@ NB: seeks for writable files with compression are quite restricted
 
 #include "./znzlib.h"
 #include <stdio.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 
 /*
@@ -41,6 +47,704 @@ znzlib.c  (zipped or non-zipped library)
 */
 
 
+static int znz_nr_threads = 1;
+static int znz_use_bgzf = 0;
+
+void znz_set_nr_threads(int nr_threads)
+{
+  znz_nr_threads = (nr_threads < 1) ? 1 : nr_threads;
+}
+
+int znz_get_nr_threads(void)
+{
+  return znz_nr_threads;
+}
+
+void znz_set_bgzf(int use_bgzf)
+{
+  znz_use_bgzf = use_bgzf ? 1 : 0;
+}
+
+int znz_get_bgzf(void)
+{
+  return znz_use_bgzf;
+}
+
+
+#ifdef HAVE_ZLIB
+/*
+Block parallel gzip writer (pigz style)
+
+The uncompressed stream is cut into blocks of ZNZ_PGZ_BLOCK bytes. Each
+block is compressed as raw deflate data on its own thread, primed with the
+last 32 KB of the preceding input as dictionary so that the compression
+ratio stays close to a single stream. All blocks but the last end on a
+byte boundary (Z_SYNC_FLUSH), so the compressed blocks can simply be
+concatenated behind one gzip header. The CRC of the blocks is combined
+with crc32_combine(). The result is a standard single member gzip file.
+
+In BGZF mode (znz_set_bgzf) the blocks hold at most ZNZ_BGZF_BLOCK bytes,
+are compressed without dictionary and each one is written as a gzip member
+of its own, with the compressed size in a 'BC' extra field (the blocked
+gzip format of samtools/htslib). Standard gzip readers see a multi member
+gzip file, znzopen uses the block sizes for random access reads.
+*/
+#define ZNZ_PGZ_BLOCK (128*1024)
+#define ZNZ_PGZ_DICT  (32*1024)
+#define ZNZ_BGZF_BLOCK 65280     /* uncompressed bytes per BGZF block */
+#define ZNZ_BGZF_MAX   65536     /* BGZF block size limit (compressed) */
+#define ZNZ_BGZF_HEADER 18
+
+struct znz_pgz {
+  FILE*          fp;
+  int            level;
+  int            nr_threads;
+  int            bgzf;
+  size_t         block;     /* uncompressed bytes per block */
+  unsigned char* buf;       /* dictionary area followed by pending input */
+  size_t         dict_len;  /* dictionary bytes in front of the input */
+  size_t         in_len;    /* pending input bytes */
+  size_t         in_size;   /* capacity for pending input */
+  uLong          crc;
+  unsigned long  total;     /* uncompressed bytes written so far */
+  int            error;
+};
+
+struct znz_pgz_job {
+  const unsigned char*       dict;
+  size_t                     dict_len;
+  const unsigned char*       in;
+  size_t                     len;
+  int                        level;
+  int                        last;
+  int                        bgzf;
+  std::vector<unsigned char> out;
+  uLong                      crc;
+  int                        error;
+};
+
+static void znz_put_le(unsigned char* p, unsigned long v, int nr_bytes)
+{
+  int i;
+  for( i = 0; i < nr_bytes; i++ ) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static unsigned long znz_get_le(const unsigned char* p, int nr_bytes)
+{
+  unsigned long v = 0;
+  int i;
+  for( i = nr_bytes - 1; i >= 0; i-- ) v = (v << 8) | p[i];
+  return v;
+}
+
+static void znz_pgz_deflate_block(znz_pgz_job* job)
+{
+  z_stream strm;
+  int ret;
+  size_t done = 0, offset = job->bgzf ? ZNZ_BGZF_HEADER : 0;
+
+  job->error = 0;
+  job->crc = crc32(crc32(0L, Z_NULL, 0), job->in, (uInt)job->len);
+
+  memset(&strm, 0, sizeof(strm));
+  if( deflateInit2(&strm, job->level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK ){
+     job->error = 1;
+     return;
+  }
+  if( job->dict_len > 0 )
+     deflateSetDictionary(&strm, job->dict, (uInt)job->dict_len);
+
+  job->out.resize(offset + deflateBound(&strm, (uLong)job->len) + 16);
+  strm.next_in  = (Bytef *)job->in;
+  strm.avail_in = (uInt)job->len;
+  for(;;){
+     strm.next_out  = job->out.data() + offset + done;
+     strm.avail_out = (uInt)(job->out.size() - offset - done);
+     ret = deflate(&strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+     done = job->out.size() - offset - strm.avail_out;
+     if( ret == Z_STREAM_ERROR ){ job->error = 1; break; }
+     if( job->last ? (ret == Z_STREAM_END) : (strm.avail_out != 0) ) break;
+     job->out.resize(job->out.size() * 2);  /* should not happen */
+  }
+  deflateEnd(&strm);
+
+  if( job->bgzf && !job->error ){
+     /* incompressible data, stored blocks always fit */
+     if( offset + done + 8 > ZNZ_BGZF_MAX && job->level != 0 ){
+        job->level = 0;
+        znz_pgz_deflate_block(job);
+        return;
+     }
+     /* gzip header with the 'BC' extra field holding the block size - 1 */
+     static const unsigned char header[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0,
+                                              0, 0xff, 6, 0, 'B', 'C', 2, 0};
+     job->out.resize(offset + done + 8);
+     memcpy(job->out.data(), header, sizeof(header));
+     znz_put_le(job->out.data() + 16, (unsigned long)(job->out.size() - 1), 2);
+     znz_put_le(job->out.data() + offset + done, job->crc, 4);
+     znz_put_le(job->out.data() + offset + done + 4, (unsigned long)job->len, 4);
+     return;
+  }
+  job->out.resize(done);
+}
+
+/* compress all pending input, 'last' finishes the deflate stream */
+static int znz_pgz_compress(struct znz_pgz* pgz, int last)
+{
+  unsigned char* in = pgz->buf + ZNZ_PGZ_DICT;
+  size_t nr_jobs = (pgz->in_len + pgz->block - 1) / pgz->block;
+  size_t i, keep;
+
+  if( nr_jobs == 0 ){
+     if( !last || pgz->bgzf ) return 0;
+     nr_jobs = 1;  /* an empty final block closes the stream */
+  }
+
+  std::vector<znz_pgz_job> jobs(nr_jobs);
+  for( i = 0; i < nr_jobs; i++ ){
+     size_t begin = i * pgz->block;
+     size_t dict_len = (i == 0) ? pgz->dict_len : ZNZ_PGZ_DICT;
+     if( pgz->bgzf ) dict_len = 0;  /* blocks are independent */
+     jobs[i].dict     = in + begin - dict_len;
+     jobs[i].dict_len = dict_len;
+     jobs[i].in       = in + begin;
+     jobs[i].len      = (pgz->in_len - begin < pgz->block)
+                        ? pgz->in_len - begin : pgz->block;
+     jobs[i].level    = pgz->level;
+     jobs[i].last     = pgz->bgzf || (last && (i == nr_jobs - 1));
+     jobs[i].bgzf     = pgz->bgzf;
+  }
+
+  std::vector<std::thread> threads;
+  for( i = 1; i < nr_jobs; i++ )
+     threads.push_back(std::thread(znz_pgz_deflate_block, &jobs[i]));
+  znz_pgz_deflate_block(&jobs[0]);
+  for( i = 0; i < threads.size(); i++ ) threads[i].join();
+
+  /* write blocks in order */
+  for( i = 0; i < nr_jobs; i++ ){
+     if( jobs[i].error ||
+         fwrite(jobs[i].out.data(), 1, jobs[i].out.size(), pgz->fp)
+            != jobs[i].out.size() ){
+        fprintf(stderr,"** ERROR: znzwrite failed to compress block\n");
+        pgz->error = 1;
+        return -1;
+     }
+     pgz->crc = crc32_combine(pgz->crc, jobs[i].crc, (z_off_t)jobs[i].len);
+  }
+
+  /* keep the tail of the input as dictionary for the next blocks */
+  keep = pgz->dict_len + pgz->in_len;
+  if( keep > ZNZ_PGZ_DICT ) keep = ZNZ_PGZ_DICT;
+  memmove(pgz->buf + ZNZ_PGZ_DICT - keep, in + pgz->in_len - keep, keep);
+  pgz->dict_len = keep;
+  pgz->in_len = 0;
+  return 0;
+}
+
+static struct znz_pgz* znz_pgz_open(const char *path, const char *mode)
+{
+  struct znz_pgz* pgz;
+  /* gzip header: magic, deflate, no flags, no mtime, no xfl, unix */
+  static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+  const char* c;
+  int level = Z_DEFAULT_COMPRESSION;
+
+  /* only plain write modes, e.g. "wb" or "wb9", others go through gzopen */
+  if( mode[0] != 'w' ) return NULL;
+  for( c = mode + 1; *c; c++ ){
+     if( *c >= '0' && *c <= '9' ) level = *c - '0';
+     else if( *c != 'b' ) return NULL;
+  }
+
+  pgz = (struct znz_pgz *) calloc(1, sizeof(struct znz_pgz));
+  if( pgz == NULL ) return NULL;
+  pgz->level      = level;
+  pgz->nr_threads = znz_nr_threads;
+  pgz->bgzf       = znz_use_bgzf;
+  pgz->block      = pgz->bgzf ? ZNZ_BGZF_BLOCK : ZNZ_PGZ_BLOCK;
+  pgz->in_size    = (size_t)pgz->nr_threads * pgz->block;
+  pgz->buf        = (unsigned char *) malloc(ZNZ_PGZ_DICT + pgz->in_size);
+  pgz->crc        = crc32(0L, Z_NULL, 0);
+  if( pgz->buf == NULL || (pgz->fp = fopen(path, "wb")) == NULL ){
+     free(pgz->buf);
+     free(pgz);
+     return NULL;
+  }
+  if( !pgz->bgzf ) fwrite(header, 1, sizeof(header), pgz->fp);
+  return pgz;
+}
+
+static size_t znz_pgz_write(struct znz_pgz* pgz, const void* buf, size_t len)
+{
+  const unsigned char* cbuf = (const unsigned char *)buf;
+  size_t remain = len, n;
+
+  while( remain > 0 && !pgz->error ){
+     n = pgz->in_size - pgz->in_len;
+     if( n > remain ) n = remain;
+     if( cbuf != NULL ) memcpy(pgz->buf + ZNZ_PGZ_DICT + pgz->in_len, cbuf, n);
+     else               memset(pgz->buf + ZNZ_PGZ_DICT + pgz->in_len, 0, n);
+     pgz->in_len += n;
+     pgz->total += n;
+     remain -= n;
+     if( cbuf != NULL ) cbuf += n;
+     if( pgz->in_len == pgz->in_size ) znz_pgz_compress(pgz, 0);
+  }
+  return len - remain;
+}
+
+static int znz_pgz_close(struct znz_pgz* pgz)
+{
+  unsigned char trailer[8];
+  /* BGZF end of file marker, an empty block */
+  static const unsigned char bgzf_eof[28] = {
+     0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+     0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  int i, retval;
+
+  znz_pgz_compress(pgz, 1);
+  if( pgz->bgzf ){
+     fwrite(bgzf_eof, 1, sizeof(bgzf_eof), pgz->fp);
+  } else {
+     for( i = 0; i < 4; i++ ){
+        trailer[i]     = (unsigned char)(pgz->crc >> (8 * i));
+        trailer[i + 4] = (unsigned char)(pgz->total >> (8 * i));  /* mod 2^32 */
+     }
+     fwrite(trailer, 1, sizeof(trailer), pgz->fp);
+  }
+  retval = fclose(pgz->fp);
+  if( pgz->error ) retval = -1;
+  free(pgz->buf);
+  free(pgz);
+  return retval;
+}
+
+/* only forward seeks are possible, the gap is filled with zeros (as gzseek) */
+static long znz_pgz_seek(struct znz_pgz* pgz, long offset, int whence)
+{
+  long target = offset;
+  if( whence == SEEK_CUR ) target += (long)pgz->total;
+  else if( whence != SEEK_SET ) return -1;
+  if( target < (long)pgz->total ) return -1;
+  znz_pgz_write(pgz, NULL, (size_t)(target - (long)pgz->total));
+  return pgz->error ? -1 : target;
+}
+
+
+/*
+BGZF reader
+
+Files written in BGZF mode (by this library, bgzip or htslib) are opened
+for reading with this reader instead of gzopen. An index of the block
+offsets is built from the block headers when the file is opened, so that
+seeks only need to inflate the block they land in. Reads that span whole
+blocks inflate these blocks on several threads, straight into the output
+buffer.
+*/
+#define ZNZ_BGZF_BATCH 256   /* blocks read from disk at once */
+
+struct znz_bgzf {
+  FILE*                      fp;
+  int                        nr_threads;
+  std::vector<long>          coffset;  /* file offset of each block */
+  std::vector<unsigned long> uoffset;  /* uncompressed offset, +1 at end */
+  std::vector<unsigned char> cache;    /* last inflated block */
+  long                       cache_block;
+  std::vector<unsigned char> cbuf;
+  unsigned long              pos;
+};
+
+/* size of the block starting at 'p' (0 if not a BGZF block header) */
+static size_t znz_bgzf_block_size(const unsigned char* p, size_t len)
+{
+  size_t xlen, i;
+  if( len < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4) )
+     return 0;
+  xlen = znz_get_le(p + 10, 2);
+  if( len < 12 + xlen ) return 0;
+  for( i = 12; i + 4 <= 12 + xlen; i += 4 + znz_get_le(p + i + 2, 2) ){
+     if( p[i] == 'B' && p[i + 1] == 'C' && znz_get_le(p + i + 2, 2) == 2
+         && i + 6 <= 12 + xlen )
+        return znz_get_le(p + i + 4, 2) + 1;
+  }
+  return 0;
+}
+
+/* 1 if a block of 'size' bytes holds its header and the 8 byte trailer */
+static int znz_bgzf_block_valid(const unsigned char* p, size_t size)
+{
+  return size >= 12 + znz_get_le(p + 10, 2) + 8 && size <= ZNZ_BGZF_MAX;
+}
+
+static int znz_bgzf_inflate(const unsigned char* block, size_t block_size,
+                            unsigned char* out, size_t out_size)
+{
+  z_stream strm;
+  size_t start = 12 + znz_get_le(block + 10, 2);
+  int ret;
+
+  if( block_size < start + 8 ) return -1;
+  memset(&strm, 0, sizeof(strm));
+  if( inflateInit2(&strm, -15) != Z_OK ) return -1;
+  strm.next_in   = (Bytef *)(block + start);
+  strm.avail_in  = (uInt)(block_size - start - 8);
+  strm.next_out  = out;
+  strm.avail_out = (uInt)out_size;
+  ret = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  if( ret != Z_STREAM_END || strm.total_out != out_size ) return -1;
+  if( crc32(crc32(0L, Z_NULL, 0), out, (uInt)out_size)
+      != znz_get_le(block + block_size - 8, 4) ) return -1;
+  return 0;
+}
+
+static void znz_bgzf_close(struct znz_bgzf* bgzf)
+{
+  fclose(bgzf->fp);
+  delete bgzf;
+}
+
+/* returns NULL when the file is not BGZF, it is then read with gzopen. Files
+   that start with a BGZF block but have an inconsistent block header or size
+   are rejected, with 'malformed' set. */
+static struct znz_bgzf* znz_bgzf_open(const char *path, int *malformed)
+{
+  unsigned char head[ZNZ_BGZF_HEADER + 256];
+  unsigned char tail[4];
+  unsigned long total = 0;
+  long offset = 0;
+  size_t nread, size;
+  struct znz_bgzf* bgzf;
+  FILE* fp = fopen(path, "rb");
+  if( fp == NULL ) return NULL;
+
+  bgzf = new znz_bgzf;
+  bgzf->fp          = fp;
+  bgzf->nr_threads  = znz_nr_threads;
+  bgzf->cache_block = -1;
+  bgzf->pos         = 0;
+  *malformed = 0;
+  for(;;){
+     nread = fread(head, 1, sizeof(head), fp);
+     if( nread == 0 && offset > 0 ) break;  /* end of file */
+     size = znz_bgzf_block_size(head, nread);
+     if( size == 0 && offset == 0 ){  /* not BGZF */
+        znz_bgzf_close(bgzf);
+        return NULL;
+     }
+     if( !znz_bgzf_block_valid(head, size)
+         || fseek(fp, offset + (long)size - 4, SEEK_SET)
+         || fread(tail, 1, 4, fp) != 4 || znz_get_le(tail, 4) > ZNZ_BGZF_MAX ){
+        fprintf(stderr,"** ERROR: malformed BGZF block at offset %ld in '%s'\n",
+                offset, path);
+        *malformed = 1;
+        znz_bgzf_close(bgzf);
+        return NULL;
+     }
+     if( znz_get_le(tail, 4) > 0 ){  /* empty blocks are skipped */
+        bgzf->coffset.push_back(offset);
+        bgzf->uoffset.push_back(total);
+        total += znz_get_le(tail, 4);
+     }
+     offset += (long)size;
+  }
+  bgzf->coffset.push_back(offset);
+  bgzf->uoffset.push_back(total);
+  return bgzf;
+}
+
+/* read 'nr_blocks' consecutive blocks into bgzf->cbuf (followed by any
+   empty blocks) */
+static int znz_bgzf_read_blocks(struct znz_bgzf* bgzf, size_t first,
+                                size_t nr_blocks)
+{
+  long begin = bgzf->coffset[first];
+  size_t len = (size_t)(bgzf->coffset[first + nr_blocks] - begin);
+  bgzf->cbuf.resize(len);
+  if( fseek(bgzf->fp, begin, SEEK_SET) ||
+      fread(bgzf->cbuf.data(), 1, len, bgzf->fp) != len ) return -1;
+  return 0;
+}
+
+struct znz_bgzf_job {
+  struct znz_bgzf* bgzf;
+  size_t           first;
+  size_t           nr_blocks;
+  int              thread;
+  int              nr_threads;
+  unsigned char*   out;
+  int              error;
+};
+
+static void znz_bgzf_inflate_blocks(znz_bgzf_job* job)
+{
+  struct znz_bgzf* bgzf = job->bgzf;
+  const unsigned char* base = bgzf->cbuf.data();
+  size_t i, b;
+  job->error = 0;
+  for( i = job->thread; i < job->nr_blocks; i += job->nr_threads ){
+     b = job->first + i;
+     const unsigned char* block = base + (bgzf->coffset[b] - bgzf->coffset[job->first]);
+     size_t block_size = znz_bgzf_block_size(block, ZNZ_BGZF_MAX);
+     if( znz_bgzf_inflate(block, block_size,
+                          job->out + (bgzf->uoffset[b] - bgzf->uoffset[job->first]),
+                          bgzf->uoffset[b + 1] - bgzf->uoffset[b]) ){
+        job->error = 1;
+     }
+  }
+}
+
+static size_t znz_bgzf_find(const struct znz_bgzf* bgzf, unsigned long pos)
+{
+  /* last block starting at or before 'pos' */
+  return (size_t)(std::upper_bound(bgzf->uoffset.begin(), bgzf->uoffset.end() - 1,
+                                   pos) - bgzf->uoffset.begin()) - 1;
+}
+
+static long znz_bgzf_read(struct znz_bgzf* bgzf, void* buf, size_t len)
+{
+  unsigned char* out = (unsigned char *)buf;
+  const unsigned long total = bgzf->uoffset.back();
+  size_t done = 0, b, n, nr_blocks, i;
+
+  while( done < len && bgzf->pos < total ){
+     b = znz_bgzf_find(bgzf, bgzf->pos);
+     /* whole blocks go straight into the output buffer */
+     nr_blocks = 0;
+     if( bgzf->pos == bgzf->uoffset[b] ){
+        while( b + nr_blocks + 1 < bgzf->uoffset.size() &&
+               nr_blocks < ZNZ_BGZF_BATCH &&
+               bgzf->uoffset[b + nr_blocks + 1] - bgzf->pos <= len - done ){
+           nr_blocks++;
+        }
+     }
+     if( nr_blocks > 0 ){
+        int nr_threads = (bgzf->nr_threads < (int)nr_blocks)
+                         ? bgzf->nr_threads : (int)nr_blocks;
+        if( znz_bgzf_read_blocks(bgzf, b, nr_blocks) ) return -1;
+        std::vector<znz_bgzf_job> jobs(nr_threads);
+        std::vector<std::thread> threads;
+        for( i = 0; i < jobs.size(); i++ ){
+           jobs[i].bgzf       = bgzf;
+           jobs[i].first      = b;
+           jobs[i].nr_blocks  = nr_blocks;
+           jobs[i].thread     = (int)i;
+           jobs[i].nr_threads = nr_threads;
+           jobs[i].out        = out + done;
+           if( i > 0 ) threads.push_back(std::thread(znz_bgzf_inflate_blocks, &jobs[i]));
+        }
+        znz_bgzf_inflate_blocks(&jobs[0]);
+        for( i = 0; i < threads.size(); i++ ) threads[i].join();
+        for( i = 0; i < jobs.size(); i++ ) if( jobs[i].error ) return -1;
+        n = bgzf->uoffset[b + nr_blocks] - bgzf->pos;
+     } else {
+        /* partial block, through the cache */
+        if( bgzf->cache_block != (long)b ){
+           bgzf->cache_block = -1;
+           bgzf->cache.resize(bgzf->uoffset[b + 1] - bgzf->uoffset[b]);
+           if( znz_bgzf_read_blocks(bgzf, b, 1) ||
+               znz_bgzf_inflate(bgzf->cbuf.data(),
+                                znz_bgzf_block_size(bgzf->cbuf.data(), bgzf->cbuf.size()),
+                                bgzf->cache.data(), bgzf->cache.size()) )
+              return -1;
+           bgzf->cache_block = (long)b;
+        }
+        n = bgzf->uoffset[b + 1] - bgzf->pos;
+        if( n > len - done ) n = len - done;
+        memcpy(out + done, bgzf->cache.data() + (bgzf->pos - bgzf->uoffset[b]), n);
+     }
+     done += n;
+     bgzf->pos += n;
+  }
+  return (long)done;
+}
+
+static long znz_bgzf_seek(struct znz_bgzf* bgzf, long offset, int whence)
+{
+  long target = offset;
+  if( whence == SEEK_CUR )      target += (long)bgzf->pos;
+  else if( whence == SEEK_END ) target += (long)bgzf->uoffset.back();
+  if( target < 0 ) return -1;
+  bgzf->pos = (unsigned long)target;
+  return target;
+}
+
+
+/*
+Read-ahead gzip reader
+
+A single deflate stream can only be inflated in order, so other compressed
+files are inflated on a background thread instead. With more than one
+thread set, the thread keeps up to ZNZ_RA_DEPTH chunks of ZNZ_RA_CHUNK bytes
+inflated ahead of the read position, while the caller works on the data it
+already has (e.g. converts one volume while the next one is inflated).
+Seeks forward skip data, seeks backwards restart the thread at the new
+position (gzseek inflates from the start of the file, as before).
+*/
+#define ZNZ_RA_CHUNK (1<<20)
+#define ZNZ_RA_DEPTH 4
+#define ZNZ_READ_BUFFER (1<<20)
+
+struct znz_gzra {
+  gzFile                                  gz;
+  std::thread                             thread;
+  std::mutex                              mutex;
+  std::condition_variable                 cv;
+  std::deque<std::vector<unsigned char> > chunks;  /* inflated, not read */
+  std::vector<std::vector<unsigned char> > spare;  /* read, for reuse */
+  size_t                                  chunk_pos;  /* in chunks.front() */
+  unsigned long                           pos;
+  int                                     done;   /* end of file or error */
+  int                                     error;
+  int                                     stop;
+};
+
+static void znz_gzra_loop(struct znz_gzra* ra)
+{
+  std::unique_lock<std::mutex> lock(ra->mutex);
+  std::vector<unsigned char> chunk;
+  int nread;
+  while( !ra->done ){
+     ra->cv.wait(lock, [ra]{ return ra->stop || ra->chunks.size() < ZNZ_RA_DEPTH; });
+     if( ra->stop ) break;
+     if( !ra->spare.empty() ){
+        chunk.swap(ra->spare.back());
+        ra->spare.pop_back();
+     }
+     lock.unlock();
+     chunk.resize(ZNZ_RA_CHUNK);
+     nread = gzread(ra->gz, chunk.data(), ZNZ_RA_CHUNK);
+     lock.lock();
+     if( nread < 0 ){
+        ra->error = 1;
+        ra->done = 1;
+     } else {
+        if( nread < ZNZ_RA_CHUNK ) ra->done = 1;  /* gzread stops short at the end */
+        if( nread > 0 ){
+           chunk.resize((size_t)nread);
+           ra->chunks.push_back(std::vector<unsigned char>());
+           ra->chunks.back().swap(chunk);
+        }
+     }
+     ra->cv.notify_all();
+  }
+}
+
+static void znz_gzra_start(struct znz_gzra* ra)
+{
+  ra->done = 0;
+  ra->error = 0;
+  ra->stop = 0;
+  ra->thread = std::thread(znz_gzra_loop, ra);
+}
+
+static void znz_gzra_stop(struct znz_gzra* ra)
+{
+  {
+     std::lock_guard<std::mutex> lock(ra->mutex);
+     ra->stop = 1;
+  }
+  ra->cv.notify_all();
+  ra->thread.join();
+  while( !ra->chunks.empty() ){
+     ra->spare.push_back(std::vector<unsigned char>());
+     ra->spare.back().swap(ra->chunks.front());
+     ra->chunks.pop_front();
+  }
+  ra->chunk_pos = 0;
+}
+
+static struct znz_gzra* znz_gzra_open(const char *path, const char *mode)
+{
+  struct znz_gzra* ra;
+  gzFile gz = gzopen(path, mode);
+  if( gz == NULL ) return NULL;
+#if ZLIB_VERNUM >= 0x1240
+  gzbuffer(gz, ZNZ_READ_BUFFER);
+#endif
+  ra = new znz_gzra;
+  ra->gz = gz;
+  ra->chunk_pos = 0;
+  ra->pos = 0;
+  znz_gzra_start(ra);
+  return ra;
+}
+
+static int znz_gzra_close(struct znz_gzra* ra)
+{
+  int retval;
+  znz_gzra_stop(ra);
+  retval = gzclose(ra->gz);
+  delete ra;
+  return retval;
+}
+
+/* 'buf' NULL skips the data (forward seeks) */
+static long znz_gzra_read(struct znz_gzra* ra, void* buf, size_t len)
+{
+  unsigned char* out = (unsigned char *)buf;
+  size_t done = 0, n;
+  std::unique_lock<std::mutex> lock(ra->mutex);
+  while( done < len ){
+     ra->cv.wait(lock, [ra]{ return !ra->chunks.empty() || ra->done; });
+     if( ra->chunks.empty() ){
+        if( ra->error ) return -1;
+        break;  /* end of file, the read is short */
+     }
+     /* the thread only appends chunks, so the front chunk stays in place */
+     std::vector<unsigned char>& chunk = ra->chunks.front();
+     n = chunk.size() - ra->chunk_pos;
+     if( n > len - done ) n = len - done;
+     if( out != NULL ){
+        lock.unlock();
+        memcpy(out + done, chunk.data() + ra->chunk_pos, n);
+        lock.lock();
+     }
+     done += n;
+     ra->pos += n;
+     ra->chunk_pos += n;
+     if( ra->chunk_pos == chunk.size() ){
+        ra->spare.push_back(std::vector<unsigned char>());
+        ra->spare.back().swap(chunk);
+        ra->chunks.pop_front();
+        ra->chunk_pos = 0;
+        ra->cv.notify_all();  /* room for the next chunk */
+     }
+  }
+  return (long)done;
+}
+
+static long znz_gzra_seek(struct znz_gzra* ra, long offset, int whence)
+{
+  long target = offset;
+  if( whence == SEEK_CUR )      target += (long)ra->pos;
+  else if( whence != SEEK_SET ) return -1;  /* as gzseek */
+  if( target < 0 ) return -1;
+  if( (unsigned long)target >= ra->pos ){
+     if( znz_gzra_read(ra, NULL, (unsigned long)target - ra->pos) < 0 ) return -1;
+     return (long)ra->pos;
+  }
+  znz_gzra_stop(ra);
+  if( gzseek(ra->gz, target, SEEK_SET) < 0 ){
+     ra->done = 1;
+     ra->error = 1;
+     return -1;
+  }
+  ra->pos = (unsigned long)target;
+  znz_gzra_start(ra);
+  return target;
+}
+
+static int znz_gzra_eof(struct znz_gzra* ra)
+{
+  std::lock_guard<std::mutex> lock(ra->mutex);
+  return ra->done && ra->chunks.empty();
+}
+#endif
+
+
 /* Note extra argument (use_compression) where
    use_compression==0 is no compression
    use_compression!=0 uses zlib (gzip) compression
@@ -59,13 +763,43 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
 
 #ifdef HAVE_ZLIB
   file->zfptr = NULL;
+  file->pgz = NULL;
+  file->bgzf = NULL;
+  file->gzra = NULL;
 
   if (use_compression) {
     file->withz = 1;
+    if ((znz_nr_threads > 1 || znz_use_bgzf)
+        && (file->pgz = znz_pgz_open(path,mode)) != NULL) {
+      return file;
+    }
+    if (mode[0] == 'r') {
+      int malformed;
+      if ((file->bgzf = znz_bgzf_open(path, &malformed)) != NULL) {
+        return file;
+      }
+      if (malformed) {
+        free(file);
+        return NULL;
+      }
+      if (znz_nr_threads > 1) {
+        if ((file->gzra = znz_gzra_open(path, mode)) == NULL) {
+          free(file);
+          file = NULL;
+        }
+        return file;
+      }
+    }
     if((file->zfptr = gzopen(path,mode)) == NULL) {
         free(file);
         file = NULL;
     }
+#if ZLIB_VERNUM >= 0x1240
+    else if (mode[0] == 'r') {
+      /* larger input buffer, fewer reads from disk while inflating */
+      gzbuffer(file->zfptr, ZNZ_READ_BUFFER);
+    }
+#endif
   } else {
 #endif
 
@@ -92,6 +826,9 @@ znzFile znzdopen(int fd, const char *mode, int use_compression)
      return NULL;
   }
 #ifdef HAVE_ZLIB
+  file->pgz = NULL;
+  file->bgzf = NULL;
+  file->gzra = NULL;
   if (use_compression) {
     file->withz = 1;
     file->zfptr = gzdopen(fd,mode);
@@ -116,6 +853,9 @@ int Xznzclose(znzFile * file)
   if (*file!=NULL) {
 #ifdef HAVE_ZLIB
     if ((*file)->zfptr!=NULL)  { retval = gzclose((*file)->zfptr); }
+    if ((*file)->pgz!=NULL)    { retval = znz_pgz_close((*file)->pgz); }
+    if ((*file)->bgzf!=NULL)   { znz_bgzf_close((*file)->bgzf); }
+    if ((*file)->gzra!=NULL)   { retval = znz_gzra_close((*file)->gzra); }
 #endif
     if ((*file)->nzfptr!=NULL) { retval = fclose((*file)->nzfptr); }
 
@@ -139,6 +879,17 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
 
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) { return 0; }  /* write only */
+  if (file->bgzf!=NULL) {
+    long nread = znz_bgzf_read(file->bgzf, buf, remain);
+    if( nread < 0 ) return 0;
+    return (size_t)nread / size;
+  }
+  if (file->gzra!=NULL) {
+    long nread = znz_gzra_read(file->gzra, buf, remain);
+    if( nread < 0 ) return 0;
+    return (size_t)nread / size;
+  }
   if (file->zfptr!=NULL) {
     /* gzread/write take unsigned int length, so maybe read in int pieces
        (noted by M Hanke, example given by M Adler)   6 July 2010 [rickr] */
@@ -173,6 +924,10 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
 
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) {
+    return znz_pgz_write(file->pgz, buf, remain) / size;
+  }
+  if (file->bgzf!=NULL || file->gzra!=NULL) { return 0; }  /* read only */
   if (file->zfptr!=NULL) {
     while( remain > 0 ) {
        n2write = (remain < ZNZ_MAX_BLOCK_SIZE) ? remain : ZNZ_MAX_BLOCK_SIZE;
@@ -198,10 +953,22 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
   return fwrite(buf,size,nmemb,file->nzfptr);
 }
 
+int znz_random_access(znzFile file)
+{
+  if (file==NULL) { return 0; }
+#ifdef HAVE_ZLIB
+  if (file->zfptr!=NULL || file->pgz!=NULL || file->gzra!=NULL) return 0;
+#endif
+  return 1;
+}
+
 long znzseek(znzFile file, long offset, int whence)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return znz_pgz_seek(file->pgz,offset,whence);
+  if (file->bgzf!=NULL) return znz_bgzf_seek(file->bgzf,offset,whence);
+  if (file->gzra!=NULL) return znz_gzra_seek(file->gzra,offset,whence);
   if (file->zfptr!=NULL) return (long) gzseek(file->zfptr,offset,whence);
 #endif
   return fseek(file->nzfptr,offset,whence);
@@ -217,6 +984,9 @@ int znzrewind(znzFile stream)
      if (stream->zfptr!=NULL) return gzrewind(stream->zfptr);
   */
 
+  if (stream->pgz!=NULL) return (int)znz_pgz_seek(stream->pgz, 0L, SEEK_SET);
+  if (stream->bgzf!=NULL) return (int)znz_bgzf_seek(stream->bgzf, 0L, SEEK_SET);
+  if (stream->gzra!=NULL) return (int)znz_gzra_seek(stream->gzra, 0L, SEEK_SET);
   if (stream->zfptr!=NULL) return (int)gzseek(stream->zfptr, 0L, SEEK_SET);
 #endif
   rewind(stream->nzfptr);
@@ -227,6 +997,9 @@ long znztell(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return (long) file->pgz->total;
+  if (file->bgzf!=NULL) return (long) file->bgzf->pos;
+  if (file->gzra!=NULL) return (long) file->gzra->pos;
   if (file->zfptr!=NULL) return (long) gztell(file->zfptr);
 #endif
   return ftell(file->nzfptr);
@@ -236,6 +1009,8 @@ int znzputs(const char * str, znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return (int)znz_pgz_write(file->pgz,str,strlen(str));
+  if (file->bgzf!=NULL || file->gzra!=NULL) return -1;  /* read only */
   if (file->zfptr!=NULL) return gzputs(file->zfptr,str);
 #endif
   return fputs(str,file->nzfptr);
@@ -246,6 +1021,29 @@ char * znzgets(char* str, int size, znzFile file)
 {
   if (file==NULL) { return NULL; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return NULL;  /* write only */
+  if (file->bgzf!=NULL) {
+    int i = 0;
+    char c;
+    while (i < size - 1 && znz_bgzf_read(file->bgzf, &c, 1) == 1) {
+      str[i++] = c;
+      if (c == '\n') break;
+    }
+    if (i == 0 || size < 1) return NULL;
+    str[i] = '\0';
+    return str;
+  }
+  if (file->gzra!=NULL) {
+    int i = 0;
+    char c;
+    while (i < size - 1 && znz_gzra_read(file->gzra, &c, 1) == 1) {
+      str[i++] = c;
+      if (c == '\n') break;
+    }
+    if (i == 0 || size < 1) return NULL;
+    str[i] = '\0';
+    return str;
+  }
   if (file->zfptr!=NULL) return gzgets(file->zfptr,str,size);
 #endif
   return fgets(str,size,file->nzfptr);
@@ -256,6 +1054,11 @@ int znzflush(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) {
+    if (znz_pgz_compress(file->pgz, 0) != 0) return -1;
+    return fflush(file->pgz->fp);
+  }
+  if (file->bgzf!=NULL || file->gzra!=NULL) return 0;
   if (file->zfptr!=NULL) return gzflush(file->zfptr,Z_SYNC_FLUSH);
 #endif
   return fflush(file->nzfptr);
@@ -266,6 +1069,9 @@ int znzeof(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return 0;
+  if (file->bgzf!=NULL) return file->bgzf->pos >= file->bgzf->uoffset.back();
+  if (file->gzra!=NULL) return znz_gzra_eof(file->gzra);
   if (file->zfptr!=NULL) return gzeof(file->zfptr);
 #endif
   return feof(file->nzfptr);
@@ -276,6 +1082,11 @@ int znzputc(int c, znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) {
+    unsigned char uc = (unsigned char)c;
+    return (znz_pgz_write(file->pgz,&uc,1) == 1) ? uc : -1;
+  }
+  if (file->bgzf!=NULL || file->gzra!=NULL) return -1;  /* read only */
   if (file->zfptr!=NULL) return gzputc(file->zfptr,c);
 #endif
   return fputc(c,file->nzfptr);
@@ -286,6 +1097,15 @@ int znzgetc(znzFile file)
 {
   if (file==NULL) { return 0; }
 #ifdef HAVE_ZLIB
+  if (file->pgz!=NULL) return -1;  /* write only */
+  if (file->bgzf!=NULL) {
+    unsigned char uc;
+    return (znz_bgzf_read(file->bgzf, &uc, 1) == 1) ? uc : -1;
+  }
+  if (file->gzra!=NULL) {
+    unsigned char uc;
+    return (znz_gzra_read(file->gzra, &uc, 1) == 1) ? uc : -1;
+  }
   if (file->zfptr!=NULL) return gzgetc(file->zfptr);
 #endif
   return fgetc(file->nzfptr);
@@ -300,6 +1120,14 @@ int znzprintf(znzFile stream, const char *format, ...)
   if (stream==NULL) { return 0; }
   va_start(va, format);
 #ifdef HAVE_ZLIB
+  if (stream->pgz!=NULL) {
+    char tmp[256];
+    vsnprintf(tmp,256,format,va);
+    retval=(int)znz_pgz_write(stream->pgz,tmp,strlen(tmp));
+  } else
+  if (stream->bgzf!=NULL || stream->gzra!=NULL) {
+    retval=-1;  /* read only */
+  } else
   if (stream->zfptr!=NULL) {
     int size;  /* local to HAVE_ZLIB block */
     size = strlen(format) + 1000000;  /* overkill I hope */
@@ -63,11 +63,22 @@ extern "C" {
 #endif
 #endif
 
+#ifdef HAVE_ZLIB
+/* block parallel gzip writer, BGZF reader and read-ahead gzip reader, see
+   znzlib.cpp */
+struct znz_pgz;
+struct znz_bgzf;
+struct znz_gzra;
+#endif
+
 struct znzptr {
   int withz;
   FILE* nzfptr;
 #ifdef HAVE_ZLIB
   gzFile zfptr;
+  struct znz_pgz* pgz;
+  struct znz_bgzf* bgzf;
+  struct znz_gzra* gzra;
 #endif
 } ;
 
@@ -87,6 +98,32 @@ typedef struct znzptr * znzFile;
 
 znzFile znzopen(const char *path, const char *mode, int use_compression);
 
+/* Number of threads used to compress files opened for writing with
+   compression. With more than one thread the data is compressed in
+   independent blocks (pigz style). The output is a single standard gzip
+   member. Compressed files opened for reading (other than BGZF) are then
+   inflated ahead of the reads on a background thread. The default (1) uses
+   plain gzopen/gzread/gzwrite.
+*/
+void znz_set_nr_threads(int nr_threads);
+
+int znz_get_nr_threads(void);
+
+/* Write compressed files as BGZF (blocked gzip, as bgzip/htslib): a series
+   of small gzip members that record their compressed size. These are valid
+   gzip files for all readers. Compressed files in this format are always
+   read with random access, seeks only inflate the block they land in.
+*/
+void znz_set_bgzf(int use_bgzf);
+
+int znz_get_bgzf(void);
+
+/* 1 if seeks in the file are cheap: uncompressed files and compressed files
+   read as BGZF. Seeks in other compressed files inflate all data up to the
+   target, from the start of the file when seeking backwards.
+*/
+int znz_random_access(znzFile file);
+
 znzFile znzdopen(int fd, const char *mode, int use_compression);
 
 int Xznzclose(znzFile * file);
@@ -343,6 +343,9 @@ int main(int argc, char*  argv[]) {
 
     save_output_nifti(fout, "borders", nii_borders, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -590,6 +590,9 @@ int main(int argc, char*  argv[]) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "padded", dist, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
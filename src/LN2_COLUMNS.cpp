@@ -25,6 +25,8 @@ int show_help(void) {
     "                    Especially useful for large images that takes long\n"
     "                    time to process.\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
+    "    -profile      : (Optional) Write the time and memory use of each stage\n"
+    "                    to 'LN2_COLUMNS_profile.json' at exit.\n"
     "    -incl_borders : (Optional) Include inner and outer gray matter borders\n"
     "                    into the layering. This treats the borders as \n"
     "                    a part of gray matter. Off by default.\n"
@@ -86,6 +88,8 @@ int main(int argc, char*  argv[]) {
             mode_incl_borders = true;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
+        } else if (!strcmp(argv[ac], "-profile")) {
+            ln_set_profile("");
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -107,28 +111,40 @@ int main(int argc, char*  argv[]) {
         }
     }
 
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin1, 1);
+    // Read input datasets, cropped to the bounding box of their voxels
+    ln_profile_stage("read inputs");
+    std::vector<string> fin_crop = {fin1, fin2};
+    if (mode_initialize_with_centroids) {
+        fin_crop.push_back(fin3);
+    }
+    ln_crop crop;
+    if (!ln_crop_find(crop, fin_crop)) {
+        return 2;
+    }
+    nii1 = ln_read_cropped(fin1, crop);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
+    nii2 = ln_read_cropped(fin2, crop);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
         return 2;
     }
     if (mode_initialize_with_centroids) {
-        nii3 = nifti_image_read(fin3, 1);
+        nii3 = ln_read_cropped(fin3, crop);
         if (!nii3) {
             fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
             return 2;
         }
     }
+    // Outputs are written in the full field of view
+    ln_set_output_crop(&crop);
 
     log_welcome("LN2_COLUMNS");
     log_nifti_descriptives(nii1);
     log_nifti_descriptives(nii2);
+    log_crop_descriptives(crop);
 
     if (mode_initialize_with_centroids) {
         log_nifti_descriptives(nii3);
@@ -158,6 +174,7 @@ int main(int argc, char*  argv[]) {
 
     // ========================================================================
     // Fix input datatype issues
+    ln_profile_stage("prepare inputs");
     nifti_image* nii_rim = copy_nifti_as_int32(nii1);
     int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
     nifti_image* nii_midgm = copy_nifti_as_int32(nii2);
@@ -236,659 +253,89 @@ int main(int argc, char*  argv[]) {
     // Find connected clusters to initialize one voxel in each
     // ========================================================================
     cout << "  Start finding connected clusters..." << endl;
+    ln_profile_stage("connected clusters");
 
-    // Loop until all clusters have one initial voxel
-    uint32_t voxel_counter = 0, prev_voxel_counter = 0;
-    int32_t init_voxel_id = 1;
-    bool terminate_switch1 = true;
-    while (terminate_switch1) {
-        uint32_t ix, iy, iz, i, j;
-
-        if (voxel_counter == nr_voi) {
-            // Indicates all clusters are reached. Terminate condition.
-            terminate_switch1 = false;
-            cout << "    Nr. of connected clusters within midgm input: "
-                << init_voxel_id - 1 << endl;
-        } else if (voxel_counter == prev_voxel_counter) {
-            // Find the initial voxel for each disconnected cluster
-            uint32_t start_voxel;
-            for (uint32_t i = 0; i != nr_voxels; ++i) {
-                if (*(nii_midgm_data + i) == 1) {
-                    start_voxel = i;
-                }
-            }
-            voxel_counter += 1;
-            init_voxel_id += 1;
-            *(nii_midgm_data + start_voxel) = init_voxel_id;
-        }
-
-        while (prev_voxel_counter != voxel_counter) {
-            prev_voxel_counter = voxel_counter;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                // Map subset to full set
-                i = *(voi_id + ii);
-                if (*(nii_midgm_data + i) == init_voxel_id) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            *(nii_midgm_data + j) = init_voxel_id;
-                        }
-                    }
-                }
-            }
-
-            // Count cluster assigned voxels
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(nii_midgm_data + i) > 1) {
-                    voxel_counter += 1;
-                }
-            }
-        }
+    nifti_image* nii_clusters = copy_nifti_as_int32(nii_midgm);
+    int32_t* nii_clusters_data = static_cast<int32_t*>(nii_clusters->data);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(nii_clusters_data + i) = *(nii_midgm_data + i) == 1;
     }
+    std::vector<uint32_t> cluster_sizes;
+    const uint32_t nr_clusters = ln_label_clusters(
+        nii_clusters_data, nii_clusters_data, size_x, size_y, size_z, 26,
+        cluster_sizes);
+    cout << "    Nr. of connected clusters within midgm input: "
+        << nr_clusters << endl;
     if (mode_debug) {
-        save_output_nifti(fout, "connected_clusters", nii_midgm, false);
+        save_output_nifti(fout, "connected_clusters", nii_clusters, false);
     }
 
     // ========================================================================
     // Find column centers through farthest flood distance
     // ========================================================================
     cout << "  Start generating columns..." << endl;
-    // Find the initial voxel
-    uint32_t start_voxel;
-    for (int32_t n = 2; n <= init_voxel_id; ++n) {
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);  // Map subset to full set
-            if (*(nii_midgm_data + i) == n) {
-                start_voxel = i;
-                *(nii_midgm_data + i) = 1;  // Reset midgm
-            }
+    ln_profile_stage("column centers");
+
+    // Distances to the closest center are kept in a running
+    // minimum field. Adding a center only re-propagates distances within the
+    // region that it gets closer to. The lowered distances go into a max-heap
+    // with lazy deletion, so the farthest voxel is found without scanning the
+    // whole domain for every new center.
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, dX, dY, dZ);
+    std::vector<float> min_dist(nr_voi, std::numeric_limits<float>::max());
+    std::vector<uint32_t> lowered;
+
+    typedef std::pair<float, uint32_t> dist_id;
+    // Farthest first, lowest index first among equal distances
+    auto nearer = [](const dist_id& a, const dist_id& b) {
+        return a.first < b.first || (a.first == b.first && a.second > b.second);
+    };
+    std::priority_queue<dist_id, std::vector<dist_id>, decltype(nearer)> farthest(nearer);
+
+    // Initial voxels are the last voxel of each cluster in RAM and the
+    // centroids given as input.
+    std::vector<uint32_t> cluster_last(nr_clusters + 1, 0);
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        cluster_last[*(nii_clusters_data + *(voi_id + ii))] = ii;
+    }
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        const uint32_t i = *(voi_id + ii);
+        if (cluster_last[*(nii_clusters_data + i)] == ii
+            || *(nii_columns_data + i) != 0) {
+            ln_update_geodesic_min_voi(grid, min_dist.data(), ii, &lowered);
         }
-        *(nii_midgm_data + start_voxel) = 2;  // Reduce to single initial voxel
     }
-
-    // Initialize new voxel
-    uint32_t new_voxel_id;
-    float flood_dist_thr = std::numeric_limits<float>::infinity();
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        farthest.push(dist_id(min_dist[ii], ii));
+    }
+    nifti_image_free(nii_clusters);
 
     // Loop until desired number of columns reached
-    for (int32_t n = max_column_id; n < nr_columns; ++n) {
+    for (int32_t n = max_column_id; n < nr_columns && !farthest.empty(); ++n) {
         cout << "\r    Column [" << n+1 << "/" << nr_columns << "]";
 
-        int32_t grow_step = 1;
-        voxel_counter = 1;
-        uint32_t ix, iy, iz, i, j;
-        float d;
-
-        // Initialize grow volume
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_midgm_data + i) == 2) {
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 0.;
-            } else if (*(flood_dist_data + i) >= flood_dist_thr
-                       && *(flood_dist_data + i) > 0) {
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
-                *(nii_midgm_data + i) = 1;
-            } else if (*(flood_dist_data + i) < flood_dist_thr
-                       && *(flood_dist_data + i) > 0) {
-                *(nii_midgm_data + i) = 0;  // no need to recompute
-            }
-        }
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                // Map subset to full set
-                i = *(voi_id + ii);
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_midgm_data + j) == 1) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                new_voxel_id = j;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
-        flood_dist_thr = *(flood_dist_data + new_voxel_id) / 2.;
-        *(nii_midgm_data + new_voxel_id) = 2;
-        *(nii_columns_data + new_voxel_id) = n+1;
-
-        // --------------------------------------------------------------------
-        // Find farthest point
-        float max_distance = 0;
-        int idx_new_point;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);
-            if (*(flood_dist_data + i) > max_distance) {
-                max_distance = *(flood_dist_data + i);
-                idx_new_point = i;
-            }
+        // Find farthest point, skipping entries of lowered distances
+        while (farthest.top().first != min_dist[farthest.top().second]) {
+            farthest.pop();
         }
+        const float max_distance = farthest.top().first;
+        const uint32_t ii_new_point = farthest.top().second;
         cout << " | Max. distance between points: " << max_distance << " [voxel dimension units]" << flush;
 
-        // --------------------------------------------------------------------
-        // Remove the initial voxel (reduces arbitrariness of the 1st point)
-        // NOTE(Faruk): This step guarantees to start from extrememums. The
-        // initial point is only used to determine an extremum distance.
-        // if (n == 0) {
-        //     *(nii_midgm_data + start_voxel) = 1;
-        //     // Also reset distances
-        //     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        //         *(flood_step_data + i) = 0.;
-        //         *(flood_dist_data + i) = 0.;
-        //     }
-        // }
+        *(nii_columns_data + *(voi_id + ii_new_point)) = n + 1;
+        lowered.clear();
+        ln_update_geodesic_min_voi(grid, min_dist.data(), ii_new_point, &lowered);
+        for (const uint32_t ii : lowered) {
+            farthest.push(dist_id(min_dist[ii], ii));
+        }
     }
     cout << endl;
 
     if (mode_debug) {
-        save_output_nifti(fout, "flood_step", flood_step, false);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            *(flood_dist_data + *(voi_id + ii)) = min_dist[ii];
+        }
         save_output_nifti(fout, "flood_dist", flood_dist, false);
     }
     // Add number of columns into the output tag
@@ -901,6 +348,7 @@ int main(int argc, char*  argv[]) {
     // but not borders, to avoid leakage across kissing gyri.
     // ========================================================================
     cout << "\n  Start Voronoi..." << endl;
+    ln_profile_stage("Voronoi");
 
     // ------------------------------------------------------------------------
     // Reduce number of looped-through voxels
@@ -936,8 +384,11 @@ int main(int argc, char*  argv[]) {
         }
     }
 
+    // TODO: Port to ln_grow_voronoi_voi once building an ln_voi_grid gets
+    // cheaper. The grid above only covers midgm, and a second one over rim 3
+    // costs more than this single growth saves.
     int32_t grow_step = 1;
-    voxel_counter = 1;
+    uint32_t voxel_counter = 1;
     uint32_t ix, iy, iz, i, j;
     float d;
     voxel_counter = nr_voxels;
@@ -1319,6 +770,7 @@ int main(int argc, char*  argv[]) {
     // Voronoi cell flood into borders of Rim file, if -include borders option is used.
     // ========================================================================
     if (mode_incl_borders) {
+        ln_profile_stage("include borders");
     // NOTE(Renzo): One-two iteration should be enough. I wouldn't know why
     // the border should be thicker than one voxel. I am only using direct
     // neighbors to avoid over overwriting values of closer neighbors.
@@ -1385,6 +837,9 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "voronoi_flood_dist", flood_dist, false);
     }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -13,6 +13,11 @@ int show_help(void) {
     "Options:\n"
     "    -help         : Show this help.\n"
     "    -input        : Binary nifti image (only consists of 0s and 1s).\n"
+    "    -connectivity : (Optional) Neighbourhood of connected voxels. '6' (faces),\n"
+    "                    '18' (faces and edges) or '26' (default, faces, edges\n"
+    "                    and corners).\n"
+    "    -sizes        : (Optional) Also save the number of voxels of each\n"
+    "                    cluster at its voxels (e.g. for cluster size thresholds).\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -22,7 +27,8 @@ int main(int argc, char*  argv[]) {
 
     nifti_image *nii1 = NULL;
     char *fin1 = NULL, *fout = NULL;
-    int ac;
+    int ac, connectivity = 26;
+    bool mode_sizes = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -36,6 +42,18 @@ int main(int argc, char*  argv[]) {
             }
             fin1 = argv[ac];
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-connectivity")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -connectivity\n");
+                return 1;
+            }
+            connectivity = atoi(argv[ac]);
+            if (connectivity != 6 && connectivity != 18 && connectivity != 26) {
+                fprintf(stderr, "** -connectivity has to be 6, 18 or 26\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[ac], "-sizes")) {
+            mode_sizes = true;
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -68,10 +86,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -79,265 +93,71 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_input = copy_nifti_as_int32(nii1);
     int32_t* nii_input_data = static_cast<int32_t*>(nii_input->data);
 
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            *(nii_input_data + i) = 1;
-            nr_voi += 1;
-        }
-    }
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
-
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_input_data + i) != 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
-    }
-
     // ========================================================================
     // Find connected clusters
     // ========================================================================
-    cout << "  Start finding connected clusters (3-jump neighbourhood)..." << endl;
-
-    // Loop until all clusters have one initial voxel
-    uint32_t voxel_counter = 0, prev_voxel_counter = 0;
-    int32_t init_voxel_id = 1;
-    bool terminate_switch1 = true;
-    while (terminate_switch1) {
-        uint32_t ix, iy, iz, i, j;
-        // cout << "  " << voxel_counter << "/" << nr_voi << flush;
-
-        if (voxel_counter == nr_voi) {
-            // Indicates all clusters are reached. Terminate condition.
-            terminate_switch1 = false;
-            cout << "    Nr. of connected clusters within midgm input: "
-                << init_voxel_id - 1 << endl;
-        } else if (voxel_counter == prev_voxel_counter) {
-            // Find the initial voxel for each disconnected cluster
-            uint32_t start_voxel;
-            for (uint32_t i = 0; i != nr_voxels; ++i) {
-                if (*(nii_input_data + i) == 1) {
-                    start_voxel = i;
-                }
-            }
-            voxel_counter += 1;
-            init_voxel_id += 1;
-            *(nii_input_data + start_voxel) = init_voxel_id;
-        }
-
-        while (prev_voxel_counter != voxel_counter) {
-            prev_voxel_counter = voxel_counter;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                // Map subset to full set
-                i = *(voi_id + ii);
-                if (*(nii_input_data + i) == init_voxel_id) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_input_data + j) == 1) {
-                            *(nii_input_data + j) = init_voxel_id;
-                        }
-                    }
-                }
-            }
-
-            // Count cluster assigned voxels
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(nii_input_data + i) > 1) {
-                    voxel_counter += 1;
-                }
-            }
-        }
+    cout << "  Start finding connected clusters (" << connectivity
+        << " neighbourhood)..." << endl;
+    std::vector<uint32_t> sizes;
+    const uint32_t nr_clusters = ln_label_clusters(
+        nii_input_data, nii_input_data, size_x, size_y, size_z, connectivity, sizes);
+
+    // Earlier versions seeded each next cluster at the last
+    // unlabeled voxel. Cluster ids are kept in that order, descending by the
+    // highest voxel index of each cluster, so that outputs do not change.
+    std::vector<uint32_t> last_voxel(nr_clusters + 1, 0);
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        last_voxel[nii_input_data[i]] = i;
+    }
+    std::vector<uint32_t> order(nr_clusters);
+    for (uint32_t c = 0; c != nr_clusters; ++c) {
+        order[c] = c + 1;
     }
-    cout << endl;
-    cout << "  Nr. connected clusters = " << init_voxel_id - 1 << endl;
+    std::sort(order.begin(), order.end(), [&last_voxel](uint32_t a, uint32_t b) {
+        return last_voxel[a] > last_voxel[b];
+    });
+    std::vector<int32_t> new_id(nr_clusters + 1, 0);
+    std::vector<uint32_t> new_sizes(nr_clusters + 1, 0);
+    for (uint32_t c = 0; c != nr_clusters; ++c) {
+        new_id[order[c]] = c + 1;
+        new_sizes[c + 1] = sizes[order[c]];
+    }
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        nii_input_data[i] = new_id[nii_input_data[i]];
+    }
+    sizes.swap(new_sizes);
 
-    // Make uniqute cluster ids start from 1 instead of 2
-    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-        uint32_t i = *(voi_id + ii);  // Map subset to full set
-        if (*(nii_input_data + i) != 0) {
-            *(nii_input_data + i) -= 1;
+    cout << "  Nr. connected clusters = " << nr_clusters << endl;
+    if (nr_clusters > 0) {
+        uint64_t nr_clustered = 0;
+        for (uint32_t c = 1; c <= nr_clusters; ++c) {
+            nr_clustered += sizes[c];
         }
+        cout << "    Largest cluster = " << *std::max_element(sizes.begin() + 1, sizes.end())
+            << " voxels" << endl;
+        cout << "    Smallest cluster = " << *std::min_element(sizes.begin() + 1, sizes.end())
+            << " voxels" << endl;
+        cout << "    Mean cluster size = " << static_cast<float>(nr_clustered) / nr_clusters
+            << " voxels" << endl;
     }
 
     // Add number of clusters into the output tag
     std::ostringstream tag;
-    tag << init_voxel_id - 1;
+    tag << nr_clusters;
     save_output_nifti(fout, "connected_clusters" + tag.str(), nii_input, true);
 
+    if (mode_sizes) {
+        nifti_image* nii_sizes = copy_nifti_as_int32(nii_input);
+        int32_t* nii_sizes_data = static_cast<int32_t*>(nii_sizes->data);
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            nii_sizes_data[i] = sizes[nii_input_data[i]];
+        }
+        save_output_nifti(fout, "connected_clusters" + tag.str() + "_sizes", nii_sizes, true);
+    }
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -444,6 +444,9 @@ int main(int argc, char* argv[]) {
 
     save_output_nifti(f_out, tag, nii_output, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
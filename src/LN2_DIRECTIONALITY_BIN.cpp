@@ -1089,6 +1089,9 @@ for (int paridx=0; paridx<Nr_parcels; ++paridx) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "output_columnarity", nii_columnarity, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
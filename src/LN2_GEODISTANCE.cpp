@@ -20,6 +20,9 @@ int show_help(void) {
     "                  file, but the user wants to only take e.g. all values that\n"
     "                  are '2' within the domain file.\n"
     "    -no_smooth : (Optional) Disable smoothing on distance metric.\n"
+    "    -threads   : (Optional) Number of threads used for smoothing and for\n"
+    "                 writing .nii.gz outputs. '1' by default. '0' uses all\n"
+    "                 available cores.\n"
     "    -output    : (Optional) Output basename for all outputs.\n"
     "\n"
     "\n");
@@ -33,7 +36,6 @@ int main(int argc, char*  argv[]) {
     bool use_outpath = false, mode_smooth = true, mode_init_val = false, mode_max_dist = false;
     int ac;
     float max_dist = std::numeric_limits<float>::max();
-    float temp_max_dist = 0;
     int init_val;
 
     // Process user options
@@ -68,6 +70,12 @@ int main(int argc, char*  argv[]) {
             }
             mode_init_val = true;
             init_val = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -113,23 +121,12 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     const float dX = nii1->pixdim[1];
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ========================================================================
     // Fix input datatype issues
     nifti_image* nii_init = copy_nifti_as_int32(nii1);
@@ -138,14 +135,11 @@ int main(int argc, char*  argv[]) {
     int32_t* nii_domain_data = static_cast<int32_t*>(nii_domain->data);
 
     // Prepare flood fill related nifti images
-    nifti_image* flood_step = copy_nifti_as_int32(nii_init);
-    int32_t* flood_step_data = static_cast<int32_t*>(flood_step->data);
     nifti_image* flood_dist = copy_nifti_as_float32(nii_init);
     float* flood_dist_data = static_cast<float*>(flood_dist->data);
 
     // Setting zero
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        *(flood_step_data + i) = 0;
         *(flood_dist_data + i) = 0;
     }
 
@@ -208,11 +202,6 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     cout << "\n  Finding geodesic distances..." << endl;
 
-    int32_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
-    uint32_t ix, iy, iz, i, j;
-    float d;
-
     // TODO(Faruk): Guesstimate an initial distance to axis lines. Probably
     // I can do this better by considering the local neighbourhood in the
     // future.
@@ -221,344 +210,26 @@ int main(int argc, char*  argv[]) {
     // Initialize grow volume
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(nii_init_data + i) != 0) {
-            *(flood_step_data + i) = 1.;
             *(flood_dist_data + i) = dist_to_axes;
         }
     }
 
-    while (voxel_counter != 0 && temp_max_dist < max_dist) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);  // Map subset to full set
-            if (*(flood_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // --------------------------------------------------------
-                // 1-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                // --------------------------------------------------------
-                // 2-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xy;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xy;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xy;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xy;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_yz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_yz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_yz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_yz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, dX, dY, dZ);
 
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-
-                // --------------------------------------------------------
-                // 3-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
+    std::vector<int32_t> flood_step(nr_voi);
+    std::vector<float> flood_dist_voi(nr_voi);
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
+        flood_step[ii] = *(nii_init_data + i) != 0 ? 1 : 0;
+        flood_dist_voi[ii] = *(flood_dist_data + i);
+    }
 
-                    if (*(nii_domain_data + j) > 0) {
-                        d = *(flood_dist_data + i) + dia_xyz;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                        }
-                    }
-                }
+    ln_grow_geodesic_voi(grid, NULL, flood_dist_voi.data(), flood_step.data(),
+                         NULL, NULL, false, max_dist);
 
-                // Update maximum distance reached
-                if (*(flood_dist_data + i) > temp_max_dist) {
-                    temp_max_dist = *(flood_dist_data + i);
-                }
-            }
-        }
-        grow_step += 1;
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        *(flood_dist_data + *(voi_id + ii)) = flood_dist_voi[ii];
     }
 
     if (mode_max_dist) {
@@ -575,6 +246,9 @@ int main(int argc, char*  argv[]) {
 
     save_output_nifti(fout, "geodistance", flood_dist, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -143,6 +143,9 @@ int main(int argc, char*  argv[]) {
     cout << "  Saving output..." << endl;
     save_output_nifti(fout, "gramag", nii_gramag, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -219,6 +219,9 @@ int main(int argc, char*  argv[]) {
     tag << radius;
     save_output_nifti(fout, "hexbins"+tag.str(), nii_bins, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
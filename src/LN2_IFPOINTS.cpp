@@ -112,23 +112,12 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     const float dX = nii1->pixdim[1];
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
@@ -185,377 +174,37 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     cout << "  Start generating points..." << endl;
 
+    // Distances to the closest point are kept in a running
+    // minimum field. Adding a point only re-propagates distances within the
+    // region that it gets closer to, instead of flooding the whole domain
+    // from all points again.
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, dX, dY, dZ);
+    const float unreached = std::numeric_limits<float>::max();
+    std::vector<float> min_dist(nr_voi, unreached);
+
     // Select first voxel in RAM within domain as the initial point
     uint32_t p = *(voi_id + 0);
     *(nii_points_data + p) = 1;
-    *(nii_domain_data + p) = 2;
+    ln_update_geodesic_min_voi(grid, min_dist.data(), 0);
 
     // Loop until desired number of points is reached
     for (int32_t n = 1; n < nr_points; ++n) {
         cout << "\r    Point [" << n+1 << "/" << nr_points << "]";
-        int32_t grow_step = 1;
-        uint32_t voxel_counter = nr_voxels;
-        uint32_t ix, iy, iz, i, j;
-        float d;
-
-        // Initialize grow volume
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_domain_data + i) == 2) {
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 0.;
-            } else {
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
-            }
-        }
-
-        // Reset some parameters
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
-        }
 
         // Find farthest point
         float max_distance = 0;
-        int idx_new_point;
+        uint32_t ii_new_point = 0;
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);
-            if (*(flood_dist_data + i) > max_distance) {
-                max_distance = *(flood_dist_data + i);
-                idx_new_point = i;
+            if (min_dist[ii] > max_distance && min_dist[ii] != unreached) {
+                max_distance = min_dist[ii];
+                ii_new_point = ii;
             }
         }
         cout << " | Max. distance between points: " << max_distance << " [voxel dimension units]" << flush;
 
-        *(nii_domain_data + idx_new_point) = 2;
-        *(nii_points_data + idx_new_point) = n + 1;
+        *(nii_points_data + *(voi_id + ii_new_point)) = n + 1;
+        ln_update_geodesic_min_voi(grid, min_dist.data(), ii_new_point);
     }
     cout << "\n" << endl;
 
@@ -575,370 +224,33 @@ int main(int argc, char*  argv[]) {
         *(nii_domain_data + i) = 1;
     }
 
-    // Initialize grow volume
+    // Voxels next to the outside of the domain only grow into their face
+    // neighbours
+    std::vector<uint8_t> outside(nr_voxels, 0);
+    uint8_t* outside_data = outside.data();
     for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_points_data + i) != 0) {
-            *(flood_step_data + i) = 1;
-            *(flood_dist_data + i) = 0;
-        } else {
-            *(flood_step_data + i) = 0;
-            *(flood_dist_data + i) = 0;
-        }
+        *(outside_data + i) = *(nii_domain_data + i) == 0;
     }
+    std::vector<uint8_t> jump_lock;
+    ln_voi_grid_face_lock(grid, outside.data(), jump_lock);
 
-    int32_t grow_step = 1;
-    uint32_t ix, iy, iz, i, j;
-    float d;
-    uint32_t voxel_counter = nr_voxels;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            i = *(voi_id + ii);
-            if (*(flood_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-                bool jump_lock = false;
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dX;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dY;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_domain_data + j) != 0) {
-                        d = *(flood_dist_data + i) + dZ;
-                        if (d < *(flood_dist_data + j)
-                            || *(flood_dist_data + j) == 0) {
-                            *(flood_dist_data + j) = d;
-                            *(flood_step_data + j) = grow_step + 1;
-                            *(nii_points_data + j) = *(nii_points_data + i);
-                        }
-                    } else {
-                        jump_lock = true;
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (jump_lock == false) {
-
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-
-                    // ------------------------------------------------------------
-                    // 3-jump neighbours
-                    // ------------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                        if (*(nii_domain_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(nii_points_data + j) = *(nii_points_data + i);
-                            }
-                        }
-                    }
-                }
-            }
+    // Initialize grow volume
+    std::vector<float> dist(nr_voi, 0);
+    std::vector<int32_t> step(nr_voi, 0);
+    std::vector<int32_t> cell(nr_voi, 0);
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        cell[ii] = *(nii_points_data + *(voi_id + ii));
+        if (cell[ii] != 0) {
+            step[ii] = 1;
         }
-        grow_step += 1;
+    }
+    ln_grow_voronoi_voi(grid, jump_lock.data(), dist.data(), step.data(), cell.data());
+
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);  // Map subset to full set
+        *(nii_points_data + i) = cell[ii];
+        *(flood_step_data + i) = step[ii];
+        *(flood_dist_data + i) = dist[ii];
     }
 
     if (mode_debug) {
@@ -948,6 +260,9 @@ int main(int argc, char*  argv[]) {
     // Add number of points into the output tag
     save_output_nifti(fout, "cells"+tag.str(), nii_points, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
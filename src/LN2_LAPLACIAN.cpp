@@ -191,6 +191,9 @@ int main(int argc, char*  argv[]) {
     cout << "  Saving output..." << endl;
     save_output_nifti(fout, "laplacian", nii_laplacian, true);
     
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -245,6 +245,9 @@ int main(int argc, char*  argv[]) {
     if (!use_outpath) fout = fin1;
     save_output_nifti(fout, "layerdim", layerdim, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
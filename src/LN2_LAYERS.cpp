@@ -6,12 +6,13 @@
 // NOTE(Faruk): Might be better to use step 1 id's to define columns.
 
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 #include <limits>
 #include <vector>
 #include <algorithm>
 
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_LAYERS: Generates equi-distant cortical gray matter layers with\n"
     "            an option to also generate equi-volume layers.\n"
@@ -54,6 +55,15 @@ int show_help(void) {
     "                    Useful for ~0.8 mm inputs where no upsampling is done.\n"
     "    -no_smooth    : (Optional) Disable smoothing on cortical depth metric.\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
+    "    -legacy_grow  : (Optional) Use the older wavefront growth (rescans all\n"
+    "                    rim voxels at every step) instead of the active\n"
+    "                    front growth. Slower. Outputs are identical, only\n"
+    "                    useful for regression comparisons.\n"
+    "    -profile      : (Optional) Write the time and memory use of each stage\n"
+    "                    to 'LN2_LAYERS_profile.json' at exit.\n"
+    "    -threads      : (Optional) Number of threads used for smoothing and for\n"
+    "                    writing .nii.gz outputs. '1' by default. '0' uses all\n"
+    "                    available cores.\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n"
     "Notes:\n"
@@ -65,7 +75,7 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char*  argv[]) {
+int ln2_layers_run(int argc, char*  argv[]) {
 
     nifti_image *nii1 = NULL;
     char *fin = NULL, *fout = NULL;
@@ -74,6 +84,7 @@ int main(int argc, char*  argv[]) {
     bool mode_equivol = false, mode_debug = false, mode_incl_borders = false;
     bool mode_curvature =false, mode_streamlines = false, mode_smooth = true;
     bool mode_thickness = false, mode_equal_counts = false;
+    bool mode_legacy_grow = false;
 
     // Process user options
     if (argc < 2) return show_help();
@@ -101,6 +112,12 @@ int main(int argc, char*  argv[]) {
             }
         } else if (!strcmp(argv[ac], "-equivol")) {
             mode_equivol = true;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -121,6 +138,10 @@ int main(int argc, char*  argv[]) {
             mode_smooth = false;
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
+        } else if (!strcmp(argv[ac], "-legacy_grow")) {
+            mode_legacy_grow = true;
+        } else if (!strcmp(argv[ac], "-profile")) {
+            ln_set_profile("");
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -132,15 +153,26 @@ int main(int argc, char*  argv[]) {
         return 1;
     }
 
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin, 1);
+    // Read input dataset, cropped to the bounding box of the rim. All scratch
+    // images below are allocated in this box, which keeps memory low for small
+    // rims in large images.
+    ln_profile_stage("read inputs");
+    ln_crop crop;
+    if (!ln_crop_find(crop, {fin})) {
+        return 2;
+    }
+    nii1 = ln_read_cropped(fin, crop);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
+        ln_crop_free(crop);
         return 2;
     }
+    // Outputs are written in the full field of view
+    ln_set_output_crop(&crop);
 
     log_welcome("LN2_LAYERS");
     log_nifti_descriptives(nii1);
+    log_crop_descriptives(crop);
 
     cout << "  Nr. layers: " << nr_layers << endl;
 
@@ -149,28 +181,18 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     const float dX = nii1->pixdim[1];
     const float dY = nii1->pixdim[2];
     const float dZ = nii1->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
-    // Long diagonals
-    const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
     // ========================================================================
     // Fix input datatype issues
+    ln_profile_stage("prepare rim");
     nifti_image* nii_rim = copy_nifti_as_int16(nii1);
     int16_t* nii_rim_data = static_cast<int16_t*>(nii_rim->data);
-    free(nii1);
+    nifti_image_free(nii1);
 
     // ------------------------------------------------------------------------
     // NOTE(Faruk): This section is written to constrain voxel visits
@@ -204,13 +226,13 @@ int main(int argc, char*  argv[]) {
         *(nii_layers_data + i) = 0;
     }
 
-    nifti_image* innerGM_step = copy_nifti_as_int16(nii_layers);
-    int16_t* innerGM_step_data = static_cast<int16_t*>(innerGM_step->data);
+    nifti_image* innerGM_step = copy_nifti_as_int32(nii_layers);
+    int32_t* innerGM_step_data = static_cast<int32_t*>(innerGM_step->data);
     nifti_image* innerGM_dist = copy_nifti_as_float32(nii_layers);
     float* innerGM_dist_data = static_cast<float*>(innerGM_dist->data);
 
-    nifti_image* outerGM_step = copy_nifti_as_int16(nii_layers);
-    int16_t* outerGM_step_data = static_cast<int16_t*>(outerGM_step->data);
+    nifti_image* outerGM_step = copy_nifti_as_int32(nii_layers);
+    int32_t* outerGM_step_data = static_cast<int32_t*>(outerGM_step->data);
     nifti_image* outerGM_dist = copy_nifti_as_float32(nii_layers);
     float* outerGM_dist_data = static_cast<float*>(outerGM_dist->data);
 
@@ -246,831 +268,112 @@ int main(int argc, char*  argv[]) {
     nifti_image* curvature = copy_nifti_as_float32(nii_layers);
     float* curvature_data = static_cast<float*>(curvature->data);
 
+    // Sparse neighbourhood of the rim voxels, shared by both growths
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, dX, dY, dZ);
+
+    // Growth scratch data is only kept for the voxels of interest
+    std::vector<uint8_t> grow_mask(nr_voi);
+    std::vector<float> grow_dist(nr_voi);
+    std::vector<int32_t> grow_step(nr_voi), grow_id(nr_voi), grow_prevstep(nr_voi);
+    uint32_t j, k;
+
     // ========================================================================
     // Grow from WM
     // ========================================================================
     cout << "\n  Start growing from inner GM (WM-facing border)..." << endl;
+    ln_profile_stage("grow inner GM");
 
     // Initialize grow volume
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
         if (*(nii_rim_data + i) == 2) {  // WM boundary voxels within GM
-            *(innerGM_step_data + i) = 1;
-            *(innerGM_dist_data + i) = 0.;
-            *(innerGM_id_data + i) = i;
+            grow_step[ii] = 1;
+            grow_id[ii] = i;
         } else {
-            *(innerGM_step_data + i) = 0.;
-            *(innerGM_dist_data + i) = 0.;
+            grow_step[ii] = 0;
         }
+        grow_dist[ii] = 0.;
+        grow_prevstep[ii] = -1;
+        // Voxels that can be reached from inner GM
+        grow_mask[ii] = *(nii_rim_data + i) == 3 || *(nii_rim_data + i) == 1;
     }
+    ln_grow_geodesic_voi(grid, grow_mask.data(), grow_dist.data(), grow_step.data(),
+                         grow_id.data(), grow_prevstep.data(), mode_legacy_grow);
 
-    uint16_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
-    uint32_t ix, iy, iz, j, k;
-    float d;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
-
-            if (*(innerGM_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dX;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dX;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dY;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dY;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dZ;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dZ;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xy;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_yz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 1 ) {
-                        d = *(innerGM_dist_data + i) + dia_xyz;
-                        if (d < *(innerGM_dist_data + j)
-                            || *(innerGM_dist_data + j) == 0) {
-                            *(innerGM_dist_data + j) = d;
-                            *(innerGM_step_data + j) = grow_step + 1;
-                            *(innerGM_id_data + j) = *(innerGM_id_data + i);
-                            *(innerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-            }
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(innerGM_step_data + i) = 0;
+        *(innerGM_dist_data + i) = 0.;
+    }
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
+        *(innerGM_step_data + i) = grow_step[ii];
+        *(innerGM_dist_data + i) = grow_dist[ii];
+        if (grow_step[ii] != 0) {
+            *(innerGM_id_data + i) = grow_id[ii];
+        }
+        if (grow_prevstep[ii] >= 0) {
+            *(innerGM_prevstep_id_data + i) = *(voi_id + grow_prevstep[ii]);
         }
-        grow_step += 1;
     }
     if (mode_debug) {
         save_output_nifti(fout, "innerGM_step", innerGM_step, false);
         save_output_nifti(fout, "innerGM_dist", innerGM_dist, false);
-        save_output_nifti(fout, "innerGM_id", innerGM_id, false);
+        nifti_image* innerGM_id_full = ln_crop_ids_to_full(crop, innerGM_id);
+        save_output_nifti(fout, "innerGM_id", innerGM_id_full, false);
+        nifti_image_free(innerGM_id_full);
     }
 
     // ========================================================================
     // Grow from CSF
     // ========================================================================
     cout << "\n  Start growing from outer GM..." << endl;
+    ln_profile_stage("grow outer GM");
 
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
         if (*(nii_rim_data + i) == 1) {
-            *(outerGM_step_data + i) = 1.;
-            *(outerGM_dist_data + i) = 0.;
-            *(outerGM_id_data + i) = i;
+            grow_step[ii] = 1;
+            grow_id[ii] = i;
         } else {
-            *(outerGM_step_data + i) = 0.;
-            *(outerGM_dist_data + i) = 0.;
+            grow_step[ii] = 0;
         }
+        grow_dist[ii] = 0.;
+        grow_prevstep[ii] = -1;
+        // Voxels that can be reached from outer GM
+        grow_mask[ii] = *(nii_rim_data + i) == 3 || *(nii_rim_data + i) == 2;
     }
+    ln_grow_geodesic_voi(grid, grow_mask.data(), grow_dist.data(), grow_step.data(),
+                         grow_id.data(), grow_prevstep.data(), mode_legacy_grow);
 
-    grow_step = 1, voxel_counter = nr_voxels;
-    while (voxel_counter != 0) {
-        voxel_counter = 0;
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            uint32_t i = *(voi_id + ii);
-
-            if (*(outerGM_step_data + i) == grow_step) {
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                voxel_counter += 1;
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dX;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dX;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dY;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dY;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dZ;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dZ;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xy;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_yz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                    if (*(nii_rim_data + j) == 3 || *(nii_rim_data + j) == 2 ) {
-                        d = *(outerGM_dist_data + i) + dia_xyz;
-                        if (d < *(outerGM_dist_data + j)
-                            || *(outerGM_dist_data + j) == 0) {
-                            *(outerGM_dist_data + j) = d;
-                            *(outerGM_step_data + j) = grow_step + 1;
-                            *(outerGM_id_data + j) = *(outerGM_id_data + i);
-                            *(outerGM_prevstep_id_data + j) = i;
-                        }
-                    }
-                }
-            }
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(outerGM_step_data + i) = 0;
+        *(outerGM_dist_data + i) = 0.;
+    }
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        uint32_t i = *(voi_id + ii);
+        *(outerGM_step_data + i) = grow_step[ii];
+        *(outerGM_dist_data + i) = grow_dist[ii];
+        if (grow_step[ii] != 0) {
+            *(outerGM_id_data + i) = grow_id[ii];
+        }
+        if (grow_prevstep[ii] >= 0) {
+            *(outerGM_prevstep_id_data + i) = *(voi_id + grow_prevstep[ii]);
         }
-        grow_step += 1;
     }
     if (mode_debug) {
         save_output_nifti(fout, "outerGM_step", outerGM_step, false);
         save_output_nifti(fout, "outerGM_dist", outerGM_dist, false);
-        save_output_nifti(fout, "outerGM_id", outerGM_id, false);
+        nifti_image* outerGM_id_full = ln_crop_ids_to_full(crop, outerGM_id);
+        save_output_nifti(fout, "outerGM_id", outerGM_id_full, false);
+        nifti_image_free(outerGM_id_full);
     }
 
     // ========================================================================
     // Layers
     // ========================================================================
     cout << "\n  Start layering (equi-distant)..." << endl;
+    ln_profile_stage("equidistant layers");
     float x, y, z, wm_x, wm_y, wm_z, gm_x, gm_y, gm_z;
 
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
@@ -1136,10 +439,11 @@ int main(int argc, char*  argv[]) {
                 *(temp_mask_data + i) = 1;
             }
         }
-        normdist = iterative_smoothing(normdist, 3, temp_mask, 1);
+        nifti_image* normdist_smooth = iterative_smoothing(normdist, 3, temp_mask, 1);
+        nifti_image_free(normdist);
+        normdist = normdist_smooth;
         normdist_data = static_cast<float*>(normdist->data);
-        free(temp_mask_data);
-        free(temp_mask);
+        nifti_image_free(temp_mask);
     }
     // ------------------------------------------------------------------------
     // Quantize metric file to get layers
@@ -1184,6 +488,7 @@ int main(int argc, char*  argv[]) {
             }
         }
         save_output_nifti(fout, "layers_equicount", nii_binlayers);
+        nifti_image_free(nii_binlayers);
     }
 
     // ------------------------------------------------------------------------
@@ -1220,6 +525,7 @@ int main(int argc, char*  argv[]) {
     // Middle gray matter
     // ========================================================================
     cout << "\n  Start finding middle gray matter (equi-distant)..." << endl;
+    ln_profile_stage("middle GM");
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
         uint32_t i = *(voi_id + ii);
 
@@ -1280,6 +586,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Columns
     // ========================================================================
+    ln_profile_stage("columns");
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
         uint32_t i = *(voi_id + ii);
 
@@ -1311,6 +618,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     // Find Middle Gray Matter centroids
     // ========================================================================
+    ln_profile_stage("middle GM centroids");
     // NOTE(Faruk): I am a bit sluggish with memory usage here. Might optimize
     // later by switching nifti images to vectors.
     nifti_image* coords_x = copy_nifti_as_float32(nii_rim);
@@ -1376,8 +684,12 @@ int main(int argc, char*  argv[]) {
         }
     }
     if (mode_debug) {
-        save_output_nifti(fout, "midGM_equidist_id", midGM_id, false);
-        save_output_nifti(fout, "columns", midGM_centroid_id, false);
+        nifti_image* midGM_id_full = ln_crop_ids_to_full(crop, midGM_id);
+        save_output_nifti(fout, "midGM_equidist_id", midGM_id_full, false);
+        nifti_image_free(midGM_id_full);
+        nifti_image* midGM_centroid_id_full = ln_crop_ids_to_full(crop, midGM_centroid_id);
+        save_output_nifti(fout, "columns", midGM_centroid_id_full, false);
+        nifti_image_free(midGM_centroid_id_full);
     }
 
     // ========================================================================
@@ -1385,6 +697,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     if (mode_equivol) {
         cout << "\n  Start equi-volume stage..." << endl;
+        ln_profile_stage("equivol layers");
 
         nifti_image* hotspots_i = copy_nifti_as_float32(nii_rim);
         float* hotspots_i_data = static_cast<float*>(hotspots_i->data);
@@ -1434,6 +747,7 @@ int main(int argc, char*  argv[]) {
         // Compute equi-volume factors
         // --------------------------------------------------------------------
         cout << "\n  Start computing equi-volume factors..." << endl;
+        ln_profile_stage("equivol factors");
         nifti_image* equivol_factors = copy_nifti_as_float32(nii_rim);
         float* equivol_factors_data = static_cast<float*>(equivol_factors->data);
         for (uint32_t i = 0; i != nr_voxels; ++i) {
@@ -1469,11 +783,12 @@ int main(int argc, char*  argv[]) {
         // Smooth equi-volume factors for seamless transitions
         // --------------------------------------------------------------------
         cout << "\n  Start smoothing equi-volume transitions..." << endl;
+        ln_profile_stage("equivol smoothing");
 
         nifti_image* equivol_factors_smooth = iterative_smoothing(
             equivol_factors, iter_smooth, nii_rim, 3);
         float* equivol_factors_smooth_data = static_cast<float*>(equivol_factors_smooth->data);
-        free(equivol_factors);
+        nifti_image_free(equivol_factors);
 
         if (mode_debug) {
             save_output_nifti(fout, "equivol_factors_smooth", equivol_factors_smooth, false);
@@ -1483,6 +798,7 @@ int main(int argc, char*  argv[]) {
         // Apply equi-volume factors
         // --------------------------------------------------------------------
         cout << "\n  Start final layering..." << endl;
+        ln_profile_stage("equivol final layering");
         float d1_new, d2_new, a, b;
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             uint32_t i = *(voi_id + ii);
@@ -1553,10 +869,11 @@ int main(int argc, char*  argv[]) {
                     *(temp_mask_data + i) = 1;
                 }
             }
-            normdistdiff = iterative_smoothing(normdistdiff, 3, temp_mask, 1);
+            nifti_image* normdistdiff_smooth = iterative_smoothing(normdistdiff, 3, temp_mask, 1);
+            nifti_image_free(normdistdiff);
+            normdistdiff = normdistdiff_smooth;
             normdistdiff_data = static_cast<float*>(normdistdiff->data);
-            free(temp_mask_data);
-            free(temp_mask);
+            nifti_image_free(temp_mask);
         }
         // --------------------------------------------------------------------
         // Quantize metric file to get layers
@@ -1600,6 +917,7 @@ int main(int argc, char*  argv[]) {
                 }
             }
             save_output_nifti(fout, "layerbins_equivol", nii_bineqlayers);
+            nifti_image_free(nii_bineqlayers);
         }
 
         // --------------------------------------------------------------------
@@ -1631,6 +949,7 @@ int main(int argc, char*  argv[]) {
         // Middle gray matter for equi-volume
         // ====================================================================
         cout << "\n  Start finding middle gray matter (equi-volume)..." << endl;
+        ln_profile_stage("middle GM equivol");
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             uint32_t i = *(voi_id + ii);
 
@@ -1699,6 +1018,10 @@ int main(int argc, char*  argv[]) {
             }
         }
         save_output_nifti(fout, "midGM_equivol", midGM, true);
+
+        nifti_image_free(hotspots_i);
+        nifti_image_free(hotspots_o);
+        nifti_image_free(equivol_factors_smooth);
     }
 
     // ========================================================================
@@ -1706,6 +1029,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     if (mode_thickness) {
         cout << "\n  Start saving cortical thickness..." << endl;
+        ln_profile_stage("thickness");
         for (uint32_t i = 0; i != nr_voxels; ++i) {
             *(innerGM_dist_data + i) += *(outerGM_dist_data + i);
         }
@@ -1722,8 +1046,7 @@ int main(int argc, char*  argv[]) {
         nifti_image* thickness = iterative_smoothing(
             innerGM_dist, iter_smooth, temp_mask, 1);
         float* thickness_data = static_cast<float*>(thickness->data);
-        free(temp_mask_data);
-        free(temp_mask);
+        nifti_image_free(temp_mask);
 
         // --------------------------------------------------------------------
         // Handle include borders type
@@ -1737,8 +1060,7 @@ int main(int argc, char*  argv[]) {
             }
         }
         save_output_nifti(fout, "thickness", thickness, true);
-        free(thickness);
-        free(thickness_data);
+        nifti_image_free(thickness);
     }
 
     // ========================================================================
@@ -1746,6 +1068,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     if (mode_streamlines) {
         cout << "\n  Start saving streamline vectors..." << endl;
+        ln_profile_stage("streamlines");
 
         // Prepare a 4D nifti for streamline vectors
         nifti_image* svec = nifti_copy_nim_info(normdist);
@@ -1807,10 +1130,11 @@ int main(int argc, char*  argv[]) {
         }
         // --------------------------------------------------------------------
         cout << "\n  Start smoothing streamline vector components..." << endl;
-        svec = iterative_smoothing(svec, iter_smooth, nii_rim, 3);
+        nifti_image* svec_smooth = iterative_smoothing(svec, iter_smooth, nii_rim, 3);
+        nifti_image_free(svec);
         // --------------------------------------------------------------------
-        save_output_nifti(fout, "streamline_vectors", svec, true);
-        free(svec);
+        save_output_nifti(fout, "streamline_vectors", svec_smooth, true);
+        nifti_image_free(svec_smooth);
     }
 
     // ========================================================================
@@ -1831,6 +1155,7 @@ int main(int argc, char*  argv[]) {
     // --------------------------------------------------------------------
     if (mode_curvature) {
         cout << "\n  Start smoothing curvature..." << endl;
+        ln_profile_stage("curvature smoothing");
 
         nifti_image* curvature_smooth = iterative_smoothing(
             curvature, iter_smooth, nii_rim, 3);
@@ -1862,8 +1187,44 @@ int main(int argc, char*  argv[]) {
             }
         }
         save_output_nifti(fout, "curvature_binned", nii_columns, true);
+        nifti_image_free(curvature_smooth);
     }
 
+    nifti_image_free(nii_rim);
+    nifti_image_free(nii_layers);
+    nifti_image_free(innerGM_step);
+    nifti_image_free(innerGM_dist);
+    nifti_image_free(outerGM_step);
+    nifti_image_free(outerGM_dist);
+    nifti_image_free(innerGM_id);
+    nifti_image_free(outerGM_id);
+    nifti_image_free(innerGM_prevstep_id);
+    nifti_image_free(outerGM_prevstep_id);
+    nifti_image_free(normdist);
+    nifti_image_free(normdistdiff);
+    nifti_image_free(nii_columns);
+    nifti_image_free(midGM);
+    nifti_image_free(midGM_id);
+    nifti_image_free(hotspots);
+    nifti_image_free(curvature);
+    nifti_image_free(coords_x);
+    nifti_image_free(coords_y);
+    nifti_image_free(coords_z);
+    nifti_image_free(coords_count);
+    nifti_image_free(centroid);
+    nifti_image_free(midGM_centroid_id);
+    free(voi_id);
+    ln_crop_free(crop);
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char*  argv[]) {
+    return ln2_layers_run(argc, argv);
+}
+#endif
@@ -5,8 +5,9 @@
 // TODO(Renzo): make the vicinity direction specific vinc_x, vinc_y, vinc_z
 
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_LAYER_SMOOTH : Layering algorithm based on iterative smoothing.\n"
     "\n"
@@ -33,13 +34,102 @@ int show_help(void) {
     "                  is best done with not too many layers. Otherwise a \n"
     "                  single layer has holes and is not connected.\n"
     "                  !!!WARNING!!! this option is not well tested for version 1.5\n"
+    "    -threads    : (Optional) Number of threads used for smoothing within\n"
+    "                  layers and for writing .nii.gz outputs. '1' by default.\n"
+    "                  '0' uses all available cores.\n"
     "    -output     : (Optional) Output filename, including .nii or\n"
     "                  .nii.gz, and path if needed. Overwrites existing files.\n"    
     "\n");
     return 0;
 }
 
-int main(int argc, char* argv[]) {
+// ============================================================================
+// Smooth every voxel within its own layer, visiting the slices
+// z_begin, z_begin + z_step, ... Kernel weights are looked up by voxel offset.
+// Input and output are voxel-major (all volumes of a voxel are contiguous), so
+// the neighbourhood of a voxel is found once and applied to every volume.
+static void layer_smooth_slices(const float* input, const int32_t* layer,
+                                float* smooth, const float* kernel, const int vic,
+                                const int size_x, const int size_y, const int size_z,
+                                const int64_t nr_vols, const int z_begin, const int z_step,
+                                const bool log_progress) {
+    const int nx = size_x;
+    const int nxy = size_x * size_y;
+    const int kernel_w = 2 * vic + 1;
+    int prev_n = 0;
+
+    // Neighbours of the current voxel and their weights
+    vector<int> nbr_j;
+    vector<float> nbr_w;
+    vector<float> sum_val(nr_vols);
+    nbr_j.reserve(kernel_w * kernel_w * kernel_w);
+    nbr_w.reserve(kernel_w * kernel_w * kernel_w);
+
+    for (int iz = z_begin; iz < size_z; iz += z_step) {
+        if (log_progress) {
+            int n = (iz * 100) / size_z;
+            if (n != prev_n) {
+                cout << "\r    " << n <<  "%" << flush;
+                prev_n = n;
+            }
+        }
+        const int jz_start = max(0, iz - vic);
+        const int jz_stop = min(iz + vic, size_z - 1);
+
+        for (int iy = 0; iy < size_y; ++iy) {
+            const int jy_start = max(0, iy - vic);
+            const int jy_stop = min(iy + vic, size_y - 1);
+
+            for (int ix = 0; ix < size_x; ++ix) {
+                const int64_t voxel_i = nxy * iz + nx * iy + ix;
+                const int32_t layer_i = *(layer + voxel_i);
+                if (layer_i <= 0) {
+                    for (int t = 0; t < nr_vols; ++t) {
+                        *(smooth + nr_vols * voxel_i + t) = *(input + nr_vols * voxel_i + t);
+                    }
+                    continue;
+                }
+                const int jx_start = max(0, ix - vic);
+                const int jx_stop = min(ix + vic, size_x - 1);
+
+                nbr_j.clear();
+                nbr_w.clear();
+                float sum_w = 0;
+                for (int jz = jz_start; jz <= jz_stop; ++jz) {
+                    for (int jy = jy_start; jy <= jy_stop; ++jy) {
+                        const int64_t row_j = nxy * jz + nx * jy;
+                        // Kernel row shifted so that it is indexed by jx
+                        const float* kernel_row = kernel
+                            + ((jz - iz + vic) * kernel_w + (jy - iy + vic)) * kernel_w
+                            + vic - ix;
+                        for (int jx = jx_start; jx <= jx_stop; ++jx) {
+                            if (*(layer + row_j + jx) == layer_i) {
+                                nbr_j.push_back(row_j + jx);
+                                nbr_w.push_back(kernel_row[jx]);
+                                sum_w += kernel_row[jx];
+                            }
+                        }
+                    }
+                }
+
+                // Weighted sum of the neighbours for all volumes at once
+                std::fill(sum_val.begin(), sum_val.end(), 0);
+                for (size_t k = 0; k != nbr_j.size(); ++k) {
+                    const float* input_j = input + nr_vols * nbr_j[k];
+                    const float g = nbr_w[k];
+                    for (int t = 0; t < nr_vols; ++t) {
+                        sum_val[t] += input_j[t] * g;
+                    }
+                }
+                for (int t = 0; t < nr_vols; ++t) {
+                    *(smooth + nr_vols * voxel_i + t) = sum_val[t] / sum_w;
+                }
+            }
+        }
+    }
+}
+
+int ln2_layer_smooth_run(int argc, char* argv[]) {
     bool use_outpath = false ;
     char *fout = NULL ;
     char *f_input = NULL, *f_layer = NULL;
@@ -78,6 +168,12 @@ int main(int argc, char* argv[]) {
         } else if (!strcmp(argv[ac], "-mask")) {
             do_masking = 1;
             cout << "Set voxels to zero outside layers (mask option)"  << endl;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -100,8 +196,9 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Read inputs including data
-    nifti_image* nii1 = nifti_image_read(f_input, 1);
+    // Read inputs including data. The (possibly 4D) input is converted to
+    // float32 while it is read, to not hold two copies of it in memory.
+    nifti_image* nii1 = ln_read_as_float32(f_input);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", f_input);
         return 2;
@@ -110,6 +207,7 @@ int main(int argc, char* argv[]) {
     nifti_image* nii2 = nifti_image_read(f_layer, 1);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", f_layer);
+        nifti_image_free(nii1);
         return 2;
     }
 
@@ -123,7 +221,8 @@ int main(int argc, char* argv[]) {
     const int size_y = nii2->ny;
     const int nx = nii2->nx;
     const int nxy = nii2->nx * nii2->ny;
-    const int nr_voxels = size_z * size_y * size_x;
+    const int64_t nr_voxels = size_z * size_y * size_x;
+    const int64_t nr_vols = nii1->nvox / nr_voxels;  // e.g. timepoints
     const float dX = nii2->pixdim[1];
     const float dY = nii2->pixdim[2];
     float dZ = nii2->pixdim[3];
@@ -133,7 +232,7 @@ int main(int argc, char* argv[]) {
 
     // ========================================================================
     // Fix datatype issues
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
+    nifti_image* nii_input = nii1;
     float *nii_input_data = static_cast<float*>(nii_input->data);
     nifti_image* nii_layer = copy_nifti_as_int32(nii2);
     int32_t *nii_layer_data = static_cast<int32_t*>(nii_layer->data);
@@ -141,13 +240,13 @@ int main(int argc, char* argv[]) {
     // Allocate new niftis
     nifti_image *nii_smooth = copy_nifti_as_float32(nii_input);
     float *nii_smooth_data = static_cast<float*>(nii_smooth->data);
-    nifti_image* nii_gaussw = copy_nifti_as_float32(nii_input);
-    float *nii_gaussw_data = static_cast<float*>(nii_gaussw->data);
+    // Gaussian weights are the same across volumes
+    std::vector<float> gaussw(nr_voxels, 0);
+    float *nii_gaussw_data = gaussw.data();
 
     // Zero new images
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels * nr_vols; ++i) {
         *(nii_smooth_data + i) = 0;
-        *(nii_gaussw_data + i) = 0;
     }
 
     // ========================================================================
@@ -160,7 +259,7 @@ int main(int argc, char* argv[]) {
     // Find number of layers //
     ///////////////////////////
     int32_t nr_layers = 0;
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         if (*(nii_layer_data + i) > nr_layers) {
             nr_layers = *(nii_layer_data + i);
         }
@@ -172,7 +271,7 @@ int main(int argc, char* argv[]) {
     ////////////////////
     // For time estimation
     int nr_vox_to_loop = 0, idx = 0, prev_n = 0;
-    for (int i = 0; i < nr_voxels; ++i) {
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         if (*(nii_layer_data + i) > 0) {
             nr_vox_to_loop++;
         }
@@ -180,47 +279,62 @@ int main(int argc, char* argv[]) {
 
     if (sulctouch == 0) {
         cout << "  Smoothing in layer, not considering sulci." << endl;
-        for (int iz = 0; iz < size_z; ++iz) {
-            for (int iy = 0; iy < size_y; ++iy) {
-                for (int ix = 0; ix < size_x; ++ix) {
-                    int voxel_i = nxy * iz + nx * iy + ix;
-                    int layer_i = *(nii_layer_data + voxel_i);
 
-                    if (layer_i > 0) {
-                        idx += 1;
-                        int n = (idx * 100) / nr_vox_to_loop;
-                        if (n != prev_n) {
-                            cout << "\r    " << n <<  "%" << flush;
-                            prev_n = n;
-                        }
+        // Kernel weights only depend on the voxel offset, not on the position
+        const int kernel_w = 2 * vic + 1;
+        vector<float> kernel(kernel_w * kernel_w * kernel_w);
+        for (int kz = -vic; kz <= vic; ++kz) {
+            for (int ky = -vic; ky <= vic; ++ky) {
+                for (int kx = -vic; kx <= vic; ++kx) {
+                    float d = dist(0, 0, 0, (float)kx, (float)ky, (float)kz,
+                                   dX, dY, dZ);
+                    kernel[((kz + vic) * kernel_w + (ky + vic)) * kernel_w
+                           + (kx + vic)] = gaus(d, FWHM_val);
+                }
+            }
+        }
 
-                        int jz_start = max(0, iz - vic);
-                        int jz_stop = min(iz + vic, size_z - 1);
-                        int jy_start = max(0, iy - vic);
-                        int jy_stop = min(iy + vic, size_y - 1);
-                        int jx_start = max(0, ix - vic);
-                        int jx_stop = min(ix + vic, size_x - 1);
+        // Reorder volumes to be contiguous per voxel. The reordered input is
+        // kept in the output image and smoothed into the input image, which
+        // is not needed afterwards, so no further copies of the data are made.
+        float* input_vm = nii_input_data;
+        float* smooth_vm = nii_smooth_data;
+        if (nr_vols > 1) {
+            cout << "  Smoothing " << nr_vols << " volumes." << endl;
+            for (int t = 0; t < nr_vols; ++t) {
+                for (int64_t i = 0; i < nr_voxels; ++i) {
+                    *(nii_smooth_data + nr_vols * i + t) = *(nii_input_data + nr_voxels * t + i);
+                }
+            }
+            input_vm = nii_smooth_data;
+            smooth_vm = nii_input_data;
+        }
 
-                        for (int jz = jz_start; jz <= jz_stop; ++jz) {
-                            for (int jy = jy_start; jy <= jy_stop; ++jy) {
-                                for (int jx = jx_start; jx <= jx_stop; ++jx) {
-                                    int voxel_j = nxy * jz + nx * jy + jx;
-                                    if (*(nii_layer_data + voxel_j) == layer_i) {
-                                        float d = dist((float)ix, (float)iy, (float)iz,
-                                                       (float)jx, (float)jy, (float)jz,
-                                                       dX, dY, dZ);
-                                        float g = gaus(d, FWHM_val);
-                                        *(nii_smooth_data + voxel_i) += *(nii_input_data + voxel_j) * g;
-                                        *(nii_gaussw_data + voxel_i) += g;
-                                    }
-                                }
-                            }
-                        }
-                        // Normalize
-                        *(nii_smooth_data + voxel_i) /= *(nii_gaussw_data + voxel_i);
-                    } else {
-                        *(nii_smooth_data + voxel_i) = *(nii_input_data + voxel_i);
-                    }
+        // Slices are interleaved across threads so that the
+        // work is balanced even when layers only cover part of the slab.
+        const int nr_threads = max(1, min(ln_get_nr_threads(), size_z));
+        if (nr_threads == 1) {
+            layer_smooth_slices(input_vm, nii_layer_data, smooth_vm,
+                                kernel.data(), vic, size_x, size_y, size_z,
+                                nr_vols, 0, 1, true);
+        } else {
+            cout << "  Using " << nr_threads << " threads." << endl;
+            vector<std::thread> threads;
+            for (int n_th = 0; n_th != nr_threads; ++n_th) {
+                threads.push_back(std::thread(
+                    layer_smooth_slices, input_vm, nii_layer_data, smooth_vm,
+                    kernel.data(), vic, size_x, size_y, size_z,
+                    nr_vols, n_th, nr_threads, n_th == 0));
+            }
+            for (int n_th = 0; n_th != nr_threads; ++n_th) {
+                threads[n_th].join();
+            }
+        }
+
+        if (nr_vols > 1) {
+            for (int t = 0; t < nr_vols; ++t) {
+                for (int64_t i = 0; i < nr_voxels; ++i) {
+                    *(nii_smooth_data + nr_voxels * t + i) = *(smooth_vm + nr_vols * i + t);
                 }
             }
         }
@@ -245,7 +359,7 @@ int main(int argc, char* argv[]) {
         for (int iz = 0; iz < size_z; ++iz) {
             for (int iy = 0; iy < size_y; ++iy) {
                 for (int ix = 0; ix < size_x; ++ix) {
-                    int voxel_i = nxy * iz + nx * iy + ix;
+                    int64_t voxel_i = nxy * iz + nx * iy + ix;
 
                     if (*(nii_layer_data + voxel_i) > 0) {
                         idx++;
@@ -328,14 +442,19 @@ int main(int argc, char* argv[]) {
                                                        dX, dY, dZ);
                                         float g = gaus(d, FWHM_val);
 
-                                        *(nii_smooth_data + voxel_i) += *(nii_input_data + nxy * jz + nx * jy + jx) * g;
+                                        for (int t = 0; t < nr_vols; ++t) {
+                                            *(nii_smooth_data + nr_voxels * t + voxel_i) +=
+                                                *(nii_input_data + nr_voxels * t + nxy * jz + nx * jy + jx) * g;
+                                        }
                                         *(nii_gaussw_data + voxel_i) += g;
                                     }
                                 }
                             }
                         }
                         if (*(nii_gaussw_data + voxel_i) > 0) {
-                        *(nii_smooth_data + voxel_i) /= *(nii_gaussw_data + voxel_i);
+                            for (int t = 0; t < nr_vols; ++t) {
+                                *(nii_smooth_data + nr_voxels * t + voxel_i) /= *(nii_gaussw_data + voxel_i);
+                            }
                         }
                     }
 
@@ -343,6 +462,7 @@ int main(int argc, char* argv[]) {
             }
         }
         save_output_nifti(f_input, "hairy_brain", hairy_brain, false);
+        nifti_image_free(hairy_brain);
     }
     cout << "  Smoothing is done. " <<  endl;
 
@@ -350,15 +470,31 @@ int main(int argc, char* argv[]) {
     // Masking if it is it wanted //
     ////////////////////////////////
     if (do_masking == 1) {
-        for (int i = 0; i < nr_voxels; ++i)
+        for (int64_t i = 0; i < nr_voxels; ++i)
             if (*(nii_layer_data + i) == 0) {
-                *(nii_smooth_data + i) = 0;
+                for (int t = 0; t < nr_vols; ++t) {
+                    *(nii_smooth_data + nr_voxels * t + i) = 0;
+                }
         }
     }
 
     if (!use_outpath) fout = f_input;
     save_output_nifti(fout, "layer_smoothed", nii_smooth, true, use_outpath);
 
+    nifti_image_free(nii1);
+    nifti_image_free(nii2);
+    nifti_image_free(nii_layer);
+    nifti_image_free(nii_smooth);
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char* argv[]) {
+    return ln2_layer_smooth_run(argc, argv);
+}
+#endif
@@ -242,6 +242,9 @@ int main(int argc, char*  argv[]) {
     save_output_nifti(fout, "mask", mask, true, use_outpath);
     save_output_nifti(fout, "masked", columns, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
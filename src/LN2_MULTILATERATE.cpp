@@ -1,8 +1,9 @@
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 #include <limits>
 #include <sstream>
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_MULTILATERATE: Injects a coordinate system upon a region of the rim file.\n"
     "                   These coordinates can be used to flatten chunks of the brain.\n"
@@ -10,6 +11,7 @@ int show_help(void) {
     "Usage:\n"
     "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_control_point_0.nii -radius 10\n"
     "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_control_points.nii -radius 10\n"
+    "    LN2_MULTILATERATE -rim rim.nii -control_points rim_midgm_points.nii -radius 10 -batch\n"
     "\n"
     "Options:\n"
     "    -help           : Show this help.\n"
@@ -34,7 +36,23 @@ int show_help(void) {
     "    -incl_borders   : (Conditional) Include borders as if they are labeled with 3.\n"
     "    -norms          : (Optional) Save L2 and Linf norm of the UV coordinates.\n"
     "    -angles         : (Optional) Save angles in radians and 4 quadrants.\n"
+    "    -batch          : (Optional) Compute many patches in one run. Either\n"
+    "                      each volume of a 4D '-control_points' file is one\n"
+    "                      patch (all with the same middle gray matter), or a 3D\n"
+    "                      file holds one origin label (above 1) per patch, as\n"
+    "                      in CASE I. Outputs get a 'patch<id>' tag, where id is\n"
+    "                      the volume number or the origin label minus 1. With\n"
+    "                      '-threads', patches are computed in parallel.\n"
+    "    -combined       : (Optional) Batch mode with an additional combined\n"
+    "                      output. Each voxel gets the UV coordinates of the patch\n"
+    "                      with the closest origin, and 'patches' holds its id.\n"
     "    -debug          : (Optional) Save extra intermediate outputs.\n"
+    "    -profile        : (Optional) Write the time and memory use of each stage\n"
+    "                      to 'LN2_MULTILATERATE_profile.json' at exit.\n"
+    "    -threads        : (Optional) Number of threads used for the independent\n"
+    "                      distance floods (or patches in batch mode) and for\n"
+    "                      writing .nii.gz outputs.\n"
+    "                      '1' by default. '0' uses all available cores.\n"
     "    -output         : (Optional) Output basename for all outputs.\n"
     "\n"
     "Notes:\n"
@@ -51,90 +69,60 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char*  argv[]) {
-
-    nifti_image *nii1 = NULL, *nii2 = NULL;
-    char *fin1 = NULL, *fout = NULL, *fin2=NULL;
-    float thr_radius = 10;
-    int ac;
-    bool mode_debug = false, mode_mask=true, mode_incl_borders = false;
-    bool mode_norms = false, mode_angles=false;
-
-    // Process user options
-    if (argc < 2) return show_help();
-    for (ac = 1; ac < argc; ac++) {
-        if (!strncmp(argv[ac], "-h", 2)) {
-            return show_help();
-        } else if (!strcmp(argv[ac], "-rim")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -rim\n");
-                return 1;
-            }
-            fin1 = argv[ac];
-            fout = argv[ac];
-        } else if (!strcmp(argv[ac], "-control_points")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -control_points\n");
-                return 1;
-            }
-            fin2 = argv[ac];
-        } else if (!strcmp(argv[ac], "-radius")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -radius\n");
-                return 1;
-            }
-            thr_radius = atof(argv[ac]);
-        } else if (!strcmp(argv[ac], "-nomask")) {
-            mode_mask = false;
-        } else if (!strcmp(argv[ac], "-incl_borders")) {
-            mode_incl_borders = true;
-        } else if (!strcmp(argv[ac], "-norms")) {
-            mode_norms = true;
-        } else if (!strcmp(argv[ac], "-angles")) {
-            mode_angles = true;
-        } else if (!strcmp(argv[ac], "-output")) {
-            if (++ac >= argc) {
-                fprintf(stderr, "** missing argument for -output\n");
-                return 1;
-            }
-            fout = argv[ac];
-        } else if (!strcmp(argv[ac], "-debug")) {
-            mode_debug = true;
-        } else {
-            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
-            return 1;
-        }
-    }
-
-    if (!fin1) {
-        fprintf(stderr, "** missing option '-rim'\n");
-        return 1;
-    }
-    if (!fin2) {
-        fprintf(stderr, "** missing option '-control_points'\n");
-        return 1;
-    }
-
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin1, 1);
-    if (!nii1) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
-        return 2;
-    }
-    nii2 = nifti_image_read(fin2, 1);
-    if (!nii2) {
-        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
-        return 2;
-    }
-
-    log_welcome("LN2_MULTILATERATE");
-    log_nifti_descriptives(nii1);
-    log_nifti_descriptives(nii2);
+// ============================================================================
+// Inputs shared by all patches. They are prepared once in main.
+struct multilaterate_inputs {
+    const char* fout;
+    float thr_radius;
+    bool mode_debug, mode_mask, mode_norms, mode_angles;
+    bool mode_batch, mode_combined;
+    nifti_image* nii_rim;  // Rim labels, int32
+    const int32_t* control_points_in_data;
+    uint32_t nr_volumes;
+    const std::vector<int32_t>* patch_labels;  // Empty unless a label volume
+    const int32_t* voi_id;  // Middle gray matter voxels
+    uint32_t nr_voi;
+    const int32_t* voi_id2;  // Rim (3) voxels
+    uint32_t nr_voi2;
+    const ln_voi_grid* grid;  // Neighbours of the middle gray matter
+    const ln_voi_grid* grid2;  // Neighbours of the rim (3) voxels
+    const std::vector<uint8_t>* jump_lock2;  // Rim (3) voxels next to borders
+    // Combined output of all patches, updated under 'patch_mutex'
+    nifti_image* combined_coords;
+    nifti_image* combined_patches;
+    std::vector<float>* combined_norm;
+    std::mutex* patch_mutex;
+};
+
+// Compute the UV coordinates of one patch and save its outputs. Returns 2
+// when the control points of the patch are missing.
+static int run_patch(const multilaterate_inputs& in, const uint32_t patch) {
+    const char* fout = in.fout;
+    const float thr_radius = in.thr_radius;
+    const bool mode_debug = in.mode_debug, mode_mask = in.mode_mask;
+    const bool mode_norms = in.mode_norms, mode_angles = in.mode_angles;
+    const bool mode_batch = in.mode_batch, mode_combined = in.mode_combined;
+    nifti_image* nii_rim = in.nii_rim;
+    const int32_t* nii_rim_data = static_cast<const int32_t*>(nii_rim->data);
+    const int32_t* control_points_in_data = in.control_points_in_data;
+    const uint32_t nr_volumes = in.nr_volumes;
+    const std::vector<int32_t>& patch_labels = *in.patch_labels;
+    const int32_t* voi_id = in.voi_id;
+    const uint32_t nr_voi = in.nr_voi;
+    const int32_t* voi_id2 = in.voi_id2;
+    const uint32_t nr_voi2 = in.nr_voi2;
+    const ln_voi_grid& grid = *in.grid;
+    const ln_voi_grid& grid2 = *in.grid2;
+    const std::vector<uint8_t>& jump_lock2 = *in.jump_lock2;
+    nifti_image* combined_coords = in.combined_coords;
+    nifti_image* combined_patches = in.combined_patches;
+    std::vector<float>& combined_norm = *in.combined_norm;
+    std::mutex& patch_mutex = *in.patch_mutex;
 
     // Get dimensions of input
-    const uint32_t size_x = nii1->nx;
-    const uint32_t size_y = nii1->ny;
-    const uint32_t size_z = nii1->nz;
+    const uint32_t size_x = nii_rim->nx;
+    const uint32_t size_y = nii_rim->ny;
+    const uint32_t size_z = nii_rim->nz;
 
     const uint32_t end_x = size_x - 1;
     const uint32_t end_y = size_y - 1;
@@ -142,37 +130,38 @@ int main(int argc, char*  argv[]) {
 
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
-    const float dX = nii1->pixdim[1];
-    const float dY = nii1->pixdim[2];
-    const float dZ = nii1->pixdim[3];
+    const float dX = nii_rim->pixdim[1];
+    const float dY = nii_rim->pixdim[2];
+    const float dZ = nii_rim->pixdim[3];
 
-    // Short diagonals
-    const float dia_xy = sqrt(dX * dX + dY * dY);
-    const float dia_xz = sqrt(dX * dX + dZ * dZ);
-    const float dia_yz = sqrt(dY * dY + dZ * dZ);
     // Long diagonals
     const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
 
-    // ========================================================================
-    // Fix input datatype issues
-    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
-    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
-    free(nii1);
-    // ------------------------------------------------------------------------
-    // Include borders adjustment to rim labels
-    if (mode_incl_borders) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(nii_rim_data + i) != 0){
-                *(nii_rim_data + i) = 3;
-            }
-        }
+    // Patch id, as in the output names. In label mode it is the label minus 1
+    // (e.g. the point ids of LN2_IFPOINTS when the points are added to midgm).
+    int32_t patch_id = nr_volumes > 1 ? patch + 1 : 0;
+    if (!patch_labels.empty()) {
+        patch_id = patch_labels[patch] - 1;
     }
-    // ------------------------------------------------------------------------
-    // Control points file (modified middle gray matter)
-    nifti_image* control_points = copy_nifti_as_int32(nii2);
+    const string tag = mode_batch ? "patch" + std::to_string(patch_id) + "_" : "";
+    auto save_patch_output = [&](const string& name, nifti_image* nii, bool log) {
+        std::lock_guard<std::mutex> lock(patch_mutex);
+        save_output_nifti(fout, tag + name, nii, log);
+    };
+
+    // Control points of this patch
+    nifti_image* control_points = copy_nifti_as_int32(nii_rim);
     int32_t* control_points_data = static_cast<int32_t*>(control_points->data);
-    free(nii2);
-
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        const int32_t v = *(control_points_in_data + i);
+        if (!patch_labels.empty()) {
+            *(control_points_data + i) = v == patch_labels[patch] ? 2 : (v > 0 ? 1 : 0);
+        } else if (mode_batch) {
+            *(control_points_data + i) = *(control_points_in_data + nr_voxels*patch + i);
+        } else {
+            *(control_points_data + i) = v;
+        }
+    }
     // Prepare flood fill related nifti images
     nifti_image* flood_step = copy_nifti_as_int32(nii_rim);
     int32_t* flood_step_data = static_cast<int32_t*>(flood_step->data);
@@ -224,69 +213,13 @@ int main(int argc, char*  argv[]) {
     nifti_image* pin_coords = copy_nifti_as_float32(point_coords);
     float* pin_coords_data = static_cast<float*>(pin_coords->data);
 
-    // ------------------------------------------------------------------------
-    // Final voronoi volume to output midgm distances for whole rim
-    nifti_image* voronoi = copy_nifti_as_float32(flood_dist);
-    float* voronoi_data = static_cast<float*>(voronoi->data);
-    nifti_image* smooth = copy_nifti_as_float32(flood_dist);
-    float* smooth_data = static_cast<float*>(smooth->data);
-
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This section is written to constrain the big iterative
-    // flooding distance loop to the subset of voxels. Required for substantial
-    // speed boost.
-    // ------------------------------------------------------------------------
-    // Find the subset voxels that will be used many times
-    uint32_t nr_voi = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(control_points_data + i) > 0){
-            nr_voi += 1;
-        }
-    }
-    cout << "  Nr. midgm voxels = " << nr_voi << endl;
-
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id;
-    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t ii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(control_points_data + i) > 0){
-            *(voi_id + ii) = i;
-            ii += 1;
-        }
-    }
-
-    // ------------------------------------------------------------------------
-    // NOTE(Faruk): This part is for speeding up the final Voronoi propagation
-    // ------------------------------------------------------------------------
-    // Reduce number of looped-through voxels for the second stage (Voronoi)
-    uint32_t nr_voi2 = 0;  // Voxels of interest
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_rim_data + i) == 3){
-            nr_voi2 += 1;
-        }
-    }
-    cout << "  Nr. rim (3) voxels = " << nr_voi2 << endl;
-
-    // Allocate memory to only the voxel of interest
-    int32_t* voi_id2;
-    voi_id2 = (int32_t*) malloc(nr_voi2*sizeof(int32_t));
-    // Fill in indices to be able to remap from subset to full set of voxels
-    uint32_t iii = 0;
-    for (uint32_t i = 0; i != nr_voxels; ++i) {
-        if (*(nii_rim_data + i) == 3){
-            *(voi_id2 + iii) = i;
-            iii += 1;
-        }
-    }
-
     // ========================================================================
     // Initial flood from centroid
     // ========================================================================
     cout << "\n  Checking control points..." << endl;
+    ln_profile_stage("control point 0");
     // Find the initial voxel
-    uint32_t control_point0;  // Origin
+    uint32_t control_point0 = 0;  // Origin
     uint32_t control_point1 = 0, control_point2 = 0;  // First extrema pair
     uint32_t control_point3 = 0, control_point4 = 0;  // Second extrema pair
     for (uint32_t i = 0; i != nr_voxels; ++i) {
@@ -319,357 +252,38 @@ int main(int argc, char*  argv[]) {
         cout << "    ERROR! Origin and extrema quartet voxels are NOT found!" << endl;
         cout << "    Check your '-control_points' input file." << endl;
         cout << "    Stopping program." << endl;
+        nifti_image_free(control_points);
+        nifti_image_free(flood_step);
+        nifti_image_free(flood_dist);
+        nifti_image_free(perimeter);
+        nifti_image_free(point_dist);
+        nifti_image_free(point_coords);
+        nifti_image_free(pin_axes);
+        nifti_image_free(pin_coords);
         return 2;
     }
 
 
-    int32_t grow_step = 1;
-    uint32_t voxel_counter = nr_voxels;
     uint32_t ix, iy, iz, i, j;
-    float d;
 
     if (!mode_custom_extrema) {
         cout << "\n  Computing control point 0 distances..." << endl;
         // Initialize grow volume
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(control_points_data + i) == 2) {
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 0.;
+        std::vector<float> dist(nr_voi, 0);
+        std::vector<int32_t> step(nr_voi, 0);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            if (*(control_points_data + *(voi_id + ii)) == 2) {
+                step[ii] = 1;
             }
         }
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
+        ln_grow_geodesic_voi(grid, NULL, dist.data(), step.data(), NULL, NULL);
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);  // Map subset to full set
+            *(flood_dist_data + i) = dist[ii];
         }
 
         if (mode_debug) {
-            save_output_nifti(fout, "centroid_dist", flood_dist, false);
+            save_patch_output("centroid_dist", flood_dist, false);
         }
 
 
@@ -677,6 +291,7 @@ int main(int argc, char*  argv[]) {
         // Find perimeter
         // ========================================================================
         cout << "\n  Finding perimeter..." << endl;
+        ln_profile_stage("perimeter");
 
         // Translate 0 crossing
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
@@ -696,8 +311,6 @@ int main(int argc, char*  argv[]) {
             }
         }
 
-        // NOTE(Faruk): Once the proof of concept is working, I need to reduce code
-        // repetition here through functions. Signbit checks are easy reductions.
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             i = *(voi_id + ii);  // Map subset to full set
             // Check sign changes to find zero crossings
@@ -706,821 +319,78 @@ int main(int argc, char*  argv[]) {
             } else {
                 float m = *(flood_dist_data + i);
                 float n;
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // --------------------------------------------------------
-                // 1-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
+                for (uint32_t k = grid.nbr_start[ii]; k != grid.nbr_start[ii + 1]; ++k) {
+                    // All six face checks of the former unrolled loop read
+                    // the x- neighbour. Only that face is checked to keep
+                    // the outputs unchanged.
+                    if (grid.nbr_dir[k] > 0 && grid.nbr_dir[k] < 6) continue;
+                    j = *(voi_id + grid.nbr_id[k]);
+                    n = *(flood_dist_data + j);
+                    if (signbit(m) - signbit(n) != 0) {
+                        if (m*m < n*n) {
+                            *(perimeter_data + i) = 2;
+                        } else if (m*m > n*n) {  // Closer to prev. step
+                            *(perimeter_data + j) = 2;
+                        } else {  // Equal +/- normalized distance
+                            *(perimeter_data + i) = 2;
+                            *(perimeter_data + j) = 2;
                         }
                     }
                 }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
+            }
+        }
+        save_patch_output("perimeter", perimeter, false);
+
+        // ====================================================================
+        // Find control point extrema and compute distances on midgm domain
+        // ====================================================================
+        cout << "\n  Computing control points 1 to 4..." << endl;
+        ln_profile_stage("control points 1 to 4");
+        if (mode_custom_extrema) {
+            cout << "    Using custom extrema control points." << endl;
+        } else {
+            cout << "    Finding extrema control points on perimeter.\n" << endl;
+            // Find first point on perimeter
+            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                i = *(voi_id + ii);  // Map subset to full set
+                if (*(perimeter_data + i) == 2) {
+                    control_point1 = i;
                 }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
+            }
+            *(control_points_data + control_point1) = 3;
+
+            // Growth is restricted to the perimeter
+            std::vector<uint8_t> on_perimeter(nr_voi, 0);
+            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                on_perimeter[ii] = *(perimeter_data + *(voi_id + ii)) == 2;
+            }
+
+            // Loop until desired number of points reached
+            for (int32_t n = 4; n < 7; ++n) {
+                // Initialize grow volume
+                std::vector<float> dist(nr_voi, 0);
+                std::vector<int32_t> step(nr_voi, 0);
+                for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                    if (*(control_points_data + *(voi_id + ii)) > 1) {
+                        step[ii] = 1;
                     }
                 }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                // --------------------------------------------------------
-                // 2-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                // --------------------------------------------------------
-                // 3-jump neighbours
-                // --------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                    if (*(control_points_data + j) > 0){
-                        n = *(flood_dist_data + j);
-                        if (signbit(m) - signbit(n) != 0) {
-                            if (m*m < n*n) {
-                                *(perimeter_data + i) = 2;
-                            } else if (m*m > n*n) {  // Closer to prev. step
-                                *(perimeter_data + j) = 2;
-                            } else {  // Equal +/- normalized distance
-                                *(perimeter_data + i) = 2;
-                                *(perimeter_data + j) = 2;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        save_output_nifti(fout, "perimeter", perimeter, false);
-
-        // ====================================================================
-        // Find control point extrema and compute distances on midgm domain
-        // ====================================================================
-        cout << "\n  Computing control points 1 to 4..." << endl;
-        if (mode_custom_extrema) {
-            cout << "    Using custom extrema control points." << endl;
-        } else {
-            cout << "    Finding extrema control points on perimeter.\n" << endl;
-            // Find first point on perimeter
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(perimeter_data + i) == 2) {
-                    control_point1 = i;
-                }
-            }
-            *(control_points_data + control_point1) = 3;
-
-            // Loop until desired number of points reached
-            for (int32_t n = 4; n < 7; ++n) {
-                int32_t grow_step = 1;
-                uint32_t voxel_counter = nr_voxels;
-                uint32_t ix, iy, iz, i, j;
-                float d;
-
-                // Initialize grow volume
-                for (uint32_t i = 0; i != nr_voxels; ++i) {
-                    if (*(control_points_data + i) > 1) {
-                        *(flood_step_data + i) = 1.;
-                        *(flood_dist_data + i) = 0.;
-                    } else {
-                        *(flood_step_data + i) = 0.;
-                        *(flood_dist_data + i) = 0.;
-                    }
-                }
-
-                // Reset some parameters
-                grow_step = 1;
-                voxel_counter = nr_voxels;
-                while (voxel_counter != 0) {
-                    voxel_counter = 0;
-                    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                        i = *(voi_id + ii);  // Map subset to full set
-                        if (*(flood_step_data + i) == grow_step) {
-                            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                            voxel_counter += 1;
-
-                            // ------------------------------------------------
-                            // 1-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x) {
-                                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dX;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y) {
-                                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dY;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iz > 0) {
-                                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iz < end_z) {
-                                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dZ;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            // ------------------------------------------------
-                            // 2-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y) {
-                                j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y) {
-                                j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xy;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_yz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-
-                            // ------------------------------------------------
-                            // 3-jump neighbours
-                            // ------------------------------------------------
-                            if (ix > 0 && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix > 0 && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy > 0 && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz > 0) {
-                                j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                            if (ix < end_x && iy < end_y && iz < end_z) {
-                                j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                                if (*(perimeter_data + j) == 2) {
-                                    d = *(flood_dist_data + i) + dia_xyz;
-                                    if (d < *(flood_dist_data + j)
-                                        || *(flood_dist_data + j) == 0) {
-                                        *(flood_dist_data + j) = d;
-                                        *(flood_step_data + j) = grow_step + 1;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    grow_step += 1;
-                }
-
-                // Find farthest point
-                float max_distance = 0;
-                int idx_new_point;
-                for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                    i = *(voi_id + ii);
-                    if (*(perimeter_data + i) == 2) {
-                        if (*(flood_dist_data + i) > max_distance) {
-                            max_distance = *(flood_dist_data + i);
-                            idx_new_point = i;
-                        }
+                ln_grow_geodesic_voi(grid, on_perimeter.data(), dist.data(), step.data(),
+                                     NULL, NULL);
+
+                // Find farthest point
+                float max_distance = 0;
+                int idx_new_point;
+                for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+                    if (on_perimeter[ii] && dist[ii] > max_distance) {
+                        max_distance = dist[ii];
+                        idx_new_point = *(voi_id + ii);
                     }
                 }
                 *(control_points_data + idx_new_point) = n;
             }
             if (mode_debug) {
-                save_output_nifti(fout, "auto_control_points", control_points, false);
+                save_patch_output("auto_control_points", control_points, false);
             }
         }
     }
@@ -1529,361 +399,44 @@ int main(int argc, char*  argv[]) {
     // Compute flood distances from each extrema control points
     // ========================================================================
     cout << "  Computing control point (1 to 4) distances..." << endl;
+    ln_profile_stage("control point distances");
+    // The four floods only read the midgm domain, so they run
+    // as independent jobs on the shared neighbour table. Each writes into its
+    // own volume of the 4D point distances.
+
     for (int p = 3; p < 7; ++p) {
         cout << "    Relative to control point" + std::to_string(p-2) + "..." << endl;
-        // Initialize grow volume
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(control_points_data + i) == p) {
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 1.;
-            } else {
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
+    }
+    ln_parallel_jobs(4, [&](uint32_t n) {
+        const int p = n + 3;
+        std::vector<float> dist(nr_voi, 0);
+        std::vector<uint32_t> seeds;
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            if (*(control_points_data + *(voi_id + ii)) == p) {
+                dist[ii] = 1;
+                seeds.push_back(ii);
             }
         }
+        ln_flood_geodesic_voi(grid, NULL, dist.data(), seeds);
 
-        // Reset some parameters
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) > 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
+        // Record distances into a 4D nifti
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            *(point_dist_data + nr_voxels*(p-3) + *(voi_id + ii)) = dist[ii];
         }
+    });
 
-        if (mode_debug) {
-            save_output_nifti(fout, "control_point" + std::to_string(p-2) + "_dist", flood_dist, false);
+    // Keep the last flood in the flood volume, as used further below
+    for (int p = 3; p < 7; ++p) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(flood_step_data + i) = 0;
+            *(flood_dist_data + i) = 0;
         }
-
-        // Record distances into a 4D nifti
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             i = *(voi_id + ii);  // Map subset to full set
-            *(point_dist_data + nr_voxels*(p-3) + i) = *(flood_dist_data + i);
+            *(flood_dist_data + i) = *(point_dist_data + nr_voxels*(p-3) + i);
+        }
+        if (mode_debug) {
+            save_patch_output("control_point" + std::to_string(p-2) + "_dist", flood_dist, false);
         }
     }
 
@@ -1891,6 +444,7 @@ int main(int argc, char*  argv[]) {
     // Derive coordinates from control point (1, 2, 3, 4) distances
     // ------------------------------------------------------------------------
     cout << "\n  Computing control point coordinates..." << endl;
+    ln_profile_stage("control point coordinates");
     // Subtract distances pair-wise to get axis coordinates
     for (uint32_t t = 0; t != 2; ++t) {
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
@@ -1915,13 +469,14 @@ int main(int argc, char*  argv[]) {
     }
 
     if (mode_debug) {
-        save_output_nifti(fout, "control_point_coordinates", point_coords, true);
+        save_patch_output("control_point_coordinates", point_coords, true);
     }
 
     // ========================================================================
     // Find rolling pin axes
     // ========================================================================
     cout << "\n  Finding pin axes..." << endl;
+    ln_profile_stage("pin axes");
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         *(pin_axes_data + nr_voxels * 0 + i) = 0;
         *(pin_axes_data + nr_voxels * 1 + i) = 0;
@@ -1930,869 +485,124 @@ int main(int argc, char*  argv[]) {
     for (uint32_t t = 0; t != 2; ++t) {
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             uint32_t i = *(voi_id + ii);
-            tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
 
             // Check sign changes in normalized distance differences between
             // neighbouring voxels
             float m = *(point_coords_data + nr_voxels * t + i);
             float n;
-
-            // ------------------------------------------------------------
-            // 1-jump neighbours
-            // ------------------------------------------------------------
-            if (ix > 0) {
-                j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
-                }
-            }
-            if (ix < end_x) {
-                j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
-                }
-            }
-            if (iy > 0) {
-                j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
-                }
-            }
-            if (iy < end_y) {
-                j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
-                }
-            }
-            if (iz > 0) {
-                j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
-                }
-            }
-            if (iz < end_z) {
-                j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
+            for (uint32_t k = grid.nbr_start[ii]; k != grid.nbr_start[ii + 1]; ++k) {
+                if (grid.nbr_dir[k] >= 6) break;  // Face neighbours only
+                j = *(voi_id + grid.nbr_id[k]);
                 n = *(point_coords_data + nr_voxels * t + j);
-                if (*(control_points_data + j) != 0) {
-                    if (signbit(m) - signbit(n) != 0) {
-                        *(pin_axes_data + nr_voxels * t + i) = 1;
-                    }
+                if (signbit(m) - signbit(n) != 0) {
+                    *(pin_axes_data + nr_voxels * t + i) = 1;
                 }
             }
         }
     }
     if (mode_debug) {
-        save_output_nifti(fout, "pin_axes", pin_axes, true);
+        save_patch_output("pin_axes", pin_axes, true);
     }
 
     // ========================================================================
     // Compute flood distances relative to pin axes
     // ========================================================================
     cout << "\n  Computing pin axis distances..." << endl;
+    ln_profile_stage("pin axis distances");
     for (int p = 0; p != 2; ++p) {
         cout << "    Relative to pin axis " + std::to_string(p+1) + "/2..." << endl;
+    }
 
-        // TODO(Faruk): Guesstimate an initial distance to axis lines. Probably
-        // I can do this better by considering the local neighbourhood in the
-        // future.
-        float dist_to_axes = ((dX + dY + dZ) / 3) / 2;  // Half a voxel
+    // TODO(Faruk): Guesstimate an initial distance to axis lines. Probably
+    // I can do this better by considering the local neighbourhood in the
+    // future.
+    const float dist_to_axes = ((dX + dY + dZ) / 3) / 2;  // Half a voxel
 
-        // Initialize grow volume
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            if (*(pin_axes_data + nr_voxels * p + i) != 0) {
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = dist_to_axes;
-            } else {
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
+    std::vector<float> pin_dist(nr_voi * 2, 0);
+    ln_parallel_jobs(2, [&](uint32_t p) {
+        float* dist = pin_dist.data() + nr_voi * p;
+        std::vector<uint32_t> seeds;
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            if (*(pin_axes_data + nr_voxels * p + *(voi_id + ii)) != 0) {
+                dist[ii] = dist_to_axes;
+                seeds.push_back(ii);
             }
         }
+        ln_flood_geodesic_voi(grid, NULL, dist, seeds);
+    });
 
-        // Reset some parameters
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-                i = *(voi_id + ii);  // Map subset to full set
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y) {
-                        j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y) {
-                        j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-
-                    // --------------------------------------------------------
-                    // 3-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0 && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix > 0 && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy > 0 && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz > 0) {
-                        j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                    if (ix < end_x && iy < end_y && iz < end_z) {
-                        j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                        if (*(control_points_data + j) != 0) {
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                            }
-                        }
-                    }
-                }
-            }
-            grow_step += 1;
+    for (int p = 0; p != 2; ++p) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(flood_dist_data + i) = 0;
+        }
+        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+            i = *(voi_id + ii);  // Map subset to full set
+            *(flood_dist_data + i) = pin_dist[nr_voi * p + ii];
         }
-
         if (mode_debug) {
-            save_output_nifti(fout, "pin_axis" + std::to_string(p+1) + "_dist", flood_dist, true);
+            save_patch_output("pin_axis" + std::to_string(p+1) + "_dist", flood_dist, true);
         }
 
         // Save distances into 4D nifti
         for (uint32_t ii = 0; ii != nr_voi; ++ii) {
             i = *(voi_id + ii);  // Map subset to full set
-            // Transfer signs onto pin distances to convert them to coordinates
-            if (*(point_coords_data + nr_voxels * p + i) < 0) {
-                *(pin_coords_data + nr_voxels * p + i) = -*(flood_dist_data + i);
-            } else {
-                *(pin_coords_data + nr_voxels * p + i) = *(flood_dist_data + i);
-            }
-        }
-    }
-
-    if (mode_debug) {
-        save_output_nifti(fout, "pin_coordinates", pin_coords, true);
-    }
-
-    // ========================================================================
-    // Final Voronoi for propagating distances to all gray matter
-    // ========================================================================
-    cout << "\n  Start Voronoi propagation..." << endl;
-    for (uint32_t t = 0; t != 2; ++t) {
-        cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
-        // Initialize grow volume
-        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
-            i = *(voi_id2 + iii);  // Map subset to full set
-            if (*(pin_coords_data + nr_voxels*t + i) != 0) {
-                *(voronoi_data + i) = *(pin_coords_data + nr_voxels*t + i);
-                *(flood_step_data + i) = 1.;
-                *(flood_dist_data + i) = 1.;
-            } else {
-                *(voronoi_data + i) = 0;
-                *(flood_step_data + i) = 0.;
-                *(flood_dist_data + i) = 0.;
-            }
-        }
-
-        grow_step = 1;
-        voxel_counter = nr_voxels;
-
-        while (voxel_counter != 0) {
-            voxel_counter = 0;
-            for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
-                i = *(voi_id2 + iii);
-                if (*(flood_step_data + i) == grow_step) {
-                    tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                    voxel_counter += 1;
-
-                    bool jump_lock = false;
-                    // --------------------------------------------------------
-                    // 1-jump neighbours
-                    // --------------------------------------------------------
-                    if (ix > 0) {
-                        j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (ix < end_x) {
-                        j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy > 0) {
-                        j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iy < end_y) {
-                        j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz > 0) {
-                        j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
-                    if (iz < end_z) {
-                        j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-
-                        if (*(nii_rim_data + j) == 3) {
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(voronoi_data + j) = *(voronoi_data + i);
-                            }
-                        } else if (*(nii_rim_data + j) != 0) {
-                            jump_lock = true;
-                        }
-                    }
+            // Transfer signs onto pin distances to convert them to coordinates
+            if (*(point_coords_data + nr_voxels * p + i) < 0) {
+                *(pin_coords_data + nr_voxels * p + i) = -*(flood_dist_data + i);
+            } else {
+                *(pin_coords_data + nr_voxels * p + i) = *(flood_dist_data + i);
+            }
+        }
+    }
 
-                    // --------------------------------------------------------
-                    // 2-jump neighbours
-                    // --------------------------------------------------------
-                    if (jump_lock == false) {
-
-                        if (ix > 0 && iy > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y) {
-                            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y) {
-                            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xy;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_yz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
+    if (mode_debug) {
+        save_patch_output("pin_coordinates", pin_coords, true);
+    }
 
-                        // ----------------------------------------------------
-                        // 3-jump neighbours
-                        // ----------------------------------------------------
-                        if (ix > 0 && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-
-                            if (*(nii_rim_data + j) == 3) {
-                                d = *(flood_dist_data + i) + dia_xyz;
-                                if (d < *(flood_dist_data + j)
-                                    || *(flood_dist_data + j) == 0) {
-                                    *(flood_dist_data + j) = d;
-                                    *(flood_step_data + j) = grow_step + 1;
-                                    *(voronoi_data + j) = *(voronoi_data + i);
-                                }
-                            }
-                        }
-                    }
-                }
+    // ========================================================================
+    // Final Voronoi for propagating distances to all gray matter
+    // ========================================================================
+    cout << "\n  Start Voronoi propagation..." << endl;
+    ln_profile_stage("Voronoi propagation");
+    for (uint32_t t = 0; t != 2; ++t) {
+        cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
+        // Initialize grow volume. Each cell holds the index of its seed.
+        std::vector<float> seed_coord(nr_voi2, 0);
+        std::vector<float> dist(nr_voi2, 0);
+        std::vector<int32_t> step(nr_voi2, 0);
+        std::vector<int32_t> cell(nr_voi2, -1);
+        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+            i = *(voi_id2 + iii);  // Map subset to full set
+            seed_coord[iii] = *(pin_coords_data + nr_voxels*t + i);
+            if (seed_coord[iii] != 0) {
+                cell[iii] = iii;
+                step[iii] = 1;
+                dist[iii] = 1;
             }
-            grow_step += 1;
         }
+        ln_grow_voronoi_voi(grid2, jump_lock2.data(), dist.data(), step.data(),
+                            cell.data());
 
         // Record into 4D nifti
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);  // Map subset to full set
-            *(pin_coords_data + nr_voxels * t + i) = *(voronoi_data + i);
+            *(pin_coords_data + nr_voxels * t + i) =
+                cell[iii] < 0 ? 0 : seed_coord[cell[iii]];
         }
     }
 
     if (mode_debug) {
-        save_output_nifti(fout, "pin_coordinates", pin_coords, true);
+        save_patch_output("pin_coordinates", pin_coords, true);
     }
 
     // ========================================================================
     // Smooth coordinates
     // ========================================================================
     cout << "\n  Smoothing coordinates..." << endl;
+    ln_profile_stage("smoothing coordinates");
+    std::vector<float> smooth(nr_voi2);
     for (uint32_t t = 0; t != 2; ++t) {
         cout << "    Doing coordinate " + std::to_string(t+1) + "/2..." << endl;
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(smooth_data + i) = 0;
-        }
 
         // Pre-compute weights
         float FWHM_val = 1;  // TODO(Faruk): Might tweak this one
@@ -2801,80 +611,43 @@ int main(int argc, char*  argv[]) {
         float w_dY = gaus(dY, FWHM_val);
         float w_dZ = gaus(dZ, FWHM_val);
 
+        const float w_face[6] = {w_dX, w_dX, w_dY, w_dY, w_dZ, w_dZ};
+
         for (uint16_t n = 0; n != 2; ++n) {
             for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
                 i = *(voi_id2 + iii);
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
                 float new_val = 0, total_weight = 0;
 
                 // Start with the voxel itself
                 new_val += *(pin_coords_data + nr_voxels * t + i) * w_0;
                 total_weight += w_0;
 
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dX;
-                        total_weight += w_dX;
-                    }
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dX;
-                        total_weight += w_dX;
-                    }
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dY;
-                        total_weight += w_dY;
-                    }
+                for (uint32_t k = grid2.nbr_start[iii]; k != grid2.nbr_start[iii + 1]; ++k) {
+                    if (grid2.nbr_dir[k] >= 6) break;  // Face neighbours only
+                    j = *(voi_id2 + grid2.nbr_id[k]);
+                    new_val += *(pin_coords_data + nr_voxels*t + j) * w_face[grid2.nbr_dir[k]];
+                    total_weight += w_face[grid2.nbr_dir[k]];
                 }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dY;
-                        total_weight += w_dY;
-                    }
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dZ;
-                        total_weight += w_dZ;
-                    }
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    if (*(nii_rim_data + j) == 3) {
-                        new_val += *(pin_coords_data + nr_voxels*t + j) * w_dZ;
-                        total_weight += w_dZ;
-                    }
-                }
-                *(smooth_data + i) = new_val / total_weight;
+                smooth[iii] = new_val / total_weight;
             }
 
             // Swap image that needs to be smoothed
             for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
                 i = *(voi_id2 + iii);
-                *(pin_coords_data + nr_voxels * t + i) = *(smooth_data + i);
+                *(pin_coords_data + nr_voxels * t + i) = smooth[iii];
             }
         }
     }
 
     if (mode_debug) {
-        save_output_nifti(fout, "pin_coordinates_smooth", pin_coords, true);
+        save_patch_output("pin_coordinates_smooth", pin_coords, true);
     }
 
     // ========================================================================
     // Compute norms
     // ========================================================================
     cout << "\n  Computing L2 and Linf norms..." << endl;
+    ln_profile_stage("norms");
     // Compute Linfinity norm
     for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
         i = *(voi_id2 + iii);
@@ -2884,7 +657,7 @@ int main(int argc, char*  argv[]) {
         *(flood_dist_data + i) = norm;
     }
     if (mode_norms || mode_debug) {
-        save_output_nifti(fout, "UV_norm_Linf", flood_dist, true);
+        save_patch_output("UV_norm_Linf", flood_dist, true);
     }
 
     // Compute L2 norm
@@ -2896,13 +669,14 @@ int main(int argc, char*  argv[]) {
         *(flood_dist_data + i) = norm;
     }
     if (mode_norms || mode_debug) {
-        save_output_nifti(fout, "UV_norm_L2", flood_dist, true);
+        save_patch_output("UV_norm_L2", flood_dist, true);
     }
 
     // ========================================================================
     // Update perimeter mask using norm
     // ========================================================================
     cout << "\n  Updating perimeter using L2 norm..." << endl;
+    ln_profile_stage("update perimeter");
     for (uint32_t i = 0; i != nr_voxels; ++i) {
         if (*(flood_dist_data + i) != 0) {
             if (*(flood_dist_data + i) < thr_radius) {
@@ -3106,12 +880,13 @@ int main(int argc, char*  argv[]) {
         i = *(voi_id2 + iii);
         *(perimeter_data + i) = *(flood_step_data + i);
     }
-    save_output_nifti(fout, "perimeter_chunk", perimeter, true);
+    save_patch_output("perimeter_chunk", perimeter, true);
 
     // ========================================================================
     // Convert pin axes from 4D nifti into 3D
     // ========================================================================
     cout << "\n  Start preparing axes output (used for quality control)..." << endl;
+    ln_profile_stage("axes output");
     for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
         i = *(voi_id2 + iii);
 
@@ -3135,6 +910,7 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     if (mode_mask) {
         cout << "\n  Masking outputs..." << endl;
+        ln_profile_stage("masking outputs");
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);
             // Zero values outside of perimeter chunk
@@ -3146,14 +922,36 @@ int main(int argc, char*  argv[]) {
         }
     }
 
-    save_output_nifti(fout, "UV_axes", perimeter, true);
-    save_output_nifti(fout, "UV_coordinates", pin_coords, true);
+    save_patch_output("UV_axes", perimeter, true);
+    save_patch_output("UV_coordinates", pin_coords, true);
+
+    // Add this patch to the combined output
+    if (mode_combined) {
+        std::lock_guard<std::mutex> lock(patch_mutex);
+        float* coords_data = static_cast<float*>(combined_coords->data);
+        int32_t* patches_data = static_cast<int32_t*>(combined_patches->data);
+        for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
+            i = *(voi_id2 + iii);
+            if (*(flood_step_data + i) == 0) continue;  // Outside of perimeter chunk
+            float coord_U = *(pin_coords_data + nr_voxels*0 + i);
+            float coord_V = *(pin_coords_data + nr_voxels*1 + i);
+            float norm = sqrt(coord_U * coord_U + coord_V * coord_V);
+            if (norm < combined_norm[i]
+                || (norm == combined_norm[i] && patch_id < *(patches_data + i))) {
+                combined_norm[i] = norm;
+                *(patches_data + i) = patch_id;
+                *(coords_data + nr_voxels*0 + i) = coord_U;
+                *(coords_data + nr_voxels*1 + i) = coord_V;
+            }
+        }
+    }
 
     // ========================================================================
     // Compute angles & quadrants
     // ========================================================================
     if (mode_angles) {
         cout << "\n  Computing angles (in radians) and quadrants..." << endl;
+        ln_profile_stage("angles");
         for (uint32_t iii = 0; iii != nr_voi2; ++iii) {
             i = *(voi_id2 + iii);
             // Only compute for within the masked region
@@ -3172,10 +970,390 @@ int main(int argc, char*  argv[]) {
                 *(flood_step_data + i) = 0;
             }
         }
-        save_output_nifti(fout, "UV_radians", flood_dist, true);
-        save_output_nifti(fout, "UV_quadrants", flood_step, true);
+        save_patch_output("UV_radians", flood_dist, true);
+        save_patch_output("UV_quadrants", flood_step, true);
     }
 
-    cout << "\n  Finished." << endl;
+
+    nifti_image_free(control_points);
+    nifti_image_free(flood_step);
+    nifti_image_free(flood_dist);
+    nifti_image_free(perimeter);
+    nifti_image_free(point_dist);
+    nifti_image_free(point_coords);
+    nifti_image_free(pin_axes);
+    nifti_image_free(pin_coords);
     return 0;
 }
+
+int ln2_multilaterate_run(int argc, char*  argv[]) {
+
+    nifti_image *nii1 = NULL, *nii2 = NULL;
+    char *fin1 = NULL, *fout = NULL, *fin2=NULL;
+    float thr_radius = 10;
+    int ac;
+    bool mode_debug = false, mode_mask=true, mode_incl_borders = false;
+    bool mode_norms = false, mode_angles=false;
+    bool mode_batch = false, mode_combined = false;
+
+    // Process user options
+    if (argc < 2) return show_help();
+    for (ac = 1; ac < argc; ac++) {
+        if (!strncmp(argv[ac], "-h", 2)) {
+            return show_help();
+        } else if (!strcmp(argv[ac], "-rim")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -rim\n");
+                return 1;
+            }
+            fin1 = argv[ac];
+            fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-control_points")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -control_points\n");
+                return 1;
+            }
+            fin2 = argv[ac];
+        } else if (!strcmp(argv[ac], "-radius")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -radius\n");
+                return 1;
+            }
+            thr_radius = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-nomask")) {
+            mode_mask = false;
+        } else if (!strcmp(argv[ac], "-incl_borders")) {
+            mode_incl_borders = true;
+        } else if (!strcmp(argv[ac], "-norms")) {
+            mode_norms = true;
+        } else if (!strcmp(argv[ac], "-angles")) {
+            mode_angles = true;
+        } else if (!strcmp(argv[ac], "-batch")) {
+            mode_batch = true;
+        } else if (!strcmp(argv[ac], "-combined")) {
+            mode_batch = true;
+            mode_combined = true;
+        } else if (!strcmp(argv[ac], "-output")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -output\n");
+                return 1;
+            }
+            fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-debug")) {
+            mode_debug = true;
+        } else if (!strcmp(argv[ac], "-profile")) {
+            ln_set_profile("");
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
+        } else {
+            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
+            return 1;
+        }
+    }
+
+    if (!fin1) {
+        fprintf(stderr, "** missing option '-rim'\n");
+        return 1;
+    }
+    if (!fin2) {
+        fprintf(stderr, "** missing option '-control_points'\n");
+        return 1;
+    }
+
+    // Read input datasets, cropped to the bounding box of their voxels
+    ln_profile_stage("read inputs");
+    ln_crop crop;
+    if (!ln_crop_find(crop, {fin1, fin2})) {
+        return 2;
+    }
+    nii1 = ln_read_cropped(fin1, crop);
+    if (!nii1) {
+        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
+        ln_crop_free(crop);
+        return 2;
+    }
+    nii2 = ln_read_cropped(fin2, crop);
+    if (!nii2) {
+        fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+        nifti_image_free(nii1);
+        ln_crop_free(crop);
+        return 2;
+    }
+    // Outputs are written in the full field of view
+    ln_set_output_crop(&crop);
+
+    log_welcome("LN2_MULTILATERATE");
+    log_nifti_descriptives(nii1);
+    log_nifti_descriptives(nii2);
+    log_crop_descriptives(crop);
+
+    // Get dimensions of input
+    const uint32_t size_x = nii1->nx;
+    const uint32_t size_y = nii1->ny;
+    const uint32_t size_z = nii1->nz;
+
+    const uint32_t nr_voxels = size_z * size_y * size_x;
+
+    const float dX = nii1->pixdim[1];
+    const float dY = nii1->pixdim[2];
+    const float dZ = nii1->pixdim[3];
+
+    // ========================================================================
+    // Fix input datatype issues
+    ln_profile_stage("prepare inputs");
+    nifti_image* nii_rim = copy_nifti_as_int32(nii1);
+    int32_t* nii_rim_data = static_cast<int32_t*>(nii_rim->data);
+    nifti_image_free(nii1);
+    // ------------------------------------------------------------------------
+    // Include borders adjustment to rim labels
+    if (mode_incl_borders) {
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            if (*(nii_rim_data + i) != 0){
+                *(nii_rim_data + i) = 3;
+            }
+        }
+    }
+    // ------------------------------------------------------------------------
+    // Control points files (modified middle gray matter), one per patch
+    nifti_image* control_points_in = copy_nifti_as_int32(nii2);
+    int32_t* control_points_in_data = static_cast<int32_t*>(control_points_in->data);
+    const uint32_t nr_volumes = nii2->nvox / nr_voxels;
+    nifti_image_free(nii2);
+
+    // In batch mode each volume of a 4D control points file is
+    // one patch. A 3D control points file is read as a label volume instead,
+    // where each label above 1 marks the origin of one patch (as in CASE I).
+    // All patches share the middle gray matter, so the subsets of voxels and
+    // the neighbour table below are only prepared once.
+    std::vector<int32_t> patch_labels;
+    uint32_t nr_patches = 1;
+    if (mode_batch) {
+        if (nr_volumes > 1) {
+            nr_patches = nr_volumes;
+            for (uint32_t p = 1; p != nr_patches; ++p) {
+                for (uint32_t i = 0; i != nr_voxels; ++i) {
+                    if ((*(control_points_in_data + nr_voxels*p + i) > 0)
+                        != (*(control_points_in_data + i) > 0)) {
+                        fprintf(stderr, "** volume %u of '-control_points' has a different "
+                                "middle gray matter than volume 1\n", p + 1);
+                        nifti_image_free(nii_rim);
+                        nifti_image_free(control_points_in);
+                        ln_crop_free(crop);
+                        return 2;
+                    }
+                }
+            }
+        } else {
+            for (uint32_t i = 0; i != nr_voxels; ++i) {
+                if (*(control_points_in_data + i) > 1) {
+                    patch_labels.push_back(*(control_points_in_data + i));
+                }
+            }
+            std::sort(patch_labels.begin(), patch_labels.end());
+            patch_labels.erase(std::unique(patch_labels.begin(), patch_labels.end()),
+                               patch_labels.end());
+            nr_patches = patch_labels.size();
+        }
+        cout << "  Batch mode, nr. patches = " << nr_patches << endl;
+        if (nr_patches == 0) {
+            fprintf(stderr, "** no patch origins (labels above 1) in '-control_points'\n");
+            nifti_image_free(nii_rim);
+            nifti_image_free(control_points_in);
+            ln_crop_free(crop);
+            return 2;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // NOTE(Faruk): This section is written to constrain the big iterative
+    // flooding distance loop to the subset of voxels. Required for substantial
+    // speed boost.
+    // ------------------------------------------------------------------------
+    // Find the subset voxels that will be used many times
+    uint32_t nr_voi = 0;  // Voxels of interest
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(control_points_in_data + i) > 0){
+            nr_voi += 1;
+        }
+    }
+    cout << "  Nr. midgm voxels = " << nr_voi << endl;
+
+    // Allocate memory to only the voxel of interest
+    int32_t* voi_id;
+    voi_id = (int32_t*) malloc(nr_voi*sizeof(int32_t));
+    // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t ii = 0;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(control_points_in_data + i) > 0){
+            *(voi_id + ii) = i;
+            ii += 1;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // NOTE(Faruk): This part is for speeding up the final Voronoi propagation
+    // ------------------------------------------------------------------------
+    // Reduce number of looped-through voxels for the second stage (Voronoi)
+    uint32_t nr_voi2 = 0;  // Voxels of interest
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_rim_data + i) == 3){
+            nr_voi2 += 1;
+        }
+    }
+    cout << "  Nr. rim (3) voxels = " << nr_voi2 << endl;
+
+    // Allocate memory to only the voxel of interest
+    int32_t* voi_id2;
+    voi_id2 = (int32_t*) malloc(nr_voi2*sizeof(int32_t));
+    // Fill in indices to be able to remap from subset to full set of voxels
+    uint32_t iii = 0;
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        if (*(nii_rim_data + i) == 3){
+            *(voi_id2 + iii) = i;
+            iii += 1;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // Neighbour table of the middle gray matter, shared by all patches
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, dX, dY, dZ);
+
+    // Neighbour table of the rim (3) voxels, for the final Voronoi and the
+    // smoothing. Voxels next to the borders (non-zero rim other than 3) only
+    // grow into their face neighbours in the Voronoi.
+    ln_voi_grid grid2;
+    ln_voi_grid_build(grid2, voi_id2, nr_voi2, size_x, size_y, size_z, dX, dY, dZ);
+    std::vector<uint8_t> borders(nr_voxels, 0);
+    uint8_t* borders_data = borders.data();
+    for (uint32_t i = 0; i != nr_voxels; ++i) {
+        *(borders_data + i) = *(nii_rim_data + i) != 0 && *(nii_rim_data + i) != 3;
+    }
+    std::vector<uint8_t> jump_lock2;
+    ln_voi_grid_face_lock(grid2, borders.data(), jump_lock2);
+
+    // Combined output of all patches, each voxel takes the coordinates of the
+    // patch with the closest origin
+    nifti_image* combined_coords = NULL;
+    nifti_image* combined_patches = NULL;
+    std::vector<float> combined_norm;
+    if (mode_combined) {
+        combined_coords = nifti_copy_nim_info(nii_rim);
+        combined_coords->datatype = NIFTI_TYPE_FLOAT32;
+        combined_coords->dim[0] = 4;  // For proper 4D nifti
+        combined_coords->dim[4] = 2;
+        nifti_update_dims_from_array(combined_coords);
+        combined_coords->nvox = nr_voxels * 2;
+        combined_coords->nbyper = sizeof(float);
+        combined_coords->data = calloc(combined_coords->nvox, combined_coords->nbyper);
+        combined_patches = copy_nifti_as_int32(nii_rim);
+        for (uint32_t i = 0; i != nr_voxels; ++i) {
+            *(static_cast<int32_t*>(combined_patches->data) + i) = 0;
+        }
+        combined_norm.assign(nr_voxels, std::numeric_limits<float>::max());
+    }
+    std::mutex patch_mutex;
+
+    // Inputs shared by all patches
+    multilaterate_inputs in;
+    in.fout = fout;
+    in.thr_radius = thr_radius;
+    in.mode_debug = mode_debug;
+    in.mode_mask = mode_mask;
+    in.mode_norms = mode_norms;
+    in.mode_angles = mode_angles;
+    in.mode_batch = mode_batch;
+    in.mode_combined = mode_combined;
+    in.nii_rim = nii_rim;
+    in.control_points_in_data = control_points_in_data;
+    in.nr_volumes = nr_volumes;
+    in.patch_labels = &patch_labels;
+    in.voi_id = voi_id;
+    in.nr_voi = nr_voi;
+    in.voi_id2 = voi_id2;
+    in.nr_voi2 = nr_voi2;
+    in.grid = &grid;
+    in.grid2 = &grid2;
+    in.jump_lock2 = &jump_lock2;
+    in.combined_coords = combined_coords;
+    in.combined_patches = combined_patches;
+    in.combined_norm = &combined_norm;
+    in.patch_mutex = &patch_mutex;
+
+    // ========================================================================
+    // Run patches
+    // ========================================================================
+    int retval = 0;
+    if (!mode_batch) {
+        retval = run_patch(in, 0);
+    } else {
+        // With more than one thread, patches run in parallel
+        // (one patch per thread). Their logs would interleave, so they are
+        // replaced by one line per patch. Their stages are profiled as one.
+        const bool mode_parallel = ln_get_nr_threads() > 1 && nr_patches > 1;
+        std::vector<int> patch_retval(nr_patches, 0);
+        uint32_t nr_done = 0;
+        if (mode_parallel) {
+            cout << "\n  Running " << nr_patches << " patches on "
+                << std::min(static_cast<uint32_t>(ln_get_nr_threads()), nr_patches)
+                << " threads..." << endl;
+            cout.setstate(std::ios::failbit);
+            ln_profile_stage("patches");
+        }
+        ln_parallel_jobs(nr_patches, [&](uint32_t patch) {
+            if (!mode_parallel) {
+                cout << "\n  ====================\n  Patch " << patch + 1 << "/"
+                    << nr_patches << "\n  ====================" << endl;
+            }
+            patch_retval[patch] = run_patch(in, patch);
+            if (mode_parallel) {
+                std::lock_guard<std::mutex> lock(patch_mutex);
+                nr_done += 1;
+                printf("\r    Patch [%u/%u]", nr_done, nr_patches);
+                fflush(stdout);
+            }
+        });
+        cout.clear();
+        if (mode_parallel) {
+            cout << endl;
+        }
+
+        for (uint32_t patch = 0; patch != nr_patches; ++patch) {
+            if (patch_retval[patch] != 0) {
+                fprintf(stderr, "** patch %u/%u failed, check its control points\n",
+                        patch + 1, nr_patches);
+                retval = patch_retval[patch];
+            }
+        }
+        if (mode_combined) {
+            ln_profile_stage("combined outputs");
+            cout << "\n  Saving combined outputs..." << endl;
+            save_output_nifti(fout, "UV_coordinates", combined_coords, true);
+            save_output_nifti(fout, "patches", combined_patches, true);
+        }
+    }
+
+    nifti_image_free(nii_rim);
+    nifti_image_free(control_points_in);
+    nifti_image_free(combined_coords);
+    nifti_image_free(combined_patches);
+    free(voi_id);
+    free(voi_id2);
+    ln_crop_free(crop);
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
+    cout << "\n  Finished." << endl;
+    return retval;
+}
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char*  argv[]) {
+    return ln2_multilaterate_run(argc, argv);
+}
+#endif
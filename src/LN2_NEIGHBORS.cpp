@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <map>
 #include <set>
 #include <vector>
 #include <string>
@@ -86,10 +87,6 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_y = nii1->ny;
     const uint32_t size_z = nii1->nz;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
 
     // ========================================================================
@@ -198,140 +195,40 @@ int main(int argc, char*  argv[]) {
     // Find first order neighbors
     // ========================================================================
     cout << "  Start finding neighbors (3-jump neighborhood)..." << endl;
-    uint32_t i, j, ix, iy, iz, max_nr_neighbors = 0;
+    uint32_t i, j, max_nr_neighbors = 0;
 
-    // Loop through all unique labels
+    // Index of each label in the (ascending) order of the unique labels
+    std::map<int, int> label_index;
     int c = 0;
     for (int k : set_labels) {
-        set<uint32_t> set_neighbors;
-        // Loop though voxels
-        for (uint32_t ii = 0; ii != nr_voi; ++ii) {
-            // Map subset to full set
-            i = *(voi_id + ii);
-            if (*(nii_input_data + i) == k) {
-                *(idx_label_data + i) = c;
-
-                tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-
-                // ------------------------------------------------------------
-                // 1-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x) {
-                    j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y) {
-                    j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz > 0) {
-                    j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iz < end_z) {
-                    j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                // ------------------------------------------------------------
-                // 2-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y) {
-                    j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y) {
-                    j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-
-                // ------------------------------------------------------------
-                // 3-jump neighbours
-                // ------------------------------------------------------------
-                if (ix > 0 && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix > 0 && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy > 0 && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz > 0) {
-                    j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-                if (ix < end_x && iy < end_y && iz < end_z) {
-                    j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                    set_neighbors.insert(*(nii_input_data + j));
-                }
-            }
+        label_index[k] = c;
+        c += 1;
+    }
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        i = *(voi_id + ii);  // Map subset to full set
+        *(idx_label_data + i) = label_index[*(nii_input_data + i)];
+    }
+
+    // Collect the neighbours of all labels in one pass over the neighbour
+    // table. Zero voxels are not in the table, so they are never collected.
+    ln_voi_grid grid;
+    ln_voi_grid_build(grid, voi_id, nr_voi, size_x, size_y, size_z, 1, 1, 1);
+    std::vector<set<uint32_t>> label_neighbors(set_labels.size());
+    for (uint32_t ii = 0; ii != nr_voi; ++ii) {
+        i = *(voi_id + ii);
+        set<uint32_t>& set_neighbors = label_neighbors[*(idx_label_data + i)];
+        for (uint32_t k = grid.nbr_start[ii]; k != grid.nbr_start[ii + 1]; ++k) {
+            j = *(voi_id + grid.nbr_id[k]);
+            set_neighbors.insert(*(nii_input_data + j));
         }
+    }
+
+    // Loop through all unique labels
+    c = 0;
+    for (int k : set_labels) {
+        set<uint32_t>& set_neighbors = label_neighbors[c];
 
         // Remove unwanted elements
-        set_neighbors.erase(0);
         set_neighbors.erase(k);
 
         cout << "    Label " << k << " neighbors: ";
@@ -412,6 +309,9 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "neighbors", nii_output, true);
     }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
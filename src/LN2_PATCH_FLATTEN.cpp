@@ -1,8 +1,9 @@
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 #include <limits>
 #include <sstream>
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_PATCH_FLATTEN: Flatten a patch of cortex using 2D flat coordinates (U and V)\n"
     "                   and cortical a depth measurement (D). Intended to be used in\n"
@@ -43,9 +44,10 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char*  argv[]) {
+int ln2_patch_flatten_run(int argc, char*  argv[]) {
 
     nifti_image *nii1 = NULL, *nii2 = NULL, *nii3 = NULL, *nii4 = NULL;
+    nifti_image *nii1_hdr = NULL;
     char *fin1 = NULL, *fout = NULL, *fin2=NULL, *fin3=NULL, *fin4=NULL;
     int ac;
     int bins_u = 10, bins_v = 10, bins_d = 1;
@@ -137,33 +139,54 @@ int main(int argc, char*  argv[]) {
         return 1;
     }
 
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin1, 1);
+    // Read input dataset, including data. Only the bounding box of the domain
+    // is flattened, the other inputs are read within that box.
+    ln_crop crop;
+    if (!ln_crop_find(crop, {fin4})) {
+        return 2;
+    }
+    // Frees the inputs that are read so far, for the early returns below
+    auto free_inputs = [&]() {
+        nifti_image_free(nii1);
+        nifti_image_free(nii2);
+        nifti_image_free(nii3);
+        nifti_image_free(nii4);
+        nifti_image_free(nii1_hdr);
+        ln_crop_free(crop);
+    };
+    nii1 = ln_read_cropped(fin1, crop);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
+        free_inputs();
         return 2;
     }
-    nii2 = nifti_image_read(fin2, 1);
+    nii2 = ln_read_cropped(fin2, crop);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
+        free_inputs();
         return 2;
     }
-    nii3 = nifti_image_read(fin3, 1);
+    nii3 = ln_read_cropped(fin3, crop);
     if (!nii3) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin3);
+        free_inputs();
         return 2;
     }
-    nii4 = nifti_image_read(fin4, 1);
+    nii4 = ln_read_cropped(fin4, crop);
     if (!nii4) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin4);
+        free_inputs();
         return 2;
     }
+    // Header of the uncropped values, for the flat outputs
+    nii1_hdr = nifti_image_read(fin1, 0);
 
     log_welcome("LN2_PATCH_FLATTEN");
     log_nifti_descriptives(nii1);
     log_nifti_descriptives(nii2);
     log_nifti_descriptives(nii3);
     log_nifti_descriptives(nii4);
+    log_crop_descriptives(crop);
 
     // Get dimensions of input
     const int size_x = nii1->nx;
@@ -172,35 +195,43 @@ int main(int argc, char*  argv[]) {
     const int size_time = nii1->nt;
     const int nr_voxels = size_z * size_y * size_x;
 
-    // ========================================================================
-    // Fix input datatype issues
-    // ========================================================================
-    nifti_image* nii_input = copy_nifti_as_float32(nii1);
-    float* nii_input_data = static_cast<float*>(nii_input->data);
-    nifti_image* coords_uv = copy_nifti_as_float32(nii2);
-    float* coords_uv_data = static_cast<float*>(coords_uv->data);
-    nifti_image* coords_d = copy_nifti_as_float32(nii3);
-    float* coords_d_data = static_cast<float*>(coords_d->data);
-    nifti_image* domain = copy_nifti_as_int32(nii4);
-    int32_t* domain_data = static_cast<int32_t*>(domain->data);
-
     // ========================================================================
     // Determine the type of depth file
     // ========================================================================
     float min_d = std::numeric_limits<float>::max();
     float max_d = std::numeric_limits<float>::min();
 
-    // Check D coordinate min & max
-    for (int i = 0; i != nr_voxels; ++i) {
-        if (*(coords_d_data + i) != 0) {
-            if (*(coords_d_data + i) < min_d) {
-                min_d = *(coords_d_data + i);
-            }
-            if (*(coords_d_data + i) > max_d) {
-                max_d = *(coords_d_data + i);
+    // Check D coordinate min & max, over the whole depth image
+    nifti_image* nii3_full = nifti_image_read(fin3, 0);
+    const int nr_slices = ln_slab_nr_slices(nii3_full, 1);
+    std::vector<float> slab(nii3_full->nx * nii3_full->ny * nr_slices);
+    ln_slab_reader reader;
+    if (!ln_slab_reader_open(reader, nii3_full, nr_slices)) {
+        nifti_image_free(nii3_full);
+        free_inputs();
+        return 2;
+    }
+    for (int z0 = 0; z0 < nii3_full->nz; z0 += nr_slices) {
+        const int n = std::min(nr_slices, static_cast<int>(nii3_full->nz) - z0);
+        if (!ln_read_slab(reader, z0, n, slab.data())) {
+            ln_slab_reader_close(reader);
+            nifti_image_free(nii3_full);
+            free_inputs();
+            return 2;
+        }
+        for (int i = 0; i != nii3_full->nx * nii3_full->ny * n; ++i) {
+            if (slab[i] != 0) {
+                if (slab[i] < min_d) {
+                    min_d = slab[i];
+                }
+                if (slab[i] > max_d) {
+                    max_d = slab[i];
+                }
             }
         }
     }
+    ln_slab_reader_close(reader);
+    nifti_image_free(nii3_full);
 
     // Determine whether depth input is a metric file or a layer file
     bool mode_depth_metric = false;
@@ -212,9 +243,22 @@ int main(int argc, char*  argv[]) {
         mode_depth_metric = false;
     } else {
         cout << "  ERROR! Depth input contains negative values!" << endl;
+        free_inputs();
         return 1;
     }
 
+    // ========================================================================
+    // Fix input datatype issues
+    // ========================================================================
+    nifti_image* nii_input = copy_nifti_as_float32(nii1);
+    float* nii_input_data = static_cast<float*>(nii_input->data);
+    nifti_image* coords_uv = copy_nifti_as_float32(nii2);
+    float* coords_uv_data = static_cast<float*>(coords_uv->data);
+    nifti_image* coords_d = copy_nifti_as_float32(nii3);
+    float* coords_d_data = static_cast<float*>(coords_d->data);
+    nifti_image* domain = copy_nifti_as_int32(nii4);
+    int32_t* domain_data = static_cast<int32_t*>(domain->data);
+
     // ========================================================================
     // Prepare outputs
     // ========================================================================
@@ -241,7 +285,7 @@ int main(int argc, char*  argv[]) {
     tag_d << bins_d;
 
     // Allocating new 4D nifti for flat images
-    nifti_image* flat_4D = nifti_copy_nim_info(nii1);
+    nifti_image* flat_4D = nifti_copy_nim_info(nii1_hdr);
     flat_4D->datatype = NIFTI_TYPE_INT32;
     flat_4D->dim[0] = 4;  // For proper 4D nifti
     flat_4D->dim[1] = bins_u;
@@ -268,7 +312,7 @@ int main(int argc, char*  argv[]) {
 
     // ------------------------------------------------------------------------
     // Allocating new 3D nifti for flat images
-    nifti_image* flat_3D = nifti_copy_nim_info(nii1);
+    nifti_image* flat_3D = nifti_copy_nim_info(nii1_hdr);
     flat_3D->datatype = NIFTI_TYPE_INT32;
     flat_3D->dim[0] = 4;  // For proper 4D nifti
     flat_3D->dim[1] = bins_u;
@@ -299,7 +343,7 @@ int main(int argc, char*  argv[]) {
     // ------------------------------------------------------------------------
     // Allocating new 4D nifti for saveing the folded image coordinates in the 
     // flat image format. This is for back projection from flat to folded.
-    nifti_image* flat_coords = nifti_copy_nim_info(nii1);
+    nifti_image* flat_coords = nifti_copy_nim_info(nii1_hdr);
     flat_coords->datatype = NIFTI_TYPE_FLOAT32;
     flat_coords->dim[0] = 4;  // For proper 4D nifti
     flat_coords->dim[1] = bins_u;
@@ -419,9 +463,9 @@ int main(int argc, char*  argv[]) {
             // Project folded data coordinates
             int ix, iy, iz;
             tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-            *(flat_coords_data + k + nr_bins*0) += static_cast<float>(ix);
-            *(flat_coords_data + k + nr_bins*1) += static_cast<float>(iy);
-            *(flat_coords_data + k + nr_bins*2) += static_cast<float>(iz);
+            *(flat_coords_data + k + nr_bins*0) += static_cast<float>(ix + crop.start[0]);
+            *(flat_coords_data + k + nr_bins*1) += static_cast<float>(iy + crop.start[1]);
+            *(flat_coords_data + k + nr_bins*2) += static_cast<float>(iz + crop.start[2]);
 
             if (t==0) {  // Write 3D values once
                 *(flat_density_data + k) += 1;
@@ -455,464 +499,55 @@ int main(int argc, char*  argv[]) {
     if (mode_voronoi) {
         cout << "\n  Start Voronoi (nearest neighbor) filling-in..." << endl;
 
-        // Prepare additional flat niftis
-        nifti_image* flood_step = copy_nifti_as_float32(flat_4D);
-        float* flood_step_data = static_cast<float*>(flood_step->data);
-        nifti_image* flood_dist = copy_nifti_as_float32(flat_4D);
-        float* flood_dist_data = static_cast<float*>(flood_dist->data);
-
-        // --------------------------------------------------------------------
-        const int size_x = bins_u;
-        const int size_y = bins_v;
-        const int size_z = bins_d;
-        const int end_x = size_x - 1;
-        const int end_y = size_y - 1;
-        const int end_z = size_z - 1;
-
-        const float dX = 1;
-        const float dY = 1;
-        const float dZ = 1;
-
-        // Short diagonals
-        const float dia_xy = sqrt(dX * dX + dY * dY);
-        const float dia_xz = sqrt(dX * dX + dZ * dZ);
-        const float dia_yz = sqrt(dY * dY + dZ * dZ);
-        // Long diagonals
-        const float dia_xyz = sqrt(dX * dX + dY * dY + dZ * dZ);
-
-        for (int t=0; t!=size_time; ++t) {
-            // Initialize grow volume
+        // The propagation only depends on which bins are filled,
+        // not on their values. The source bin of each bin is therefore found
+        // once, with a flood of bin indices, and applied to all timepoints as
+        // a gather. The flood is only repeated for a timepoint when its filled
+        // bins differ from the previous flood.
+        std::vector<int32_t> bin_id(nr_bins);
+        for (int i = 0; i != nr_bins; ++i) {
+            bin_id[i] = i;
+        }
+        ln_voi_grid grid;
+        ln_voi_grid_build(grid, bin_id.data(), nr_bins, bins_u, bins_v, bins_d, 1, 1, 1);
+
+        std::vector<uint8_t> filled(nr_bins), flood_filled;
+        std::vector<int32_t> flood_source(nr_bins), flood_step(nr_bins);
+        std::vector<float> flood_dist(nr_bins), temp(nr_bins);
+        int nr_floods = 0;
+
+        for (int t = 0; t != size_time; ++t) {
+            float* values_t = flat_values_data + t*nr_bins;
             for (int i = 0; i != nr_bins; ++i) {
-                if (*(flat_values_data + i + t*nr_bins) != 0) {
-                    *(flood_step_data + i) = 1.;
-                    *(flood_dist_data + i) = 0.;
-                } else {
-                    *(flood_step_data + i) = 0.;
-                    *(flood_dist_data + i) = 0.;
-                }
+                filled[i] = *(values_t + i) != 0;
             }
-            int grow_step = 1, bin_counter = 1;
-            int ix, iy, iz, j;
-            float d;
-            if (size_time > 1) {
-                cout << "  Doing 4th dimension: " << t+1 << endl;
+            if (filled != flood_filled) {
+                // Initialize grow volume
+                for (int i = 0; i != nr_bins; ++i) {
+                    flood_step[i] = filled[i];
+                    flood_dist[i] = 0;
+                    flood_source[i] = i;
+                }
+                ln_grow_geodesic_voi(grid, NULL, flood_dist.data(), flood_step.data(),
+                                     flood_source.data(), NULL);
+                flood_filled = filled;
+                nr_floods += 1;
             }
-            bin_counter = nr_bins;
 
-            while (bin_counter != 0) {
-                bin_counter = 0;
+            // Copy values from source bins, 3D values are propagated again
+            // for every timepoint as well
+            float* gather_data[6] = {values_t, flat_density_data, flat_domain_data,
+                                     flat_coords_data + nr_bins*0,
+                                     flat_coords_data + nr_bins*1,
+                                     flat_coords_data + nr_bins*2};
+            for (float* data : gather_data) {
+                temp.assign(data, data + nr_bins);
                 for (int i = 0; i != nr_bins; ++i) {
-                    if (*(flood_step_data + i) == grow_step) {
-                        tie(ix, iy, iz) = ind2sub_3D(i, size_x, size_y);
-                        bin_counter += 1;
-
-                        // --------------------------------------------------------
-                        // 1-jump neighbours
-                        // --------------------------------------------------------
-                        if (ix > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x) {
-                            j = sub2ind_3D(ix+1, iy, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dX;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y) {
-                            j = sub2ind_3D(ix, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dY;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iz > 0) {
-                            j = sub2ind_3D(ix, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iz < end_z) {
-                            j = sub2ind_3D(ix, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dZ;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-
-                        // --------------------------------------------------------
-                        // 2-jump neighbours
-                        // --------------------------------------------------------
-
-                        if (ix > 0 && iy > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y) {
-                            j = sub2ind_3D(ix-1, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y) {
-                            j = sub2ind_3D(ix+1, iy+1, iz, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xy;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_yz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-
-                        // --------------------------------------------------------
-                        // 3-jump neighbours
-                        // --------------------------------------------------------
-                        if (ix > 0 && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix-1, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy-1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix > 0 && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix-1, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy > 0 && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy-1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz > 0) {
-                            j = sub2ind_3D(ix+1, iy+1, iz-1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                        if (ix < end_x && iy < end_y && iz < end_z) {
-                            j = sub2ind_3D(ix+1, iy+1, iz+1, size_x, size_y);
-                            d = *(flood_dist_data + i) + dia_xyz;
-                            if (d < *(flood_dist_data + j)
-                                || *(flood_dist_data + j) == 0) {
-                                *(flat_values_data + j + t*nr_bins) = *(flat_values_data + i + t*nr_bins);
-                                *(flood_dist_data + j) = d;
-                                *(flood_step_data + j) = grow_step + 1;
-                                *(flat_density_data + j) = *(flat_density_data + i);
-                                *(flat_domain_data + j) = *(flat_domain_data + i);
-                                *(flat_coords_data + nr_bins*0 + j) = *(flat_coords_data + nr_bins*0 + i);
-                                *(flat_coords_data + nr_bins*1 + j) = *(flat_coords_data + nr_bins*1 + i);
-                                *(flat_coords_data + nr_bins*2 + j) = *(flat_coords_data + nr_bins*2 + i);
-                            }
-                        }
-                    }
+                    *(data + i) = temp[flood_source[i]];
                 }
-            grow_step += 1;
             }
         }
+        cout << "    Nr. of Voronoi floods: " << nr_floods << endl;
 
         // NOTE(Option 2) Mask values based on radius
         if (mode_norm_mask) {
@@ -954,7 +589,10 @@ int main(int argc, char*  argv[]) {
         }
     } else {
         if (mode_debug) {
-            save_output_nifti(fout, "UV_bins_"+tag_u.str()+"x"+tag_v.str()+"x"+tag_d.str(), out_cells, true);
+            nifti_image* out_cells_full = ln_uncrop_nifti(out_cells, crop);
+            save_output_nifti(fout, "UV_bins_"+tag_u.str()+"x"+tag_v.str()+"x"+tag_d.str(),
+                              out_cells_full, true);
+            nifti_image_free(out_cells_full);
         }
         save_output_nifti(fout, "flat_"+tag_u.str()+"x"+tag_v.str()+"x"+tag_d.str(), flat_values, true);
         save_output_nifti(fout, "flat_"+tag_u.str()+"x"+tag_v.str()+"x"+tag_d.str()+"_foldedcoords", flat_coords, true);
@@ -967,6 +605,29 @@ int main(int argc, char*  argv[]) {
 
     }
 
+    nifti_image_free(nii_input);
+    nifti_image_free(coords_uv);
+    nifti_image_free(coords_d);
+    nifti_image_free(domain);
+    nifti_image_free(out_cells);
+    nifti_image_free(flat_4D);
+    nifti_image_free(flat_values);
+    nifti_image_free(flat_3D);
+    nifti_image_free(flat_density);
+    nifti_image_free(flat_domain);
+    nifti_image_free(flat_coords);
+    free(voi_id);
+    free_inputs();
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char*  argv[]) {
+    return ln2_patch_flatten_run(argc, argv);
+}
+#endif
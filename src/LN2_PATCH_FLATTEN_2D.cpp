@@ -573,6 +573,9 @@ int main(int argc, char*  argv[]) {
 
     }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
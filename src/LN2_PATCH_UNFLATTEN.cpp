@@ -84,7 +84,9 @@ int main(int argc, char*  argv[]) {
         return 1;
     }
 
-    // Read input dataset, including data
+    // Read input dataset, including data. Inputs are only read, so
+    // uncompressed data is mapped from the file instead of copied.
+    nifti_set_mmap_read(1);
     nii1 = nifti_image_read(fin1, 1);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
@@ -175,6 +177,9 @@ int main(int argc, char*  argv[]) {
     save_output_nifti(fout, "unflattened", folded, true);
     save_output_nifti(fout, "unflattened_density", folded_density, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -341,6 +341,9 @@ int main(int argc, char* argv[]) {
 
     save_output_nifti(fout, "peaks", nii_output, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -0,0 +1,253 @@
+
+#include "../dep/laynii_lib.h"
+
+int show_help(void) {
+    printf(
+    "LN2_PHANTOM: Generate a synthetic rim file (and matching inputs) of any\n"
+    "             size and resolution. Useful for testing and for measuring\n"
+    "             how programs scale with the number of voxels.\n"
+    "\n"
+    "Usage:\n"
+    "    LN2_PHANTOM -shape sphere -size 64 -res 1\n"
+    "    LN2_PHANTOM -shape folded -size 128 -res 0.5 -nr_volumes 20 -output folded.nii.gz\n"
+    "\n"
+    "Options:\n"
+    "    -help       : Show this help.\n"
+    "    -shape      : 'sphere' (default) for a spherical shell of gray matter,\n"
+    "                  'folded' for a sheet of gray matter folded by sinusoids.\n"
+    "    -size       : (Optional) Field of view along each axis in mm. '64' by\n"
+    "                  default. Needs to be at least 20.\n"
+    "    -res        : (Optional) Isotropic voxel size in mm. '1' by default.\n"
+    "    -thickness  : (Optional) Gray matter thickness in mm. '3' by default.\n"
+    "    -nr_volumes : (Optional) Also generate nulled and not nulled (BOLD)\n"
+    "                  time series with this many volumes, e.g. for LN_BOCO.\n"
+    "    -output     : (Optional) Output basename for all outputs.\n"
+    "                  'phantom.nii.gz' by default.\n"
+    "\n"
+    "Outputs:\n"
+    "    - rim            : Rim file, 1 = outer border, 2 = inner border, 3 = gray matter.\n"
+    "    - midgm          : Middle gray matter (e.g. for LN2_COLUMNS).\n"
+    "    - control_points : Middle gray matter with one voxel labeled 2 (e.g. for\n"
+    "                       LN2_MULTILATERATE).\n"
+    "    - act            : Activation increasing with cortical depth, modulated\n"
+    "                       by a columnar pattern.\n"
+    "    - nulled, bold   : Time series with a block design (see -nr_volumes).\n"
+    "\n"
+    "Notes:\n"
+    "    - The outputs are deterministic, so that timings of different runs\n"
+    "      and LayNii versions can be compared (see test_data/bench.sh).\n"
+    "\n");
+    return 0;
+}
+
+// Small deterministic noise generator, values in [-1, 1]
+static float phantom_noise(uint64_t seed) {
+    seed ^= seed >> 33;
+    seed *= 0xff51afd7ed558ccdULL;
+    seed ^= seed >> 33;
+    seed *= 0xc4ceb9fe1a85ec53ULL;
+    seed ^= seed >> 33;
+    return static_cast<float>(seed >> 40) / static_cast<float>(1 << 23) - 1;
+}
+
+static nifti_image* phantom_nifti(const int64_t size, const int64_t nr_volumes,
+                                  const float res, const int datatype) {
+    const int64_t dims[8] = {nr_volumes > 1 ? 4 : 3, size, size, size,
+                             nr_volumes > 1 ? nr_volumes : 1, 1, 1, 1};
+    nifti_image* nii = nifti_make_new_nim(dims, datatype, 1);
+    // Unused dimensions are 1 (not 0), as in headers written by other tools
+    for (int c = nii->ndim + 1; c != 8; ++c) {
+        nii->dim[c] = 1;
+    }
+    nii->pixdim[1] = nii->pixdim[2] = nii->pixdim[3] = res;
+    nifti_update_dims_from_array(nii);
+    nii->xyz_units = NIFTI_UNITS_MM;
+    nii->qform_code = NIFTI_XFORM_SCANNER_ANAT;
+    nii->quatern_b = nii->quatern_c = nii->quatern_d = 0;
+    nii->qfac = 1;
+    nii->qoffset_x = nii->qoffset_y = nii->qoffset_z = 0;
+    return nii;
+}
+
+int main(int argc, char* argv[]) {
+    char* fout = NULL;
+    string shape = "sphere";
+    float size_mm = 64, res = 1, thickness = 3;
+    int nr_volumes = 0;
+    int ac;
+
+    // Process user options
+    for (ac = 1; ac < argc; ac++) {
+        if (!strncmp(argv[ac], "-h", 2)) {
+            return show_help();
+        } else if (!strcmp(argv[ac], "-shape")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -shape\n");
+                return 1;
+            }
+            shape = argv[ac];
+        } else if (!strcmp(argv[ac], "-size")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -size\n");
+                return 1;
+            }
+            size_mm = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-res")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -res\n");
+                return 1;
+            }
+            res = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-thickness")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -thickness\n");
+                return 1;
+            }
+            thickness = atof(argv[ac]);
+        } else if (!strcmp(argv[ac], "-nr_volumes")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -nr_volumes\n");
+                return 1;
+            }
+            nr_volumes = atoi(argv[ac]);
+        } else if (!strcmp(argv[ac], "-output")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -output\n");
+                return 1;
+            }
+            fout = argv[ac];
+        } else {
+            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
+            return 1;
+        }
+    }
+
+    string path_out = fout ? fout : "phantom.nii.gz";
+    const bool mode_sphere = shape == "sphere";
+    if (!mode_sphere && shape != "folded") {
+        fprintf(stderr, "** invalid shape '%s', use 'sphere' or 'folded'\n", shape.c_str());
+        return 1;
+    }
+    if (size_mm < 20 || res <= 0 || thickness <= 0 || thickness > size_mm / 8) {
+        fprintf(stderr, "** invalid -size, -res or -thickness\n");
+        return 1;
+    }
+
+    log_welcome("LN2_PHANTOM");
+
+    const int64_t size = static_cast<int64_t>(size_mm / res + 0.5);
+    const int64_t nr_voxels = size * size * size;
+    cout << "  Shape: " << shape << endl;
+    cout << "  Image size: " << size << " X | " << size << " Y | " << size << " Z" << endl;
+    cout << "  Voxel size: " << res << " mm" << endl;
+    cout << "  Thickness: " << thickness << " mm" << endl;
+
+    // ========================================================================
+    // Cortical depth
+    // ========================================================================
+    // Depth is the distance in mm from the inner gray matter
+    // surface. For the sphere it is measured along the radius, for the folded
+    // sheet along z. The folded sheet is therefore only approximately of
+    // constant thickness where it is steep. Its slope stays below 1, so that
+    // the one voxel thick borders and middle gray matter stay connected.
+    const float center = size * res / 2;
+    const float radius_in = size * res / 4;
+    const float amplitude = size * res / 16;
+    const float wavelength = size * res / 2;
+    const float two_pi = 6.28318530718;
+
+    nifti_image* nii_rim = phantom_nifti(size, 1, res, NIFTI_TYPE_INT16);
+    nifti_image* nii_midgm = phantom_nifti(size, 1, res, NIFTI_TYPE_INT16);
+    nifti_image* nii_act = phantom_nifti(size, 1, res, NIFTI_TYPE_FLOAT32);
+    int16_t* rim_data = static_cast<int16_t*>(nii_rim->data);
+    int16_t* midgm_data = static_cast<int16_t*>(nii_midgm->data);
+    float* act_data = static_cast<float*>(nii_act->data);
+
+    // Control point target, the middle gray matter voxel closest to it is used
+    const float target[3] = {center, center,
+        mode_sphere ? center + radius_in + thickness / 2 : center};
+    int64_t control_point = -1;
+    float control_dist = std::numeric_limits<float>::max();
+    int64_t nr_gm = 0;
+
+    for (int64_t i = 0; i != nr_voxels; ++i) {
+        const float x = (i % size + 0.5) * res;
+        const float y = (i / size % size + 0.5) * res;
+        const float z = (i / (size * size) + 0.5) * res;
+
+        float depth;
+        if (mode_sphere) {
+            depth = sqrt((x - center) * (x - center) + (y - center) * (y - center)
+                         + (z - center) * (z - center)) - radius_in;
+        } else {
+            depth = z - (center - thickness / 2 + amplitude
+                         * sin(two_pi * x / wavelength) * sin(two_pi * y / wavelength));
+        }
+
+        if (depth >= -res && depth < 0) {
+            rim_data[i] = 2;
+        } else if (depth >= thickness && depth < thickness + res) {
+            rim_data[i] = 1;
+        } else if (depth >= 0 && depth < thickness) {
+            rim_data[i] = 3;
+            nr_gm += 1;
+            act_data[i] = (1 + depth / thickness)
+                * (1.5 + 0.5 * sin(two_pi * x / 10) * sin(two_pi * y / 10));
+            if (std::abs(depth - thickness / 2) < res / 2) {
+                midgm_data[i] = 1;
+                const float d = dist(x, y, z, target[0], target[1], target[2], 1, 1, 1);
+                if (d < control_dist) {
+                    control_dist = d;
+                    control_point = i;
+                }
+            }
+        }
+    }
+    cout << "  Nr. gray matter voxels: " << nr_gm << endl;
+    if (control_point < 0) {
+        fprintf(stderr, "** no middle gray matter voxels, use a smaller -res\n");
+        return 2;
+    }
+
+    nifti_image* nii_control = copy_nifti_as_int16(nii_midgm);
+    static_cast<int16_t*>(nii_control->data)[control_point] = 2;
+
+    cout << "\n  Saving outputs..." << endl;
+    save_output_nifti(path_out, "rim", nii_rim);
+    save_output_nifti(path_out, "midgm", nii_midgm);
+    save_output_nifti(path_out, "control_points", nii_control);
+    save_output_nifti(path_out, "act", nii_act);
+
+    // ========================================================================
+    // Time series
+    // ========================================================================
+    // Blocks of 10 volumes rest and 10 volumes activity. During
+    // activity the BOLD signal goes up and the nulled (VASO) signal goes down
+    // in gray matter. One percent noise is added everywhere.
+    if (nr_volumes > 0) {
+        nifti_image* nii_nulled = phantom_nifti(size, nr_volumes, res, NIFTI_TYPE_FLOAT32);
+        nifti_image* nii_bold = phantom_nifti(size, nr_volumes, res, NIFTI_TYPE_FLOAT32);
+        float* nulled_data = static_cast<float*>(nii_nulled->data);
+        float* bold_data = static_cast<float*>(nii_bold->data);
+
+        for (int64_t t = 0; t != nr_volumes; ++t) {
+            const float on = (t / 10) % 2 == 1 ? 1 : 0;
+            for (int64_t i = 0; i != nr_voxels; ++i) {
+                const float gm = rim_data[i] == 3 ? 1 : 0;
+                const uint64_t seed = 2 * (t * nr_voxels + i);
+                bold_data[t * nr_voxels + i] = 1000
+                    * (1 + 0.03 * on * gm + 0.01 * phantom_noise(seed));
+                nulled_data[t * nr_voxels + i] = 600
+                    * (1 - 0.02 * on * gm + 0.01 * phantom_noise(seed + 1));
+            }
+        }
+        save_output_nifti(path_out, "nulled", nii_nulled);
+        save_output_nifti(path_out, "bold", nii_bold);
+    }
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
+    cout << "\n  Finished." << endl;
+    return 0;
+}
@@ -252,6 +252,9 @@ int main(int argc, char*  argv[]) {
         save_output_nifti(fout, "phase_gradient_z", nii_gra_z, true);
     }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
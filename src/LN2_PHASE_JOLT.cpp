@@ -486,6 +486,9 @@ int main(int argc, char*  argv[]) {
     }
     save_output_nifti(fout, "phase_jolt", nii_divergence, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -286,6 +286,9 @@ int main(int argc, char*  argv[]) {
 
     save_output_nifti(fout, "phase_laplacian", nii_laplacian, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
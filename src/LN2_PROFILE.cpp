@@ -7,8 +7,9 @@
 #include <iomanip>
 
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_PROFILE: Generates layer profiles from 3D nii file based on layer masks.\n"
     "             It averages all the signal intensities of each layer and write it\n"
@@ -51,7 +52,7 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char*  argv[]) {
+int ln2_profile_run(int argc, char*  argv[]) {
     uint16_t ac;
     nifti_image *nii1 = NULL;
     nifti_image *niil = NULL;
@@ -113,28 +114,43 @@ int main(int argc, char*  argv[]) {
         return 1;
     }
 
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin, 1);
+    // Read input dataset, including data. Only the bounding box of the layers
+    // is needed (voxels outside have no layer), so only the box is read.
+    // When the box is the whole image, uncompressed inputs are mapped from
+    // the file instead of copied, as they are only read.
+    nifti_set_mmap_read(1);
+    ln_crop crop;
+    if (!ln_crop_find(crop, {finl})) {
+        return 2;
+    }
+    nii1 = ln_read_cropped(fin, crop);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
+        ln_crop_free(crop);
         return 2;
     }
-    niil = nifti_image_read(finl, 1);
+    niil = ln_read_cropped(finl, crop);
     if (!niil) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", finl);
+        nifti_image_free(nii1);
+        ln_crop_free(crop);
         return 2;
     }
     
     if (use_mask == true) {
-        niim = nifti_image_read(finm, 1);
+        niim = ln_read_cropped(finm, crop);
         if (!niim) {
             fprintf(stderr, "** failed to read NIfTI from '%s'\n", finm);
+            nifti_image_free(nii1);
+            nifti_image_free(niil);
+            ln_crop_free(crop);
             return 2;
         }
     }
     
     log_welcome("LN2_PROFILE");
     log_nifti_descriptives(nii1);
+    log_crop_descriptives(crop);
 
     // Get dimensions of input
     const uint32_t size_x = nii1->nx;
@@ -174,11 +190,12 @@ int main(int argc, char*  argv[]) {
 	  nifti_image* mask = copy_nifti_as_int16(niim);
       int16_t* mask_data = static_cast<int16_t*>(mask->data);	
       
-	  for (int j = 0; j != nr_voxels; ++j) {
+	  for (uint32_t j = 0; j != nr_voxels; ++j) {
             if (*(mask_data + j) == 0  ) {
                 *(layers_data + j) = 0 ;
             }
         }
+        nifti_image_free(mask);
     }
     
     
@@ -206,7 +223,7 @@ int main(int argc, char*  argv[]) {
     // Look how many voxels we have per layer
     // ========================================================================
     for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
+        for (uint32_t j = 0; j != nr_voxels; ++j) {
             if (*(layers_data + j) == i+1 ) {
                 numb_voxels[i] ++;
             }
@@ -232,7 +249,7 @@ int main(int argc, char*  argv[]) {
     int dummy_index = 0;
 
     for(int i = 0; i < nr_layers; i++) {
-        for (int j = 0; j != nr_voxels; ++j) {
+        for (uint32_t j = 0; j != nr_voxels; ++j) {
             if (*(layers_data + j) == i+1 ) {
                 vec1[dummy_index] = *(act_data + j) ;
                 dummy_index ++;
@@ -407,6 +424,22 @@ int main(int argc, char*  argv[]) {
    // save_output_nifti(fout, "output1", act, true, use_outpath);
    // save_output_nifti(fout, "output2", layers, true, use_outpath);
 
+    nifti_image_free(nii1);
+    nifti_image_free(niil);
+    nifti_image_free(niim);
+    nifti_image_free(layers);
+    nifti_image_free(act);
+    ln_crop_free(crop);
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char*  argv[]) {
+    return ln2_profile_run(argc, argv);
+}
+#endif
@@ -14,6 +14,9 @@ int show_help(void) {
     "    -input1 : First timeseries nifti (4D)"
     "    -input2 : Second timeseries nifti (4D)"
     "    -output : (Optional) Output basename for all outputs.\n"
+    "    -max_mem: (Optional) Memory budget in MB. Time series are read and\n"
+    "              written in slabs of slices that fit this budget. '2048'\n"
+    "              by default.\n"
     "    -debug  : (Optional) Save extra intermediate outputs.\n"
     "\n"
     "\n");
@@ -52,6 +55,12 @@ int main(int argc, char*  argv[]) {
                 return 1;
             }
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -63,14 +72,14 @@ int main(int argc, char*  argv[]) {
         return 1;
     }
 
-    // Read input dataset, including data
-    nii1 = nifti_image_read(fin1, 1);
+    // Read input headers, data is streamed in slabs below
+    nii1 = nifti_image_read(fin1, 0);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin1);
         return 2;
     }
 
-    nii2 = nifti_image_read(fin2, 1);
+    nii2 = nifti_image_read(fin2, 0);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin2);
         return 2;
@@ -86,31 +95,39 @@ int main(int argc, char*  argv[]) {
     const uint32_t size_z = nii1->nz;
     const uint32_t size_time = nii1->nt;
 
-    const uint32_t end_x = size_x - 1;
-    const uint32_t end_y = size_y - 1;
-    const uint32_t end_z = size_z - 1;
-
     const uint32_t nr_voxels = size_z * size_y * size_x;
+    const uint32_t nxy = size_y * size_x;
+
+    if (nii2->nx != nii1->nx || nii2->ny != nii1->ny || nii2->nz != nii1->nz
+        || nii2->nvox != nii1->nvox) {
+        fprintf(stderr, "** '-input1' and '-input2' dimensions do not match\n");
+        return 2;
+    }
 
     // ========================================================================
     // Fix input datatype issues
     // ========================================================================
-    nifti_image* nii_input1 = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii1);
-    float* nii_input1_data = static_cast<float*>(nii_input1->data);
-    nifti_image* nii_input2 = copy_nifti_as_float32_with_scl_slope_and_scl_inter(nii2);
-    float* nii_input2_data = static_cast<float*>(nii_input2->data);
-
-    // Prepare output image
-    nifti_image* nii_residual = copy_nifti_as_float32(nii_input1);
-    float* nii_residual_data = static_cast<float*>(nii_residual->data);
-
-    // Set to zero
-    for (uint32_t i = 0; i != nr_voxels*size_time; ++i) {
-        *(nii_residual_data + i) = 0;
+    // Inputs are read in slabs of slices across all time points,
+    // with scl_slope and scl_inter applied. Fitted timeseries and residuals
+    // are written slab by slab.
+    cout << "  Nifti header 'scl slope': " << nii1->scl_slope <<endl;
+    cout << "  Nifti header 'scl inter': " << nii1->scl_inter <<endl;
+    cout << "  Nifti header 'scl slope': " << nii2->scl_slope <<endl;
+    cout << "  Nifti header 'scl inter': " << nii2->scl_inter <<endl;
+
+    // Prepare output images
+    nifti_image* nii_residual = nifti_copy_nim_info(nii1);
+    if (nii1->scl_slope != 0) {
+        nii_residual->scl_slope = 1.;
+        nii_residual->scl_inter = 0.;
     }
+    nifti_image* nii_predicted = nifti_copy_nim_info(nii_residual);
 
-    nifti_image* nii_predicted = copy_nifti_as_float32(nii_residual);
-    float* nii_predicted_data = static_cast<float*>(nii_predicted->data);
+    ln_slab_writer writer_predicted, writer_residual;
+    if (!ln_slab_writer_open(writer_predicted, nii_predicted, fout, "fitted")
+        || !ln_slab_writer_open(writer_residual, nii_residual, fout, "residuals")) {
+        return 2;
+    }
 
     // Create a 4D nifti image for point distances
     nifti_image *nii_intercept = NULL;
@@ -136,65 +153,106 @@ int main(int argc, char*  argv[]) {
     nifti_image* nii_meany = copy_nifti_as_float32(nii_intercept);
     float* nii_meany_data = static_cast<float*>(nii_meany->data);
 
-    // ========================================================================
-    cout << "  Calculating means..." << endl;
-    // ========================================================================
-    float n = static_cast<float>(size_time);
-    for (uint32_t t = 0; t != size_time; ++t) {
-        for (uint32_t i = 0; i != nr_voxels; ++i) {
-            *(nii_meany_data + i) += *(nii_input1_data + i + nr_voxels*t) / n;
-            *(nii_meanx_data + i) += *(nii_input2_data + i + nr_voxels*t) / n;
-        }
+    // Slab buffers: two inputs, fitted timeseries and residuals
+    const int slab_size = ln_slab_nr_slices(nii1, 4);
+    std::vector<float> slab1(static_cast<int64_t>(nxy) * slab_size * size_time);
+    std::vector<float> slab2(slab1.size()), slab_predicted(slab1.size());
+    std::vector<float> slab_residual(slab1.size());
+    ln_slab_reader reader1, reader2;
+    if (!ln_slab_reader_open(reader1, nii1, slab_size)
+        || !ln_slab_reader_open(reader2, nii2, slab_size)) {
+        return 2;
     }
 
-    // ========================================================================
-    cout << "  Calculating slope and intercept..." << endl;
-    // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        float y_mean = *(nii_meany_data + i);
-        float x_mean = *(nii_meanx_data + i);
-        float term1 = 0, term2 = 0;
-
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float y = *(nii_input1_data + i + nr_voxels*t);
-            float x = *(nii_input2_data + i + nr_voxels*t);
-            term1 += (x - x_mean) * (y - y_mean);
-            term2 += (x - x_mean) * (x - x_mean);
+    for (uint32_t z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const uint32_t nr_slices = min(static_cast<uint32_t>(slab_size), size_z - z_begin);
+        const uint32_t slab_voxels = nxy * nr_slices;
+        float* nii_input1_data = slab1.data();
+        float* nii_input2_data = slab2.data();
+        float* nii_predicted_data = slab_predicted.data();
+        float* nii_residual_data = slab_residual.data();
+        float* slab_meanx_data = nii_meanx_data + nxy * z_begin;
+        float* slab_meany_data = nii_meany_data + nxy * z_begin;
+        float* slab_slope_data = nii_slope_data + nxy * z_begin;
+        float* slab_intercept_data = nii_intercept_data + nxy * z_begin;
+
+        if (!ln_read_slab(reader1, z_begin, nr_slices, nii_input1_data, true)
+            || !ln_read_slab(reader2, z_begin, nr_slices, nii_input2_data, true)) {
+            return 2;
         }
 
-        *(nii_slope_data + i) = term1 / term2;
-        *(nii_intercept_data + i) = y_mean - *(nii_slope_data + i) * x_mean;
-    }
+        // ====================================================================
+        // Calculating means
+        // ====================================================================
+        float n = static_cast<float>(size_time);
+        for (uint32_t t = 0; t != size_time; ++t) {
+            for (uint32_t i = 0; i != slab_voxels; ++i) {
+                *(slab_meany_data + i) += *(nii_input1_data + i + slab_voxels*t) / n;
+                *(slab_meanx_data + i) += *(nii_input2_data + i + slab_voxels*t) / n;
+            }
+        }
 
-    save_output_nifti(fout, "slope", nii_slope, true);
-    save_output_nifti(fout, "intercept", nii_intercept, true);
+        // ====================================================================
+        // Calculating slope and intercept
+        // ====================================================================
+        for (uint32_t i = 0; i != slab_voxels; ++i) {  // Loop across voxels
+            float y_mean = *(slab_meany_data + i);
+            float x_mean = *(slab_meanx_data + i);
+            float term1 = 0, term2 = 0;
 
-    // ========================================================================
-    cout << "  Computing fitted timeseries..." << endl;
-    // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float slope = *(nii_slope_data + i);
-            float intercept = *(nii_intercept_data + i);
-            float x = *(nii_input2_data + i + nr_voxels*t);
-            *(nii_predicted_data + i + nr_voxels*t) = intercept +  slope * x;
+            for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
+                float y = *(nii_input1_data + i + slab_voxels*t);
+                float x = *(nii_input2_data + i + slab_voxels*t);
+                term1 += (x - x_mean) * (y - y_mean);
+                term2 += (x - x_mean) * (x - x_mean);
+            }
+
+            *(slab_slope_data + i) = term1 / term2;
+            *(slab_intercept_data + i) = y_mean - *(slab_slope_data + i) * x_mean;
         }
-    }
-    save_output_nifti(fout, "fitted", nii_predicted, true);
 
-    // ========================================================================
-    cout << "  Computing residuals..." << endl;
-    // ========================================================================
-    for (uint32_t i = 0; i != nr_voxels; ++i) {  // Loop across voxels
-        for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
-            float y_fitted = *(nii_predicted_data + i + nr_voxels*t);
-            float y = *(nii_input1_data + i + nr_voxels*t);
+        // ====================================================================
+        // Computing fitted timeseries
+        // ====================================================================
+        for (uint32_t i = 0; i != slab_voxels; ++i) {  // Loop across voxels
+            for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
+                float slope = *(slab_slope_data + i);
+                float intercept = *(slab_intercept_data + i);
+                float x = *(nii_input2_data + i + slab_voxels*t);
+                *(nii_predicted_data + i + slab_voxels*t) = intercept +  slope * x;
+            }
+        }
+
+        // ====================================================================
+        // Computing residuals
+        // ====================================================================
+        for (uint32_t i = 0; i != slab_voxels; ++i) {  // Loop across voxels
+            for (uint32_t t = 0; t != size_time; ++t) {  // Loop across time points
+                float y_fitted = *(nii_predicted_data + i + slab_voxels*t);
+                float y = *(nii_input1_data + i + slab_voxels*t);
 
-            *(nii_residual_data + i + nr_voxels*t) = y - y_fitted;
+                *(nii_residual_data + i + slab_voxels*t) = y - y_fitted;
+            }
+        }
+
+        if (!ln_slab_write(writer_predicted, z_begin, nr_slices, nii_predicted_data)
+            || !ln_slab_write(writer_residual, z_begin, nr_slices, nii_residual_data)) {
+            return 2;
         }
     }
-    save_output_nifti(fout, "residuals", nii_residual, true);
+    ln_slab_reader_close(reader1);
+    ln_slab_reader_close(reader2);
+
+    save_output_nifti(fout, "slope", nii_slope, true);
+    save_output_nifti(fout, "intercept", nii_intercept, true);
+    if (!ln_slab_writer_close(writer_predicted)
+        || !ln_slab_writer_close(writer_residual)) {
+        return 2;
+    }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -1,9 +1,10 @@
 
 #include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
 #include <limits>
 
 
-int show_help(void) {
+static int show_help(void) {
     printf(
     "LN2_RIMIFY: Convert segmentation files generated by other software\n"
     "           (fsl, freesurfer, brainvoyager etc) into a 'rim' file that is\n"
@@ -44,7 +45,7 @@ int show_help(void) {
     return 0;
 }
 
-int main(int argc, char *argv[]) {
+int ln2_rimify_run(int argc, char *argv[]) {
     bool use_outpath = false, mode_custom = true, mode_brainvoyager=false;
     char *fin = NULL, *fout = NULL;
     int ac;
@@ -175,6 +176,19 @@ int main(int argc, char *argv[]) {
     // Save
     save_output_nifti(fout, "rim", nii_rim, true, use_outpath);
 
+    nifti_image_free(nii);
+    nifti_image_free(nii_in);
+    nifti_image_free(nii_rim);
+
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
+
+#ifndef LAYNII_NO_MAIN
+int main(int argc, char *argv[]) {
+    return ln2_rimify_run(argc, argv);
+}
+#endif
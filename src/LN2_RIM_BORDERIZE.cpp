@@ -334,6 +334,9 @@ int main(int argc, char*  argv[]) {
 
     save_output_nifti(fout, "borderized", nii_borderized, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -29,6 +29,9 @@ int show_help(void) {
     "                     preventing smoothing artifacts around the edges of partially\n" 
     "                     segmented volumes. '5' by default, chosen for 0.2 mm iso. images.\n"
     "    -debug         : (Optional) Save extra intermediate outputs.\n"
+    "    -threads       : (Optional) Number of threads used for smoothing and for\n"
+    "                     writing .nii.gz outputs. '1' by default. '0' uses all\n"
+    "                     available cores.\n"
     "    -output        : (Optional) Output filename, including .nii or\n"
     "                     .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n");
@@ -70,6 +73,12 @@ int main(int argc, char *argv[]) {
             steps_voronoi = std::stoi(argv[ac]);
         } else if (!strcmp(argv[ac], "-debug")) {
             mode_debug = true;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 2;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -579,6 +588,9 @@ int main(int argc, char *argv[]) {
     // Final output
     save_output_nifti(fout, "polished", nii_temp, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -130,6 +130,9 @@ int main(int argc, char*  argv[]) {
     }
     save_output_nifti(fout, "sensitivity", nii_sensitivity, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
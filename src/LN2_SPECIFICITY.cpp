@@ -170,6 +170,9 @@ int main(int argc, char*  argv[]) {
     }
     save_output_nifti(fout, "specificity", nii_specificity, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
\ No newline at end of file
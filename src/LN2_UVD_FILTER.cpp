@@ -259,7 +259,12 @@ int main(int argc, char* argv[]) {
     // Visit each voxel to check their coordinate
     // ========================================================================
     float half_height = height / 2;
-    float radius_sqr = radius * radius;
+
+    // Bin UV coordinates so that each window only visits nearby voxels
+    ln_uv_grid uv_grid;
+    ln_uv_grid_build(uv_grid, vec_u.data(), vec_v.data(), nr_voi, radius);
+    vector <uint32_t> uv_ids;
+
     for (int i = 0; i != nr_voi; ++i) {
         cout << "\r    " << i * 100 / nr_voi << " %" << flush;
         vector <float> temp_vec;
@@ -269,17 +274,14 @@ int main(int argc, char* argv[]) {
         // --------------------------------------------------------------------
         // Cylinder windowing in UVD space
         // --------------------------------------------------------------------
-        for (int j = 0; j != nr_voi; ++j) {
-            // Compute distances relative to reference UVD
+        ln_uv_grid_query(uv_grid, vec_u.data(), vec_v.data(), vec_u[i], vec_v[i],
+                         radius, uv_ids);
+        for (uint32_t k = 0; k != uv_ids.size(); ++k) {
+            int j = uv_ids[k];
             if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    temp_vec.push_back(vec_val[j]);
-                    temp_vec_id.push_back(vec_voi_id[j]);
-                    temp_vec_d.push_back(vec_d[j]);
-
-                }
+                temp_vec.push_back(vec_val[j]);
+                temp_vec_id.push_back(vec_voi_id[j]);
+                temp_vec_d.push_back(vec_d[j]);
             }
         }
 
@@ -457,6 +459,9 @@ int main(int argc, char* argv[]) {
         save_output_nifti(fout, "UVD_columns_mode_filter_window_count", temp_nii_output_extra, true);
     }
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
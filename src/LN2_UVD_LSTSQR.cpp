@@ -2,28 +2,6 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
-#include <numeric>
-
-// ============================================================================
-// NOTE(Faruk): From <https://stackoverflow.com/questions/1577475/c-sorting-and-keeping-track-of-indexes>
-template <typename T>
-vector<size_t> sort_indexes(const vector<T> &v) {
-
-    // initialize original index locations
-    vector<size_t> idx(v.size());
-    iota(idx.begin(), idx.end(), 0);
-
-    // sort indexes based on comparing values in v
-    // using std::stable_sort instead of std::sort
-    // to avoid unnecessary index re-orderings
-    // when v contains elements of equal values
-    stable_sort(idx.begin(), idx.end(),
-        [&v](size_t i1, size_t i2) {return v[i1] < v[i2];});
-
-    return idx;
-}
-
-// ============================================================================
 
 int show_help(void) {
     printf(
@@ -198,77 +176,63 @@ int main(int argc, char* argv[]) {
     cout << "  Fitting..." << endl;
 
     float half_height = height / 2;
-    float radius_sqr = radius * radius;
+
+    // Bin UV coordinates so that each window only visits nearby voxels
+    ln_uv_grid uv_grid;
+    ln_uv_grid_build(uv_grid, vec_u.data(), vec_v.data(), nr_voi, radius);
+    vector <uint32_t> uv_ids;
+
     for (int i = 0; i != nr_voi; ++i) {
+        cout << "\r    " << i << "/" << nr_voi << flush;
+
         // --------------------------------------------------------------------
         // Cylinder windowing in UVD space
         // --------------------------------------------------------------------
-        vector <float> vec_y;
-        for (int j = 0; j != nr_voi; ++j) {
-            cout << "\r    " << i << "/" << nr_voi << flush;
-
-            // Compute distances relative to reference UVD
+        // NOTE: The sums of the normal equations are accumulated while
+        // visiting the window, so the fit does not need another pass.
+        // TODO(Faruk): All ones flat profile (x) for now. I need to find a way
+        // to allow users to choose this.
+        int n = 0;
+        double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, sum_yy = 0;
+        ln_uv_grid_query(uv_grid, vec_u.data(), vec_v.data(), vec_u[i], vec_v[i],
+                         radius, uv_ids);
+        for (uint32_t k = 0; k != uv_ids.size(); ++k) {
+            int j = uv_ids[k];
             if (abs(vec_d[i] - vec_d[j]) < half_height) {  // Check height
-                float dist_uv = (vec_u[i] - vec_u[j])*(vec_u[i] - vec_u[j])
-                    + (vec_v[i] - vec_v[j])*(vec_v[i] - vec_v[j]);
-                if (dist_uv < radius_sqr) {  // Check Euclidean distance
-                    vec_y.push_back(vec_val[j]);
-                }
+                double x = 1.0;
+                double y = vec_val[j];
+                sum_x += x;
+                sum_y += y;
+                sum_xx += x * x;
+                sum_xy += x * y;
+                sum_yy += y * y;
+                n += 1;
             }
         }
 
-        int n = vec_y.size();
         if (n > 1) {
-            // ----------------------------------------------------------------
-            // Sort vector by depth
-            // ----------------------------------------------------------------
-            vector <float> vec_y_sorted(n);
-            int k = 0;
-            for (auto j: sort_indexes(vec_d)) {
-              vec_y_sorted[k] = vec_y[j];
-              k += 1;
-            }
-
-            // ----------------------------------------------------------------
-            // Create design matrix
-            // ----------------------------------------------------------------
-            // TODO(Faruk): All ones flat profile for now. I need to find a way
-            // to allow users to choose this.
-            vector <float> vec_x(n, 1.0);
-
             // ----------------------------------------------------------------
             // Compute the least-squares solution to a linear matrix equation
             // ----------------------------------------------------------------
-            float vec_x_sum = std::accumulate(vec_x.begin(), vec_x.end(), 0);
-            float vec_y_sum = std::accumulate(vec_y.begin(), vec_y.end(), 0);
-            float vec_x_avg = vec_x_sum / n;
-            float vec_y_avg = vec_y_sum / n;
-
-
-            float var_x = 0;
-            float cov_xy = 0;
-            float slope = 0, intercept_y = 0, residual = 0;
-
-            for (int j = 0; j != n; ++j) {
-                float temp = vec_x[j] - vec_x_avg;
-                var_x += temp * temp;
-                cov_xy += temp * (vec_y[j] - vec_y_avg);
-            }
+            double x_avg = sum_x / n;
+            double y_avg = sum_y / n;
+            double var_x = sum_xx - sum_x * x_avg;
+            double cov_xy = sum_xy - sum_x * y_avg;
+            double slope = 0, intercept_y = 0, residual = 0;
 
             if (var_x != 0) {
                 slope = cov_xy / var_x;
-                intercept_y = vec_y_avg - (slope * vec_x_avg);
+                intercept_y = y_avg - (slope * x_avg);
             } else {
                 slope = 0;  // avoid nans
-                intercept_y = vec_y_avg;
+                intercept_y = y_avg;
             }
 
-            // Compute residuals
-            for (int j = 0; j != n; ++j) {
-                float y_hat = vec_x[j] * slope + intercept_y;
-                residual += (vec_y[j] - y_hat) * (vec_y[j] - y_hat);
-            }
-            residual /= n;
+            // Mean of squared residuals, expanded in terms of the sums
+            residual = sum_yy - 2 * slope * sum_xy - 2 * intercept_y * sum_y
+                + slope * slope * sum_xx + 2 * slope * intercept_y * sum_x
+                + n * intercept_y * intercept_y;
+            residual = std::max(residual / n, 0.0);
 
             // ----------------------------------------------------------------
             // Write median inside nifti
@@ -286,6 +250,9 @@ int main(int argc, char* argv[]) {
     save_output_nifti(fout, "UVD_lstsqr_samples", nii_samples, true);
     save_output_nifti(fout, "UVD_lstsqr_residuals", nii_residuals, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
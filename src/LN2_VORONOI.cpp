@@ -20,6 +20,9 @@ int show_help(void) {
     "    -iter_smooth  : (Optional) Number of smoothing iterations. Default\n"
     "                    is 0 (no smoothing).\n"
     "    -debug        : (Optional) Save extra intermediate outputs.\n"
+    "    -threads      : (Optional) Number of threads used for smoothing and for\n"
+    "                    writing .nii.gz outputs. '1' by default. '0' uses all\n"
+    "                    available cores.\n"
     "    -output       : (Optional) Output basename for all outputs.\n"
     "\n");
     return 0;
@@ -52,6 +55,12 @@ int main(int argc, char*  argv[]) {
             }
             fin2 = argv[ac];
             mode_initialize_with_centroids = true;
+        } else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -203,6 +212,9 @@ int main(int argc, char*  argv[]) {
         }
     }
 
+    // TODO: Port to ln_grow_voronoi_voi once building an ln_voi_grid gets
+    // cheaper. For this single growth the table build costs more than the
+    // rescan it saves (1.6 s vs 2.3 s on a 320^3 folded rim).
     int32_t grow_step = 1;
     uint32_t ix, iy, iz, j;
     float d;
@@ -585,6 +597,9 @@ int main(int argc, char*  argv[]) {
     // Add number of points into the output tag
     save_output_nifti(fout, "voronoi", nii_init, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
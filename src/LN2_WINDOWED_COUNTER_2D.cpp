@@ -255,6 +255,9 @@ int main(int argc, char*  argv[]) {
     // Save
     save_output_nifti(fout, "counts_rad-"+tag_rad.str(), nii2, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
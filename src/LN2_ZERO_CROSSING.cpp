@@ -140,6 +140,8 @@ int main(int argc, char*  argv[]) {
     // ========================================================================
     cout << "\n  Finding zero crossing neighbour voxels..." << endl;
 
+    // TODO: Port to ln_voi_grid once building it gets cheaper. Each voxel is
+    // only checked once here, so the table build does not pay off yet.
     for (uint32_t ii = 0; ii != nr_voi; ++ii) {
         uint32_t ix, iy, iz, i, j;
         i = *(voi_id + ii);
@@ -397,6 +399,9 @@ int main(int argc, char*  argv[]) {
 
     // Save output nifti
     save_output_nifti(fout, "zero_crossing", nii_out, true);
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -1237,6 +1237,9 @@ int main(int argc, char*  argv[]) {
     }
     save_output_nifti(fout, "DEBUG_equidist_layers", nii_out_int16, false);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished.\n" << endl;
     return 0;
 }
@@ -248,6 +248,9 @@ int main(int argc, char*  argv[]) {
 
     // TODO: implement
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "\n  Finished." << endl;
     return 0;
 }
@@ -798,6 +798,9 @@ int main(int argc, char *argv[]) {
     if (!use_outpath) fout = fin_layer;
     save_output_nifti(fout, "column_coordinates", hairy, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
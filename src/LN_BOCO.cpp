@@ -25,6 +25,9 @@ int show_help(void) {
     "                 The parameter is the trial duration in TRs.\n"
     "    -alt       : (Optional, !EXPERIMENTAL!) Alternative BOLD correction.\n"
     "                 Guaranteed to give values within 0-1 range.\n"
+    "    -max_mem   : (Optional) Memory budget in MB. The time series are read\n"
+    "                 and written in slabs of slices that fit this budget.\n"
+    "                 '2048' by default.\n"
     "    -output    : (Optional) Output basename, including .nii or\n"
     "                 .nii.gz, and path if needed. Overwrites existing files.\n"
     "                 Note different to other LayNii programs in LN_COCO \n"
@@ -79,6 +82,12 @@ int main(int argc, char * argv[]) {
             }
             use_outpath = false;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         } else if (!strcmp(argv[ac], "-alt")) {
             mode_alt = true;
         } else {
@@ -96,13 +105,13 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image* nii1 = nifti_image_read(fin_1, 1);
+    // Read input headers, data is streamed in slabs below
+    nifti_image* nii1 = nifti_image_read(fin_1, 0);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI from '%s'.\n", fin_1);
         return 2;
     }
-    nifti_image* nii2 = nifti_image_read(fin_2, 1);
+    nifti_image* nii2 = nifti_image_read(fin_2, 0);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI from '%s'.\n", fin_2);
         return 2;
@@ -119,255 +128,288 @@ int main(int argc, char * argv[]) {
     const int size_time = nii1->nt;
     const int nx = nii1->nx;
     const int nxy = nii1->nx * nii1->ny;
-    const int nxyz = nii1->nx * nii1->ny * nii1->nz;
-    const int nr_voxels = size_time * size_z * size_y * size_x;
-
-    // ========================================================================
-    // Fix datatype issues
-    nifti_image *nii_nulled = copy_nifti_as_float32(nii1);
-    float *nii_nulled_data = static_cast<float*>(nii_nulled->data);
-    nifti_image *nii_bold = copy_nifti_as_float32(nii2);
-    float *nii_bold_data = static_cast<float*>(nii_bold->data);
-
-    // Allocate new nifti
-    nifti_image *nii_boco_vaso = copy_nifti_as_float32(nii1);
-    float *nii_boco_vaso_data = static_cast<float*>(nii_boco_vaso->data);
-    
-    
+    const int64_t nr_voxels = static_cast<int64_t>(size_time) * size_z * size_y * size_x;
 
+    if (nii2->nx != size_x || nii2->ny != size_y || nii2->nz != size_z
+        || nii2->nt != size_time) {
+        fprintf(stderr, "** '-Nulled' and '-BOLD' dimensions do not match.\n");
+        return 1;
+    }
 
     // ========================================================================
     // Handle scaling factor effects
     // TODO(Faruk): I am not sure we need this part anymore. Need to check.
-    
-    float scl_slope1=nii_nulled->scl_slope, scl_slope2=nii_bold->scl_slope;
-    if (scl_slope2 != 0 || scl_slope1 != 0 ) { 
+
+    float scl_slope1 = nii1->scl_slope, scl_slope2 = nii2->scl_slope;
+    if (scl_slope2 != 0 || scl_slope1 != 0 ) {
         cout << "    !!!Warning!!! Input nifti header contains scl_scale !=0.\n"
              << "    Make sure to check the resulting output image.\n"<< endl;
     }
-    if (scl_slope1 != 0 ) {
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_nulled_data + i) *= scl_slope1;
-        }
-    } 
-    if (scl_slope2 != 0) {
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_bold_data + i) *= scl_slope2;
-        }
-    }
-
-    // We can set scaling factor to 1 because we have accounted for them above
-    nii_nulled->scl_slope = 1.;
-    nii_bold->scl_slope = 1.;
-    nii_boco_vaso->scl_slope = 1.;
-    
-    // ========================================================================
-    // BOLD correction
-    // ========================================================================
-    if (mode_alt) {
-        int nr_invalid_voxels = 0, nr_zero_voxels = 0;
-        for (int i = 0; i != nr_voxels; ++i) {
-            float nc = *(nii_nulled_data + i);  // Nulled condition
-            float nn = (*(nii_bold_data + i));  // Not nulled condition (a.k.a BOLD)
-
-            float S_ex = nc;  // Approximately extravascular signal
-            float S_in = nn - nc;  // Approximately intravascular signal
-
-            if (nc <= 0 || nn <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
-                nr_zero_voxels += 1;
-            }  else {
-                if (S_in <= 0) {
-                    // VASO assumptions invalid S_in should not be negative.
-                    S_in *= -1;
-                    nr_invalid_voxels += 1;
-                }
-                // Compute relative contribution (always between -1 to 1)
-                *(nii_boco_vaso_data + i) =  S_ex / (S_ex + S_in);
-            }
-        }
-        float term1 = static_cast<float>(nr_invalid_voxels);
-        float term2 = static_cast<float>(nr_voxels - nr_zero_voxels);
-
-        cout << "  Voxels with invalid VASO assumption:" << endl;
-        cout << "    "
-            << nr_invalid_voxels << "/" << nr_voxels - nr_zero_voxels
-            << "\n    " << (term1 / term2) * 100 << "%\n" << endl;
-    } else {
-
-        for (int i = 0; i != nr_voxels; ++i) {
-            float nc = *(nii_nulled_data + i);  // Nulled condition
-            float nn = *(nii_bold_data + i);  // Not nulled condition (a.k.a BOLD)
-
-            if (nc <= 0 || nn <= 0) {  // Skip masked-out or invalid voxels
-                *(nii_boco_vaso_data + i) = 0;
-            }  else {  // BOLD correction is happening here
-                *(nii_boco_vaso_data + i) = nc / nn;
-            }
-        }
-        // Clip VASO values that are unrealistic
-        for (int i = 0; i != nr_voxels; ++i) {
-            if (*(nii_boco_vaso_data + i) <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
-            }
-            if (*(nii_boco_vaso_data + i) >= 5) {
-                *(nii_boco_vaso_data + i) = 5;
-            }
-        }
-    }
 
     // ========================================================================
-    // Shift
-    // ========================================================================
+    // Prepare streamed outputs
+    // Inputs and outputs are processed in slabs of slices across
+    // all time points, so that long time series do not need to fit in memory.
+    // We can set scaling factor to 1 because we account for it per slab.
+    nifti_image* nii_boco_vaso = nifti_copy_nim_info(nii1);
+    nii_boco_vaso->scl_slope = 1.;
+    ln_slab_writer writer_vaso;
+    bool success = use_outpath
+        ? ln_slab_writer_open(writer_vaso, nii_boco_vaso, "VASO_LN", "", true)
+        : ln_slab_writer_open(writer_vaso, nii_boco_vaso, fout, "VASO_LN");
+    if (!success) return 2;
+
+    nifti_image* correl_file = NULL;
+    float* correl_file_data = NULL;
     if (shift == 1) {
-        nifti_image* correl_file  = nifti_copy_nim_info(nii_nulled);
+        correl_file = nifti_copy_nim_info(nii1);
+        correl_file->scl_slope = 1.;
         correl_file->nt = 7;
-        correl_file->nvox = nii_nulled->nvox / size_time *7;
+        correl_file->nvox = nii1->nvox / size_time * 7;
         correl_file->datatype = NIFTI_TYPE_FLOAT32;
         correl_file->nbyper = sizeof(float);
         correl_file->data = calloc(correl_file->nvox, correl_file->nbyper);
-        float* correl_file_data = static_cast<float*>(correl_file->data);
-
-        double vec_file1[size_time];
-        double vec_file2[size_time];
+        correl_file_data = static_cast<float*>(correl_file->data);
+    }
 
-        for (int shift = -3; shift <= 3; ++shift) {
-            cout << "  Calculating shift = " << shift << endl;
-            for (int j = 0; j != size_z * size_y * size_x; ++j) {
-                for (int t = 3; t < size_time-3; ++t) {
-                    *(nii_boco_vaso_data + nxyz * t + j)  =      *(nii_nulled_data + nxyz * t + j)  / *(nii_bold_data + nxyz * (t + shift) + j);
-                }
-                for (int t = 0; t < size_time; ++t) {
-                    vec_file1[t] = *(nii_boco_vaso_data + nxyz * t + j);
-                    vec_file2[t] = *(nii_bold_data + nxyz * t + j);
-                }
-                *(correl_file_data + nxyz * (shift + 3) + j) =  ren_correl(vec_file1, vec_file2, size_time);
-            }
+    int nr_trials = 0;
+    nifti_image *nii_avg1 = NULL, *nii_avg2 = NULL;
+    ln_slab_writer writer_avg1, writer_avg2;
+    if (trialdur != 0) {
+        nr_trials = size_time / trialdur;
+        // Trial averave files
+        nii_avg1 = nifti_copy_nim_info(nii1);
+        nii_avg1->nt = trialdur;
+        nii_avg1->nvox = nii1->nvox / size_time * trialdur;
+        nii_avg2 = nifti_copy_nim_info(nii_avg1);
+        if (use_outpath) {
+            success = ln_slab_writer_open(writer_avg1, nii_avg1, "VASO_trialAV_LN", "", true)
+                && ln_slab_writer_open(writer_avg2, nii_avg2, "BOLD_trialAV_LN", "", true);
+        } else {
+            success = ln_slab_writer_open(writer_avg1, nii_avg1, fout, "VASO_trialAV_LN")
+                && ln_slab_writer_open(writer_avg2, nii_avg2, fout, "BOLD_trialAV_LN");
         }
+        if (!success) return 2;
+    }
 
+    const int slab_size = ln_slab_nr_slices(nii1, trialdur != 0 ? 5 : 3);
+    const int64_t slab_voxels = static_cast<int64_t>(nxy) * slab_size;
+    std::vector<float> slab_nulled(slab_voxels * size_time);
+    std::vector<float> slab_bold(slab_nulled.size());
+    std::vector<float> slab_boco(slab_nulled.size());
+    std::vector<float> slab_avg1(slab_voxels * trialdur);
+    std::vector<float> slab_avg2(slab_avg1.size());
+    float* nii_nulled_data = slab_nulled.data();
+    float* nii_bold_data = slab_bold.data();
+    float* nii_boco_vaso_data = slab_boco.data();
+    float* nii_avg1_data = slab_avg1.data();
+    float* nii_avg1_B_data = slab_avg2.data();
+    ln_slab_reader reader1, reader2;
+    if (!ln_slab_reader_open(reader1, nii1, slab_size)
+        || !ln_slab_reader_open(reader2, nii2, slab_size)) {
+        return 2;
+    }
 
+    int64_t nr_invalid_voxels = 0, nr_zero_voxels = 0;
 
-        // Get back to default
-        for (int i = 0; i != nr_voxels; ++i) {
-            *(nii_boco_vaso_data + i) = *(nii_nulled_data + i)
-                                        / *(nii_bold_data + i);
-        }
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t nxyz = static_cast<int64_t>(nxy) * nr_slices;  // Slab
+        const int64_t nr_slab_voxels = nxyz * size_time;
+        if (!ln_read_slab(reader1, z_begin, nr_slices, nii_nulled_data)) return 2;
+        if (!ln_read_slab(reader2, z_begin, nr_slices, nii_bold_data)) return 2;
 
-        // Clean VASO values that are unrealistic
-        for (int i = 0; i != nr_voxels; ++i) {
-           if (*(nii_boco_vaso_data + i) <= 0) {
-                *(nii_boco_vaso_data + i) = 0;
+        if (scl_slope1 != 0 ) {
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                *(nii_nulled_data + i) *= scl_slope1;
             }
-            if (*(nii_boco_vaso_data + i) >= 2) {
-                *(nii_boco_vaso_data + i) = 2;
+        }
+        if (scl_slope2 != 0) {
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                *(nii_bold_data + i) *= scl_slope2;
             }
         }
 
-            // Replace nans with zeros
-        for (int i = 0; i < nr_voxels; ++i) {
-            if (*(correl_file_data + i)!= *(correl_file_data + i)) {
-               *(correl_file_data + i) = 0;
+        // ====================================================================
+        // BOLD correction
+        // ====================================================================
+        if (mode_alt) {
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                float nc = *(nii_nulled_data + i);  // Nulled condition
+                float nn = (*(nii_bold_data + i));  // Not nulled condition (a.k.a BOLD)
+
+                float S_ex = nc;  // Approximately extravascular signal
+                float S_in = nn - nc;  // Approximately intravascular signal
+
+                if (nc <= 0 || nn <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                    nr_zero_voxels += 1;
+                }  else {
+                    if (S_in <= 0) {
+                        // VASO assumptions invalid S_in should not be negative.
+                        S_in *= -1;
+                        nr_invalid_voxels += 1;
+                    }
+                    // Compute relative contribution (always between -1 to 1)
+                    *(nii_boco_vaso_data + i) =  S_ex / (S_ex + S_in);
+                }
+            }
+        } else {
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                float nc = *(nii_nulled_data + i);  // Nulled condition
+                float nn = *(nii_bold_data + i);  // Not nulled condition (a.k.a BOLD)
+
+                if (nc <= 0 || nn <= 0) {  // Skip masked-out or invalid voxels
+                    *(nii_boco_vaso_data + i) = 0;
+                }  else {  // BOLD correction is happening here
+                    *(nii_boco_vaso_data + i) = nc / nn;
+                }
+            }
+            // Clip VASO values that are unrealistic
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                if (*(nii_boco_vaso_data + i) <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                }
+                if (*(nii_boco_vaso_data + i) >= 5) {
+                    *(nii_boco_vaso_data + i) = 5;
+                }
             }
         }
 
-        save_output_nifti(fout, "shift_correlated", correl_file, false);
-    }
-
-    // ========================================================================
-    // Trial average
-    // ========================================================================
-    if (trialdur != 0) {
-        cout << "  Doing BOLD correction after trial average..." << endl;
-        cout << "    Trial duration is " << trialdur
-             << ". This means there are " << (float)size_time / (float)trialdur
-             <<  " trials recorded here." << endl;
-
-        int nr_trials = size_time / trialdur;
-        // Trial averave file
-        nifti_image *nii_avg1 = nifti_copy_nim_info(nii1);
-        nii_avg1->nt = trialdur;
-        nii_avg1->nvox = nii1->nvox / size_time * trialdur;
-        nii_avg1->datatype = NIFTI_TYPE_FLOAT32;
-        nii_avg1->nbyper = sizeof(float);
-        nii_avg1->data = calloc(nii_avg1->nvox, nii_avg1->nbyper);
-        float  *nii_avg1_data  = static_cast<float*>(nii_avg1->data);
-
-        nifti_image *nii_avg2 = nifti_copy_nim_info(nii1);
-        nii_avg2->nt = trialdur;
-        nii_avg2->nvox = nii1->nvox / size_time * trialdur;
-        nii_avg2->datatype = NIFTI_TYPE_FLOAT32;
-        nii_avg2->nbyper = sizeof(float);
-        nii_avg2->data = calloc(nii_avg2->nvox, nii_avg2->nbyper);
-        float  *nii_avg1_B_data  = static_cast<float*>(nii_avg2->data);
-
-        float avg_Nulled[trialdur];
-        float avg_BOLD[trialdur];
-
-        for (int iz = 0; iz < size_z; ++iz) {
-            for (int iy = 0; iy < size_y; ++iy) {
-                for (int ix = 0; ix < size_x; ++ix) {
-                    for (int it = 0; it < trialdur; ++it) {
-                        avg_Nulled[it] = 0;
-                        avg_BOLD[it] = 0;
+        // ====================================================================
+        // Shift
+        // ====================================================================
+        if (shift == 1) {
+            std::vector<double> vec_file1(size_time);
+            std::vector<double> vec_file2(size_time);
+            const int64_t correl_offset = static_cast<int64_t>(nxy) * z_begin;
+            const int64_t correl_nxyz = static_cast<int64_t>(nxy) * size_z;
+
+            for (int shift = -3; shift <= 3; ++shift) {
+                if (z_begin == 0) {
+                    cout << "  Calculating shift = " << shift << endl;
+                }
+                for (int64_t j = 0; j != nxyz; ++j) {
+                    for (int t = 3; t < size_time-3; ++t) {
+                        *(nii_boco_vaso_data + nxyz * t + j)  =      *(nii_nulled_data + nxyz * t + j)  / *(nii_bold_data + nxyz * (t + shift) + j);
                     }
-                    for (int it = 0; it < trialdur * nr_trials; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-                        avg_Nulled[it % trialdur] +=
-                            *(nii_nulled_data + voxel_i) / nr_trials;
-                        avg_BOLD[it % trialdur] +=
-                            *(nii_bold_data + voxel_i) / nr_trials;
+                    for (int t = 0; t < size_time; ++t) {
+                        vec_file1[t] = *(nii_boco_vaso_data + nxyz * t + j);
+                        vec_file2[t] = *(nii_bold_data + nxyz * t + j);
                     }
+                    *(correl_file_data + correl_nxyz * (shift + 3) + correl_offset + j) =
+                        ren_correl(vec_file1.data(), vec_file2.data(), size_time);
+                }
+            }
 
-                    for (int it = 0; it < trialdur; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-                        *(nii_avg1_data + voxel_i) = avg_Nulled[it] / avg_BOLD[it];
-                        *(nii_avg1_B_data + voxel_i) = avg_BOLD[it];
+            // Get back to default
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+                *(nii_boco_vaso_data + i) = *(nii_nulled_data + i)
+                                            / *(nii_bold_data + i);
+            }
 
-                    }
+            // Clean VASO values that are unrealistic
+            for (int64_t i = 0; i != nr_slab_voxels; ++i) {
+               if (*(nii_boco_vaso_data + i) <= 0) {
+                    *(nii_boco_vaso_data + i) = 0;
+                }
+                if (*(nii_boco_vaso_data + i) >= 2) {
+                    *(nii_boco_vaso_data + i) = 2;
                 }
             }
         }
 
-        // Clean VASO values that are unrealistic
-        for (int iz = 0; iz < size_z; ++iz) {
-            for (int iy = 0; iy < size_y; ++iy) {
-                for (int ix = 0; ix < size_x; ++ix) {
-                    for (int it = 0; it < trialdur; ++it) {
-                        int voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
-
-                        if (*(nii_avg1_data + voxel_i) <= 0) {
-                            *(nii_avg1_data + voxel_i) = 0;
+        // ====================================================================
+        // Trial average
+        // ====================================================================
+        if (trialdur != 0) {
+            float avg_Nulled[trialdur];
+            float avg_BOLD[trialdur];
+
+            for (int iz = 0; iz < nr_slices; ++iz) {
+                for (int iy = 0; iy < size_y; ++iy) {
+                    for (int ix = 0; ix < size_x; ++ix) {
+                        for (int it = 0; it < trialdur; ++it) {
+                            avg_Nulled[it] = 0;
+                            avg_BOLD[it] = 0;
                         }
-                        if (*(nii_avg1_data + voxel_i) >= 2) {
-                            *(nii_avg1_data + voxel_i) = 2;
+                        for (int it = 0; it < trialdur * nr_trials; ++it) {
+                            int64_t voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
+                            avg_Nulled[it % trialdur] +=
+                                *(nii_nulled_data + voxel_i) / nr_trials;
+                            avg_BOLD[it % trialdur] +=
+                                *(nii_bold_data + voxel_i) / nr_trials;
+                        }
+
+                        for (int it = 0; it < trialdur; ++it) {
+                            int64_t voxel_i = nxyz * it + nxy * iz + nx * iy + ix;
+                            *(nii_avg1_data + voxel_i) = avg_Nulled[it] / avg_BOLD[it];
+                            *(nii_avg1_B_data + voxel_i) = avg_BOLD[it];
                         }
                     }
                 }
             }
+
+            // Clean VASO values that are unrealistic
+            for (int64_t i = 0; i < nxyz * trialdur; ++i) {
+                if (*(nii_avg1_data + i) <= 0) {
+                    *(nii_avg1_data + i) = 0;
+                }
+                if (*(nii_avg1_data + i) >= 2) {
+                    *(nii_avg1_data + i) = 2;
+                }
+            }
+            if (!ln_slab_write(writer_avg1, z_begin, nr_slices, nii_avg1_data)
+                || !ln_slab_write(writer_avg2, z_begin, nr_slices, nii_avg1_B_data)) {
+                return 2;
+            }
         }
-        if (use_outpath) {
-            save_output_nifti("VASO_trialAV_LN", "", nii_avg1, true, true);
-            save_output_nifti("BOLD_trialAV_LN", "", nii_avg2, true, true);
-        } else {
-            save_output_nifti(fout, "VASO_trialAV_LN", nii_avg1, true);
-            save_output_nifti(fout, "BOLD_trialAV_LN", nii_avg2, true);
+
+        // Replace nans with zeros
+        for (int64_t i = 0; i < nr_slab_voxels; ++i) {
+            if (*(nii_boco_vaso_data + i)!= *(nii_boco_vaso_data + i)) {
+               *(nii_boco_vaso_data + i) = 0;
+            }
         }
+        if (!ln_slab_write(writer_vaso, z_begin, nr_slices, nii_boco_vaso_data)) return 2;
     }
+    ln_slab_reader_close(reader1);
+    ln_slab_reader_close(reader2);
+
+    if (mode_alt) {
+        float term1 = static_cast<float>(nr_invalid_voxels);
+        float term2 = static_cast<float>(nr_voxels - nr_zero_voxels);
 
+        cout << "  Voxels with invalid VASO assumption:" << endl;
+        cout << "    "
+            << nr_invalid_voxels << "/" << nr_voxels - nr_zero_voxels
+            << "\n    " << (term1 / term2) * 100 << "%\n" << endl;
+    }
 
-    // Replace nans with zeros
-    for (int i = 0; i < nr_voxels; ++i) {
-        if (*(nii_boco_vaso_data + i)!= *(nii_boco_vaso_data + i)) {
-           *(nii_boco_vaso_data + i) = 0;
+    if (shift == 1) {
+        // Replace nans with zeros
+        for (int64_t i = 0; i < static_cast<int64_t>(correl_file->nvox); ++i) {
+            if (*(correl_file_data + i)!= *(correl_file_data + i)) {
+               *(correl_file_data + i) = 0;
+            }
         }
+        save_output_nifti(fout, "shift_correlated", correl_file, false);
     }
 
-    if (use_outpath) {
-        save_output_nifti("VASO_LN", "", nii_boco_vaso, true, true);
-    } else {
-        save_output_nifti(fout, "VASO_LN", nii_boco_vaso, true);
+    if (trialdur != 0) {
+        cout << "  Doing BOLD correction after trial average..." << endl;
+        cout << "    Trial duration is " << trialdur
+             << ". This means there are " << (float)size_time / (float)trialdur
+             <<  " trials recorded here." << endl;
+        if (!ln_slab_writer_close(writer_avg1) || !ln_slab_writer_close(writer_avg2)) {
+            return 2;
+        }
     }
+    if (!ln_slab_writer_close(writer_vaso)) return 2;
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
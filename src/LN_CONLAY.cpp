@@ -248,6 +248,9 @@ int main(int argc, char*  argv[]) {
     if (!use_outpath) fout = fin_2;
     save_output_nifti(fout, "sub_layers", nii_outlay, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "Finished!" << endl;
     return 0;
 }
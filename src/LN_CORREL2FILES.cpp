@@ -16,6 +16,8 @@ int show_help(void) {
     "    -file1  : First time series.\n"
     "    -file2  : Second time series with should have the same dimensions \n"
     "              as first time series.\n"
+    "    -max_mem: (Optional) Memory budget in MB. The time series are read in\n"
+    "              slabs of slices that fit this budget. '2048' by default.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n"
@@ -59,6 +61,12 @@ int main(int argc, char *argv[]) {
             }
             use_outpath = true;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -74,13 +82,13 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image* nii1 = nifti_image_read(fin_1, 1);
+    // Read input headers, data is streamed in slabs below
+    nifti_image* nii1 = nifti_image_read(fin_1, 0);
     if (!nii1) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin_1);
         return 2;
     }
-    nifti_image*nii2 = nifti_image_read(fin_2, 1);
+    nifti_image*nii2 = nifti_image_read(fin_2, 0);
     if (!nii2) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin_2);
         return 2;
@@ -97,42 +105,69 @@ int main(int argc, char *argv[]) {
     int size_time = nii1->nt;
     int nx = nii1->nx;
     int nxy = nii1->nx * nii1->ny;
-    int nxyz = nii1->nx * nii1->ny * nii1->nz;
 
-    // ========================================================================
-    // Fix datatype issues
-    nifti_image* nii1_temp = copy_nifti_as_float32(nii1);
-    float* nii1_temp_data = static_cast<float*>(nii1_temp->data);
-    nifti_image* nii2_temp = copy_nifti_as_float32(nii2);
-    float* nii2_temp_data = static_cast<float*>(nii2_temp->data);
+    if (nii2->nx != nii1->nx || nii2->ny != nii1->ny || nii2->nz != nii1->nz
+        || nii2->nvox != nii1->nvox) {
+        fprintf(stderr, "** '-file1' and '-file2' dimensions do not match\n");
+        return 2;
+    }
 
+    // ========================================================================
     // Allocate new nifti
-    nifti_image *correl_file = nifti_copy_nim_info(nii1_temp);
+    nifti_image *correl_file = nifti_copy_nim_info(nii1);
     correl_file->nt = 1;
     correl_file->nvox = size_x * size_y * size_z;
+    correl_file->datatype = NIFTI_TYPE_FLOAT32;
+    correl_file->nbyper = sizeof(float);
     correl_file->data = calloc(correl_file->nvox, correl_file->nbyper);
     float *correl_file_data = static_cast<float*>(correl_file->data);
+
+    // Both time series are read in slabs of slices, converted to float32
+    const int slab_size = ln_slab_nr_slices(nii1, 2);
+    std::vector<float> slab1(static_cast<int64_t>(nxy) * slab_size * size_time);
+    std::vector<float> slab2(slab1.size());
+    float* nii1_temp_data = slab1.data();
+    float* nii2_temp_data = slab2.data();
+    ln_slab_reader reader1, reader2;
+    if (!ln_slab_reader_open(reader1, nii1, slab_size)
+        || !ln_slab_reader_open(reader2, nii2, slab_size)) {
+        return 2;
+    }
     // ========================================================================
 
     double vec1[size_time], vec2[size_time];
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                int voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    int voxel_j = nxyz * it + nxy * iz + nx * iy + ix;
-                    vec1[it] = *(nii1_temp_data + voxel_j);
-                    vec2[it] = *(nii2_temp_data + voxel_j);
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t slab_nxyz = static_cast<int64_t>(nxy) * nr_slices;
+        if (!ln_read_slab(reader1, z_begin, nr_slices, nii1_temp_data)
+            || !ln_read_slab(reader2, z_begin, nr_slices, nii2_temp_data)) {
+            return 2;
+        }
+
+        for (int iz = 0; iz < nr_slices; ++iz) {
+            for (int iy = 0; iy < size_y; ++iy) {
+                for (int ix = 0; ix < size_x; ++ix) {
+                    int64_t voxel_i = nxy * (z_begin + iz) + nx * iy + ix;
+                    for (int it = 0; it < size_time; ++it) {
+                        int64_t voxel_j = slab_nxyz * it + nxy * iz + nx * iy + ix;
+                        vec1[it] = *(nii1_temp_data + voxel_j);
+                        vec2[it] = *(nii2_temp_data + voxel_j);
+                    }
+                    *(correl_file_data + voxel_i) =
+                        static_cast<float>(ren_correl(vec1, vec2, size_time));
                 }
-                *(correl_file_data + voxel_i) =
-                    static_cast<float>(ren_correl(vec1, vec2, size_time));
             }
         }
     }
+    ln_slab_reader_close(reader1);
+    ln_slab_reader_close(reader2);
 
     if (!use_outpath) fout = fin_1;
     save_output_nifti(fout, "correlated", correl_file, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -210,6 +210,9 @@ int main(int argc, char* argv[]) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "smooth", smooth, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -20,6 +20,8 @@ int show_help(void) {
     "Options:\n"
     "    -help   : Show this help.\n"
     "    -input  : Input time series.\n"
+    "    -max_mem: (Optional) Memory budget in MB. The time series is read in\n"
+    "              slabs of slices that fit this budget. '2048' by default.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"
     "              Note that the output name will always contain MaxTR/MinTR tags.\n"
@@ -51,14 +53,20 @@ int main(int argc, char * argv[]) {
                 return 1;
             }
             fin_1 = argv[ac];  // Assign pointer, no string copy
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         }
     }
     if (!fin_1) {
         fprintf(stderr, "** missing option '-input'\n");
         return 1;
     }
-    // Read input dataset, including data
-    nifti_image* nii_in = nifti_image_read(fin_1, 1);
+    // Read input header, data is streamed in slabs below
+    nifti_image* nii_in = nifti_image_read(fin_1, 0);
     if (!nii_in) {
       fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin_1);
       return 2;
@@ -74,15 +82,11 @@ int main(int argc, char * argv[]) {
     const int size_time = nii_in->nt;
     const int nx = size_x;
     const int nxy = size_x * size_y;
-    const int nxyz = size_x * size_y * size_z;
+    const int64_t nxyz = size_x * size_y * size_z;
 
     // ========================================================================
-    // Fix datatype issues
-    nifti_image* nii = copy_nifti_as_float32(nii_in);
-    float* nii_data = static_cast<float*>(nii->data);
-
     // Allocate new nifti images
-    nifti_image* nii_max = nifti_copy_nim_info(nii);
+    nifti_image* nii_max = nifti_copy_nim_info(nii_in);
     nii_max->nt = 1;
     nii_max->datatype = NIFTI_TYPE_FLOAT32;
     nii_max->nbyper = sizeof(float);
@@ -90,7 +94,7 @@ int main(int argc, char * argv[]) {
     nii_max->data = calloc(nii_max->nvox, nii_max->nbyper);
     float* nii_max_data = static_cast<float*>(nii_max->data);
 
-    nifti_image* nii_min = nifti_copy_nim_info(nii);
+    nifti_image* nii_min = nifti_copy_nim_info(nii_in);
     nii_min->nt = 1;
     nii_min->datatype = NIFTI_TYPE_FLOAT32;
     nii_min->nbyper = sizeof(float);
@@ -99,34 +103,50 @@ int main(int argc, char * argv[]) {
     float* nii_min_data = static_cast<float*>(nii_min->data);
 
     // ========================================================================
+    const int slab_size = ln_slab_nr_slices(nii_in, 1);
+    std::vector<float> slab(static_cast<int64_t>(nxy) * slab_size * size_time);
+    float* nii_data = slab.data();
+    ln_slab_reader reader;
+    if (!ln_slab_reader_open(reader, nii_in, slab_size)) return 2;
+
     int TR_max = 0, TR_min = 0;
 
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                int voxel_i = nxy * iz + nx * iy + ix;
-                float max_val = 0;
-                float min_val = std::numeric_limits<float>::max();
-                for (int it = 0; it < size_time; ++it) {
-                    int voxel_j = nxyz * it + nxy * iz + nx * iy + ix;
-                    if (*(nii_data + voxel_j) > max_val) {
-                        max_val = *(nii_data + voxel_j);
-                        TR_max = it;
-                    }
-                    if (*(nii_data + voxel_j) < min_val) {
-                        min_val = *(nii_data + voxel_j);
-                        TR_min = it;
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t slab_nxyz = static_cast<int64_t>(nxy) * nr_slices;
+        if (!ln_read_slab(reader, z_begin, nr_slices, nii_data)) return 2;
+
+        for (int iz = 0; iz < nr_slices; ++iz) {
+            for (int iy = 0; iy < size_y; ++iy) {
+                for (int ix = 0; ix < size_x; ++ix) {
+                    int64_t voxel_i = nxy * (z_begin + iz) + nx * iy + ix;
+                    float max_val = 0;
+                    float min_val = std::numeric_limits<float>::max();
+                    for (int it = 0; it < size_time; ++it) {
+                        int64_t voxel_j = slab_nxyz * it + nxy * iz + nx * iy + ix;
+                        if (*(nii_data + voxel_j) > max_val) {
+                            max_val = *(nii_data + voxel_j);
+                            TR_max = it;
+                        }
+                        if (*(nii_data + voxel_j) < min_val) {
+                            min_val = *(nii_data + voxel_j);
+                            TR_min = it;
+                        }
                     }
+                    *(nii_min_data + voxel_i) = TR_min;
+                    *(nii_max_data + voxel_i) = TR_max;
                 }
-                *(nii_min_data + voxel_i) = TR_min;
-                *(nii_max_data + voxel_i) = TR_max;
-           }
+            }
         }
     }
+    ln_slab_reader_close(reader);
     if (!use_outpath) fout = fin_1;
     save_output_nifti(fout, "MaxTR", nii_max, true);
     save_output_nifti(fout, "MinTR", nii_min, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -89,6 +89,9 @@ int main(int argc, char *argv[]) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "float", nii_new, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -293,6 +293,9 @@ int main(int argc, char * argv[]) {
     save_output_nifti(fout, "Gfactormap", nii_gfactormap, true, false);
     save_output_nifti(fout, "Amplified_GRAPPA", nii_noise, true, false);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
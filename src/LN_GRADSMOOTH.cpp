@@ -383,5 +383,8 @@ int main(int argc, char * argv[])
     }
     save_output_nifti(fout, "smoothed", smoothed, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     return 0;
 }
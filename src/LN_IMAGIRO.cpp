@@ -86,27 +86,39 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image* nim_column_r = nifti_image_read(fin_columns, 1);
+    // Read input dataset, cropped to the bounding box of the layers and
+    // columns. Slices are the depth axis of the unfolded image, so the box
+    // always spans all of them.
+    ln_crop crop;
+    if (!ln_crop_find(crop, {fin_layers, fin_columns})) {
+        return 2;
+    }
+    crop.start[2] = 0;
+    crop.size[2] = crop.nii_full->nz;
+
+    nifti_image* nim_column_r = ln_read_cropped(fin_columns, crop);
     if (!nim_column_r) {
         fprintf(stderr, " ** failed to read NIfTI from '%s'\n", fin_columns);
         return 2;
     }
-    nifti_image* nim_layers_r = nifti_image_read(fin_layers, 1);
+    nifti_image* nim_layers_r = ln_read_cropped(fin_layers, crop);
     if (!nim_layers_r) {
         fprintf(stderr, " ** failed to read NIfTI from '%s'\n", fin_layers);
         return 2;
     }
-    nifti_image* nim_data_r = nifti_image_read(fin_data, 1);
+    nifti_image* nim_data_r = ln_read_cropped(fin_data, crop);
     if (!nim_data_r) {
         fprintf(stderr, " ** failed to read NIfTI from '%s'\n", fin_data);
         return 2;
     }
+    // Header of the uncropped data, for the unfolded outputs
+    nifti_image* nim_data_hdr = nifti_image_read(fin_data, 0);
 
     log_welcome("LN_IMAGIRO");
     log_nifti_descriptives(nim_layers_r);
     log_nifti_descriptives(nim_column_r);
     log_nifti_descriptives(nim_data_r);
+    log_crop_descriptives(crop);
 
     // Get dimensions of input
     int size_z = nim_layers_r->nz;
@@ -150,7 +162,7 @@ int main(int argc, char * argv[]) {
     ////////////////////////////////
     // Allocating necessary files //
     ////////////////////////////////
-    nifti_image* imagiro = nifti_copy_nim_info(nim_data);
+    nifti_image* imagiro = nifti_copy_nim_info(nim_data_hdr);
     imagiro->datatype = NIFTI_TYPE_FLOAT32;
     imagiro->nbyper = sizeof(float);
 
@@ -291,9 +303,9 @@ int main(int argc, char * argv[]) {
                         nr_vic = 0;
 
                         int jy_start = max(0, iy - vinc);
-                        int jy_stop = min(iy + vinc + 1, size_x_imagiro);
+                        int jy_stop = min(iy + vinc + 1, size_y_imagiro);
                         int jx_start = max(0, ix - vinc);
-                        int jx_stop = min(ix + vinc + 1, size_y_imagiro);
+                        int jx_stop = min(ix + vinc + 1, size_x_imagiro);
                         int jz_start = max(0, iz - vinc);
                         int jz_stop = min(iz + vinc + 1, size_z_imagiro);
 
@@ -353,6 +365,9 @@ int main(int argc, char * argv[]) {
     save_output_nifti(fout, "unfolded", imagiro, true, use_outpath);
     save_output_nifti(fin_data, "nr_voxels", imagiro_vnr, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -77,7 +77,9 @@ int main(int argc, char * argv[]) {
         fprintf(stderr, "** missing option '-input'\n");
         return 1;
     }
-    // Read input dataset, including data
+    // Read input dataset, including data. Inputs are only read, so
+    // uncompressed data is mapped from the file instead of copied.
+    nifti_set_mmap_read(1);
     nifti_image* nii_input = nifti_image_read(fin, 1);
     if (!nii_input) {
         fprintf(stderr, "** failed to read NIfTI image from '%s'\n", fin);
@@ -254,5 +254,8 @@ int main(int argc, char * argv[]) {
     if (!use_outpath) fout = fin_1;
     save_output_nifti(fout, "collapsed", nii_collapse, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     return 0;
 }
@@ -74,6 +74,9 @@ int main(int argc, char *argv[]) {
     nifti_image *nii_new = copy_nifti_as_int16(nii);
     save_output_nifti(fout, "int16", nii_new, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -26,6 +26,9 @@ int show_help(void){
     "                  Note, that this is best done with not too manny layers,  \n"
     "                  otherwise a single layer has wholes and is not connected.  \n"
     "                  This option can only smooth within layers and removes signal outside the layer mask  \n"
+    "    -threads    : (Optional) Number of threads used for smoothing within\n"
+    "                  layers and for writing .nii.gz outputs. '1' by default.\n"
+    "                  '0' uses all available cores.\n"
     "    -output     : (Optional) Output filename, including .nii or\n"
     "                  .nii.gz, and path if needed. Overwrites existing files.\n"
     "\n"
@@ -37,6 +40,70 @@ int show_help(void){
    return 0;
 }
 
+// Smooths the voxels of the slices z_begin, z_begin + z_step, ... within
+// their layer. Data is voxel-major (timepoints of a voxel are contiguous).
+// NOTE: ix runs along ny and iy along nx, same as in the main loops below.
+static void smooth_within_layer_slices(const float* input, const int* mask, float* smoothed,
+                                       const float* kernel, int vinc, int sizeRead,
+                                       int sizePhase, int sizeSlice, int64_t nrep,
+                                       int z_begin, int z_step, bool log_progress)
+{
+   int nx = sizePhase;
+   int nxy = sizePhase * sizeRead;
+   int vinc_w = 2 * vinc + 1;
+
+   vector<int> nbr_i;
+   vector<float> nbr_w;
+   vector<float> sum_t(nrep);
+
+   for(int iz=z_begin; iz<sizeSlice; iz+=z_step){
+     if (log_progress) cout << "\r  slice " << iz+1 << " of " << sizeSlice << flush ;
+      for(int iy=0; iy<sizePhase; ++iy){
+        for(int ix=0; ix<sizeRead; ++ix){
+          int64_t voxel_i = nxy*iz + nx*ix + iy;
+          int layer_i = *(mask + voxel_i);
+
+          if (layer_i <= 0){
+            for (int time_i = 0 ; time_i < nrep ; ++time_i){
+              *(smoothed + nrep*voxel_i + time_i) = *(input + nrep*voxel_i + time_i);
+            }
+            continue;
+          }
+
+          nbr_i.clear();
+          nbr_w.clear();
+          float gausweight = 0;
+          for(int iz_i=max(0,iz-vinc); iz_i<min(iz+vinc+1,sizeSlice-1); ++iz_i){
+            for(int iy_i=max(0,iy-vinc); iy_i<min(iy+vinc+1,sizePhase-1); ++iy_i){
+              for(int ix_i=max(0,ix-vinc); ix_i<min(ix+vinc+1,sizeRead-1); ++ix_i){
+                int64_t voxel_j = nxy*iz_i + nx*ix_i + iy_i;
+                if (*(mask + voxel_j) == layer_i){
+                  float g = kernel[((iz_i-iz+vinc) * vinc_w + (iy_i-iy+vinc)) * vinc_w + (ix_i-ix+vinc)];
+                  nbr_i.push_back(voxel_j);
+                  nbr_w.push_back(g);
+                  gausweight = gausweight + g;
+                }
+              }
+            }
+          }
+
+          std::fill(sum_t.begin(), sum_t.end(), 0);
+          for (size_t k = 0; k != nbr_i.size(); ++k){
+            const float* input_j = input + nrep * nbr_i[k];
+            float g = nbr_w[k];
+            for (int time_i = 0 ; time_i < nrep ; ++time_i){
+              sum_t[time_i] = sum_t[time_i] + input_j[time_i] * g;
+            }
+          }
+          for (int time_i = 0 ; time_i < nrep ; ++time_i){
+            if (gausweight > 0) sum_t[time_i] = sum_t[time_i] / gausweight;
+            *(smoothed + nrep*voxel_i + time_i) = sum_t[time_i];
+          }
+        }
+      }
+   }
+}
+
 int main(int argc, char * argv[])
 {
    bool use_outpath = false ;
@@ -83,6 +150,13 @@ int main(int argc, char * argv[])
          do_masking = 1;
          cout << "I will set every thing to zero outside the layers (masking option)"  << endl;
       }
+      else if (!strcmp(argv[ac], "-threads")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -threads\n");
+                return 1;
+            }
+            ln_set_nr_threads(atoi(argv[ac]));
+      }
       else if (!strcmp(argv[ac], "-output")) {
             if (++ac >= argc) {
                 fprintf(stderr, "** missing argument for -output\n");
@@ -123,7 +197,7 @@ int main(int argc, char * argv[])
    int sizeRead = nim_maski->ny ;
    int nx =  nim_maski->nx;
    int nxy = nim_maski->nx * nim_maski->ny;
-   int nxyz = nim_maski->nx * nim_maski->ny * nim_maski->nz;
+   int64_t nxyz = nim_maski->nx * nim_maski->ny * nim_maski->nz;
    float dX =  nim_maski->pixdim[1] ;
    float dY =  nim_maski->pixdim[2] ;
    float dZ =  nim_maski->pixdim[3] ;
@@ -263,6 +337,9 @@ if ( nim_maski->datatype == NIFTI_TYPE_INT32 ) {
 
 
 
+   // Only the header of the input is needed from here on
+   nifti_image_unload(nim_inputfi);
+
    cout << sizeSlice << " slices    " <<  sizePhase << " PhaseSteps     " <<  sizeRead << " Read steps    " <<  nrep << " timesteps "  << endl;
    cout << " Voxel size    " <<  dX << " x " <<  dY << " x "  <<  dZ  << endl;
 
@@ -284,7 +361,7 @@ if ( nim_maski->datatype == NIFTI_TYPE_INT32 ) {
     smoothed->nbyper 		= sizeof(float);
 	gausweight->nbyper 		= sizeof(float);
 
-    smoothed->data = calloc(smoothed->nvox*nrep, smoothed->nbyper);
+    smoothed->data = calloc(smoothed->nvox, smoothed->nbyper);
     gausweight->data = calloc(gausweight->nvox, gausweight->nbyper);
 
     float  *smoothed_data = (float *) smoothed->data;
@@ -343,57 +420,60 @@ cout << " There are  " <<  layernumber<< " layers/masks to smooth within  " << e
 
 if (sulctouch == 0 ){
 
- cout << " smoothing in layer not considering sulci  " << flush ;
-
-
- for(int layernumber_i=1; layernumber_i<=layernumber; ++layernumber_i){
- cout << "\r  " <<  layernumber_i << " of  " << layernumber<<  flush ;
-
-	for(int iz=0; iz<sizeSlice; ++iz){
-      for(int iy=0; iy<sizePhase; ++iy){
-        for(int ix=0; ix<sizeRead-0; ++ix){
-          *(gausweight_data  + nxy*iz + nx*ix  + iy  )  = 0 ;
-		  //*(smoothed_data    + nxy*iz + nx*ix  + iy  )  = 0 ;
-
-	     if (*(nim_mask_data   +  nxy*iz + nx*ix  + iy  )  == layernumber_i ){
-
-			for(int iz_i=max(0,iz-vinc); iz_i<min(iz+vinc+1,sizeSlice-1); ++iz_i){
-	    		for(int iy_i=max(0,iy-vinc); iy_i<min(iy+vinc+1,sizePhase-1); ++iy_i){
-	      			for(int ix_i=max(0,ix-vinc); ix_i<min(ix+vinc+1,sizeRead-1); ++ix_i){
-	      			  if (*(nim_mask_data   +  nxy*iz_i + nx*ix_i  + iy_i  )  == layernumber_i ){
-		  				dist_i = dist((float)ix,(float)iy,(float)iz,(float)ix_i,(float)iy_i,(float)iz_i,dX,dY,dZ);
-		  				//cout << "debug  4 " <<  gaus(dist_i ,FWHM_val ) <<   endl;
-		  			    //cout << "debug  5 " <<  dist_i  <<   endl;
-						//if ( *(nim_input_data   +  nxy*iz + nx*ix  + iy  )  == 3 ) cout << "debug  4b " << endl;
-							//dummy = *(layer_data  + nxy*iz_i + nx*ix_i  + iy_i  );
-
-                            for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                                *(smoothed_data + nxyz *time_i    + nxy*iz + nx*ix  + iy  ) = *(smoothed_data  +  nxyz *time_i    + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data +  nxyz *time_i  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
-                            }
-                              //  *(smoothed_data     + nxy*iz + nx*ix  + iy  ) = *(smoothed_data     + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
-
-		    				*(gausweight_data  + nxy*iz + nx*ix  + iy  ) = *(gausweight_data  + nxy*iz + nx*ix  + iy  ) + gaus(dist_i ,FWHM_val ) ;
-			  		  }
-		            }
-	      	    }
-	       }
-                for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                    if (*(gausweight_data  + nxy*iz + nx*ix  + iy  ) > 0 ) *(smoothed_data + nxyz *time_i     + nxy*iz + nx*ix  + iy  )  = *(smoothed_data  + nxyz *time_i  + nxy*iz + nx*ix  + iy  )/ *(gausweight_data  + nxy*iz + nx*ix  + iy  );
-                }
-	     }
-
-	     if (*(nim_mask_data   +  nxy*iz + nx*ix  + iy  )  <= 0 )	 {
-
-                for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                 	*(smoothed_data +  nxyz *time_i   + nxy*iz + nx*ix  + iy  ) =  *(nim_inputf_data  +  nxyz *time_i + nxy*iz + nx*ix  + iy  ) ;
-                }
-            }
-
+ cout << " smoothing in layer not considering sulci  " << endl ;
+
+ // Gaussian weights only depend on the voxel offset
+ int vinc_w = 2 * vinc + 1;
+ vector<float> kernel(vinc_w * vinc_w * vinc_w);
+ for (int kz = -vinc; kz <= vinc; ++kz){
+   for (int ky = -vinc; ky <= vinc; ++ky){
+     for (int kx = -vinc; kx <= vinc; ++kx){
+       dist_i = dist(0., 0., 0., (float)kx, (float)ky, (float)kz, dX, dY, dZ);
+       kernel[((kz + vinc) * vinc_w + (ky + vinc)) * vinc_w + (kx + vinc)] = gaus(dist_i, FWHM_val);
+     }
+   }
+ }
+
+ // Timepoints of each voxel are made contiguous, so the neighbourhood of a
+ // voxel is found once and applied to the whole time course. The reordered
+ // input is kept in the output image and smoothed into the input image, so
+ // that no further copies of the time series are needed.
+ float* input_vm = nim_inputf_data;
+ float* smoothed_vm = smoothed_data;
+ if (nrep > 1){
+   for (int time_i = 0 ; time_i < nrep ; ++time_i){
+     for (int64_t i = 0; i < nxyz; ++i){
+       smoothed_data[nrep * i + time_i] = *(nim_inputf_data + nxyz * time_i + i);
+     }
+   }
+   input_vm = smoothed_data;
+   smoothed_vm = nim_inputf_data;
+ }
+
+ int nr_threads = max(1, min(ln_get_nr_threads(), sizeSlice));
+ if (nr_threads == 1){
+   smooth_within_layer_slices(input_vm, nim_mask_data, smoothed_vm, kernel.data(),
+                              vinc, sizeRead, sizePhase, sizeSlice, nrep, 0, 1, true);
+ } else {
+   cout << " using " << nr_threads << " threads " << endl;
+   vector<std::thread> threads;
+   for (int n_th = 0; n_th != nr_threads; ++n_th){
+     threads.push_back(std::thread(smooth_within_layer_slices, input_vm, nim_mask_data,
+                                   smoothed_vm, kernel.data(), vinc, sizeRead, sizePhase,
+                                   sizeSlice, nrep, n_th, nr_threads, n_th == 0));
+   }
+   for (int n_th = 0; n_th != nr_threads; ++n_th){
+     threads[n_th].join();
+   }
+ }
 
-        }
-      }
-    }
-  }// for layer loop closed
+ if (nrep > 1){
+   for (int time_i = 0 ; time_i < nrep ; ++time_i){
+     for (int64_t i = 0; i < nxyz; ++i){
+       *(smoothed_data + nxyz * time_i + i) = smoothed_vm[nrep * i + time_i];
+     }
+   }
+ }
 
    cout << endl;
 
@@ -519,15 +599,16 @@ int pref_ratio = 0 ;
 	      			for(int ix_i=max(0,ix-vinc); ix_i<=min(ix+vinc,sizeRead-1); ++ix_i){
 	      			  if ( *(hairy_brain_data  + nxy*iz_i + nx*ix_i  + iy_i) == 1){
 		  				dist_i = dist((float)ix,(float)iy,(float)iz,(float)ix_i,(float)iy_i,(float)iz_i,dX,dY,dZ);
+		  				float gaus_i = gaus(dist_i ,FWHM_val ) ;
 		  				//*(smoothed_data    + nxy*iz + nx*ix  + iy  ) = *(smoothed_data    + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data  + nxy*iz_i + nx*ix_i  + iy_i) * gaus(dist_i ,FWHM_val ) ;
 		    			//*(gausweight_data  + nxy*iz + nx*ix  + iy  ) = *(gausweight_data  + nxy*iz + nx*ix  + iy  ) + gaus(dist_i ,FWHM_val ) ;
 		    			
 		    			for (int time_i = 0 ; time_i < nrep ; ++time_i){
-                            *(smoothed_data + nxyz *time_i    + nxy*iz + nx*ix  + iy  ) = *(smoothed_data  +  nxyz *time_i    + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data +  nxyz *time_i  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
+                            *(smoothed_data + nxyz *time_i    + nxy*iz + nx*ix  + iy  ) = *(smoothed_data  +  nxyz *time_i    + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data +  nxyz *time_i  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus_i ;
                             }
                               //  *(smoothed_data     + nxy*iz + nx*ix  + iy  ) = *(smoothed_data     + nxy*iz + nx*ix  + iy  ) + *(nim_inputf_data  + nxy*iz_i + nx*ix_i  + iy_i  ) * gaus(dist_i ,FWHM_val ) ;
 
-		    				*(gausweight_data  + nxy*iz + nx*ix  + iy  ) = *(gausweight_data  + nxy*iz + nx*ix  + iy  ) + gaus(dist_i ,FWHM_val ) ;
+		    				*(gausweight_data  + nxy*iz + nx*ix  + iy  ) = *(gausweight_data  + nxy*iz + nx*ix  + iy  ) + gaus_i ;
 
 			  		  }
 		            }
@@ -652,6 +733,9 @@ cout << " ############################################################# " << end
 
 
 
+  if (!ln_flush_outputs()) {
+    return 2;
+  }
   return 0;
 }
 
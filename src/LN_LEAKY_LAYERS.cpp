@@ -246,6 +246,9 @@ int main(int argc, char * argv[]) {
 
     //save_output_nifti(fin, "gauswight", gaus_weigth, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
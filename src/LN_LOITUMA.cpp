@@ -417,5 +417,8 @@ cout << " min layer is " <<  min_layer << "   max layers is " << max_layer << en
      //   save_output_nifti(fout, "denoised", nii_denoised, true, use_outpath);
 
 
+  if (!ln_flush_outputs()) {
+    return 2;
+  }
   return 0;
 }
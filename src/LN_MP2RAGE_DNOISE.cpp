@@ -205,6 +205,9 @@ int main(int argc, char* argv[]) {
     save_output_nifti(fout, "denoised", nii_denoised, true, use_outpath);
     save_output_nifti(fout, "border_enhance", nii_phaseerr, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
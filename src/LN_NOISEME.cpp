@@ -94,8 +94,8 @@ int main(int argc, char * argv[]) {
     float* nii_new_data = static_cast<float*>(nii_new->data);
     // ========================================================================
 
-    int nr_voxels = nii_input->nvox;
-    for (int i = 0; i < nr_voxels; ++i) {
+    int64_t nr_voxels = nii_input->nvox;
+    for (int64_t i = 0; i < nr_voxels; ++i) {
         *(nii_new_data + i) +=
             adjusted_rand_numbers(0, std_val,
                                   arb_pdf_num(N_rand, pFunc, lower, upper));
@@ -105,6 +105,9 @@ int main(int argc, char * argv[]) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "noised", nii_new, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -238,6 +238,9 @@ cout << endl;
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "fPSF", nii_kernel, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
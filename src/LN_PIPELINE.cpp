@@ -0,0 +1,220 @@
+#include "../dep/laynii_lib.h"
+#include "../dep/laynii_programs.h"
+#include <limits>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+// ============================================================================
+// Pipeline stages
+// ============================================================================
+// The stages are the LayNii programs, linked into this driver (see
+// laynii_programs.h). They run in this process and free the images they
+// allocate, so images pass from one program to the next through the in-memory
+// image store of laynii_lib instead of compressed files.
+typedef int (*ln_program_run)(int argc, char* argv[]);
+
+struct ln_program {
+    const char* name;
+    ln_program_run run;
+};
+
+static const ln_program ln_programs[] = {
+    {"LN2_RIMIFY", ln2_rimify_run},
+    {"LN2_LAYERS", ln2_layers_run},
+    {"LN2_MULTILATERATE", ln2_multilaterate_run},
+    {"LN2_PATCH_FLATTEN", ln2_patch_flatten_run},
+    {"LN2_LAYER_SMOOTH", ln2_layer_smooth_run},
+    {"LN2_PROFILE", ln2_profile_run},
+};
+
+int show_help(void) {
+    printf(
+    "LN_PIPELINE: Run several LayNii programs in one process. Images written\n"
+    "             by one program and read by a later one are passed in memory.\n"
+    "             Only the requested outputs are written to disk.\n"
+    "\n"
+    "Usage:\n"
+    "    LN_PIPELINE -config steps.txt\n"
+    "\n"
+    "    Example steps.txt:\n"
+    "        # One program call per line, as on the command line\n"
+    "        LN2_RIMIFY -input seg.nii.gz -innergm 2 -outergm 1 -gm 3 -output rim.nii.gz\n"
+    "        LN2_LAYERS -rim rim.nii.gz -nr_layers 10 -equivol\n"
+    "        LN2_PROFILE -input act.nii.gz -layers rim_layers_equivol.nii.gz -output profile.txt\n"
+    "        # Outputs to write to disk, '*' matches any characters\n"
+    "        save rim_layers_equivol.nii.gz rim_metric_*.nii.gz\n"
+    "\n"
+    "Options:\n"
+    "    -help     : Show this help.\n"
+    "    -config   : Text file with one program call per line. Lines starting\n"
+    "                with 'save' list the outputs that are written to disk.\n"
+    "                Empty lines and lines starting with '#' are ignored.\n"
+    "    -save_all : (Optional) Write all outputs to disk.\n"
+    "    -profile  : (Optional) Write the time and memory use of each stage\n"
+    "                to 'LN_PIPELINE_profile.json' at exit.\n"
+    "\n"
+    "Notes:\n"
+    "    - Supported programs: LN2_RIMIFY, LN2_LAYERS, LN2_MULTILATERATE,\n"
+    "      LN2_PATCH_FLATTEN, LN2_LAYER_SMOOTH, LN2_PROFILE.\n"
+    "    - Programs find earlier outputs by the file name they were written\n"
+    "      as (see the log), so inputs have to be given with the same name.\n"
+    "    - Text outputs (e.g. LN2_PROFILE) are always written.\n"
+    "\n");
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* fin_config = NULL;
+    bool mode_save_all = false;
+    int ac;
+
+    // Process user options
+    if (argc < 2) return show_help();
+    for (ac = 1; ac < argc; ac++) {
+        if (!strncmp(argv[ac], "-h", 2)) {
+            return show_help();
+        } else if (!strcmp(argv[ac], "-config")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -config\n");
+                return 1;
+            }
+            fin_config = argv[ac];
+        } else if (!strcmp(argv[ac], "-save_all")) {
+            mode_save_all = true;
+        } else if (!strcmp(argv[ac], "-profile")) {
+            ln_set_profile("");
+        } else {
+            fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
+            return 1;
+        }
+    }
+
+    if (!fin_config) {
+        fprintf(stderr, "** missing option '-config'\n");
+        return 1;
+    }
+
+    // ========================================================================
+    // Read the pipeline
+    // ========================================================================
+    std::ifstream config(fin_config);
+    if (!config) {
+        fprintf(stderr, "** failed to read '%s'\n", fin_config);
+        return 2;
+    }
+    std::vector<std::vector<string> > stages;
+    std::vector<ln_program_run> stage_run;
+    std::vector<string> save_patterns;
+    if (mode_save_all) {
+        save_patterns.push_back("*");
+    }
+
+    string line;
+    int line_nr = 0;
+    while (std::getline(config, line)) {
+        line_nr += 1;
+        std::istringstream words(line);
+        std::vector<string> args;
+        string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
+        if (args.empty() || args[0][0] == '#') {
+            continue;
+        }
+        if (args[0] == "save") {
+            save_patterns.insert(save_patterns.end(), args.begin() + 1, args.end());
+            continue;
+        }
+        ln_program_run program = NULL;
+        for (const ln_program& p : ln_programs) {
+            if (args[0] == p.name) {
+                program = p.run;
+            }
+        }
+        if (program == NULL) {
+            fprintf(stderr, "** '%s' line %d: unknown program '%s'\n",
+                    fin_config, line_nr, args[0].c_str());
+            return 1;
+        }
+        stages.push_back(args);
+        stage_run.push_back(program);
+    }
+
+    // ========================================================================
+    // Run the stages
+    // ========================================================================
+    ln_profile_begin("LN_PIPELINE");
+    ln_memory_store_begin(save_patterns);
+    std::vector<string> not_saved;
+    int retval = 0;
+    bool write_failed = false;
+    const std::ios_base::fmtflags cout_flags = cout.flags();
+    const std::streamsize cout_precision = cout.precision();
+
+    for (size_t s = 0; s < stages.size(); ++s) {
+        cout << "\n  Stage " << s + 1 << "/" << stages.size() << ":";
+        for (const string& arg : stages[s]) {
+            cout << " " << arg;
+        }
+        cout << endl;
+
+        std::vector<char*> stage_argv;
+        for (string& arg : stages[s]) {
+            stage_argv.push_back(&arg[0]);
+        }
+        stage_argv.push_back(NULL);
+        {
+            const string stage_name = std::to_string(s + 1) + " " + stages[s][0];
+            ln_profile_scope profile(stage_name.c_str());
+            retval = stage_run[s](static_cast<int>(stages[s].size()), stage_argv.data());
+        }
+
+        // Settings of one program do not carry over to the next
+        if (!ln_flush_outputs()) {
+            write_failed = true;
+        }
+        ln_reset_settings();
+        cout.flags(cout_flags);
+        cout.precision(cout_precision);
+        if (retval != 0) {
+            fprintf(stderr, "** stage %d (%s) failed\n", static_cast<int>(s + 1),
+                    stages[s][0].c_str());
+            break;
+        }
+
+        // Free outputs that no later stage reads
+        for (const string& path : ln_memory_store_paths()) {
+            bool used = false;
+            for (size_t s_next = s + 1; s_next < stages.size(); ++s_next) {
+                for (const string& arg : stages[s_next]) {
+                    if (ln_memory_store_find(arg) == ln_memory_store_find(path)) {
+                        used = true;
+                    }
+                }
+            }
+            if (!used) {
+                if (!ln_memory_store_saved(path)) {
+                    not_saved.push_back(path);
+                }
+                ln_memory_store_drop(path);
+            }
+        }
+    }
+    ln_memory_store_end();
+
+    if (!ln_flush_outputs() || write_failed) {
+        retval = retval != 0 ? retval : 2;
+    }
+    if (!not_saved.empty()) {
+        cout << "\n  Outputs that were not saved (see 'save' in the help):" << endl;
+        for (const string& path : not_saved) {
+            cout << "    " << path << endl;
+        }
+    }
+    cout << "\n  Finished." << endl;
+    return retval;
+}
@@ -162,6 +162,9 @@ int main(int argc, char * argv[]) {
     save_output_nifti(fout, "ragrug", ragrug, true, use_outpath);
 //    save_output_nifti(fin, "coordinates", coord, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -71,6 +71,9 @@ int main(int argc, char *argv[]) {
     nifti_image *nii_new = copy_nifti_as_float16(nii);
     save_output_nifti(fout, "short", nii_new, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -20,6 +20,8 @@ int show_help(void) {
     "Options:\n"
     "    -help   : Show this help.\n"
     "    -input  : Nifti (.nii or nii.gz) time series.\n"
+    "    -max_mem: (Optional) Memory budget in MB. The time series is read in\n"
+    "              slabs of slices that fit this budget. '2048' by default.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"    
     "\n"
@@ -54,6 +56,12 @@ int main(int argc, char * argv[]) {
             }
             use_outpath = true;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -65,8 +73,8 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image * nii_input = nifti_image_read(fin, 1);
+    // Read input header, data is streamed in slabs below
+    nifti_image * nii_input = nifti_image_read(fin, 0);
     if (!nii_input) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
@@ -82,17 +90,22 @@ int main(int argc, char * argv[]) {
     int size_time = nii_input->nt;
     int nx = nii_input->nx;
     int nxy = nii_input->nx * nii_input->ny;
-    int nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
+    int64_t nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
 
     // ========================================================================
-    // Fix data type issues
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
+    // The time series is read in slabs of slices across all time
+    // points. Only the 3D outputs are kept in memory.
+    const int slab_size = ln_slab_nr_slices(nii_input, 1);
+    const bool single_slab = slab_size >= size_z;
+    std::vector<float> slab(static_cast<int64_t>(nxy) * slab_size * size_time);
+    float* nii_data = slab.data();
+    ln_slab_reader reader;
+    if (!ln_slab_reader_open(reader, nii_input, slab_size)) return 2;
 
     // Allocate new nifti
-    nifti_image* nii_skew = nifti_copy_nim_info(nii);
+    nifti_image* nii_skew = nifti_copy_nim_info(nii_input);
     nii_skew->nt = 1;
-    nii_skew->nvox = nii->nvox / size_time;
+    nii_skew->nvox = nii_input->nvox / size_time;
     nii_skew->datatype = NIFTI_TYPE_FLOAT32;
     nii_skew->nbyper = sizeof(float);
     nii_skew->data = calloc(nii_skew->nvox, nii_skew->nbyper);
@@ -131,27 +144,67 @@ int main(int argc, char * argv[]) {
     double vec1[size_time];
     double vecl[27]; // local vector for spatial gradient (number of voxel's noigbour)
     double vec2[size_time];
-    int voxel_i = 0; 
+    int64_t voxel_i = 0; 
 
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    vec1[it] =
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i));
+    for (int it = 0; it < size_time; ++it) {
+        vec1[it] = 0;
+        vec2[it] = 0;
+    }
+    // Even number of time points for the image SNR
+    const int size_time_even = size_time - size_time % 2;
+
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t slab_nxyz = static_cast<int64_t>(nxy) * nr_slices;
+        if (!ln_read_slab(reader, z_begin, nr_slices, nii_data)) return 2;
+
+        for (int iz = 0; iz < nr_slices; ++iz) {
+            for (int iy = 0; iy < size_y; ++iy) {
+                for (int ix = 0; ix < size_x; ++ix) {
+                    voxel_i = nxy * (z_begin + iz) + nx * iy + ix;
+                    int64_t slab_i = nxy * iz + nx * iy + ix;
+                    for (int it = 0; it < size_time; ++it) {
+                        vec1[it] =
+                            static_cast<double>(*(nii_data + slab_nxyz * it + slab_i));
+                    }
+                    *(nii_skew_data + voxel_i) = ren_skew(vec1, size_time);
+                    *(nii_kurt_data + voxel_i) = ren_kurt(vec1, size_time);
+                    *(nii_autocorr_data + voxel_i) = ren_autocor(vec1, size_time);
+                    *(nii_mean_data + voxel_i) =  ren_average(vec1, size_time);
+                    *(nii_stdev_data + voxel_i) = ren_stdev(vec1, size_time);
+                    *(nii_tSNR_data + voxel_i) = ren_average(vec1, size_time)/ren_stdev(vec1, size_time);
                 }
-                *(nii_skew_data + voxel_i) = ren_skew(vec1, size_time);
-                *(nii_kurt_data + voxel_i) = ren_kurt(vec1, size_time);
-                *(nii_autocorr_data + voxel_i) = ren_autocor(vec1, size_time);
-                *(nii_mean_data + voxel_i) =  ren_average(vec1, size_time);
-                *(nii_stdev_data + voxel_i) = ren_stdev(vec1, size_time);
-                *(nii_tSNR_data + voxel_i) = ren_average(vec1, size_time)/ren_stdev(vec1, size_time);
+            }
+        }
+
+        // Mean time course of everything
+        for (int iz = 0; iz < nr_slices; ++iz) {
+            for (int iy = 0; iy < size_y; ++iy) {
+                for (int ix = 0; ix < size_x; ++ix) {
+                    int64_t slab_i = nxy * iz + nx * iy + ix;
+                    for (int it = 0; it < size_time; ++it) {
+                        vec2[it] +=
+                            static_cast<double>(*(nii_data + slab_nxyz * it + slab_i)
+                                                / nxyz);
+                    }
+                }
+            }
+        }
+
+        // Difference of even and odd time points
+        for (int it = 0; it < size_time_even - 1 ; it = it + 2 )   {
+            for (int64_t slab_i = 0; slab_i < slab_nxyz ; slab_i++) {
+                voxel_i = nxy * z_begin + slab_i;
+                *(nii_NOISE_data + voxel_i) += static_cast<double>(*(nii_data + slab_nxyz * it     + slab_i)) ;
+                *(nii_NOISE_data + voxel_i) -= static_cast<double>(*(nii_data + slab_nxyz * (it+1) + slab_i)) ;
             }
         }
     }
+    for (int it = 0; it < size_time; ++it) {
+        vec1[it] = vec2[it];
+    }
 
-    for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
+    for (int64_t voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
       if ((nii_tSNR->scl_slope) != 0)  *(nii_tSNR_data + voxel_i) /=  (nii_tSNR->scl_slope) ; 
       if ( *(nii_tSNR_data + voxel_i) != *(nii_tSNR_data + voxel_i) ) *(nii_tSNR_data + voxel_i) = 0; // filtering NaNs
     }
@@ -167,38 +220,30 @@ int main(int argc, char * argv[]) {
     // ========================================================================
     cout << "  Calculating correlation with everything..." << endl;
 
-    for (int it = 0; it < size_time; ++it) {
-        vec1[it] = 0;
-        vec2[it] = 0;
-    }
-
-    // Mean time course of everything
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix < size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it) {
-                    vec1[it] +=
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i)
-                                            / nxyz);
-                }
-            }
+    // Voxel-wise corelation to mean of everything
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t slab_nxyz = static_cast<int64_t>(nxy) * nr_slices;
+        // A single slab is still in memory from above
+        if (!single_slab && !ln_read_slab(reader, z_begin, nr_slices, nii_data)) {
+            return 2;
         }
-    }
 
-    // Voxel-wise corelation to mean of everything
-    for (int iz = 0; iz < size_z; ++iz) {
-        for (int iy = 0; iy < size_y; ++iy) {
-            for (int ix = 0; ix <size_x; ++ix) {
-                voxel_i = nxy * iz + nx * iy + ix;
-                for (int it = 0; it < size_time; ++it)   {
-                    vec2[it] =
-                        static_cast<double>(*(nii_data + nxyz * it + voxel_i));
+        for (int iz = 0; iz < nr_slices; ++iz) {
+            for (int iy = 0; iy < size_y; ++iy) {
+                for (int ix = 0; ix <size_x; ++ix) {
+                    voxel_i = nxy * (z_begin + iz) + nx * iy + ix;
+                    int64_t slab_i = nxy * iz + nx * iy + ix;
+                    for (int it = 0; it < size_time; ++it)   {
+                        vec2[it] =
+                            static_cast<double>(*(nii_data + slab_nxyz * it + slab_i));
+                    }
+                    *(nii_conc_data + voxel_i) = ren_correl(vec1, vec2, size_time);
                 }
-                *(nii_conc_data + voxel_i) = ren_correl(vec1, vec2, size_time);
             }
         }
     }
+    ln_slab_reader_close(reader);
     save_output_nifti(fout, "overall_correl", nii_conc, true);
     
     
@@ -208,17 +253,9 @@ int main(int argc, char * argv[]) {
     cout << "  Calculating image SNR ..." << endl;
     //size_time = 20;
     if (size_time%2 == 1) size_time = size_time -1  ;  // make sure its and odd number of time points 
-    
-    for (int it = 0; it < size_time-1 ; it = it + 2 )   {
-        for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
-                    //vec2[it] =  static_cast<double>(*(nii_data + nxyz * it + voxel_i));
-                *(nii_NOISE_data + voxel_i) += static_cast<double>(*(nii_data + nxyz * it     + voxel_i)) ;
-                *(nii_NOISE_data + voxel_i) -= static_cast<double>(*(nii_data + nxyz * (it+1) + voxel_i)) ;
-        }
-    }
   
   // normalicing to time course duration
-    for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
+    for (int64_t voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
                 *(nii_NOISE_data + voxel_i) = *(nii_NOISE_data + voxel_i) / sqrt((double) (size_time)/2 ) ;
     }
     
@@ -280,13 +317,16 @@ int main(int argc, char * argv[]) {
         }
     }
     
-    for (int voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
+    for (int64_t voxel_i = 0; voxel_i < nxyz ; voxel_i++) {
         if ((nii_NOISESTDEV->scl_slope) != 0) *(nii_NOISESTDEV_data + voxel_i) /=  (nii_NOISESTDEV->scl_slope) ; 
         if ( *(nii_NOISESTDEV_data + voxel_i) != *(nii_NOISESTDEV_data + voxel_i) ) *(nii_NOISESTDEV_data + voxel_i) = 0; 
     }
 
     save_output_nifti(fout, "imageSNR", nii_NOISESTDEV, true);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -23,6 +23,9 @@ int show_help(void) {
     "    -box    : Doing the smoothing with a box-var. Specify the value \n"
     "              of the box sice (integer value). This is like a \n"
     "              running average sliding window.\n"
+    "    -max_mem: (Optional) Memory budget in MB. The time series is read and\n"
+    "              written in slabs of slices that fit this budget. '2048'\n"
+    "              by default.\n"
     "    -output : (Optional) Output filename, including .nii or\n"
     "              .nii.gz, and path if needed. Overwrites existing files.\n"    
     "\n"
@@ -72,6 +75,12 @@ int main(int argc, char * argv[]) {
             }
             use_outpath = true;
             fout = argv[ac];
+        } else if (!strcmp(argv[ac], "-max_mem")) {
+            if (++ac >= argc) {
+                fprintf(stderr, "** missing argument for -max_mem\n");
+                return 1;
+            }
+            ln_set_max_memory(atoi(argv[ac]));
         } else {
             fprintf(stderr, "** invalid option, '%s'\n", argv[ac]);
             return 1;
@@ -83,8 +92,8 @@ int main(int argc, char * argv[]) {
         return 1;
     }
 
-    // Read input dataset
-    nifti_image * nii_input = nifti_image_read(fin, 1);
+    // Read input header, data is streamed in slabs below
+    nifti_image * nii_input = nifti_image_read(fin, 0);
     if (!nii_input) {
         fprintf(stderr, "** failed to read NIfTI from '%s'\n", fin);
         return 2;
@@ -107,28 +116,28 @@ int main(int argc, char * argv[]) {
     int size_y = nii_input->ny;
     int size_z = nii_input->nz;
     int size_time = nii_input->nt;
-    int nr_voxels = size_x * size_y * size_z;
+    int nxy = size_x * size_y;
     // int nx = nii_input->nx;
-    // int nxy = nii_input->nx * nii_input->ny;
-    int nxyz = nii_input->nx * nii_input->ny * nii_input->nz;
     float dT = 1;
 
     // ========================================================================
-    // Fixing potential problems with different input datatypes
-    nifti_image* nii = copy_nifti_as_float32(nii_input);
-    float* nii_data = static_cast<float*>(nii->data);
-
-    // Allocating necessary files
-    nifti_image* nii_smooth = copy_nifti_as_float32(nii);
-    float* nii_smooth_data = static_cast<float*>(nii_smooth->data);
-
-    nifti_image* nii_weight = nifti_copy_nim_info(nii);
-    nii_weight->nt = 1;
-    nii_weight->datatype = NIFTI_TYPE_FLOAT32;
-    nii_weight->nbyper = sizeof(float);
-    nii_weight->nvox = size_x * size_y * size_z;
-    nii_weight->data = calloc(nii_weight->nvox, nii_weight->nbyper);
-    float* nii_weight_data = static_cast<float*>(nii_weight->data);
+    // Prepare streamed output
+    // Input and output are processed in slabs of slices across
+    // all time points, so that long time series do not need to fit in memory.
+    if (!use_outpath) fout = fin;
+    nifti_image* nii_smooth = nifti_copy_nim_info(nii_input);
+    ln_slab_writer writer;
+    if (!ln_slab_writer_open(writer, nii_smooth, fout, "tempsmooth", use_outpath)) {
+        return 2;
+    }
+
+    const int slab_size = ln_slab_nr_slices(nii_input, 2);
+    std::vector<float> slab_in(static_cast<int64_t>(nxy) * slab_size * size_time);
+    std::vector<float> slab_out(slab_in.size());
+    float* nii_data = slab_in.data();
+    float* nii_smooth_data = slab_out.data();
+    ln_slab_reader reader;
+    if (!ln_slab_reader_open(reader, nii_input, slab_size)) return 2;
 
     // ========================================================================
     // Smoothing loop
@@ -142,42 +151,51 @@ int main(int argc, char * argv[]) {
     cout << "    vic " << vic << endl;
     cout << "    FWHM_val " << gFWHM_val << endl;
 
-    for (int i = 0; i < nr_voxels; ++i) {
-        *(nii_weight_data + i) = 0;
-        if (*(nii_data + i) != 0) {
-            for (int it = 0; it < size_time; ++it) {
-                int j = nxyz * it + i;
-                *(nii_smooth_data + j) = 0;
-
-                if (do_gaus) {
-                    float weight = 0;
-                    int jt_start = max(0, it - vic);
-                    int jt_stop = min(it + vic + 1, size_time);
-                    for (int jt = jt_start; jt < jt_stop; ++jt) {
-                        int k = nxyz * jt + i;
-                        float dist = abs(it - jt);
-                        float g = gaus(dist, gFWHM_val);
-                        *(nii_smooth_data + j) += (*(nii_data + k) * g);
-                        weight += g;
-                    }
-                    *(nii_smooth_data + j) /= weight;
-                } else if (do_box) {
-                    float weight = 0;
-                    int jt_start = max(0, it - vic);
-                    int jt_stop = min(it + vic + 1, size_time);
-                    for (int jt = jt_start; jt < jt_stop; ++jt) {
-                        int k = nxyz * jt + i;
-                        *(nii_smooth_data + j) += *(nii_data + k);
-                        weight += 1;
+    for (int z_begin = 0; z_begin < size_z; z_begin += slab_size) {
+        const int nr_slices = min(slab_size, size_z - z_begin);
+        const int64_t nxyz = static_cast<int64_t>(nxy) * nr_slices;  // Slab
+        const int64_t nr_voxels = nxyz;
+        if (!ln_read_slab(reader, z_begin, nr_slices, nii_data)) return 2;
+
+        // Voxels that are zero in the first time point stay unchanged
+        std::copy(nii_data, nii_data + nxyz * size_time, nii_smooth_data);
+
+        for (int64_t i = 0; i < nr_voxels; ++i) {
+            if (*(nii_data + i) != 0) {
+                for (int it = 0; it < size_time; ++it) {
+                    int64_t j = nxyz * it + i;
+                    *(nii_smooth_data + j) = 0;
+
+                    if (do_gaus) {
+                        float weight = 0;
+                        int jt_start = max(0, it - vic);
+                        int jt_stop = min(it + vic + 1, size_time);
+                        for (int jt = jt_start; jt < jt_stop; ++jt) {
+                            int64_t k = nxyz * jt + i;
+                            float dist = abs(it - jt);
+                            float g = gaus(dist, gFWHM_val);
+                            *(nii_smooth_data + j) += (*(nii_data + k) * g);
+                            weight += g;
+                        }
+                        *(nii_smooth_data + j) /= weight;
+                    } else if (do_box) {
+                        float weight = 0;
+                        int jt_start = max(0, it - vic);
+                        int jt_stop = min(it + vic + 1, size_time);
+                        for (int jt = jt_start; jt < jt_stop; ++jt) {
+                            int64_t k = nxyz * jt + i;
+                            *(nii_smooth_data + j) += *(nii_data + k);
+                            weight += 1;
+                        }
+                        *(nii_smooth_data + j) /= weight;
                     }
-                    *(nii_smooth_data + j) /= weight;
                 }
             }
         }
+        if (!ln_slab_write(writer, z_begin, nr_slices, nii_smooth_data)) return 2;
     }
-
-    if (!use_outpath) fout = fin;
-    save_output_nifti(fout, "tempsmooth", nii_smooth, true, use_outpath);
+    ln_slab_reader_close(reader);
+    if (!ln_slab_writer_close(writer)) return 2;
 
     cout << "  Finished." << endl;
     return 0;
@@ -116,6 +116,9 @@ int main(int argc, char * argv[]) {
     if (!use_outpath) fout = fin;
     save_output_nifti(fout, "TrialAverage", nii_trials, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "  Finished." << endl;
     return 0;
 }
@@ -162,6 +162,9 @@ int main(int argc, char*  argv[]) {
     if (!use_outpath) fout = fin_1;
     save_output_nifti(fout, "zoomed", nii_new, true, use_outpath);
 
+    if (!ln_flush_outputs()) {
+        return 2;
+    }
     cout << "Finished!" << endl;
     return 0;
 }
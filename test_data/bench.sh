@@ -0,0 +1,60 @@
+#! /bin/bash
+# Benchmark of the heavy programs on synthetic phantoms (see LN2_PHANTOM) of
+# increasing size. Prints and saves (bench/bench_summary.csv) the run time,
+# peak memory and throughput of each run.
+#
+# Usage: bash bench.sh [size in mm] ...
+#   Default sizes are 24 32 48. BENCH_RES sets the voxel size in mm (0.5 by
+#   default), BENCH_THREADS the number of threads for programs that have the
+#   -threads option (1 by default).
+#
+# Throughput is in gray matter voxels per second. For LN_BOCO it is in voxels
+# of the whole time series per second.
+
+SIZES=${@:-"24 32 48"}
+RES=${BENCH_RES:-0.5}
+THREADS=${BENCH_THREADS:-1}
+NR_VOLUMES=20
+
+mkdir -p bench
+cd bench || exit 1
+SUMMARY=bench_summary.csv
+echo "program,shape,size_mm,res_mm,threads,voxels,seconds,voxels_per_second,peak_rss_mb" > $SUMMARY
+
+# Run a program with profiling on and add its time and memory use to the summary
+run() {
+    local program=$1 voxels=$2
+    shift 2
+    rm -f profile.json
+    LAYNII_PROFILE=profile.json ../../$program "$@" > ${program}.log 2>&1
+    if [ $? -ne 0 ] || [ ! -f profile.json ]; then
+        echo "** $program failed on $P, see bench/${program}.log"
+        return
+    fi
+    local seconds=`grep '"wall_seconds"' profile.json | head -1 | tr -dc '0-9.'`
+    local peak=`grep '"peak_rss_mb"' profile.json | head -1 | tr -dc '0-9.'`
+    local rate=`awk -v v=$voxels -v s=$seconds 'BEGIN { printf "%.0f", (s > 0 ? v / s : 0) }'`
+    echo "$program,$SHAPE,$SIZE,$RES,$THREADS,$voxels,$seconds,$rate,$peak" >> $SUMMARY
+    printf "  %-18s %-7s %5s mm %10s voxels %9s s %12s voxels/s %8s MB\n" \
+        $program $SHAPE $SIZE $voxels $seconds $rate $peak
+}
+
+for SIZE in $SIZES; do
+    for SHAPE in sphere folded; do
+        P=${SHAPE}${SIZE}
+        ../../LN2_PHANTOM -shape $SHAPE -size $SIZE -res $RES -nr_volumes $NR_VOLUMES \
+            -output $P.nii.gz > LN2_PHANTOM.log || exit 1
+        NR_GM=`grep "Nr. gray matter voxels" LN2_PHANTOM.log | tr -dc '0-9'`
+        NR_TS=`awk -v s=$SIZE -v r=$RES -v t=$NR_VOLUMES 'BEGIN { n = int(s / r + 0.5); printf "%.0f", n * n * n * t }'`
+
+        run LN2_LAYERS $NR_GM -rim ${P}_rim.nii.gz -nr_layers 10 -equivol -threads $THREADS
+        run LN2_COLUMNS $NR_GM -rim ${P}_rim.nii.gz -midgm ${P}_midgm.nii.gz -nr_columns 100
+        run LN2_MULTILATERATE $NR_GM -rim ${P}_rim.nii.gz -control_points ${P}_control_points.nii.gz -radius 10
+        run LN2_UVD_FILTER $NR_GM -values ${P}_act.nii.gz -coord_uv ${P}_rim_UV_coordinates.nii.gz \
+            -coord_d ${P}_rim_metric_equidist.nii.gz -domain ${P}_rim_perimeter_chunk.nii.gz -radius 3 -height 0.25
+        run LN2_LAYER_SMOOTH $NR_GM -input ${P}_act.nii.gz -layer_file ${P}_rim_layers_equidist.nii.gz -FWHM 1
+        run LN_BOCO $NR_TS -Nulled ${P}_nulled.nii.gz -BOLD ${P}_bold.nii.gz -output ${P}_boco.nii.gz
+    done
+done
+rm -f profile.json
+echo "  Summary written to bench/$SUMMARY"
@@ -42,3 +42,4 @@
 ../LN2_PROFILE -input sc_VASO_act.nii.gz -layers sc_layers.nii.gz -plot
 ../LN2_LAYERDIMENSION -values lo_BOLD_act.nii.gz -layers lo_layers.nii.gz -columns lo_columns.nii.gz
 ../LN2_MASK -scores lo_BOLD_act.nii.gz -columns lo_columns.nii.gz -mean_thr 1 -output mask.nii.gz -abs
+../LN2_PHANTOM -shape folded -size 32 -nr_volumes 20 -output phantom.nii.gz